@@ -0,0 +1,507 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Micro benchmark for the filter plugins. Every filter is measured on
+ * synthetic images of a few sizes, or on a real raw file given with --raw,
+ * while limiting the shared worker pool to an increasing number of threads,
+ * this makes it easy to spot both raw throughput regressions and filters
+ * that do not scale.
+ */
+
+#include <rawstudio.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <config.h>
+
+/* The usual RGGB pattern as delivered by dcraw */
+#define BENCH_BAYER_FILTERS 0x94949494
+
+/* Camera used for lens correction and the DCP profile of synthetic images */
+#define BENCH_MAKE "Canon"
+#define BENCH_MODEL "Canon EOS 5D Mark II"
+
+/* Flags disabled to force the different code paths */
+#define BENCH_CPU_SSE4 (RS_CPU_FLAG_SSE4_1 | RS_CPU_FLAG_SSE4_2)
+#define BENCH_CPU_AVX (RS_CPU_FLAG_AVX | RS_CPU_FLAG_AVX2)
+
+typedef struct _BenchCase BenchCase;
+
+typedef RSFilter *(*BenchSetupFunc)(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height);
+
+struct _BenchCase {
+	const gchar *name;
+	gboolean cfa;       /* Feed the filter a bayer image instead of RGB */
+	guint required;     /* Cpu features needed to run this case */
+	guint disabled;     /* Cpu features to hide from the filter */
+	gboolean eight;     /* Request an 8 bit image */
+	const gchar *option;
+	BenchSetupFunc setup;
+};
+
+/* The profile used by the DCP cases, without one RSDcp only runs the matrix */
+static RSDcpFile *dcp_profile = NULL;
+
+static RSFilter *
+setup_demosaic(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	RSFilter *filter = rs_filter_new("RSDemosaic", input);
+
+	g_object_set(filter, "method", bench->option, NULL);
+
+	return filter;
+}
+
+static RSFilter *
+setup_dcp(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	RSFilter *filter = rs_filter_new("RSDcp", input);
+
+	g_object_set(filter, "settings", settings, NULL);
+	if (dcp_profile)
+		g_object_set(filter, "profile", dcp_profile, NULL);
+
+	return filter;
+}
+
+static RSFilter *
+setup_resample(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	RSFilter *filter = rs_filter_new("RSResample", input);
+
+	g_object_set(filter,
+		"width", MAX(6, width/2),
+		"height", MAX(6, height/2),
+		"never-quick", TRUE,
+		NULL);
+
+	return filter;
+}
+
+static RSFilter *
+setup_denoise(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	RSFilter *filter = rs_filter_new("RSDenoise", input);
+
+	g_object_set(filter, "settings", settings, NULL);
+
+	return filter;
+}
+
+static RSFilter *
+setup_lensfun(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	RSFilter *filter = rs_filter_new("RSLensfun", input);
+	RSLens *lens = rs_lens_new();
+
+	g_object_set(filter,
+		"make", BENCH_MAKE,
+		"model", BENCH_MODEL,
+		"lens", lens,
+		"focal", 50.0,
+		"aperture", 8.0,
+		"settings", settings,
+		NULL);
+	g_object_unref(lens);
+
+	return filter;
+}
+
+static RSFilter *
+setup_rotate(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	RSFilter *filter = rs_filter_new("RSRotate", input);
+
+	g_object_set(filter, "angle", 3.0, NULL);
+
+	return filter;
+}
+
+static RSFilter *
+setup_transform(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	return rs_filter_new("RSColorspaceTransform", input);
+}
+
+/* The chain used when exporting, minus the filters without any real work */
+static RSFilter *
+setup_chain(RSFilter *input, RSSettings *settings, const BenchCase *bench, gint width, gint height)
+{
+	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", input);
+	RSFilter *flensfun = setup_lensfun(fdemosaic, settings, bench, width, height);
+	RSFilter *frotate = setup_rotate(flensfun, settings, bench, width, height);
+	RSFilter *ftransform_input = rs_filter_new("RSColorspaceTransform", frotate);
+	RSFilter *fdcp = setup_dcp(ftransform_input, settings, bench, width, height);
+	RSFilter *fresample = setup_resample(fdcp, settings, bench, width, height);
+	RSFilter *fdenoise = setup_denoise(fresample, settings, bench, width, height);
+
+	return rs_filter_new("RSColorspaceTransform", fdenoise);
+}
+
+static const BenchCase cases[] = {
+	{ "demosaic-none",     TRUE,  0, 0, FALSE, "none", setup_demosaic },
+	{ "demosaic-bilinear", TRUE,  0, 0, FALSE, "bilinear", setup_demosaic },
+	{ "demosaic-ppg-c",    TRUE,  0, ~0, FALSE, "pixel-grouping", setup_demosaic },
+	{ "demosaic-ppg-sse2", TRUE,  RS_CPU_FLAG_SSE2, BENCH_CPU_AVX, FALSE, "pixel-grouping", setup_demosaic },
+	{ "demosaic-ppg-avx2", TRUE,  RS_CPU_FLAG_AVX2, 0, FALSE, "pixel-grouping", setup_demosaic },
+	{ "demosaic-directional", TRUE, 0, 0, FALSE, "directional", setup_demosaic },
+	{ "dcp-c",             FALSE, 0, ~0, FALSE, NULL, setup_dcp },
+	{ "dcp-sse2",          FALSE, RS_CPU_FLAG_SSE2, BENCH_CPU_SSE4|BENCH_CPU_AVX, FALSE, NULL, setup_dcp },
+	{ "dcp-sse4",          FALSE, RS_CPU_FLAG_SSE4_1, BENCH_CPU_AVX, FALSE, NULL, setup_dcp },
+	{ "dcp-avx",           FALSE, RS_CPU_FLAG_AVX, 0, FALSE, NULL, setup_dcp },
+	{ "resample-c",        FALSE, 0, ~0, FALSE, NULL, setup_resample },
+	{ "resample-sse2",     FALSE, RS_CPU_FLAG_SSE2, RS_CPU_FLAG_AVX2, FALSE, NULL, setup_resample },
+	{ "resample-avx2",     FALSE, RS_CPU_FLAG_AVX2, 0, FALSE, NULL, setup_resample },
+	{ "denoise",           FALSE, 0, 0, FALSE, NULL, setup_denoise },
+	{ "lensfun",           FALSE, 0, 0, FALSE, NULL, setup_lensfun },
+	{ "rotate",            FALSE, 0, 0, FALSE, NULL, setup_rotate },
+	{ "transform8",        FALSE, 0, 0, TRUE,  NULL, setup_transform },
+	{ "chain",             TRUE,  0, 0, TRUE,  NULL, setup_chain },
+};
+
+/* Something resembling a real photo: smooth gradients with a bit of noise */
+static RS_IMAGE16 *
+synthetic_image(gint width, gint height, gboolean cfa)
+{
+	RS_IMAGE16 *image;
+	GRand *rand = g_rand_new_with_seed(42);
+	gint x, y, c;
+
+	if (cfa)
+	{
+		image = rs_image16_new(width, height, 1, 1);
+		image->filters = BENCH_BAYER_FILTERS;
+	}
+	else
+		image = rs_image16_new(width, height, 3, 4);
+
+	for(y = 0; y < height; y++)
+	{
+		gushort *pixel = GET_PIXEL(image, 0, y);
+		for(x = 0; x < width; x++)
+		{
+			for(c = 0; c < image->channels; c++)
+			{
+				gint value = ((x + c * width / 3) % width) * 40000 / width + y * 20000 / height;
+				value += g_rand_int_range(rand, -1024, 1024);
+				pixel[c] = CLAMP(value, 0, 65535);
+			}
+			pixel += image->pixelsize;
+		}
+	}
+
+	g_rand_free(rand);
+
+	return image;
+}
+
+/* Loads the CFA image of a raw file */
+static RS_IMAGE16 *
+raw_image(const gchar *filename)
+{
+	RSFilterResponse *response = rs_filetype_load(filename);
+	RS_IMAGE16 *image = NULL;
+
+	if (response && rs_filter_response_has_image(response))
+		image = rs_filter_response_get_image(response);
+	if (response)
+		g_object_unref(response);
+
+	return image;
+}
+
+/* Demosaics a raw image once, this is the input of the RGB cases */
+static RS_IMAGE16 *
+demosaic_image(RS_IMAGE16 *cfa)
+{
+	RSFilterResponse *input_response = rs_filter_response_new();
+	RSFilterRequest *request = rs_filter_request_new();
+	RSFilterResponse *response;
+	RSFilter *finput, *fdemosaic;
+	RS_IMAGE16 *image;
+
+	rs_filter_response_set_image(input_response, cfa);
+	finput = rs_filter_new("RSInputImage16", NULL);
+	g_object_set(finput, "image", input_response, NULL);
+	fdemosaic = rs_filter_new("RSDemosaic", finput);
+
+	rs_filter_request_set_quick(request, FALSE);
+	response = rs_filter_get_image(fdemosaic, request);
+	image = rs_filter_response_get_image(response);
+
+	g_object_unref(response);
+	g_object_unref(request);
+	g_object_unref(fdemosaic);
+	g_object_unref(finput);
+	g_object_unref(input_response);
+
+	return image;
+}
+
+/* Picks the profile Rawstudio would use for the camera, the advanced
+   profiles exercise the hue/sat maps and looktables as well */
+static RSDcpFile *
+load_dcp_profile(const gchar *make, const gchar *model)
+{
+	RSProfileFactory *factory = rs_profile_factory_new_default();
+	GSList *profiles = rs_profile_factory_find_from_model(factory, make, model);
+	GSList *i;
+	RSDcpFile *profile = NULL;
+
+	for(i = profiles; i; i = i->next)
+	{
+		RSDcpFile *dcp;
+		const gchar *name;
+
+		if (!RS_IS_DCP_FILE(i->data))
+			continue;
+		dcp = RS_DCP_FILE(i->data);
+		name = rs_dcp_file_get_name(dcp);
+		if (!profile || (name && strstr(name, "Advanced")))
+			profile = dcp;
+	}
+	if (profile)
+		g_object_ref(profile);
+	g_slist_free(profiles);
+
+	return profile;
+}
+
+/* Returns the best time of @runs renderings in seconds */
+static gdouble
+run_filter(RSFilter *filter, gboolean eight, gint runs)
+{
+	RSFilterRequest *request = rs_filter_request_new();
+	RSFilterResponse *response;
+	GTimer *timer = g_timer_new();
+	gdouble best = G_MAXDOUBLE;
+	gint i;
+
+	rs_filter_request_set_quick(request, FALSE);
+	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", rs_color_space_new_singleton("RSSrgb"));
+
+	for(i = 0; i < runs; i++)
+	{
+		g_timer_start(timer);
+		if (eight)
+			response = rs_filter_get_image8(filter, request);
+		else
+			response = rs_filter_get_image(filter, request);
+		g_timer_stop(timer);
+		g_object_unref(response);
+
+		best = MIN(best, g_timer_elapsed(timer, NULL));
+	}
+
+	g_timer_destroy(timer);
+	g_object_unref(request);
+
+	return best;
+}
+
+static void
+run_case(const BenchCase *bench, RSSettings *settings, RS_IMAGE16 *image, const gint *threads, gint runs)
+{
+	RSFilterResponse *input_response;
+	RSFilter *finput, *filter;
+	gdouble mpix, base = 0.0;
+	gint width = image->w;
+	gint height = image->h;
+	gint i;
+
+	input_response = rs_filter_response_new();
+	rs_filter_response_set_image(input_response, image);
+
+	finput = rs_filter_new("RSInputImage16", NULL);
+	g_object_set(finput,
+		"image", input_response,
+		"color-space", rs_color_space_new_singleton("RSProphoto"),
+		NULL);
+	filter = bench->setup(finput, settings, bench, width, height);
+
+	rs_set_cpu_features_mask(~bench->disabled);
+
+	/* Warm up, this will initialize tables and plans */
+	rs_parallel_set_number_of_threads(0);
+	run_filter(filter, bench->eight, 1);
+
+	mpix = ((gdouble) width) * height / 1000000.0;
+	for(i = 0; threads[i] > 0; i++)
+	{
+		gdouble speed;
+		rs_parallel_set_number_of_threads(threads[i]);
+
+		speed = mpix / run_filter(filter, bench->eight, runs);
+		if (i == 0)
+			base = speed / threads[i];
+
+		printf("%-18s %5dx%-5d %3d threads %9.2f Mpix/s %6.1f%% efficiency\n",
+			bench->name, width, height, threads[i], speed,
+			speed / (base * threads[i]) * 100.0);
+		fflush(stdout);
+	}
+
+	rs_set_cpu_features_mask(~0);
+	rs_parallel_set_number_of_threads(0);
+
+	/* Unref the whole chain, the input filter is the last one left */
+	while(RS_IS_FILTER(filter) && filter != finput)
+	{
+		RSFilter *previous = filter->previous;
+		g_object_unref(filter);
+		filter = previous;
+	}
+	g_object_unref(finput);
+	g_object_unref(input_response);
+}
+
+int
+main(int argc, char **argv)
+{
+	RSSettings *settings;
+	gint sizes[] = { 512, 1536, 3072, 0 };
+	gint threads[16];
+	gint cores, n = 0, i, j;
+	gint runs = 3;
+	gboolean hugepages = FALSE;
+	gchar *only = NULL;
+	gchar *raw = NULL;
+	RS_IMAGE16 *raw_cfa = NULL, *raw_rgb = NULL;
+	RSMetadata *metadata = NULL;
+	RSImage16PoolStats pool_stats;
+	GError *error = NULL;
+	GOptionContext *option_context;
+	GOptionEntry option_entries[] = {
+		{ "runs", 'r', 0, G_OPTION_ARG_INT, &runs, "Number of runs per measurement, the best is reported", "N" },
+		{ "filter", 'f', 0, G_OPTION_ARG_STRING, &only, "Only run benchmarks with names containing STRING", "STRING" },
+		{ "hugepages", 0, 0, G_OPTION_ARG_NONE, &hugepages, "Back image buffers with transparent hugepages", NULL },
+		{ "raw", 0, 0, G_OPTION_ARG_FILENAME, &raw, "Benchmark on a raw file instead of synthetic images", "FILE" },
+		{ NULL }
+	};
+
+	option_context = g_option_context_new("- Rawstudio filter benchmark");
+	g_option_context_add_main_entries(option_context, option_entries, NULL);
+	if (!g_option_context_parse(option_context, &argc, &argv, &error))
+	{
+		g_print("%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+	g_option_context_free(option_context);
+
+#if GLIB_MAJOR_VERSION <= 2 && GLIB_MINOR_VERSION < 31
+	g_thread_init(NULL);
+#endif
+	g_type_init();
+
+	rs_plugin_manager_load_all_plugins();
+	rs_image16_pool_set_hugepages(hugepages);
+
+	if (raw)
+	{
+		/* Metadata and decoders want absolute paths */
+		if (!g_path_is_absolute(raw))
+		{
+			gchar *cwd = g_get_current_dir();
+			gchar *absolute = g_build_filename(cwd, raw, NULL);
+			g_free(cwd);
+			g_free(raw);
+			raw = absolute;
+		}
+
+		if (!(raw_cfa = raw_image(raw)))
+		{
+			g_print("Could not load %s\n", raw);
+			return 1;
+		}
+		raw_rgb = demosaic_image(raw_cfa);
+
+		metadata = rs_metadata_new();
+		rs_metadata_load_from_file(metadata, raw);
+	}
+
+	if (metadata && metadata->make_ascii && metadata->model_ascii)
+		dcp_profile = load_dcp_profile(metadata->make_ascii, metadata->model_ascii);
+	else
+		dcp_profile = load_dcp_profile(BENCH_MAKE, BENCH_MODEL);
+
+	/* 1, 2, 4 ... and finally all cores */
+	cores = rs_get_number_of_processor_cores();
+	for(i = 1; i < cores && n < 14; i *= 2)
+		threads[n++] = i;
+	threads[n++] = cores;
+	threads[n] = 0;
+
+	settings = rs_settings_new();
+	g_object_set(settings,
+		"sharpen", 20.0,
+		"denoise_luma", 10.0,
+		"denoise_chroma", 10.0,
+		"tca_kr", 0.1,
+		"tca_kb", -0.1,
+		"vignetting", 0.2,
+		"saturation", 1.2,
+		"contrast", 1.1,
+		NULL);
+
+	printf("Rawstudio %s filter benchmark, %d cores, best of %d runs\n", VERSION, cores, MAX(1, runs));
+	if (raw)
+		printf("Input: %s\n", raw);
+	printf("DCP profile: %s\n", (dcp_profile && rs_dcp_file_get_name(dcp_profile)) ? rs_dcp_file_get_name(dcp_profile) : "none");
+	for(i = 0; i < G_N_ELEMENTS(cases); i++)
+	{
+		if (only && !strstr(cases[i].name, only))
+			continue;
+		if ((rs_detect_cpu_features() & cases[i].required) != cases[i].required)
+		{
+			printf("%-18s skipped, cpu not supported\n", cases[i].name);
+			continue;
+		}
+
+		if (raw)
+			run_case(&cases[i], settings, cases[i].cfa ? raw_cfa : raw_rgb, threads, MAX(1, runs));
+		else
+			for(j = 0; sizes[j] > 0; j++)
+			{
+				RS_IMAGE16 *image = synthetic_image(sizes[j] * 3 / 2, sizes[j], cases[i].cfa);
+				run_case(&cases[i], settings, image, threads, MAX(1, runs));
+				g_object_unref(image);
+			}
+	}
+
+	rs_image16_pool_get_stats(&pool_stats);
+	printf("Image buffers: %" G_GUINT64_FORMAT " recycled, %" G_GUINT64_FORMAT " allocated, %" G_GUINT64_FORMAT " evicted\n",
+		pool_stats.hits, pool_stats.misses, pool_stats.evictions);
+
+	g_object_unref(settings);
+	if (dcp_profile)
+		g_object_unref(dcp_profile);
+	if (metadata)
+		g_object_unref(metadata);
+	if (raw_cfa)
+		g_object_unref(raw_cfa);
+	if (raw_rgb)
+		g_object_unref(raw_rgb);
+	g_free(only);
+	g_free(raw);
+
+	return 0;
+}
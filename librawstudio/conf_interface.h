@@ -85,6 +85,8 @@
 #define CONF_ENFUSE_EXTEND_POSITIVE_MULTI "conf_enfuse_extend_positive_multi"
 #define CONF_ENFUSE_EXTEND_STEP_MULTI "conf_enfuse_extend_step_multi"
 #define CONF_ENFUSE_CACHE "conf_enfuse_cache"
+#define CONF_BATCH_DCP_LUT "batch_dcp_lut"
+#define CONF_RENDER_FLOAT "render_float"
 #define CONF_MAP_SOURCE "conf_map_source"
 #define CONF_MAP_ZOOM "map_zoom"
 
@@ -129,6 +131,8 @@
 #define DEFAULT_CONF_ENFUSE_EXTEND_POSITIVE_MULTI 1.0
 #define DEFAULT_CONF_ENFUSE_EXTEND_STEP_MULTI 2.0
 #define DEFAULT_CONF_ENFUSE_CACHE TRUE
+#define DEFAULT_CONF_BATCH_DCP_LUT FALSE
+#define DEFAULT_CONF_RENDER_FLOAT FALSE
 
 /* get the last working directory from gconf */
 void rs_set_last_working_directory(const char *lwd);
@@ -47,6 +47,7 @@ extern "C" {
 #include "rs-image.h"
 #include "rs-image16.h"
 #include "rs-metadata.h"
+#include "rs-metadata-pack.h"
 #include "rs-lens.h"
 #include "rs-lens-db.h"
 #include "rs-lens-fix.h"
@@ -60,6 +61,8 @@ extern "C" {
 #include "rs-output.h"
 #include "rs-plugin-manager.h"
 #include "rs-job-queue.h"
+#include "rs-parallel.h"
+#include "rs-warp.h"
 #include "rs-utils.h"
 #include "rs-math.h"
 #include "rs-color.h"
@@ -25,6 +25,7 @@ struct _RSFilterRequest {
 	gboolean roi_set;
 	GdkRectangle roi;
 	gboolean quick;
+	RSParallelPriority priority;
 };
 
 G_DEFINE_TYPE(RSFilterRequest, rs_filter_request, RS_TYPE_FILTER_PARAM)
@@ -48,6 +49,7 @@ rs_filter_request_init(RSFilterRequest *filter_request)
 {
 	filter_request->roi_set = FALSE;
 	filter_request->quick = FALSE;
+	filter_request->priority = RS_PARALLEL_PRIORITY_NORMAL;
 }
 
 /**
@@ -96,6 +98,7 @@ rs_filter_request_clone(const RSFilterRequest *filter_request)
 		new_filter_request->roi_set = filter_request->roi_set;
 		new_filter_request->roi = filter_request->roi;
 		new_filter_request->quick = filter_request->quick;
+		new_filter_request->priority = filter_request->priority;
 
 		rs_filter_param_clone(RS_FILTER_PARAM(new_filter_request), RS_FILTER_PARAM(filter_request));
 	}
@@ -165,3 +168,33 @@ gboolean rs_filter_request_get_quick(const RSFilterRequest *filter_request)
 
 	return ret;
 }
+
+/**
+ * Set the priority filters should use for their parallel work, interactive
+ * renders should use RS_PARALLEL_PRIORITY_HIGH and background work
+ * RS_PARALLEL_PRIORITY_LOW
+ * @param filter_request A RSFilterRequest
+ * @param priority A RSParallelPriority, RS_PARALLEL_PRIORITY_NORMAL is default
+ */
+void rs_filter_request_set_priority(RSFilterRequest *filter_request, RSParallelPriority priority)
+{
+	g_return_if_fail(RS_IS_FILTER_REQUEST(filter_request));
+	g_return_if_fail(priority < RS_PARALLEL_PRIORITY_MAX);
+
+	filter_request->priority = priority;
+}
+
+/**
+ * Get the priority of a RSFilterRequest
+ * @param filter_request A RSFilterRequest
+ * @return The priority to pass to rs_parallel_for_full()
+ */
+RSParallelPriority rs_filter_request_get_priority(const RSFilterRequest *filter_request)
+{
+	RSParallelPriority ret = RS_PARALLEL_PRIORITY_NORMAL;
+
+	if (RS_IS_FILTER_REQUEST(filter_request))
+		ret = filter_request->priority;
+
+	return ret;
+}
@@ -22,6 +22,7 @@
 
 #include <glib-object.h>
 #include "rs-filter-param.h"
+#include "rs-parallel.h"
 
 G_BEGIN_DECLS
 
@@ -91,6 +92,22 @@ void rs_filter_request_set_quick(RSFilterRequest *filter_request, gboolean quick
  */
 gboolean rs_filter_request_get_quick(const RSFilterRequest *filter_request);
 
+/**
+ * Set the priority filters should use for their parallel work, interactive
+ * renders should use RS_PARALLEL_PRIORITY_HIGH and background work
+ * RS_PARALLEL_PRIORITY_LOW
+ * @param filter_request A RSFilterRequest
+ * @param priority A RSParallelPriority, RS_PARALLEL_PRIORITY_NORMAL is default
+ */
+void rs_filter_request_set_priority(RSFilterRequest *filter_request, RSParallelPriority priority);
+
+/**
+ * Get the priority of a RSFilterRequest
+ * @param filter_request A RSFilterRequest
+ * @return The priority to pass to rs_parallel_for_full()
+ */
+RSParallelPriority rs_filter_request_get_priority(const RSFilterRequest *filter_request);
+
 G_END_DECLS
 
 #endif /* RS_FILTER_REQUEST_H */
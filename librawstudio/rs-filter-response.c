@@ -19,6 +19,7 @@
 
 #include "rs-filter-response.h"
 #include "rs-image16.h"
+#include "rs-image.h"
 
 struct _RSFilterResponse {
 	RSFilterParam parent;
@@ -29,6 +30,7 @@ struct _RSFilterResponse {
 	gboolean quick;
 	RS_IMAGE16 *image;
 	GdkPixbuf *image8;
+	RSImage *image_float;
 	gint width;
 	gint height;
 };
@@ -49,6 +51,9 @@ rs_filter_response_dispose(GObject *object)
 
 		if (filter_response->image8)
 			g_object_unref(filter_response->image8);
+
+		if (filter_response->image_float)
+			g_object_unref(filter_response->image_float);
 	}
 
 	G_OBJECT_CLASS (rs_filter_response_parent_class)->dispose (object);
@@ -76,6 +81,7 @@ rs_filter_response_init(RSFilterResponse *filter_response)
 	filter_response->quick = FALSE;
 	filter_response->image = NULL;
 	filter_response->image8 = NULL;
+	filter_response->image_float = NULL;
 	filter_response->width = -1;
 	filter_response->height = -1;
 	filter_response->dispose_has_run = FALSE;
@@ -283,6 +289,57 @@ rs_filter_response_get_image8(const RSFilterResponse *filter_response)
 	return ret;
 }
 
+/**
+ * Set planar float image data
+ * @param filter_response A RSFilterResponse
+ * @param image A RSImage
+ */
+void
+rs_filter_response_set_image_float(RSFilterResponse *filter_response, RSImage *image)
+{
+	g_return_if_fail(RS_IS_FILTER_RESPONSE(filter_response));
+
+	if (filter_response->image_float)
+	{
+		g_object_unref(filter_response->image_float);
+		filter_response->image_float = NULL;
+	}
+
+	if (image)
+		filter_response->image_float = g_object_ref(image);
+}
+
+/**
+ * Does the response have a planar float image
+ * @param filter_response A RSFilterResponse
+ * @return A gboolean TRUE if a float image is attached, FALSE otherwise
+ */
+gboolean
+rs_filter_response_has_image_float(const RSFilterResponse *filter_response)
+{
+	g_return_val_if_fail(RS_IS_FILTER_RESPONSE(filter_response), FALSE);
+
+	return !!filter_response->image_float;
+}
+
+/**
+ * Get planar float image data
+ * @param filter_response A RSFilterResponse
+ * @return A RSImage (must be unreffed after usage) or NULL if none is set
+ */
+RSImage *
+rs_filter_response_get_image_float(const RSFilterResponse *filter_response)
+{
+	RSImage *ret = NULL;
+
+	g_return_val_if_fail(RS_IS_FILTER_RESPONSE(filter_response), NULL);
+
+	if (filter_response->image_float)
+		ret = g_object_ref(filter_response->image_float);
+
+	return ret;
+}
+
 /**
  * Set predicted width
  * @param filter_response A RSFilterResponse
@@ -130,6 +130,27 @@ gboolean rs_filter_response_has_image8(const RSFilterResponse *filter_response);
  */
 GdkPixbuf *rs_filter_response_get_image8(const RSFilterResponse *filter_response);
 
+/**
+ * Set planar float image data
+ * @param filter_response A RSFilterResponse
+ * @param image A RSImage
+ */
+void rs_filter_response_set_image_float(RSFilterResponse *filter_response, RSImage *image);
+
+/**
+ * Does the response have a planar float image
+ * @param filter_response A RSFilterResponse
+ * @return A gboolean TRUE if a float image is attached, FALSE otherwise
+ */
+gboolean rs_filter_response_has_image_float(const RSFilterResponse *filter_response);
+
+/**
+ * Get planar float image data
+ * @param filter_response A RSFilterResponse
+ * @return A RSImage (must be unreffed after usage) or NULL if none is set
+ */
+RSImage *rs_filter_response_get_image_float(const RSFilterResponse *filter_response);
+
 /**
  * Set predicted width
  * @param filter_response A RSFilterResponse
@@ -18,12 +18,12 @@
  */
 
 #include <stdlib.h> /* system() */
+#include <string.h> /* memset() */
 #include <rawstudio.h>
 #include "rs-filter.h"
 
 #if 0 /* Change to 1 to enable performance info */
 #define filter_performance printf
-#define FILTER_SHOW_PERFORMANCE
 #else
 #define filter_performance(...) {}
 #endif
@@ -41,6 +41,81 @@ enum {
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* Per thread timing state, filters calling previous filters are nested on the same thread */
+typedef struct {
+	GTimer *timer;
+	gdouble nested_time; /* Time spent in filters called by the current filter */
+	gpointer nested_image; /* Image returned by the last filter called */
+	gint depth;
+} ThreadStats;
+
+typedef struct {
+	gdouble start;
+	gdouble nested_time;
+} StatsFrame;
+
+static GStaticPrivate thread_stats = G_STATIC_PRIVATE_INIT;
+static GStaticMutex stats_lock = G_STATIC_MUTEX_INIT;
+
+static void
+thread_stats_free(gpointer data)
+{
+	ThreadStats *ts = data;
+
+	g_timer_destroy(ts->timer);
+	g_free(ts);
+}
+
+static ThreadStats *
+thread_stats_get(void)
+{
+	ThreadStats *ts = g_static_private_get(&thread_stats);
+
+	if (!ts)
+	{
+		ts = g_new0(ThreadStats, 1);
+		ts->timer = g_timer_new();
+		g_static_private_set(&thread_stats, ts, thread_stats_free);
+	}
+
+	return ts;
+}
+
+static void
+stats_begin(ThreadStats *ts, StatsFrame *frame)
+{
+	frame->start = g_timer_elapsed(ts->timer, NULL);
+	frame->nested_time = ts->nested_time;
+	ts->nested_time = 0.0;
+	ts->nested_image = NULL;
+	ts->depth++;
+}
+
+/* Returns the time spent in filter alone */
+static gdouble
+stats_end(RSFilter *filter, ThreadStats *ts, StatsFrame *frame, gpointer image, gint pixels, gsize bytes)
+{
+	const gdouble total = g_timer_elapsed(ts->timer, NULL) - frame->start;
+	const gdouble self = total - ts->nested_time;
+
+	/* Our total time is nested time for the filter calling us */
+	ts->nested_time = frame->nested_time + total;
+	ts->depth--;
+
+	g_static_mutex_lock(&stats_lock);
+	filter->stats.calls++;
+	filter->stats.time += self;
+	filter->stats.pixels += pixels;
+	/* Images passed through from previous filters are not counted */
+	if (image && image != ts->nested_image)
+		filter->stats.bytes += bytes;
+	g_static_mutex_unlock(&stats_lock);
+
+	ts->nested_image = image;
+
+	return self;
+}
+
 static void
 dispose(GObject *obj)
 {
@@ -74,7 +149,9 @@ rs_filter_class_init(RSFilterClass *klass)
 
 	klass->get_image = NULL;
 	klass->get_image8 = NULL;
+	klass->get_image_float = NULL;
 	klass->get_size = NULL;
+	klass->get_border = NULL;
 	klass->previous_changed = NULL;
 
 	object_class->dispose = dispose;
@@ -174,25 +251,25 @@ rs_filter_changed(RSFilter *filter, RSFilterChangedMask mask)
 	g_signal_emit(G_OBJECT(filter), signals[CHANGED_SIGNAL], 0, mask);
 }
 
-/* Clamps ROI rectangle to image size */
+/* Expands ROI rectangle by border and clamps it to image size */
 /* Returns a new rectangle, or NULL if ROI was within bounds*/
 
 static GdkRectangle* 
-clamp_roi(const GdkRectangle *roi, RSFilter *filter, const RSFilterRequest *request)
+clamp_roi(const GdkRectangle *roi, gint border, RSFilter *filter, const RSFilterRequest *request)
 {
 	RSFilterResponse *response = rs_filter_get_size(filter, request);
 	gint w = rs_filter_response_get_width(response);
 	gint h = rs_filter_response_get_height(response);
 	g_object_unref(response);
 
-	if ((roi->x >= 0) && (roi->y >=0) && (roi->x + roi->width <= w) && (roi->y + roi->height <= h))
+	if ((border == 0) && (roi->x >= 0) && (roi->y >=0) && (roi->x + roi->width <= w) && (roi->y + roi->height <= h))
 		return NULL;
 
 	GdkRectangle* new_roi = g_new(GdkRectangle, 1);
-	new_roi->x = MAX(0, roi->x);
-	new_roi->y = MAX(0, roi->y);
-	new_roi->width = MIN(w - new_roi->x, roi->width);
-	new_roi->height = MAX(h - new_roi->y, roi->height);
+	new_roi->x = MAX(0, roi->x - border);
+	new_roi->y = MAX(0, roi->y - border);
+	new_roi->width = MIN(w, roi->x + roi->width + border) - new_roi->x;
+	new_roi->height = MIN(h, roi->y + roi->height + border) - new_roi->y;
 	return new_roi;
 }
 
@@ -213,22 +290,16 @@ rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
 
 	RS_DEBUG(FILTERS, "rs_filter_get_image(%s [%p])", RS_FILTER_NAME(filter), filter);
 
-	/* This timer-hack will break badly when multithreaded! */
-	static gfloat last_elapsed = 0.0;
-	static gint count = -1;
-	gfloat elapsed;
-	static GTimer *gt = NULL;
+	ThreadStats *ts = thread_stats_get();
+	StatsFrame frame;
+	gdouble elapsed;
 
 	RSFilterResponse *response;
 	RS_IMAGE16 *image;
 
-	if (count == -1)
-		gt = g_timer_new();
-	count++;
-
 	if (filter->enabled && (roi = rs_filter_request_get_roi(request)))
 	{
-		roi = clamp_roi(roi, filter, request);
+		roi = clamp_roi(roi, rs_filter_get_border(filter, request), filter, request);
 		if (roi)
 		{
 			r = rs_filter_request_clone(request);
@@ -238,7 +309,10 @@ rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
 	}
 
 	if (RS_FILTER_GET_CLASS(filter)->get_image && filter->enabled)
+	{
+		stats_begin(ts, &frame);
 		response = RS_FILTER_GET_CLASS(filter)->get_image(filter, request);
+	}
 	else
 		response = rs_filter_get_image(filter->previous, request);
 
@@ -246,46 +320,44 @@ rs_filter_get_image(RSFilter *filter, const RSFilterRequest *request)
 
 	image = rs_filter_response_get_image(response);
 
-	elapsed = g_timer_elapsed(gt, NULL) - last_elapsed;
-
 	if (roi)
 		g_free(roi);
 	if (r)
 		g_object_unref(r);
 
-#ifdef FILTER_SHOW_PERFORMANCE
-	if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL)) 
+	if (RS_FILTER_GET_CLASS(filter)->get_image && filter->enabled)
 	{
-		gint iw = image->w;
-		gint ih = image->h;
-		if (rs_filter_response_get_roi(response)) 
+		gint iw = 0, ih = 0;
+		gsize bytes = 0;
+		if (image)
 		{
-			roi = rs_filter_response_get_roi(response);
-			iw = roi->width;
-			ih = roi->height;
+			iw = image->w;
+			ih = image->h;
+			bytes = image->rowstride * image->area.height * sizeof(gushort);
 		}
-		filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed*1000);
-		if ((elapsed > 0.001) && (image != NULL))
+		if (rs_filter_response_get_roi(response))
+		{
+			iw = rs_filter_response_get_roi(response)->width;
+			ih = rs_filter_response_get_roi(response)->height;
+		}
+		elapsed = stats_end(filter, ts, &frame, image, iw*ih, bytes);
+
+		if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL)) 
+		{
+			filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed*1000);
 			filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw*ih))/elapsed/1000000.0);
-		if (image)
 			filter_performance(" [w: %d, h: %d, roi-w:%d, roi-h:%d, channels: %d, pixelsize: %d, rowstride: %d]",
 				image->w, image->h, iw, ih, image->channels, image->pixelsize, image->rowstride);
-		filter_performance("\n");
+			filter_performance("\n");
+		}
+		if ((ts->depth == 0) && (ts->nested_time > CHAIN_PERF_ELAPSED_MIN))
+			filter_performance("Complete 16 bit chain took: \033[32m%.0f\033[0mms\n\n", ts->nested_time*1000.0);
 	}
-#endif
 	g_assert(RS_IS_IMAGE16(image) || (image == NULL));
-	last_elapsed += elapsed;
 
-	count--;
-	if (count == -1)
-	{
-		last_elapsed = 0.0;
-		if (g_timer_elapsed(gt,NULL) > CHAIN_PERF_ELAPSED_MIN)
-			filter_performance("Complete 16 bit chain took: \033[32m%.0f\033[0mms\n\n", g_timer_elapsed(gt, NULL)*1000.0);
-		rs_filter_param_set_float(RS_FILTER_PARAM(response), "16-bit-time", g_timer_elapsed(gt, NULL));
-		g_timer_destroy(gt);
-	}
-	
+	if (ts->depth == 0)
+		ts->nested_time = 0.0;
+
 	if (image)
 		g_object_unref(image);
 
@@ -307,27 +379,18 @@ rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
 
 	RS_DEBUG(FILTERS, "rs_filter_get_image8(%s [%p])", RS_FILTER_NAME(filter), filter);
 
-	/* This timer-hack will break badly when multithreaded! */
-	static gfloat last_elapsed = 0.0;
-	static gint count = -1;
-	gfloat elapsed, temp;
-	static GTimer *gt = NULL;
+	ThreadStats *ts = thread_stats_get();
+	StatsFrame frame;
+	gdouble elapsed;
 
 	RSFilterResponse *response = NULL;
 	GdkPixbuf *image = NULL;
 	GdkRectangle* roi = NULL;
 	RSFilterRequest *r = NULL;
 
-	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
-	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
-
-	if (count == -1)
-		gt = g_timer_new();
-	count++;
-
 	if (filter->enabled && (roi = rs_filter_request_get_roi(request)))
 	{
-		roi = clamp_roi(roi, filter, request);
+		roi = clamp_roi(roi, rs_filter_get_border(filter, request), filter, request);
 		if (roi)
 		{
 			r = rs_filter_request_clone(request);
@@ -337,62 +400,434 @@ rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request)
 	}
 
 	if (RS_FILTER_GET_CLASS(filter)->get_image8 && filter->enabled)
+	{
+		stats_begin(ts, &frame);
 		response = RS_FILTER_GET_CLASS(filter)->get_image8(filter, request);
+	}
 	else if (filter->previous)
 		response = rs_filter_get_image8(filter->previous, request);
 
 	g_assert(RS_IS_FILTER_RESPONSE(response));
 
 	image = rs_filter_response_get_image8(response);
-	elapsed = g_timer_elapsed(gt, NULL) - last_elapsed;
-
-	/* Subtract 16 bit time */
-	if (rs_filter_param_get_float(RS_FILTER_PARAM(response), "16-bit-time", &temp))
-		elapsed -= temp;
 
 	if (roi)
 		g_free(roi);
 	if (r)
 		g_object_unref(r);
 
-#ifdef FILTER_SHOW_PERFORMANCE
-	if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL)) {
-		gint iw = gdk_pixbuf_get_width(image);
-		gint ih = gdk_pixbuf_get_height(image);
-		if (rs_filter_response_get_roi(response)) 
+	if (RS_FILTER_GET_CLASS(filter)->get_image8 && filter->enabled)
+	{
+		gint iw = 0, ih = 0;
+		gsize bytes = 0;
+		if (image)
+		{
+			iw = gdk_pixbuf_get_width(image);
+			ih = gdk_pixbuf_get_height(image);
+			bytes = gdk_pixbuf_get_rowstride(image) * ih;
+		}
+		if (rs_filter_response_get_roi(response))
+		{
+			iw = rs_filter_response_get_roi(response)->width;
+			ih = rs_filter_response_get_roi(response)->height;
+		}
+		elapsed = stats_end(filter, ts, &frame, image, iw*ih, bytes);
+
+		if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL))
 		{
-			GdkRectangle *roi = rs_filter_response_get_roi(response);
-			iw = roi->width;
-			ih = roi->height;
+			filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed * 1000);
+			filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw * ih)) / elapsed / 1000000.0);
+			filter_performance("\n");
 		}
-		filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed * 1000);
-		filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw * ih)) / elapsed / 1000000.0);
-		filter_performance("\n");
+		if ((ts->depth == 0) && (ts->nested_time > CHAIN_PERF_ELAPSED_MIN))
+			filter_performance("Complete 8 bit chain took: \033[32m%.0f\033[0mms\n\n", ts->nested_time*1000.0);
 	}
-#endif
-
-	last_elapsed += elapsed;
 
 	g_assert(GDK_IS_PIXBUF(image) || (image == NULL));
 
-	count--;
-	if (count == -1)
+	if (ts->depth == 0)
+		ts->nested_time = 0.0;
+
+	if (image)
+		g_object_unref(image);
+
+	return response;
+}
+
+/* Move the 16 bit image of a response to a new response as planar float */
+static RSFilterResponse *
+response_to_float(RSFilterResponse *response, const GdkRectangle *roi)
+{
+	RSFilterResponse *float_response;
+	RS_IMAGE16 *image = rs_filter_response_get_image(response);
+	RSImage *image_float;
+
+	if (!image)
+		return response;
+
+	float_response = rs_filter_response_clone(response);
+	image_float = rs_image_new_from_image16(image, roi);
+	rs_filter_response_set_image_float(float_response, image_float);
+	g_object_unref(image_float);
+	g_object_unref(image);
+	g_object_unref(response);
+
+	return float_response;
+}
+
+/**
+ * Get planar float output image from a RSFilter. Filters that cannot render
+ * planar float will have their 16 bit output converted, so this works for any
+ * chain. The image is returned by rs_filter_response_get_image_float()
+ * @param filter A RSFilter
+ * @param param A RSFilterRequest defining parameters for a image request
+ * @return A RSFilterResponse, this must be unref'ed
+ */
+RSFilterResponse *
+rs_filter_get_image_float(RSFilter *filter, const RSFilterRequest *request)
+{
+	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
+	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), NULL);
+
+	RS_DEBUG(FILTERS, "rs_filter_get_image_float(%s [%p])", RS_FILTER_NAME(filter), filter);
+
+	ThreadStats *ts;
+	StatsFrame frame;
+	gdouble elapsed;
+
+	RSFilterResponse *response = NULL;
+	RSImage *image = NULL;
+	GdkRectangle* roi = NULL;
+	RSFilterRequest *r = NULL;
+
+	/* Filters not rendering anything themselves are skipped */
+	if (!filter->enabled || !(RS_FILTER_GET_CLASS(filter)->get_image_float || RS_FILTER_GET_CLASS(filter)->get_image))
+		return rs_filter_get_image_float(filter->previous, request);
+
+	/* 16 bit filters render as usual, the result is converted once */
+	if (!RS_FILTER_GET_CLASS(filter)->get_image_float)
+		return response_to_float(rs_filter_get_image(filter, request), rs_filter_request_get_roi(request));
+
+	if ((roi = rs_filter_request_get_roi(request)))
 	{
-		last_elapsed = 0.0;
-		rs_filter_param_get_float(RS_FILTER_PARAM(response), "16-bit-time", &last_elapsed);
-		last_elapsed = g_timer_elapsed(gt, NULL)-last_elapsed;
-		if (last_elapsed > CHAIN_PERF_ELAPSED_MIN)
-			filter_performance("Complete 8 bit chain took: \033[32m%.0f\033[0mms\n\n", last_elapsed*1000.0);
-		g_timer_destroy(gt);
-		last_elapsed = 0.0;
+		roi = clamp_roi(roi, rs_filter_get_border(filter, request), filter, request);
+		if (roi)
+		{
+			r = rs_filter_request_clone(request);
+			rs_filter_request_set_roi(r, roi);
+			request = r;
+		}
 	}
 
+	ts = thread_stats_get();
+	stats_begin(ts, &frame);
+	response = RS_FILTER_GET_CLASS(filter)->get_image_float(filter, request);
+
+	g_assert(RS_IS_FILTER_RESPONSE(response));
+
+	/* Filters may decide to pass on 16 bit data anyway */
+	if (!rs_filter_response_has_image_float(response))
+		response = response_to_float(response, rs_filter_request_get_roi(request));
+
+	image = rs_filter_response_get_image_float(response);
+
+	if (roi)
+		g_free(roi);
+	if (r)
+		g_object_unref(r);
+
+	gint iw = 0, ih = 0;
+	gsize bytes = 0;
+	if (image)
+	{
+		iw = image->width;
+		ih = image->height;
+		bytes = ((gsize) image->pitch) * image->area.height * image->number_of_planes * sizeof(gfloat);
+	}
+	if (rs_filter_response_get_roi(response))
+	{
+		iw = rs_filter_response_get_roi(response)->width;
+		ih = rs_filter_response_get_roi(response)->height;
+	}
+	elapsed = stats_end(filter, ts, &frame, image, iw*ih, bytes);
+
+	if ((elapsed > FILTER_PERF_ELAPSED_MIN) && (image != NULL))
+	{
+		filter_performance("%s took: \033[32m%.0f\033[0mms", RS_FILTER_NAME(filter), elapsed * 1000);
+		filter_performance(" [\033[33m%.01f\033[0mMpix/s]", ((gfloat)(iw * ih)) / elapsed / 1000000.0);
+		filter_performance(" [float, w: %d, h: %d, planes: %d]", iw, ih, image->number_of_planes);
+		filter_performance("\n");
+	}
+	if ((ts->depth == 0) && (ts->nested_time > CHAIN_PERF_ELAPSED_MIN))
+		filter_performance("Complete float chain took: \033[32m%.0f\033[0mms\n\n", ts->nested_time*1000.0);
+
+	g_assert(RS_IS_IMAGE(image) || (image == NULL));
+
+	if (ts->depth == 0)
+		ts->nested_time = 0.0;
+
 	if (image)
 		g_object_unref(image);
 
 	return response;
 }
 
+/* Returns FALSE if pulling tiles would render the complete image for every tile */
+static gboolean
+chain_renders_roi(RSFilter *filter)
+{
+	while (filter)
+	{
+		switch (rs_filter_get_roi_support(filter))
+		{
+			case RS_FILTER_ROI_FULL_IMAGE:
+				return TRUE;
+			case RS_FILTER_ROI_IGNORED:
+				return FALSE;
+			default:
+				break;
+		}
+		filter = filter->previous;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Pull the output image from a RSFilter one tile at a time. Every tile is
+ * requested through the chain as a ROI, and filters needing neighbouring
+ * pixels get their ROI expanded by their border (see rs_filter_get_border()).
+ * Filters rendering a ROI only allocate memory for it (see
+ * rs_image16_new_area()). If a filter in the chain ignores the ROI, and no
+ * filter after it keeps the complete image, the complete image is rendered
+ * once and handed out a tile at a time (see rs_filter_get_roi_support())
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the image request,
+ *                any ROI set will be ignored
+ * @param tile_width Width of tiles in pixels, or -1 for full width strips
+ * @param tile_height Height of tiles in pixels
+ * @param func A function to call for every tile, in top-to-bottom,
+ *             left-to-right order
+ * @param user_data Data to pass to func
+ * @return TRUE if all tiles was rendered, FALSE on errors or if aborted by func
+ */
+gboolean
+rs_filter_get_image_tiled(RSFilter *filter, const RSFilterRequest *request, gint tile_width, gint tile_height, RSFilterTileFunc func, gpointer user_data)
+{
+	RSFilterRequest *tile_request;
+	RSFilterResponse *response;
+	RS_IMAGE16 *image;
+	RS_IMAGE16 *full = NULL;
+	RS_IMAGE16 *tile;
+	GdkRectangle rect;
+	gint width, height;
+	gint x, y;
+	gboolean ret = TRUE;
+
+	g_return_val_if_fail(RS_IS_FILTER(filter), FALSE);
+	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), FALSE);
+	g_return_val_if_fail(tile_height > 0, FALSE);
+	g_return_val_if_fail(func != NULL, FALSE);
+
+	if (!rs_filter_get_size_simple(filter, request, &width, &height))
+		return FALSE;
+
+	if (tile_width <= 0)
+		tile_width = width;
+
+	/* Keep tiles at even x-positions, rs_image16_new_subframe() will align to that */
+	tile_width += (tile_width & 1);
+
+	RS_DEBUG(FILTERS, "rs_filter_get_image_tiled(%s [%p], %dx%d)", RS_FILTER_NAME(filter), filter, tile_width, tile_height);
+
+	tile_request = rs_filter_request_clone(request);
+
+	/* Render the complete image once, instead of once per tile */
+	if (!chain_renders_roi(filter))
+	{
+		RS_DEBUG(FILTERS, "rs_filter_get_image_tiled(%s [%p]): ROI ignored in chain, rendering complete image", RS_FILTER_NAME(filter), filter);
+		rs_filter_request_set_roi(tile_request, NULL);
+		response = rs_filter_get_image(filter, tile_request);
+		full = rs_filter_response_get_image(response);
+		g_object_unref(response);
+		if (!full)
+			ret = FALSE;
+	}
+
+	for(y = 0; ret && (y < height); y += tile_height)
+		for(x = 0; ret && (x < width); x += tile_width)
+		{
+			rect.x = x;
+			rect.y = y;
+			rect.width = MIN(tile_width, width - x);
+			rect.height = MIN(tile_height, height - y);
+
+			/* Every tile is rendered by a complete pull through the chain, the
+			 * response is released before the next tile is requested */
+			if (full)
+				image = g_object_ref(full);
+			else
+			{
+				rs_filter_request_set_roi(tile_request, &rect);
+				response = rs_filter_get_image(filter, tile_request);
+				image = rs_filter_response_get_image(response);
+				g_object_unref(response);
+			}
+
+			if (!image || (image->w < (rect.x + rect.width)) || (image->h < (rect.y + rect.height)))
+			{
+				if (image)
+					g_object_unref(image);
+				ret = FALSE;
+				break;
+			}
+
+			tile = rs_image16_new_subframe(image, &rect);
+			ret = func(filter, tile, &rect, user_data);
+
+			g_object_unref(tile);
+			g_object_unref(image);
+		}
+
+	if (full)
+		g_object_unref(full);
+	g_object_unref(tile_request);
+
+	return ret;
+}
+
+/**
+ * Like rs_filter_get_image_tiled(), but pulls 8 bit tiles
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the image request,
+ *                any ROI set will be ignored
+ * @param tile_width Width of tiles in pixels, or -1 for full width strips
+ * @param tile_height Height of tiles in pixels
+ * @param func A function to call for every tile, in top-to-bottom,
+ *             left-to-right order
+ * @param user_data Data to pass to func
+ * @return TRUE if all tiles was rendered, FALSE on errors or if aborted by func
+ */
+gboolean
+rs_filter_get_image8_tiled(RSFilter *filter, const RSFilterRequest *request, gint tile_width, gint tile_height, RSFilterTile8Func func, gpointer user_data)
+{
+	RSFilterRequest *tile_request;
+	RSFilterResponse *response;
+	GdkPixbuf *image;
+	GdkPixbuf *full = NULL;
+	GdkPixbuf *tile;
+	GdkRectangle rect;
+	gint width, height;
+	gint x, y;
+	gboolean ret = TRUE;
+
+	g_return_val_if_fail(RS_IS_FILTER(filter), FALSE);
+	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), FALSE);
+	g_return_val_if_fail(tile_height > 0, FALSE);
+	g_return_val_if_fail(func != NULL, FALSE);
+
+	if (!rs_filter_get_size_simple(filter, request, &width, &height))
+		return FALSE;
+
+	if (tile_width <= 0)
+		tile_width = width;
+
+	/* Keep tiles at even x-positions, like rs_filter_get_image_tiled() */
+	tile_width += (tile_width & 1);
+
+	RS_DEBUG(FILTERS, "rs_filter_get_image8_tiled(%s [%p], %dx%d)", RS_FILTER_NAME(filter), filter, tile_width, tile_height);
+
+	tile_request = rs_filter_request_clone(request);
+
+	/* Render the complete image once, instead of once per tile */
+	if (!chain_renders_roi(filter))
+	{
+		RS_DEBUG(FILTERS, "rs_filter_get_image8_tiled(%s [%p]): ROI ignored in chain, rendering complete image", RS_FILTER_NAME(filter), filter);
+		rs_filter_request_set_roi(tile_request, NULL);
+		response = rs_filter_get_image8(filter, tile_request);
+		full = rs_filter_response_get_image8(response);
+		g_object_unref(response);
+		if (!full)
+			ret = FALSE;
+	}
+
+	for(y = 0; ret && (y < height); y += tile_height)
+		for(x = 0; ret && (x < width); x += tile_width)
+		{
+			rect.x = x;
+			rect.y = y;
+			rect.width = MIN(tile_width, width - x);
+			rect.height = MIN(tile_height, height - y);
+
+			if (full)
+				image = g_object_ref(full);
+			else
+			{
+				rs_filter_request_set_roi(tile_request, &rect);
+				response = rs_filter_get_image8(filter, tile_request);
+				image = rs_filter_response_get_image8(response);
+				g_object_unref(response);
+			}
+
+			if (!image || (gdk_pixbuf_get_width(image) < (rect.x + rect.width)) || (gdk_pixbuf_get_height(image) < (rect.y + rect.height)))
+			{
+				if (image)
+					g_object_unref(image);
+				ret = FALSE;
+				break;
+			}
+
+			tile = gdk_pixbuf_new_subpixbuf(image, rect.x, rect.y, rect.width, rect.height);
+			ret = func(filter, tile, &rect, user_data);
+
+			g_object_unref(tile);
+			g_object_unref(image);
+		}
+
+	if (full)
+		g_object_unref(full);
+	g_object_unref(tile_request);
+
+	return ret;
+}
+
+/**
+ * Get the border (halo) in pixels a RSFilter needs around a ROI to render it
+ * correctly. Filters not implementing get_border() needs no border.
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the request
+ * @return Number of pixels the ROI should be expanded in each direction
+ */
+gint
+rs_filter_get_border(RSFilter *filter, const RSFilterRequest *request)
+{
+	g_return_val_if_fail(RS_IS_FILTER(filter), 0);
+	g_return_val_if_fail(RS_IS_FILTER_REQUEST(request), 0);
+
+	if (RS_FILTER_GET_CLASS(filter)->get_border && filter->enabled)
+		return MAX(0, RS_FILTER_GET_CLASS(filter)->get_border(filter, request));
+
+	return 0;
+}
+
+/**
+ * Get how a RSFilter handles a ROI. Filters not implementing
+ * get_roi_support() renders only the ROI
+ * @param filter A RSFilter
+ * @return A RSFilterRoiSupport
+ */
+RSFilterRoiSupport
+rs_filter_get_roi_support(RSFilter *filter)
+{
+	g_return_val_if_fail(RS_IS_FILTER(filter), RS_FILTER_ROI_SUPPORTED);
+
+	/* Disabled filters just pass the request on */
+	if (RS_FILTER_GET_CLASS(filter)->get_roi_support && filter->enabled)
+		return RS_FILTER_GET_CLASS(filter)->get_roi_support(filter);
+
+	return RS_FILTER_ROI_SUPPORTED;
+}
+
 /**
  * Get predicted size of a RSFilter
  * @param filter A RSFilter
@@ -644,6 +1079,147 @@ rs_filter_get_label(RSFilter *filter)
 	return filter->label;
 }
 
+/**
+ * Get performance counters of a RSFilter
+ * @param filter A RSFilter
+ * @param stats A RSFilterStats to fill
+ */
+void
+rs_filter_get_stats(RSFilter *filter, RSFilterStats *stats)
+{
+	g_return_if_fail(RS_IS_FILTER(filter));
+	g_return_if_fail(stats != NULL);
+
+	g_static_mutex_lock(&stats_lock);
+	*stats = filter->stats;
+	g_static_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Reset performance counters of a RSFilter and all filters after it
+ * @param filter A RSFilter
+ */
+void
+rs_filter_reset_stats(RSFilter *filter)
+{
+	GSList *next;
+
+	g_return_if_fail(RS_IS_FILTER(filter));
+
+	g_static_mutex_lock(&stats_lock);
+	memset(&filter->stats, 0, sizeof(RSFilterStats));
+	g_static_mutex_unlock(&stats_lock);
+
+	for(next = filter->next_filters; next; next = next->next)
+		rs_filter_reset_stats(RS_FILTER(next->data));
+}
+
+/**
+ * Count cache lookups, this should only be called from caching filters
+ * @param filter A RSFilter
+ * @param hits Number of lookups served from cache
+ * @param misses Number of lookups that had to be rendered
+ */
+void
+rs_filter_stats_add_cache(RSFilter *filter, guint hits, guint misses)
+{
+	g_return_if_fail(RS_IS_FILTER(filter));
+
+	g_static_mutex_lock(&stats_lock);
+	filter->stats.cache_hits += hits;
+	filter->stats.cache_misses += misses;
+	g_static_mutex_unlock(&stats_lock);
+}
+
+static void
+json_append_string(GString *str, const gchar *value)
+{
+	const gchar *p;
+
+	g_string_append_c(str, '"');
+	for(p = value; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+			g_string_append_printf(str, "\\%c", *p);
+		else if (((guchar) *p) < 0x20)
+			g_string_append_printf(str, "\\u%04x", (guchar) *p);
+		else
+			g_string_append_c(str, *p);
+	}
+	g_string_append_c(str, '"');
+}
+
+/* JSON needs a dot as decimal separator regardless of locale */
+static void
+json_append_double(GString *str, const gchar *format, gdouble value)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	g_string_append(str, g_ascii_formatd(buf, sizeof(buf), format, value));
+}
+
+static void
+rs_filter_profile_helper(GString *str, RSFilter *filter)
+{
+	RSFilterStats stats;
+	GSList *next;
+
+	rs_filter_get_stats(filter, &stats);
+
+	g_string_append(str, "{\"filter\": ");
+	json_append_string(str, RS_FILTER_NAME(filter));
+	if (filter->label)
+	{
+		g_string_append(str, ", \"label\": ");
+		json_append_string(str, filter->label);
+	}
+	g_string_append_printf(str, ", \"enabled\": %s, \"calls\": %u, \"time_ms\": ",
+		filter->enabled ? "true" : "false", stats.calls);
+	json_append_double(str, "%.3f", stats.time * 1000.0);
+	g_string_append(str, ", \"mpix_per_s\": ");
+	json_append_double(str, "%.2f", (stats.time > 0.0) ? ((gdouble) stats.pixels) / stats.time / 1000000.0 : 0.0);
+	g_string_append_printf(str, ", \"pixels\": %" G_GUINT64_FORMAT ", \"bytes\": %" G_GUINT64_FORMAT,
+		stats.pixels, stats.bytes);
+	g_string_append_printf(str, ", \"cache_hits\": %u, \"cache_misses\": %u, \"next\": [",
+		stats.cache_hits, stats.cache_misses);
+
+	for(next = filter->next_filters; next; next = next->next)
+	{
+		rs_filter_profile_helper(str, RS_FILTER(next->data));
+		if (next->next)
+			g_string_append(str, ", ");
+	}
+
+	g_string_append(str, "]}");
+}
+
+/**
+ * Get performance counters of a filter graph as JSON
+ * @param filter The top-most filter to include
+ * @param label A label to include in the output, for example a camera model, or NULL
+ * @return A newly allocated string, this must be freed with g_free()
+ */
+gchar *
+rs_filter_get_profile_json(RSFilter *filter, const gchar *label)
+{
+	GString *str;
+
+	g_return_val_if_fail(RS_IS_FILTER(filter), NULL);
+
+	str = g_string_new("{");
+	if (label)
+	{
+		g_string_append(str, "\"label\": ");
+		json_append_string(str, label);
+		g_string_append(str, ", ");
+	}
+	g_string_append(str, "\"graph\": ");
+	rs_filter_profile_helper(str, filter);
+	g_string_append(str, "}");
+
+	return g_string_free(str, FALSE);
+}
+
 static void
 rs_filter_graph_helper(GString *str, RSFilter *filter)
 {
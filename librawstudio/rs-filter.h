@@ -76,11 +76,53 @@ typedef enum {
 	RS_FILTER_CHANGED_ICC_PROFILE = 1<<2
 } RSFilterChangedMask;
 
+typedef enum {
+	RS_FILTER_ROI_SUPPORTED,  /* Only the ROI is rendered */
+	RS_FILTER_ROI_IGNORED,    /* The complete image is rendered for any ROI */
+	RS_FILTER_ROI_FULL_IMAGE  /* The complete image is kept, previous filters are only asked for it once */
+} RSFilterRoiSupport;
+
 typedef struct _RSFilter RSFilter;
 typedef struct _RSFilterClass RSFilterClass;
 
 typedef RSFilterResponse *(*RSFilterFunc)(RSFilter *filter, const RSFilterRequest *request);
 
+/**
+ * Called by rs_filter_get_image_tiled() for every rendered tile
+ * @param filter The filter the tiles are pulled from
+ * @param image A RS_IMAGE16 with the pixels of the tile at (0,0), this can
+ *              be wider than rect to retain alignment. Should not be unreffed
+ * @param rect The area of the complete image covered by this tile
+ * @param user_data The user_data passed to rs_filter_get_image_tiled()
+ * @return TRUE to continue, FALSE to abort rendering
+ */
+typedef gboolean (*RSFilterTileFunc)(RSFilter *filter, RS_IMAGE16 *image, const GdkRectangle *rect, gpointer user_data);
+
+/**
+ * Called by rs_filter_get_image8_tiled() for every rendered tile
+ * @param filter The filter the tiles are pulled from
+ * @param image A GdkPixbuf with the pixels of the tile at (0,0). Should not be unreffed
+ * @param rect The area of the complete image covered by this tile
+ * @param user_data The user_data passed to rs_filter_get_image8_tiled()
+ * @return TRUE to continue, FALSE to abort rendering
+ */
+typedef gboolean (*RSFilterTile8Func)(RSFilter *filter, GdkPixbuf *image, const GdkRectangle *rect, gpointer user_data);
+
+/**
+ * Performance counters collected for every RSFilter instance
+ */
+typedef struct {
+	guint calls;
+	gdouble time; /* Seconds spent in the filter itself, previous filters excluded */
+	guint64 pixels; /* Pixels rendered */
+	guint64 bytes; /* Bytes of image data allocated */
+	guint cache_hits;
+	guint cache_misses;
+} RSFilterStats;
+
+/* Default tile size used for tiled chain execution */
+#define RS_FILTER_TILE_SIZE 512
+
 struct _RSFilter {
 	GObject parent;
 	gboolean dispose_has_run;
@@ -90,6 +132,8 @@ struct _RSFilter {
 	RSFilter *previous;
 	GSList *next_filters;
 	gboolean enabled;
+
+	RSFilterStats stats;
 };
 
 struct _RSFilterClass {
@@ -97,7 +141,10 @@ struct _RSFilterClass {
 	const gchar *name;
 	RSFilterFunc get_image;
 	RSFilterFunc get_image8;
+	RSFilterFunc get_image_float;
 	RSFilterResponse *(*get_size)(RSFilter *filter, const RSFilterRequest *request);
+	gint (*get_border)(RSFilter *filter, const RSFilterRequest *request);
+	RSFilterRoiSupport (*get_roi_support)(RSFilter *filter);
 	void (*previous_changed)(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
 };
 
@@ -142,6 +189,67 @@ extern RSFilterResponse *rs_filter_get_image(RSFilter *filter, const RSFilterReq
  */
 extern RSFilterResponse *rs_filter_get_image8(RSFilter *filter, const RSFilterRequest *request);
 
+/**
+ * Get planar float output image from a RSFilter. Filters that cannot render
+ * planar float will have their 16 bit output converted, so this works for any
+ * chain. The image is returned by rs_filter_response_get_image_float()
+ * @param filter A RSFilter
+ * @param param A RSFilterRequest defining parameters for a image request
+ * @return A RSFilterResponse, this must be unref'ed
+ */
+extern RSFilterResponse *rs_filter_get_image_float(RSFilter *filter, const RSFilterRequest *request);
+
+/**
+ * Pull the output image from a RSFilter one tile at a time. Every tile is
+ * requested through the chain as a ROI, and filters needing neighbouring
+ * pixels get their ROI expanded by their border (see rs_filter_get_border()).
+ * Filters rendering a ROI only allocate memory for it (see
+ * rs_image16_new_area()). If a filter in the chain ignores the ROI, and no
+ * filter after it keeps the complete image, the complete image is rendered
+ * once and handed out a tile at a time (see rs_filter_get_roi_support())
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the image request,
+ *                any ROI set will be ignored
+ * @param tile_width Width of tiles in pixels, or -1 for full width strips
+ * @param tile_height Height of tiles in pixels
+ * @param func A function to call for every tile, in top-to-bottom,
+ *             left-to-right order
+ * @param user_data Data to pass to func
+ * @return TRUE if all tiles was rendered, FALSE on errors or if aborted by func
+ */
+extern gboolean rs_filter_get_image_tiled(RSFilter *filter, const RSFilterRequest *request, gint tile_width, gint tile_height, RSFilterTileFunc func, gpointer user_data);
+
+/**
+ * Like rs_filter_get_image_tiled(), but pulls 8 bit tiles
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the image request,
+ *                any ROI set will be ignored
+ * @param tile_width Width of tiles in pixels, or -1 for full width strips
+ * @param tile_height Height of tiles in pixels
+ * @param func A function to call for every tile, in top-to-bottom,
+ *             left-to-right order
+ * @param user_data Data to pass to func
+ * @return TRUE if all tiles was rendered, FALSE on errors or if aborted by func
+ */
+extern gboolean rs_filter_get_image8_tiled(RSFilter *filter, const RSFilterRequest *request, gint tile_width, gint tile_height, RSFilterTile8Func func, gpointer user_data);
+
+/**
+ * Get the border (halo) in pixels a RSFilter needs around a ROI to render it
+ * correctly. Filters not implementing get_border() needs no border.
+ * @param filter A RSFilter
+ * @param request A RSFilterRequest defining parameters for the request
+ * @return Number of pixels the ROI should be expanded in each direction
+ */
+extern gint rs_filter_get_border(RSFilter *filter, const RSFilterRequest *request);
+
+/**
+ * Get how a RSFilter handles a ROI. Filters not implementing
+ * get_roi_support() renders only the ROI
+ * @param filter A RSFilter
+ * @return A RSFilterRoiSupport
+ */
+extern RSFilterRoiSupport rs_filter_get_roi_support(RSFilter *filter);
+
 /**
  * Get predicted size of a RSFilter
  * @param filter A RSFilter
@@ -203,6 +311,35 @@ extern void rs_filter_set_label(RSFilter *filter, const gchar *label);
  */
 extern const gchar *rs_filter_get_label(RSFilter *filter);
 
+/**
+ * Get performance counters of a RSFilter
+ * @param filter A RSFilter
+ * @param stats A RSFilterStats to fill
+ */
+extern void rs_filter_get_stats(RSFilter *filter, RSFilterStats *stats);
+
+/**
+ * Reset performance counters of a RSFilter and all filters after it
+ * @param filter A RSFilter
+ */
+extern void rs_filter_reset_stats(RSFilter *filter);
+
+/**
+ * Count cache lookups, this should only be called from caching filters
+ * @param filter A RSFilter
+ * @param hits Number of lookups served from cache
+ * @param misses Number of lookups that had to be rendered
+ */
+extern void rs_filter_stats_add_cache(RSFilter *filter, guint hits, guint misses);
+
+/**
+ * Get performance counters of a filter graph as JSON
+ * @param filter The top-most filter to include
+ * @param label A label to include in the output, for example a camera model, or NULL
+ * @return A newly allocated string, this must be freed with g_free()
+ */
+extern gchar *rs_filter_get_profile_json(RSFilter *filter, const gchar *label);
+
 /**
  * Draw a nice graph of the filter chain
  * note: Requires graphviz
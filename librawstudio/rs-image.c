@@ -17,16 +17,18 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#ifdef WIN32 /* Win32 _aligned_malloc */
+#include <malloc.h>
+#endif
+
 #include <rawstudio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "rs-image.h"
 
-struct _RSImage {
-	GObject parent;
-	gint width;
-	gint height;
-	gint number_of_planes;
-	gfloat **planes;
-};
+/* Align every row to a full cache line */
+#define PLANE_ALIGN 64
+#define PITCH(width) ((((width)+15)/16)*16)
 
 G_DEFINE_TYPE (RSImage, rs_image, G_TYPE_OBJECT)
 
@@ -37,14 +39,39 @@ typedef enum {
 
 static guint signals[RS_IMAGE_LAST_SIGNAL] = { 0 };
 
+static gfloat *
+plane_alloc(gsize size)
+{
+	gfloat *plane = NULL;
+#ifdef WIN32
+	plane = _aligned_malloc(size, PLANE_ALIGN);
+#else
+	if (posix_memalign((void **) &plane, PLANE_ALIGN, size) > 0)
+		plane = NULL;
+#endif
+	return plane;
+}
+
+static void
+plane_free(gfloat *plane)
+{
+#ifdef WIN32
+	_aligned_free(plane);
+#else
+	free(plane);
+#endif
+}
+
 static void
 rs_image_finalize (GObject *object)
 {
 	RSImage *image = RS_IMAGE(object);
 	gint plane;
 
-	for (plane=0; plane<image->number_of_planes; plane++)
-		g_free(image->planes[plane]);
+	if (image->planes)
+		for (plane=0; plane<image->number_of_planes; plane++)
+			if (image->planes[plane])
+				plane_free(image->planes[plane] + image->offset);
 	g_free(image->planes);
 
 	if (G_OBJECT_CLASS (rs_image_parent_class)->finalize)
@@ -77,7 +104,6 @@ rs_image_new(gint width, gint height, gint number_of_planes)
 	gint plane;
 	RSImage *image;
 
-	g_return_val_if_fail(width < 65535, NULL);
 	g_return_val_if_fail(width < 65536, NULL);
 	g_return_val_if_fail(height < 65536, NULL);
 	g_return_val_if_fail(width > 0, NULL);
@@ -88,15 +114,223 @@ rs_image_new(gint width, gint height, gint number_of_planes)
 	image->number_of_planes = number_of_planes;
 	image->width = width;
 	image->height = height;
+	image->pitch = PITCH(width);
+	image->area.x = 0;
+	image->area.y = 0;
+	image->area.width = width;
+	image->area.height = height;
+	image->offset = 0;
 
 	/* Allocate space for all planes and all pixels */
-	image->planes = g_new(gfloat *, number_of_planes);
+	image->planes = g_new0(gfloat *, number_of_planes);
+	for(plane=0; plane<image->number_of_planes; plane++)
+	{
+		image->planes[plane] = plane_alloc(((gsize) image->pitch) * image->height * sizeof(gfloat));
+		if (!image->planes[plane])
+		{
+			g_object_unref(image);
+			return NULL;
+		}
+	}
+
+	return image;
+}
+
+RSImage *
+rs_image_new_area(gint width, gint height, gint number_of_planes, const GdkRectangle *area)
+{
+	gint plane;
+	gint x1, y1, x2, y2;
+	RSImage *image;
+
+	g_return_val_if_fail(width < 65536, NULL);
+	g_return_val_if_fail(height < 65536, NULL);
+	g_return_val_if_fail(width > 0, NULL);
+	g_return_val_if_fail(height > 0, NULL);
+	g_return_val_if_fail(number_of_planes > 0, NULL);
+	g_return_val_if_fail(area != NULL, NULL);
+
+	/* Same margin and alignment as rs_image16_new_area() */
+	x1 = CLAMP(area->x - 1, 0, width - 1) & ~15;
+	x2 = MIN((area->x + area->width + 31) & ~15, width);
+	y1 = CLAMP(area->y - 1, 0, height - 1);
+	y2 = MIN(area->y + area->height + 1, height);
+
+	/* Not worth the trouble for most of the image */
+	if ((x2 <= x1) || (y2 <= y1) || (((gsize) (x2 - x1)) * (y2 - y1) * 4 >= ((gsize) width) * height * 3))
+		return rs_image_new(width, height, number_of_planes);
+
+	image = g_object_new(RS_TYPE_IMAGE, NULL);
+	image->number_of_planes = number_of_planes;
+	image->width = width;
+	image->height = height;
+	image->pitch = PITCH(x2 - x1);
+	image->area.x = x1;
+	image->area.y = y1;
+	image->area.width = x2 - x1;
+	image->area.height = y2 - y1;
+
+	/* Planes point at where (0,0) would be, RS_IMAGE_GET_ROW() will then work
+	   with the coordinates of the complete image */
+	image->offset = ((gsize) y1) * image->pitch + x1;
+
+	image->planes = g_new0(gfloat *, number_of_planes);
 	for(plane=0; plane<image->number_of_planes; plane++)
-		image->planes[plane] = g_new(gfloat, image->width*image->height);
+	{
+		gfloat *pixels = plane_alloc(((gsize) image->pitch) * (y2 - y1) * sizeof(gfloat));
+		if (!pixels)
+		{
+			g_object_unref(image);
+			return NULL;
+		}
+		image->planes[plane] = pixels - image->offset;
+	}
 
 	return image;
 }
 
+typedef struct {
+	RS_IMAGE16 *image16;
+	RSImage *image;
+	gint x;
+	gint width;
+} ConvertInfo;
+
+static void
+convert_from_image16(gint start, gint end, gpointer user_data)
+{
+	const ConvertInfo *info = user_data;
+	const gfloat scale = 1.0f/65535.0f;
+	gint x, y, plane;
+
+	for(y = start; y < end; y++)
+		for(plane = 0; plane < info->image->number_of_planes; plane++)
+		{
+			const gushort *in = GET_PIXEL(info->image16, info->x, y) + plane;
+			gfloat *out = RS_IMAGE_GET_ROW(info->image, plane, y) + info->x;
+			const gint pixelsize = info->image16->pixelsize;
+
+			for(x = 0; x < info->width; x++)
+			{
+				out[x] = ((gfloat) *in) * scale;
+				in += pixelsize;
+			}
+		}
+}
+
+RSImage *
+rs_image_new_from_image16(RS_IMAGE16 *input, const GdkRectangle *roi)
+{
+	ConvertInfo info;
+	gint y = 0, height;
+
+	g_return_val_if_fail(RS_IS_IMAGE16(input), NULL);
+
+	/* Only the backed part of a partial image can be converted */
+	if (!roi && (input->area.width < input->w || input->area.height < input->h))
+		roi = &input->area;
+
+	info.image16 = input;
+	info.x = 0;
+	info.width = input->w;
+	height = input->h;
+	if (roi)
+	{
+		info.x = CLAMP(roi->x, 0, input->w);
+		info.width = CLAMP(roi->width, 0, input->w - info.x);
+		y = CLAMP(roi->y, 0, input->h);
+		height = CLAMP(roi->height, 0, input->h - y);
+		info.image = rs_image_new_area(input->w, input->h, input->channels, roi);
+	}
+	else
+		info.image = rs_image_new(input->w, input->h, input->channels);
+
+	if (!info.image)
+		return NULL;
+
+	rs_parallel_for(y, y + height, 0, convert_from_image16, &info);
+
+	return info.image;
+}
+
+static void
+convert_to_image16(gint start, gint end, gpointer user_data)
+{
+	const ConvertInfo *info = user_data;
+	gint x, y, plane;
+
+	for(y = start; y < end; y++)
+		for(plane = 0; plane < info->image->number_of_planes; plane++)
+		{
+			const gfloat *in = RS_IMAGE_GET_ROW(info->image, plane, y) + info->x;
+			gushort *out = GET_PIXEL(info->image16, info->x, y) + plane;
+			const gint pixelsize = info->image16->pixelsize;
+
+			for(x = 0; x < info->width; x++)
+			{
+				gfloat value = in[x] * 65535.0f + 0.5f;
+				*out = (gushort) CLAMP(value, 0.0f, 65535.0f);
+				out += pixelsize;
+			}
+		}
+}
+
+RS_IMAGE16 *
+rs_image_to_image16(RSImage *image, const GdkRectangle *roi)
+{
+	ConvertInfo info;
+	gint y = 0, height;
+
+	g_return_val_if_fail(RS_IS_IMAGE(image), NULL);
+
+	if (!roi && (image->area.width < image->width || image->area.height < image->height))
+		roi = &image->area;
+
+	info.image = image;
+	info.x = 0;
+	info.width = image->width;
+	height = image->height;
+	/* Three channels are padded to four for alignment like everywhere else */
+	if (roi)
+	{
+		info.x = CLAMP(roi->x, 0, image->width);
+		info.width = CLAMP(roi->width, 0, image->width - info.x);
+		y = CLAMP(roi->y, 0, image->height);
+		height = CLAMP(roi->height, 0, image->height - y);
+		info.image16 = rs_image16_new_area(image->width, image->height, image->number_of_planes,
+			(image->number_of_planes == 3) ? 4 : image->number_of_planes, roi);
+	}
+	else
+		info.image16 = rs_image16_new(image->width, image->height, image->number_of_planes,
+			(image->number_of_planes == 3) ? 4 : image->number_of_planes);
+
+	if (!info.image16)
+		return NULL;
+
+	rs_parallel_for(y, y + height, 0, convert_to_image16, &info);
+
+	return info.image16;
+}
+
+void
+rs_image_copy_area(RSImage *src, gint src_x, gint src_y, gint width, gint height, RSImage *dest, gint dest_x, gint dest_y)
+{
+	gint plane, y;
+
+	g_return_if_fail(RS_IS_IMAGE(src));
+	g_return_if_fail(RS_IS_IMAGE(dest));
+	g_return_if_fail(src->number_of_planes == dest->number_of_planes);
+	g_return_if_fail(src_x >= 0 && src_y >= 0 && dest_x >= 0 && dest_y >= 0);
+	g_return_if_fail((src_x + width) <= src->width && (src_y + height) <= src->height);
+	g_return_if_fail((dest_x + width) <= dest->width && (dest_y + height) <= dest->height);
+
+	for(plane = 0; plane < src->number_of_planes; plane++)
+		for(y = 0; y < height; y++)
+			memcpy(RS_IMAGE_GET_ROW(dest, plane, dest_y + y) + dest_x,
+				RS_IMAGE_GET_ROW(src, plane, src_y + y) + src_x,
+				width * sizeof(gfloat));
+}
+
 void
 rs_image_changed(RSImage *image)
 {
@@ -121,6 +355,14 @@ rs_image_get_height(RSImage *image)
 	return image->height;
 }
 
+gint
+rs_image_get_pitch(RSImage *image)
+{
+	g_return_val_if_fail(RS_IS_IMAGE(image), 0);
+
+	return image->pitch;
+}
+
 gint
 rs_image_get_number_of_planes(RSImage *image)
 {
@@ -133,7 +375,7 @@ gfloat *
 rs_image_get_plane(RSImage *image, gint plane_num)
 {
 	g_return_val_if_fail(RS_IS_IMAGE(image), NULL);
-	g_return_val_if_fail(plane_num > 0, NULL);
+	g_return_val_if_fail(plane_num >= 0, NULL);
 	g_return_val_if_fail(plane_num < image->number_of_planes, NULL);
 
 	return image->planes[plane_num];
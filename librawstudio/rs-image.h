@@ -31,21 +31,98 @@ G_BEGIN_DECLS
 #define RS_IS_IMAGE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), RS_TYPE_IMAGE))
 #define RS_IMAGE_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), RS_TYPE_IMAGE, RSImageClass))
 
+/* A planar float image, 1.0 corresponds to 65535 in a RS_IMAGE16. Values are
+   not clamped, so they can be outside 0.0 - 1.0. Every row of every plane
+   starts at a 64 byte boundary */
+struct _RSImage {
+	GObject parent;
+	gint width;
+	gint height;
+	gint pitch; /* Distance between rows in floats */
+	gint number_of_planes;
+	gfloat **planes;
+	GdkRectangle area; /* The part of the image backed by pixels */
+	gsize offset; /* Distance in floats from planes[] to the allocated memory */
+};
+
 typedef struct {
 	GObjectClass parent_class;
 } RSImageClass;
 
+/**
+ * Convenience macro to get the start of a row in a plane
+ * @param image A RSImage
+ * @param plane The plane number
+ * @param y Y coordinate (row)
+ */
+#define RS_IMAGE_GET_ROW(image, plane, y) ((image)->planes[(plane)] + (y)*(image)->pitch)
+
 GType rs_image_get_type(void);
 
 extern RSImage *
 rs_image_new(gint width, gint height, gint number_of_planes);
 
+/**
+ * Initializes a new RSImage where only an area has pixels behind it, like
+ * rs_image16_new_area(). Pixels outside the area must not be accessed
+ * @param width The width of the complete image
+ * @param height The height of the complete image
+ * @param number_of_planes The number of planes
+ * @param area The area to back, a small margin is added
+ * @return A new RSImage, the area is available as image->area
+ */
+extern RSImage *
+rs_image_new_area(gint width, gint height, gint number_of_planes, const GdkRectangle *area);
+
+/**
+ * Convert a RS_IMAGE16 to a planar float image, with one plane per channel
+ * @param input A RS_IMAGE16
+ * @param roi The area to convert or NULL for the whole image, only the area
+ *            is backed by pixels in the result
+ * @return A new RSImage with the same size as input
+ */
+extern RSImage *
+rs_image_new_from_image16(RS_IMAGE16 *input, const GdkRectangle *roi);
+
+/**
+ * Convert a planar float image to a RS_IMAGE16, values are clamped and rounded
+ * @param image A RSImage
+ * @param roi The area to convert or NULL for the whole image, only the area
+ *            is backed by pixels in the result
+ * @return A new RS_IMAGE16 with the same size as image
+ */
+extern RS_IMAGE16 *
+rs_image_to_image16(RSImage *image, const GdkRectangle *roi);
+
+/**
+ * Copy an area from one RSImage to another, both must have the same number
+ * of planes
+ * @param src The source image
+ * @param src_x X coordinate in source
+ * @param src_y Y coordinate in source
+ * @param width Width of the area
+ * @param height Height of the area
+ * @param dest The destination image
+ * @param dest_x X coordinate in destination
+ * @param dest_y Y coordinate in destination
+ */
+extern void
+rs_image_copy_area(RSImage *src, gint src_x, gint src_y, gint width, gint height, RSImage *dest, gint dest_x, gint dest_y);
+
 extern gint
 rs_image_get_width(RSImage *image);
 
 extern gint
 rs_image_get_height(RSImage *image);
 
+/**
+ * Get the distance between rows
+ * @param image A RSImage
+ * @return The distance in floats
+ */
+extern gint
+rs_image_get_pitch(RSImage *image);
+
 extern gint
 rs_image_get_number_of_planes(RSImage *image);
 
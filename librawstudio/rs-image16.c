@@ -20,6 +20,8 @@
 #ifdef WIN32 /* Win32 _aligned_malloc */
 #include <malloc.h>
 #include <stdio.h>
+#else
+#include <sys/mman.h> /* madvise() */
 #endif
 
 #include <rawstudio.h>
@@ -34,10 +36,160 @@
 
 #define PITCH(width) ((((width)+15)/16)*16)
 
+/* Alignment of pixel data, this is a full cache line */
+#define POOL_ALIGN 64
+
+/* Buffers below this size are rounded up to it, it's not worth the trouble */
+#define POOL_MIN_SIZE (64*1024)
+
+/* Number of size classes between two powers of two, the worst case waste
+   is 1/POOL_CLASS_STEPS of the buffer */
+#define POOL_CLASS_STEPS 8
+
+/* Buffers at least this big will be aligned for transparent hugepages */
+#define POOL_HUGEPAGE_SIZE (2*1024*1024)
+
+#define POOL_DEFAULT_LIMIT (256*1024*1024)
+
+/* Every buffer is prefixed by a header, the header is padded to POOL_ALIGN
+   to keep the pixel data aligned */
+typedef struct {
+	gsize size;
+} PoolHeader;
+
+#define POOL_HEADER_SIZE (((sizeof(PoolHeader)+POOL_ALIGN-1)/POOL_ALIGN)*POOL_ALIGN)
+#define POOL_HEADER(pixels) ((PoolHeader *) (((gchar *) (pixels)) - POOL_HEADER_SIZE))
+
+static GStaticMutex pool_lock = G_STATIC_MUTEX_INIT;
+static GQueue pool_free = G_QUEUE_INIT; /* Most recently released first */
+static gsize pool_limit = POOL_DEFAULT_LIMIT;
+static gboolean pool_hugepages = FALSE;
+static RSImage16PoolStats pool_stats = {0, 0, 0, 0, 0, 0};
+
 G_DEFINE_TYPE (RS_IMAGE16, rs_image16, G_TYPE_OBJECT);
 
 static GObjectClass *parent_class = NULL;
 
+/* Round a size up to its size class */
+static gsize
+pool_class_size(gsize size)
+{
+	gsize octave = POOL_MIN_SIZE;
+	gsize step;
+
+	size += POOL_HEADER_SIZE;
+	if (size <= POOL_MIN_SIZE)
+		return POOL_MIN_SIZE;
+
+	while (octave*2 < size)
+		octave *= 2;
+	step = octave / POOL_CLASS_STEPS;
+
+	return ((size + step - 1) / step) * step;
+}
+
+static void
+pool_system_free(PoolHeader *header)
+{
+	g_assert(pool_stats.allocated_bytes >= header->size);
+	pool_stats.allocated_bytes -= header->size;
+#ifdef WIN32
+	_aligned_free(header);
+#else
+	free(header);
+#endif
+}
+
+/* Must be called with pool_lock held */
+static void
+pool_trim(gsize limit)
+{
+	PoolHeader *header;
+
+	while (pool_stats.cached_bytes > limit && (header = g_queue_pop_tail(&pool_free)))
+	{
+		pool_stats.cached_bytes -= header->size;
+		pool_stats.evictions++;
+		pool_system_free(header);
+	}
+}
+
+static gushort *
+pool_alloc(gsize size)
+{
+	PoolHeader *header = NULL;
+	gsize class_size = pool_class_size(size);
+	gsize align = POOL_ALIGN;
+	GList *node;
+
+	g_static_mutex_lock(&pool_lock);
+	for(node = pool_free.head; node; node = node->next)
+		if (((PoolHeader *) node->data)->size == class_size)
+		{
+			header = node->data;
+			g_queue_delete_link(&pool_free, node);
+			pool_stats.cached_bytes -= class_size;
+			pool_stats.hits++;
+			break;
+		}
+
+	if (!header)
+	{
+		pool_stats.misses++;
+		/* Make room for the new buffer by releasing cached ones we can't use */
+		if (pool_stats.cached_bytes > 0)
+			pool_trim((pool_limit > class_size) ? pool_limit - class_size : 0);
+
+		if (pool_hugepages && class_size >= POOL_HUGEPAGE_SIZE)
+			align = POOL_HUGEPAGE_SIZE;
+		g_static_mutex_unlock(&pool_lock);
+
+#ifdef WIN32
+		header = _aligned_malloc(class_size, align);
+#else
+		if (posix_memalign((void **) &header, align, class_size) > 0)
+			header = NULL;
+#ifdef MADV_HUGEPAGE
+		else if (align == POOL_HUGEPAGE_SIZE)
+			madvise(header, class_size, MADV_HUGEPAGE);
+#endif
+#endif
+		if (!header)
+			return NULL;
+		header->size = class_size;
+
+		g_static_mutex_lock(&pool_lock);
+		pool_stats.allocated_bytes += class_size;
+	}
+	g_static_mutex_unlock(&pool_lock);
+
+	return (gushort *) (((gchar *) header) + POOL_HEADER_SIZE);
+}
+
+static void
+pool_release(gushort *pixels)
+{
+	PoolHeader *header = POOL_HEADER(pixels);
+
+	g_static_mutex_lock(&pool_lock);
+	pool_stats.releases++;
+	if (header->size > pool_limit)
+		pool_system_free(header);
+	else
+	{
+		g_queue_push_head(&pool_free, header);
+		pool_stats.cached_bytes += header->size;
+		pool_trim(pool_limit);
+	}
+	g_static_mutex_unlock(&pool_lock);
+}
+
+static void
+pool_release_notify(gpointer pixels)
+{
+	pool_release(pixels);
+}
+
 static void
 rs_image16_dispose (GObject *obj)
 {
@@ -47,6 +199,12 @@ rs_image16_dispose (GObject *obj)
 		return;
 	self->dispose_has_run = TRUE;
 
+	/* Subframes keep their parent alive, the pixels must not be
+	   recycled through the pool while we point into them */
+	if (self->parent)
+		g_object_unref(self->parent);
+	self->parent = NULL;
+
 	G_OBJECT_CLASS (parent_class)->dispose (obj);
 }
 
@@ -55,8 +213,15 @@ rs_image16_finalize (GObject *obj)
 {
 	RS_IMAGE16 *self = (RS_IMAGE16 *)obj;
 
+	/* Only the image owning the pixels has a refcount of 1, subframes
+	   point into the pixels of their parent and never release them */
 	if (self->pixels && (self->pixels_refcount == 1))
-		free(self->pixels);
+	{
+		if (self->release)
+			self->release(self->release_data);
+		else
+			pool_release(self->pixels);
+	}
 
 	self->pixels_refcount--;
 
@@ -81,6 +246,9 @@ rs_image16_init (RS_IMAGE16 *self)
 	self->filters = 0;
 	self->pixels = NULL;
 	self->pixels_refcount = 0;
+	self->release = NULL;
+	self->release_data = NULL;
+	self->parent = NULL;
 }
 
 void
@@ -125,7 +293,6 @@ rs_image16_transform_getwh(RS_IMAGE16 *in, RS_RECT *crop, gdouble angle, gint or
 RS_IMAGE16 *
 rs_image16_new(const guint width, const guint height, const guint channels, const guint pixelsize)
 {
-	gint ret;
 	RS_IMAGE16 *rsi;
 
 	g_return_val_if_fail(width < 65536, NULL);
@@ -146,28 +313,181 @@ rs_image16_new(const guint width, const guint height, const guint channels, cons
 	rsi->pixelsize = pixelsize;
 	rsi->filters = 0;
 
-	/* Allocate actual pixels */
-#ifdef WIN32
-	rsi->pixels = _aligned_malloc(rsi->h*rsi->rowstride * sizeof(gushort), 16); 
+	/* Allocate actual pixels, recycled buffers are likely */
+	rsi->pixels = pool_alloc(((gsize) rsi->h) * rsi->rowstride * sizeof(gushort));
 	if (rsi->pixels == NULL)
-#else
-	ret = posix_memalign((void **) &rsi->pixels, 16, rsi->h*rsi->rowstride * sizeof(gushort));
-	if (ret > 0)
-#endif
 	{
-		rsi->pixels = NULL;
 		g_object_unref(rsi);
 		return NULL;
 	}
 	rsi->pixels_refcount = 1;
+	rsi->area.x = 0;
+	rsi->area.y = 0;
+	rsi->area.width = width;
+	rsi->area.height = height;
 
 	/* Verify alignment */
-	g_assert((GPOINTER_TO_INT(rsi->pixels) % 16) == 0);
+	g_assert((((guintptr) rsi->pixels) % POOL_ALIGN) == 0);
 	g_assert((rsi->rowstride % 16) == 0);
 
 	return(rsi);
 }
 
+/* Horizontal alignment of a backed area in pixels, pixels in the area keep
+   the alignment they would have in a complete image */
+#define AREA_ALIGN 16
+
+static RS_IMAGE16 *
+new_area(const guint width, const guint height, const guint channels, const guint pixelsize, gint x1, gint y1, gint x2, gint y2)
+{
+	RS_IMAGE16 *rsi;
+	gushort *pixels;
+
+	/* Not worth the trouble for most of the image */
+	if (((gsize) (x2 - x1)) * (y2 - y1) * 4 >= ((gsize) width) * height * 3)
+		return rs_image16_new(width, height, channels, pixelsize);
+
+	g_return_val_if_fail(width < 65536, NULL);
+	g_return_val_if_fail(height < 65536, NULL);
+	g_return_val_if_fail(channels > 0, NULL);
+	g_return_val_if_fail(pixelsize >= channels, NULL);
+
+	rsi = g_object_new(RS_TYPE_IMAGE16, NULL);
+	rsi->w = width;
+	rsi->h = height;
+	rsi->rowstride = PITCH((x2 - x1) * pixelsize);
+	rsi->pitch = rsi->rowstride / pixelsize;
+	rsi->channels = channels;
+	rsi->pixelsize = pixelsize;
+	rsi->filters = 0;
+
+	pixels = pool_alloc(((gsize) (y2 - y1)) * rsi->rowstride * sizeof(gushort));
+	if (pixels == NULL)
+	{
+		g_object_unref(rsi);
+		return NULL;
+	}
+
+	/* Point pixels at where (0,0) would be, GET_PIXEL() will then work with
+	   the coordinates of the complete image */
+	rsi->pixels = pixels - (((gssize) y1) * rsi->rowstride + ((gssize) x1) * pixelsize);
+	rsi->pixels_refcount = 1;
+	rsi->release = pool_release_notify;
+	rsi->release_data = pixels;
+	rsi->area.x = x1;
+	rsi->area.y = y1;
+	rsi->area.width = x2 - x1;
+	rsi->area.height = y2 - y1;
+
+	g_assert((((guintptr) GET_PIXEL(rsi, x1, y1)) % 16) == 0);
+
+	return rsi;
+}
+
+/* Bounds of the memory backing area, returns FALSE if the area is empty */
+static gboolean
+area_bounds(const gint width, const gint height, const GdkRectangle *area, gint *x1, gint *y1, gint *x2, gint *y2)
+{
+	/* Leave a margin for filters reading a pixel or a vector beyond their ROI,
+	   at least AREA_ALIGN pixels to the right */
+	*x1 = CLAMP(area->x - 1, 0, width - 1) & ~(AREA_ALIGN - 1);
+	*x2 = MIN((area->x + area->width + 2 * AREA_ALIGN - 1) & ~(AREA_ALIGN - 1), width);
+	*y1 = CLAMP(area->y - 1, 0, height - 1);
+	*y2 = MIN(area->y + area->height + 1, height);
+
+	return (*x2 > *x1) && (*y2 > *y1);
+}
+
+RS_IMAGE16 *
+rs_image16_new_area(const guint width, const guint height, const guint channels, const guint pixelsize, const GdkRectangle *area)
+{
+	gint x1, y1, x2, y2;
+
+	g_return_val_if_fail(width > 0, NULL);
+	g_return_val_if_fail(height > 0, NULL);
+	g_return_val_if_fail(area != NULL, NULL);
+
+	if (!area_bounds(width, height, area, &x1, &y1, &x2, &y2))
+		return rs_image16_new(width, height, channels, pixelsize);
+
+	return new_area(width, height, channels, pixelsize, x1, y1, x2, y2);
+}
+
+static void
+pixbuf_area_free(guchar *pixels, gpointer backing)
+{
+	g_object_unref(backing);
+}
+
+GdkPixbuf *
+rs_pixbuf_new_area(gboolean has_alpha, gint width, gint height, const GdkRectangle *area)
+{
+	GdkPixbuf *backing;
+	gint x1, y1, x2, y2;
+	gint rowstride, channels;
+
+	g_return_val_if_fail(width > 0, NULL);
+	g_return_val_if_fail(height > 0, NULL);
+	g_return_val_if_fail(area != NULL, NULL);
+
+	if (!area_bounds(width, height, area, &x1, &y1, &x2, &y2)
+		|| ((gsize) (x2 - x1)) * (y2 - y1) * 4 >= ((gsize) width) * height * 3)
+		return gdk_pixbuf_new(GDK_COLORSPACE_RGB, has_alpha, 8, width, height);
+
+	backing = gdk_pixbuf_new(GDK_COLORSPACE_RGB, has_alpha, 8, x2 - x1, y2 - y1);
+	if (!backing)
+		return NULL;
+
+	/* Wrap the pixels at where (0,0) would be, the wrapper keeps the backing
+	   pixbuf alive */
+	rowstride = gdk_pixbuf_get_rowstride(backing);
+	channels = gdk_pixbuf_get_n_channels(backing);
+	return gdk_pixbuf_new_from_data(gdk_pixbuf_get_pixels(backing) - (y1 * rowstride + x1 * channels),
+		GDK_COLORSPACE_RGB, has_alpha, 8, width, height, rowstride,
+		pixbuf_area_free, backing);
+}
+
+RS_IMAGE16 *
+rs_image16_new_wrap(const guint width, const guint height, const guint channels, const guint pixelsize, gushort *pixels, const gint rowstride, GDestroyNotify release, gpointer release_data)
+{
+	RS_IMAGE16 *rsi;
+
+	g_return_val_if_fail(width < 65536, NULL);
+	g_return_val_if_fail(height < 65536, NULL);
+
+	g_return_val_if_fail(width > 0, NULL);
+	g_return_val_if_fail(height > 0, NULL);
+
+	g_return_val_if_fail(channels > 0, NULL);
+	g_return_val_if_fail(pixelsize >= channels, NULL);
+	g_return_val_if_fail(pixels != NULL, NULL);
+
+	/* Filters expect the same layout as we allocate ourselves */
+	if ((((guintptr) pixels) % 16) != 0)
+		return NULL;
+	if ((rowstride % 16) != 0 || rowstride < width * pixelsize)
+		return NULL;
+
+	rsi = g_object_new(RS_TYPE_IMAGE16, NULL);
+	rsi->w = width;
+	rsi->h = height;
+	rsi->rowstride = rowstride;
+	rsi->pitch = rowstride / pixelsize;
+	rsi->channels = channels;
+	rsi->pixelsize = pixelsize;
+	rsi->filters = 0;
+	rsi->pixels = pixels;
+	rsi->pixels_refcount = 1;
+	rsi->release = release;
+	rsi->release_data = release_data;
+	rsi->area.x = 0;
+	rsi->area.y = 0;
+	rsi->area.width = width;
+	rsi->area.height = height;
+
+	return rsi;
+}
+
 /**
  * Initializes a new RS_IMAGE16 with pixeldata from @input.
  * @note Pixeldata is NOT copied to new RS_IMAGE16.
@@ -220,6 +540,17 @@ rs_image16_new_subframe(RS_IMAGE16 *input, GdkRectangle *rectangle)
 
 	output->pixels = GET_PIXEL(input, x, y);
 	output->pixels_refcount = input->pixels_refcount + 1;
+	output->parent = g_object_ref(input);
+
+	/* Carry over the backed area of a partial image */
+	output->area.x = x;
+	output->area.y = y;
+	output->area.width = width;
+	output->area.height = height;
+	if (!gdk_rectangle_intersect(&output->area, &input->area, &output->area))
+		output->area.width = output->area.height = 0;
+	output->area.x -= x;
+	output->area.y -= y;
 
 	/* Some sanity checks */
 	g_assert(output->w <= input->w);
@@ -234,7 +565,7 @@ rs_image16_new_subframe(RS_IMAGE16 *input, GdkRectangle *rectangle)
 	g_assert((output->w - 4) <= rectangle->width);
 
 	/* Verify alignment */
-	g_assert((GPOINTER_TO_INT(output->pixels) % 16) == 0);
+	g_assert((((guintptr) output->pixels) % 16) == 0);
 	g_assert((output->rowstride % 16) == 0);
 
 	return output;
@@ -266,6 +597,24 @@ rs_image16_copy(RS_IMAGE16 *in, gboolean copy_pixels)
 
 	g_return_val_if_fail(RS_IS_IMAGE16(in), NULL);
 
+	/* Copies of partial images are just as partial */
+	if (in->area.width < in->w || in->area.height < in->h)
+	{
+		const GdkRectangle *area = &in->area;
+
+		if (area->width <= 0 || area->height <= 0)
+			return rs_image16_new(in->w, in->h, in->channels, in->pixelsize);
+
+		/* Keep the horizontal alignment of a complete image */
+		out = new_area(in->w, in->h, in->channels, in->pixelsize,
+			area->x & ~(AREA_ALIGN - 1), area->y, area->x + area->width, area->y + area->height);
+		if (out && copy_pixels)
+			bit_blt((char*)GET_PIXEL(out, area->x, area->y), out->rowstride * 2,
+				(const char*)GET_PIXEL(in, area->x, area->y), in->rowstride * 2,
+				area->width * in->pixelsize * 2, area->height);
+		return(out);
+	}
+
 	out = rs_image16_new(in->w, in->h, in->channels, in->pixelsize);
 	if (copy_pixels)
 	{
@@ -289,20 +638,22 @@ rs_image16_get_pixel(RS_IMAGE16 *image, gint x, gint y, gboolean extend_edges)
 
 	if (image)
 	{
+		const GdkRectangle *area = &image->area;
+
 		if (extend_edges)
 		{
-			if (x >= image->w)
-				x = image->w-1;
-			else if (x < 0)
-				x = 0;
-			if (y >= image->h)
-				y = image->h-1;
-			else if (y < 0)
-				y = 0;
+			if (x >= area->x + area->width)
+				x = area->x + area->width - 1;
+			if (x < area->x)
+				x = area->x;
+			if (y >= area->y + area->height)
+				y = area->y + area->height - 1;
+			if (y < area->y)
+				y = area->y;
 		}
 
-		/* Return pixel if inside image */
-		if ((x>=0) && (y>=0) && (x<image->w) && (y<image->h))
+		/* Return pixel if inside the backed part of the image */
+		if ((x>=area->x) && (y>=area->y) && (x<area->x+area->width) && (y<area->y+area->height))
 			pixel = &image->pixels[y*image->rowstride + x*image->pixelsize];
 	}
 
@@ -338,3 +689,55 @@ rs_image16_get_checksum(RS_IMAGE16 *image)
 	}
 	return g_compute_checksum_for_data(G_CHECKSUM_SHA256, (guchar *) pixels, w*h*c);
 }
+
+/**
+ * Set the maximum amount of memory kept for recycling pixel buffers of
+ * released images, cached buffers above the limit will be freed
+ * @param limit The limit in bytes, 0 disables recycling
+ */
+void
+rs_image16_pool_set_limit(gsize limit)
+{
+	g_static_mutex_lock(&pool_lock);
+	pool_limit = limit;
+	pool_trim(pool_limit);
+	g_static_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Align big pixel buffers to hugepage boundaries and ask the kernel to back
+ * them with transparent hugepages, this only affects new allocations
+ * @param enable TRUE to enable hugepages
+ */
+void
+rs_image16_pool_set_hugepages(gboolean enable)
+{
+	g_static_mutex_lock(&pool_lock);
+	pool_hugepages = enable;
+	g_static_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Free all cached pixel buffers
+ */
+void
+rs_image16_pool_flush(void)
+{
+	g_static_mutex_lock(&pool_lock);
+	pool_trim(0);
+	g_static_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Get statistics for the pixel buffer pool
+ * @param stats A RSImage16PoolStats to fill
+ */
+void
+rs_image16_pool_get_stats(RSImage16PoolStats *stats)
+{
+	g_return_if_fail(stats != NULL);
+
+	g_static_mutex_lock(&pool_lock);
+	*stats = pool_stats;
+	g_static_mutex_unlock(&pool_lock);
+}
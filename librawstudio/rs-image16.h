@@ -39,12 +39,25 @@ struct _rs_image16 {
 	guint pixelsize; /* the size of a pixel in SHORTS */
 	gushort *pixels;
 	gint pixels_refcount;
+	GDestroyNotify release; /* Frees foreign pixels, NULL for pool buffers */
+	gpointer release_data;
+	struct _rs_image16 *parent; /* Image owning the pixels of a subframe */
+	GdkRectangle area; /* The part of the image backed by pixels */
 	guint filters;
 	gboolean dispose_has_run;
 };
 
 typedef struct _RS_IMAGE16Class RS_IMAGE16Class;
 
+typedef struct {
+	guint64 hits;          /* Allocations served by a recycled buffer */
+	guint64 misses;        /* Allocations that needed a new buffer */
+	guint64 releases;      /* Buffers returned by finalized images */
+	guint64 evictions;     /* Cached buffers freed to honour the limit */
+	gsize cached_bytes;    /* Memory held by unused buffers */
+	gsize allocated_bytes; /* Memory held by all buffers, used or not */
+} RSImage16PoolStats;
+
 struct _RS_IMAGE16Class {
 	GObjectClass parent;
 };
@@ -63,9 +76,56 @@ GType rs_image16_get_type (void);
 
 extern RS_IMAGE16 *rs_image16_new(const guint width, const guint height, const guint channels, const guint pixelsize);
 
+/**
+ * Initializes a new RS_IMAGE16 where only an area has pixels behind it. This
+ * is meant for filters rendering a ROI, the image keeps the dimensions and
+ * coordinates of the complete image while memory is only used for the ROI.
+ * Pixels outside the area must not be accessed, rs_image16_get_pixel() with
+ * extend_edges will clamp to the area
+ * @param width The width of the complete image
+ * @param height The height of the complete image
+ * @param channels The number of channels per pixel
+ * @param pixelsize The size of a pixel in shorts
+ * @param area The area to back, a small margin is added
+ * @return A new RS_IMAGE16, the area is available as image->area
+ */
+extern RS_IMAGE16 *
+rs_image16_new_area(const guint width, const guint height, const guint channels, const guint pixelsize, const GdkRectangle *area);
+
+/**
+ * Initializes a new 8 bit RGB GdkPixbuf where only an area has pixels behind
+ * it, like rs_image16_new_area(). Pixels outside the area must not be accessed
+ * @param has_alpha TRUE if the pixbuf should have an alpha channel
+ * @param width The width of the complete image
+ * @param height The height of the complete image
+ * @param area The area to back, a small margin is added
+ * @return A new GdkPixbuf
+ */
+extern GdkPixbuf *
+rs_pixbuf_new_area(gboolean has_alpha, gint width, gint height, const GdkRectangle *area);
+
+/**
+ * Wraps pixel data owned by someone else in a new RS_IMAGE16, no pixels are
+ * copied. The buffer must meet the same alignment as rs_image16_new() buffers
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param channels The number of channels per pixel
+ * @param pixelsize The size of a pixel in shorts
+ * @param pixels The pixel data, must be 16 byte aligned
+ * @param rowstride The distance between two rows in shorts, must be a
+ *                  multiple of 16
+ * @param release Called with release_data when the image is finalized
+ * @param release_data Data passed to release
+ * @return A new RS_IMAGE16 or NULL if the buffer doesn't fit the layout of
+ *         RS_IMAGE16, release will not be called in that case
+ */
+extern RS_IMAGE16 *
+rs_image16_new_wrap(const guint width, const guint height, const guint channels, const guint pixelsize, gushort *pixels, const gint rowstride, GDestroyNotify release, gpointer release_data);
+
 /**
  * Initializes a new RS_IMAGE16 with pixeldata from @input.
- * @note Pixeldata is NOT copied to new RS_IMAGE16.
+ * @note Pixeldata is NOT copied to new RS_IMAGE16, the subframe holds a
+ *       reference to @input until it is finalized.
  * @param input A RS_IMAGE16
  * @param rectangle A GdkRectangle describing the area to subframe
  * @return A new RS_IMAGE16 with a refcount of 1, the image can be bigger
@@ -76,6 +136,12 @@ rs_image16_new_subframe(RS_IMAGE16 *input, GdkRectangle *rectangle);
 
 extern void rs_image16_transform_getwh(RS_IMAGE16 *in, RS_RECT *crop, gdouble angle, gint orientation, gint *w, gint *h);
 
+/**
+ * Initializes a new RS_IMAGE16 with the same size and layout as @rsi
+ * @param rsi A RS_IMAGE16
+ * @param copy_pixels TRUE to copy the pixels as well
+ * @return A new RS_IMAGE16 backing the same area as @rsi
+ */
 extern RS_IMAGE16 *rs_image16_copy(RS_IMAGE16 *rsi, gboolean copy_pixels);
 
 /**
@@ -89,4 +155,29 @@ extern inline gushort *rs_image16_get_pixel(RS_IMAGE16 *image, gint x, gint y, g
 
 extern gchar *rs_image16_get_checksum(RS_IMAGE16 *image);
 
+/**
+ * Set the maximum amount of memory kept for recycling pixel buffers of
+ * released images, cached buffers above the limit will be freed
+ * @param limit The limit in bytes, 0 disables recycling
+ */
+extern void rs_image16_pool_set_limit(gsize limit);
+
+/**
+ * Align big pixel buffers to hugepage boundaries and ask the kernel to back
+ * them with transparent hugepages, this only affects new allocations
+ * @param enable TRUE to enable hugepages
+ */
+extern void rs_image16_pool_set_hugepages(gboolean enable);
+
+/**
+ * Free all cached pixel buffers
+ */
+extern void rs_image16_pool_flush(void);
+
+/**
+ * Get statistics for the pixel buffer pool
+ * @param stats A RSImage16PoolStats to fill
+ */
+extern void rs_image16_pool_get_stats(RSImage16PoolStats *stats);
+
 #endif /* RS_IMAGE16_H */
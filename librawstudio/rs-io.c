@@ -19,62 +19,218 @@
 
 #include "rs-io.h"
 
+/* Checksum jobs are kept in their own lane, so they can't starve metadata reads */
+typedef enum {
+	LANE_IO = 0,
+	LANE_CPU,
+	LANE_MAX
+} QueueLane;
+
+typedef struct {
+	RSIoJob *job;
+	gint priority;
+	guint64 sequence;
+	guint generation;
+	gboolean cancelled;
+} QueueEntry;
+
+typedef struct {
+	GPtrArray *heap; /* Binary min-heap of QueueEntry */
+	GCond *cond;
+	gint active;
+} Lane;
+
+typedef struct {
+	guint generation;
+	gint queued;
+} ClassInfo;
+
 static GStaticMutex init_lock = G_STATIC_MUTEX_INIT;
-static GAsyncQueue *queue = NULL;
+static GMutex *queue_lock = NULL;
+static Lane lanes[LANE_MAX];
+static GHashTable *classes = NULL; /* idle_class -> ClassInfo */
+static GHashTable *queued = NULL; /* RSIoJob -> QueueEntry */
+static guint64 sequence = 0;
+static gint queued_count = 0;
+static gboolean pause_queue = FALSE;
 static GStaticRecMutex io_lock = G_STATIC_REC_MUTEX_INIT;
 static GTimer *io_lock_timer = NULL;
-static gboolean pause_queue = FALSE;
-static gint queue_active_count = 0;
-static GStaticMutex count_lock = G_STATIC_MUTEX_INIT;
 
+/* Lower priority first, equal priorities in order of arrival */
+static inline gboolean
+entry_before(QueueEntry *a, QueueEntry *b)
+{
+	return (a->priority < b->priority) || (a->priority == b->priority && a->sequence < b->sequence);
+}
+
+static void
+heap_sift_down(GPtrArray *heap, guint i)
+{
+	QueueEntry **e = (QueueEntry **) heap->pdata;
+	QueueEntry *tmp;
+	guint child;
+
+	while ((child = i*2+1) < heap->len)
+	{
+		if (child+1 < heap->len && entry_before(e[child+1], e[child]))
+			child++;
+		if (!entry_before(e[child], e[i]))
+			break;
+		tmp = e[i]; e[i] = e[child]; e[child] = tmp;
+		i = child;
+	}
+}
+
+static void
+heap_push(GPtrArray *heap, QueueEntry *entry)
+{
+	QueueEntry **e;
+	QueueEntry *tmp;
+	guint i, parent;
+
+	g_ptr_array_add(heap, entry);
+	e = (QueueEntry **) heap->pdata;
+	i = heap->len - 1;
+	while (i > 0)
+	{
+		parent = (i-1)/2;
+		if (!entry_before(e[i], e[parent]))
+			break;
+		tmp = e[i]; e[i] = e[parent]; e[parent] = tmp;
+		i = parent;
+	}
+}
+
+static QueueEntry *
+heap_pop(GPtrArray *heap)
+{
+	QueueEntry *top;
+
+	if (heap->len == 0)
+		return NULL;
+
+	top = g_ptr_array_index(heap, 0);
+	heap->pdata[0] = heap->pdata[heap->len-1];
+	g_ptr_array_set_size(heap, heap->len-1);
+	heap_sift_down(heap, 0);
+
+	return top;
+}
+
+/* Must be called with queue_lock held */
+static ClassInfo *
+class_get(gint idle_class)
+{
+	ClassInfo *info = g_hash_table_lookup(classes, GINT_TO_POINTER(idle_class));
+
+	if (!info)
+	{
+		info = g_new0(ClassInfo, 1);
+		g_hash_table_insert(classes, GINT_TO_POINTER(idle_class), info);
+	}
+
+	return info;
+}
+
+/* Must be called with queue_lock held */
+static gboolean
+entry_is_live(QueueEntry *entry, ClassInfo **info)
+{
+	*info = class_get(entry->job->idle_class);
+
+	return !entry->cancelled && entry->generation == (*info)->generation;
+}
+
+/* Must be called with queue_lock held */
+static void
+entry_free(QueueEntry *entry)
+{
+	if (g_hash_table_lookup(queued, entry->job) == entry)
+		g_hash_table_remove(queued, entry->job);
+	g_free(entry);
+}
+
+/**
+ * Remove cancelled entries when they make up most of the queue
+ * Must be called with queue_lock held
+ */
+static void
+compact(void)
+{
+	ClassInfo *info;
+	guint i, n, total = 0;
+	gint lane;
+
+	for(lane = 0; lane < LANE_MAX; lane++)
+		total += lanes[lane].heap->len;
+
+	if ((total - queued_count) < 1024 || (total - queued_count) < queued_count)
+		return;
+
+	for(lane = 0; lane < LANE_MAX; lane++)
+	{
+		GPtrArray *heap = lanes[lane].heap;
+
+		for(i = 0, n = 0; i < heap->len; i++)
+		{
+			QueueEntry *entry = g_ptr_array_index(heap, i);
+			if (entry_is_live(entry, &info))
+				heap->pdata[n++] = entry;
+			else
+				entry_free(entry);
+		}
+		g_ptr_array_set_size(heap, n);
+
+		for(i = n/2; i > 0; i--)
+			heap_sift_down(heap, i-1);
+	}
+}
 
-static gint
-queue_sort(gconstpointer a, gconstpointer b, gpointer user_data)
+/**
+ * Get the next job to execute from a lane, cancelled entries are discarded
+ * Must be called with queue_lock held
+ */
+static RSIoJob *
+lane_pop(Lane *lane)
 {
-	gint id1 = 0;
-	gint id2 = 0;
+	QueueEntry *entry;
+	ClassInfo *info;
+	RSIoJob *job = NULL;
 
-	if (a)
-		id1 = RS_IO_JOB(a)->priority;
-	if (b)
-		id2 = RS_IO_JOB(b)->priority;
+	while (!job && (entry = heap_pop(lane->heap)))
+	{
+		if (entry_is_live(entry, &info))
+		{
+			job = entry->job;
+			info->queued--;
+			queued_count--;
+		}
+		entry_free(entry);
+	}
 
-	return (id1 > id2 ? +1 : id1 == id2 ? 0 : -1);
+	return job;
 }
 
 static gpointer
 queue_worker(gpointer data)
 {
-	GAsyncQueue *queue = data;
+	Lane *lane = data;
 	RSIoJob *job;
 
 	while (1)
 	{
-		if (pause_queue)
-			g_usleep(1000);
-		else
-		{
-			g_static_mutex_lock(&count_lock);
-			job = g_async_queue_try_pop(queue);
-			if (job)
-				queue_active_count++;
-			g_static_mutex_unlock(&count_lock);
-
-			/* If we somehow got NULL, continue. I'm not sure this will ever happen, but this is better than random segfaults :) */
-			if (job)
-			{
-				rs_io_job_execute(job);
-				rs_io_job_do_callback(job);
-				g_static_mutex_lock(&count_lock);
-				queue_active_count--;
-				g_static_mutex_unlock(&count_lock);
-			}
-			else
-			{
-				/* Sleep 1 ms */
-				g_usleep(1000);
-			}
-		}
+		g_mutex_lock(queue_lock);
+		while (pause_queue || !(job = lane_pop(lane)))
+			g_cond_wait(lane->cond, queue_lock);
+		lane->active++;
+		g_mutex_unlock(queue_lock);
+
+		rs_io_job_execute(job);
+		rs_io_job_do_callback(job);
+
+		g_mutex_lock(queue_lock);
+		lane->active--;
+		g_mutex_unlock(queue_lock);
 	}
 
 	return NULL;
@@ -83,19 +239,60 @@ queue_worker(gpointer data)
 static void
 init(void)
 {
-	int i;
+	gint i, lane;
+	const gint cores = rs_get_number_of_processor_cores();
+
 	g_static_mutex_lock(&init_lock);
-	if (!queue)
+	if (!queue_lock)
 	{
-		queue = g_async_queue_new();
-		for (i = 0; i < rs_get_number_of_processor_cores(); i++)
-			g_thread_create(queue_worker, queue, FALSE, NULL);
+		queue_lock = g_mutex_new();
+		classes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+		queued = g_hash_table_new(g_direct_hash, g_direct_equal);
+		for(lane = 0; lane < LANE_MAX; lane++)
+		{
+			lanes[lane].heap = g_ptr_array_new();
+			lanes[lane].cond = g_cond_new();
+			lanes[lane].active = 0;
+		}
+
+		/* I/O-bound workers spend most time waiting, CPU-bound should leave room for rendering */
+		for (i = 0; i < cores; i++)
+			g_thread_create(queue_worker, &lanes[LANE_IO], FALSE, NULL);
+		for (i = 0; i < MAX(1, cores/2); i++)
+			g_thread_create(queue_worker, &lanes[LANE_CPU], FALSE, NULL);
 
 		io_lock_timer = g_timer_new();
 	}
 	g_static_mutex_unlock(&init_lock);
 }
 
+static void
+add_job(RSIoJob *job, QueueLane lane, gint idle_class, gint priority, gpointer user_data)
+{
+	QueueEntry *entry = g_new(QueueEntry, 1);
+	ClassInfo *info;
+
+	init();
+
+	job->idle_class = idle_class;
+	job->priority = priority;
+	job->user_data = user_data;
+
+	g_mutex_lock(queue_lock);
+	info = class_get(idle_class);
+	entry->job = job;
+	entry->priority = priority;
+	entry->sequence = sequence++;
+	entry->generation = info->generation;
+	entry->cancelled = FALSE;
+	info->queued++;
+	queued_count++;
+	g_hash_table_insert(queued, job, entry);
+	heap_push(lanes[lane].heap, entry);
+	g_cond_signal(lanes[lane].cond);
+	g_mutex_unlock(queue_lock);
+}
+
 /**
  * Add a RSIoJob to be executed later
  * @param job A RSIoJob. This will be unreffed upon completion
@@ -108,11 +305,7 @@ rs_io_idle_add_job(RSIoJob *job, gint idle_class, gint priority, gpointer user_d
 {
 	g_return_if_fail(RS_IS_IO_JOB(job));
 
-	job->idle_class = idle_class;
-	job->priority = priority;
-	job->user_data = user_data;
-
-	g_async_queue_push_sorted(queue, job, queue_sort, NULL);
+	add_job(job, LANE_IO, idle_class, priority, user_data);
 }
 
 /**
@@ -174,7 +367,7 @@ rs_io_idle_read_checksum(const gchar *path, gint idle_class, RSGotChecksumCB cal
 	init();
 
 	RSIoJob *job = rs_io_job_checksum_new(path, callback);
-	rs_io_idle_add_job(job, idle_class, 30, user_data);
+	add_job(job, LANE_CPU, idle_class, 30, user_data);
 
 	return job;
 }
@@ -228,36 +421,21 @@ rs_io_idle_restore_tags(const gchar *path, gint idle_class)
 void
 rs_io_idle_cancel_class(gint idle_class)
 {
-	/* This behaves like rs_io_idle_cancel_class(), please see comments there */
-	RSIoJob *current_job;
-	RSIoJob *marker_job = rs_io_job_new();
+	ClassInfo *info;
 
 	init();
 
-	g_async_queue_lock(queue);
-
-	/* Put a marker in the queue, we will rotate the complete queue, so we have to know when we're around */
-	g_async_queue_push_unlocked(queue, marker_job);
-
-	while((current_job = g_async_queue_pop_unlocked(queue)))
-	{
-		/* If current job matches marker, we're done */
-		if (current_job == marker_job)
-			break;
-
-		/* Of the job's idle_class doesn't match the class to cancel, we put the job back in the queue */
-		if (current_job->idle_class != idle_class)
-		{
-			g_async_queue_push_unlocked(queue, current_job);
-		}
-	}
+	g_mutex_lock(queue_lock);
 
-	/* Make sure the queue is sorted */
-	g_async_queue_sort_unlocked(queue, queue_sort, NULL);
+	/* Queued entries of older generations are discarded when they reach the front */
+	info = class_get(idle_class);
+	info->generation++;
+	queued_count -= info->queued;
+	info->queued = 0;
 
-	g_async_queue_unlock(queue);
+	compact();
 
-	g_object_unref(marker_job);
+	g_mutex_unlock(queue_lock);
 }
 
 /**
@@ -267,33 +445,22 @@ rs_io_idle_cancel_class(gint idle_class)
 void
 rs_io_idle_cancel(RSIoJob *job)
 {
-	/* This behaves like rs_io_idle_cancel_class(), please see comments there */
-	RSIoJob *current_job;
-	RSIoJob *marker_job = rs_io_job_new();
+	QueueEntry *entry;
+	ClassInfo *info;
 
 	init();
 
-	g_async_queue_lock(queue);
-
-	/* Put a marker in the queue, we will rotate the complete queue, so we have to know when we're around */
-	g_async_queue_push_unlocked(queue, marker_job);
+	g_mutex_lock(queue_lock);
 
-	while((current_job = g_async_queue_pop_unlocked(queue)))
+	entry = g_hash_table_lookup(queued, job);
+	if (entry && entry_is_live(entry, &info))
 	{
-		/* If current job matches marker, we're done */
-		if (current_job == marker_job)
-			break;
-
-		if (current_job != job)
-			g_async_queue_push_unlocked(queue, current_job);
+		entry->cancelled = TRUE;
+		info->queued--;
+		queued_count--;
 	}
 
-	/* Make sure the queue is sorted */
-	g_async_queue_sort_unlocked(queue, queue_sort, NULL);
-
-	g_async_queue_unlock(queue);
-
-	g_object_unref(marker_job);
+	g_mutex_unlock(queue_lock);
 }
 
 /**
@@ -348,7 +515,11 @@ rs_io_unlock_real(const gchar *source_file, gint line, const gchar *caller)
 void
 rs_io_idle_pause(void)
 {
+	init();
+
+	g_mutex_lock(queue_lock);
 	pause_queue = TRUE;
+	g_mutex_unlock(queue_lock);
 }
 
 /**
@@ -357,7 +528,15 @@ rs_io_idle_pause(void)
 void
 rs_io_idle_unpause(void)
 {
+	gint lane;
+
+	init();
+
+	g_mutex_lock(queue_lock);
 	pause_queue = FALSE;
+	for(lane = 0; lane < LANE_MAX; lane++)
+		g_cond_broadcast(lanes[lane].cond);
+	g_mutex_unlock(queue_lock);
 }
 
 /**
@@ -366,8 +545,15 @@ rs_io_idle_unpause(void)
 gint
 rs_io_get_jobs_left(void)
 {
-	g_static_mutex_lock(&count_lock);
-	gint left = g_async_queue_length(queue) + queue_active_count;
-	g_static_mutex_unlock(&count_lock);
+	gint lane, left;
+
+	init();
+
+	g_mutex_lock(queue_lock);
+	left = queued_count;
+	for(lane = 0; lane < LANE_MAX; lane++)
+		left += lanes[lane].active;
+	g_mutex_unlock(queue_lock);
+
 	return left;
-}
\ No newline at end of file
+}
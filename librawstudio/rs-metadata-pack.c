@@ -0,0 +1,539 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/* Metadata and thumbnails used to be cached in two small files per photo,
+   which made opening a directory of a few thousand photos open a few
+   thousand files. Instead every directory gets a single pack, records are
+   appended to it and it is mapped and indexed once. Superseded records are
+   left behind until they take up more room than the live ones, then the
+   pack is rewritten.
+
+   Several Rawstudio processes can share a directory. They take an advisory
+   lock on a file next to the pack, exclusive for appending and rewriting,
+   shared for reading. With the lock held a changed size or inode means
+   someone else wrote to the pack and it is indexed again. */
+
+#include <rawstudio.h>
+#include <glib/gstdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef G_OS_WIN32
+ #include <windows.h>
+ #include <io.h>
+#else
+ #include <unistd.h>
+ #include <sys/file.h>
+#endif
+#include "rs-metadata-pack.h"
+
+#define PACK_MAGIC "RSMP"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 8
+
+/* Number of packs to keep mapped */
+#define PACK_MAX_OPEN 8
+
+/* Never rewrite a pack for less garbage than this */
+#define PACK_MIN_DEAD (256*1024)
+
+/* On-disk record, followed by the name, the metadata and the thumbnail. A
+   record without metadata removes the photo from the pack */
+typedef struct {
+	guint32 name_length;
+	guint32 xml_length;
+	guint32 thumb_length;
+	guint32 reserved;
+	gint64 mtime;
+	gint64 size;
+} PackRecord;
+
+typedef struct {
+	gsize offset; /* Offset of the metadata in the pack */
+	guint32 xml_length;
+	guint32 thumb_length;
+	gint64 mtime;
+	gint64 size;
+} PackEntry;
+
+typedef struct {
+	gchar *filename;
+	gchar *lockname;
+	gint lock_fd;
+	GMappedFile *map;
+	gint64 file_size; /* Size and inode of the pack when last indexed */
+	guint64 file_ino;
+	gsize length; /* Length of the valid part of the pack */
+	gsize dead; /* Bytes taken up by superseded records */
+	GHashTable *entries; /* basename -> PackEntry */
+} Pack;
+
+static GStaticMutex lock = G_STATIC_MUTEX_INIT;
+static GHashTable *packs = NULL;
+
+#define RECORD_SIZE(name, entry) (sizeof(PackRecord) + strlen(name) + (entry)->xml_length + (entry)->thumb_length)
+
+static void
+pack_free(Pack *pack)
+{
+	if (pack->map)
+		g_mapped_file_free(pack->map);
+	if (pack->lock_fd >= 0)
+		close(pack->lock_fd);
+	g_hash_table_destroy(pack->entries);
+	g_free(pack->filename);
+	g_free(pack->lockname);
+	g_free(pack);
+}
+
+static const gchar *
+pack_data(Pack *pack, gsize offset, gsize length)
+{
+	/* Records appended after the pack was mapped needs a new map */
+	if (!pack->map || offset + length > g_mapped_file_get_length(pack->map))
+	{
+		if (pack->map)
+			g_mapped_file_free(pack->map);
+		pack->map = g_mapped_file_new(pack->filename, FALSE, NULL);
+		if (!pack->map || offset + length > g_mapped_file_get_length(pack->map))
+			return NULL;
+	}
+
+	return g_mapped_file_get_contents(pack->map) + offset;
+}
+
+/* Locks the pack against other processes, writers must take it exclusive */
+static gboolean
+pack_lock(Pack *pack, gboolean exclusive)
+{
+	if (pack->lock_fd < 0)
+		pack->lock_fd = g_open(pack->lockname, O_RDWR | O_CREAT, 0666);
+	if (pack->lock_fd < 0)
+		return FALSE;
+
+#ifdef G_OS_WIN32
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(OVERLAPPED));
+	return LockFileEx((HANDLE) _get_osfhandle(pack->lock_fd), exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &overlapped);
+#else
+	return (flock(pack->lock_fd, exclusive ? LOCK_EX : LOCK_SH) == 0);
+#endif
+}
+
+static void
+pack_unlock(Pack *pack)
+{
+#ifdef G_OS_WIN32
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(OVERLAPPED));
+	UnlockFileEx((HANDLE) _get_osfhandle(pack->lock_fd), 0, 1, 0, &overlapped);
+#else
+	flock(pack->lock_fd, LOCK_UN);
+#endif
+}
+
+static void
+pack_stamp(Pack *pack)
+{
+	struct stat st;
+
+	if (g_stat(pack->filename, &st) == 0)
+	{
+		pack->file_size = st.st_size;
+		pack->file_ino = st.st_ino;
+	}
+	else
+	{
+		pack->file_size = -1;
+		pack->file_ino = 0;
+	}
+}
+
+static void
+pack_scan(Pack *pack)
+{
+	const gchar *data;
+	gsize length;
+	gsize pos = PACK_HEADER_SIZE;
+	guint64 size;
+	guint32 version;
+	PackRecord record;
+	PackEntry *entry;
+	gchar *name;
+
+	g_hash_table_remove_all(pack->entries);
+	pack->length = 0;
+	pack->dead = 0;
+
+	/* Stamp before mapping, a record appended in between is picked up by the
+	   next pack_refresh() */
+	pack_stamp(pack);
+	if (pack->map)
+		g_mapped_file_free(pack->map);
+	pack->map = g_mapped_file_new(pack->filename, FALSE, NULL);
+	if (!pack->map)
+		return;
+
+	data = g_mapped_file_get_contents(pack->map);
+	length = g_mapped_file_get_length(pack->map);
+
+	if (length < PACK_HEADER_SIZE || memcmp(data, PACK_MAGIC, 4) != 0)
+		return;
+	memcpy(&version, data+4, sizeof(version));
+	if (version != PACK_VERSION)
+		return;
+
+	/* Stop at the first incomplete record, anything after that is garbage
+	   from an interrupted write */
+	while (pos + sizeof(PackRecord) <= length)
+	{
+		memcpy(&record, data+pos, sizeof(PackRecord));
+		size = (guint64) sizeof(PackRecord) + record.name_length + record.xml_length + record.thumb_length;
+		if (record.name_length == 0 || size > length - pos)
+			break;
+
+		name = g_strndup(data + pos + sizeof(PackRecord), record.name_length);
+		if ((entry = g_hash_table_lookup(pack->entries, name)))
+			pack->dead += RECORD_SIZE(name, entry);
+
+		if (record.xml_length > 0)
+		{
+			entry = g_new(PackEntry, 1);
+			entry->offset = pos + sizeof(PackRecord) + record.name_length;
+			entry->xml_length = record.xml_length;
+			entry->thumb_length = record.thumb_length;
+			entry->mtime = record.mtime;
+			entry->size = record.size;
+			g_hash_table_insert(pack->entries, name, entry);
+		}
+		else
+		{
+			pack->dead += size;
+			g_hash_table_remove(pack->entries, name);
+			g_free(name);
+		}
+		pos += size;
+	}
+	pack->length = pos;
+}
+
+/* Indexes the pack again if another process has appended to or rewritten it */
+static void
+pack_refresh(Pack *pack)
+{
+	struct stat st;
+
+	if (g_stat(pack->filename, &st) != 0)
+	{
+		if (pack->file_size != -1)
+			pack_scan(pack);
+	}
+	else if (st.st_size != pack->file_size || (guint64) st.st_ino != pack->file_ino)
+		pack_scan(pack);
+}
+
+static Pack *
+pack_get(const gchar *dotdir)
+{
+	Pack *pack;
+
+	if (!packs)
+		packs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) pack_free);
+
+	pack = g_hash_table_lookup(packs, dotdir);
+	if (!pack)
+	{
+		if (g_hash_table_size(packs) >= PACK_MAX_OPEN)
+			g_hash_table_remove_all(packs);
+
+		pack = g_new0(Pack, 1);
+		pack->filename = g_build_filename(dotdir, DOTDIR_METAPACK, NULL);
+		pack->lockname = g_strconcat(pack->filename, ".lock", NULL);
+		pack->lock_fd = -1;
+		pack->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		pack->file_size = -1;
+		g_hash_table_insert(packs, g_strdup(dotdir), pack);
+	}
+
+	return pack;
+}
+
+static gboolean
+pack_write_record(FILE *fp, const gchar *name, gint64 mtime, gint64 size, const gchar *xml, gsize xml_length, const gchar *thumb, gsize thumb_length)
+{
+	PackRecord record;
+
+	memset(&record, 0, sizeof(PackRecord));
+	record.name_length = strlen(name);
+	record.xml_length = xml_length;
+	record.thumb_length = thumb_length;
+	record.mtime = mtime;
+	record.size = size;
+
+	return (fwrite(&record, sizeof(PackRecord), 1, fp) == 1)
+		&& (fwrite(name, record.name_length, 1, fp) == 1)
+		&& (xml_length == 0 || fwrite(xml, xml_length, 1, fp) == 1)
+		&& (thumb_length == 0 || fwrite(thumb, thumb_length, 1, fp) == 1);
+}
+
+/* Writes a new pack containing only the live records */
+static gboolean
+pack_rewrite(Pack *pack)
+{
+	GHashTableIter iter;
+	gpointer name, value;
+	PackEntry *entry;
+	const gchar *data;
+	const guint32 version = PACK_VERSION;
+	gsize pos = PACK_HEADER_SIZE;
+	gchar *temp;
+	FILE *fp;
+	gboolean ok;
+
+	temp = g_strconcat(pack->filename, ".tmp", NULL);
+	fp = g_fopen(temp, "wb");
+	if (!fp)
+	{
+		g_free(temp);
+		return FALSE;
+	}
+
+	ok = (fwrite(PACK_MAGIC, 4, 1, fp) == 1) && (fwrite(&version, sizeof(version), 1, fp) == 1);
+
+	g_hash_table_iter_init(&iter, pack->entries);
+	while (ok && g_hash_table_iter_next(&iter, &name, &value))
+	{
+		entry = value;
+		data = pack_data(pack, entry->offset, entry->xml_length + entry->thumb_length);
+		if (!data)
+		{
+			g_hash_table_iter_remove(&iter);
+			continue;
+		}
+		ok = pack_write_record(fp, name, entry->mtime, entry->size,
+			data, entry->xml_length, data + entry->xml_length, entry->thumb_length);
+		entry->offset = pos + sizeof(PackRecord) + strlen(name);
+		pos += RECORD_SIZE(name, entry);
+	}
+
+	ok = (fclose(fp) == 0) && ok;
+	if (ok && g_rename(temp, pack->filename) != 0)
+	{
+		/* Windows will not rename on top of an existing file */
+		g_unlink(pack->filename);
+		ok = (g_rename(temp, pack->filename) == 0);
+	}
+
+	if (pack->map)
+		g_mapped_file_free(pack->map);
+	pack->map = NULL;
+
+	if (ok)
+	{
+		pack->length = pos;
+		pack->dead = 0;
+		pack_stamp(pack);
+	}
+	else
+	{
+		/* Offsets may point into the failed pack, start over */
+		g_unlink(temp);
+		g_hash_table_remove_all(pack->entries);
+		pack->length = 0;
+		pack->dead = 0;
+	}
+	g_free(temp);
+
+	return ok;
+}
+
+static void
+pack_append(Pack *pack, const gchar *name, gint64 mtime, gint64 size, const gchar *xml, gsize xml_length, const gchar *thumb, gsize thumb_length)
+{
+	PackEntry *entry;
+	FILE *fp;
+	gboolean ok;
+
+	/* Pick up records appended by someone else */
+	pack_refresh(pack);
+
+	if (pack->length == 0
+		|| pack->file_size != (gint64) pack->length
+		|| (pack->dead > PACK_MIN_DEAD && pack->dead > pack->length/2))
+		if (!pack_rewrite(pack))
+			return;
+
+	fp = g_fopen(pack->filename, "ab");
+	if (!fp)
+		return;
+	ok = pack_write_record(fp, name, mtime, size, xml, xml_length, thumb, thumb_length);
+	ok = (fclose(fp) == 0) && ok;
+	pack_stamp(pack);
+	if (!ok)
+	{
+		/* Leave it to the next append to clean up */
+		g_hash_table_remove_all(pack->entries);
+		pack->length = 0;
+		return;
+	}
+
+	if ((entry = g_hash_table_lookup(pack->entries, name)))
+		pack->dead += RECORD_SIZE(name, entry);
+
+	if (xml_length > 0)
+	{
+		entry = g_new(PackEntry, 1);
+		entry->offset = pack->length + sizeof(PackRecord) + strlen(name);
+		entry->xml_length = xml_length;
+		entry->thumb_length = thumb_length;
+		entry->mtime = mtime;
+		entry->size = size;
+		g_hash_table_insert(pack->entries, g_strdup(name), entry);
+	}
+	else
+	{
+		pack->dead += sizeof(PackRecord) + strlen(name);
+		g_hash_table_remove(pack->entries, name);
+	}
+	pack->length += sizeof(PackRecord) + strlen(name) + xml_length + thumb_length;
+}
+
+static gboolean
+photo_stat(const gchar *filename, gint64 *mtime, gint64 *size)
+{
+	struct stat st;
+
+	if (g_stat(filename, &st) != 0)
+		return FALSE;
+
+	*mtime = st.st_mtime;
+	*size = st.st_size;
+
+	return TRUE;
+}
+
+gboolean
+rs_metadata_pack_get(const gchar *filename, gchar **xml, gsize *xml_length, gchar **thumb, gsize *thumb_length)
+{
+	gboolean ret = FALSE;
+	gchar *dotdir;
+	gchar *basename;
+	gint64 mtime, size;
+	const gchar *data;
+	PackEntry *entry;
+	Pack *pack;
+
+	g_return_val_if_fail(filename != NULL, FALSE);
+	g_return_val_if_fail(xml != NULL, FALSE);
+	g_return_val_if_fail(xml_length != NULL, FALSE);
+	g_return_val_if_fail(thumb != NULL, FALSE);
+	g_return_val_if_fail(thumb_length != NULL, FALSE);
+
+	if (!photo_stat(filename, &mtime, &size))
+		return FALSE;
+	if (!(dotdir = rs_dotdir_get(filename)))
+		return FALSE;
+	basename = g_path_get_basename(filename);
+
+	g_static_mutex_lock(&lock);
+	pack = pack_get(dotdir);
+	if (pack_lock(pack, FALSE))
+	{
+		pack_refresh(pack);
+		entry = g_hash_table_lookup(pack->entries, basename);
+		if (entry && entry->mtime == mtime && entry->size == size
+			&& (data = pack_data(pack, entry->offset, entry->xml_length + entry->thumb_length)))
+		{
+			*xml = g_memdup(data, entry->xml_length);
+			*xml_length = entry->xml_length;
+			*thumb = (entry->thumb_length > 0) ? g_memdup(data + entry->xml_length, entry->thumb_length) : NULL;
+			*thumb_length = entry->thumb_length;
+			ret = TRUE;
+		}
+		pack_unlock(pack);
+	}
+	g_static_mutex_unlock(&lock);
+
+	g_free(basename);
+	g_free(dotdir);
+
+	return ret;
+}
+
+void
+rs_metadata_pack_put(const gchar *filename, const gchar *xml, gsize xml_length, const gchar *thumb, gsize thumb_length)
+{
+	gchar *dotdir;
+	gchar *basename;
+	gint64 mtime, size;
+	Pack *pack;
+
+	g_return_if_fail(filename != NULL);
+	g_return_if_fail(xml != NULL);
+	g_return_if_fail(xml_length > 0);
+
+	if (!photo_stat(filename, &mtime, &size))
+		return;
+	if (!(dotdir = rs_dotdir_get(filename)))
+		return;
+	basename = g_path_get_basename(filename);
+
+	g_static_mutex_lock(&lock);
+	pack = pack_get(dotdir);
+	if (pack_lock(pack, TRUE))
+	{
+		pack_append(pack, basename, mtime, size, xml, xml_length, thumb, thumb ? thumb_length : 0);
+		pack_unlock(pack);
+	}
+	g_static_mutex_unlock(&lock);
+
+	g_free(basename);
+	g_free(dotdir);
+}
+
+void
+rs_metadata_pack_remove(const gchar *filename)
+{
+	gchar *dotdir;
+	gchar *basename;
+	Pack *pack;
+
+	g_return_if_fail(filename != NULL);
+
+	if (!(dotdir = rs_dotdir_get(filename)))
+		return;
+	basename = g_path_get_basename(filename);
+
+	g_static_mutex_lock(&lock);
+	pack = pack_get(dotdir);
+	if (pack_lock(pack, TRUE))
+	{
+		pack_refresh(pack);
+		if (g_hash_table_lookup(pack->entries, basename))
+			pack_append(pack, basename, 0, 0, NULL, 0, NULL, 0);
+		pack_unlock(pack);
+	}
+	g_static_mutex_unlock(&lock);
+
+	g_free(basename);
+	g_free(dotdir);
+}
@@ -0,0 +1,64 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_METADATA_PACK_H
+#define RS_METADATA_PACK_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define DOTDIR_METAPACK "metacache.pack"
+
+/**
+ * Looks up the cached metadata and thumbnail of a photo in the cache pack of
+ * its directory. Entries are only returned if size and modification time of
+ * the photo still matches
+ * @param filename An absolute path to a photo
+ * @param xml The cached metadata document, free with g_free()
+ * @param xml_length The length of xml
+ * @param thumb The cached JPEG thumbnail (can be NULL), free with g_free()
+ * @param thumb_length The length of thumb
+ * @return TRUE if an entry was found, FALSE otherwise
+ */
+extern gboolean
+rs_metadata_pack_get(const gchar *filename, gchar **xml, gsize *xml_length, gchar **thumb, gsize *thumb_length);
+
+/**
+ * Stores metadata and thumbnail of a photo in the cache pack of its
+ * directory, replacing any earlier entry
+ * @param filename An absolute path to a photo
+ * @param xml A metadata document
+ * @param xml_length The length of xml, must be larger than 0
+ * @param thumb A JPEG thumbnail or NULL
+ * @param thumb_length The length of thumb
+ */
+extern void
+rs_metadata_pack_put(const gchar *filename, const gchar *xml, gsize xml_length, const gchar *thumb, gsize thumb_length);
+
+/**
+ * Removes a photo from the cache pack of its directory
+ * @param filename An absolute path to a photo
+ */
+extern void
+rs_metadata_pack_remove(const gchar *filename);
+
+G_END_DECLS
+
+#endif /* RS_METADATA_PACK_H */
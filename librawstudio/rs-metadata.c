@@ -117,25 +117,22 @@ rs_metadata_new (void)
 	return g_object_new (RS_TYPE_METADATA, NULL);
 }
 
-#define METACACHEVERSION 10
+#define METACACHEVERSION 11
 void
 rs_metadata_cache_save(RSMetadata *metadata, const gchar *filename)
 {
 	if (!filename)
 	  return FALSE;
 
-	gchar *cache_filename;
-	gchar *thumb_filename;
+	xmlBufferPtr buffer;
 	xmlTextWriterPtr writer;
-	static GStaticMutex lock = G_STATIC_MUTEX_INIT;
+	gchar *thumb = NULL;
+	gsize thumb_length = 0;
 
 	g_return_if_fail(RS_IS_METADATA(metadata));
 
-	g_static_mutex_lock(&lock);
-
-	cache_filename = rs_metadata_dotdir_helper(filename, DOTDIR_METACACHE);
-
-	writer = xmlNewTextWriterFilename(cache_filename, 0);
+	buffer = xmlBufferCreate();
+	writer = xmlNewTextWriterMemory(buffer, 0);
 	if (writer)
 	{
 		xmlTextWriterSetIndent(writer, 1);
@@ -185,18 +182,22 @@ rs_metadata_cache_save(RSMetadata *metadata, const gchar *filename)
 			xmlTextWriterWriteFormatElement(writer, BAD_CAST "lens_max_aperture", "%f", metadata->lens_max_aperture);
 		if (metadata->fixed_lens_identifier)
 			xmlTextWriterWriteFormatElement(writer, BAD_CAST "fixed_lens_identifier", "%s", metadata->fixed_lens_identifier);
+		if (metadata->thumbnail_start > 0)
+			xmlTextWriterWriteFormatElement(writer, BAD_CAST "thumbnail", "%u %u", metadata->thumbnail_start, metadata->thumbnail_length);
+		if (metadata->preview_start > 0)
+			xmlTextWriterWriteFormatElement(writer, BAD_CAST "preview", "%u %u", metadata->preview_start, metadata->preview_length);
 		xmlTextWriterEndDocument(writer);
 		xmlFreeTextWriter(writer);
-	}
-	g_free(cache_filename);
-	g_static_mutex_unlock(&lock);
 
-	if (metadata->thumbnail)
-	{
-		thumb_filename = rs_metadata_dotdir_helper(filename, DOTDIR_THUMB);
-		gdk_pixbuf_save(metadata->thumbnail, thumb_filename, "jpeg", NULL, "quality", "90", NULL);
-		g_free(thumb_filename);
+		if (metadata->thumbnail)
+			gdk_pixbuf_save_to_buffer(metadata->thumbnail, &thumb, &thumb_length, "jpeg", NULL, "quality", "90", NULL);
+
+		/* Everything goes in the pack of the directory, see rs-metadata-pack.c */
+		if (xmlBufferLength(buffer) > 0)
+			rs_metadata_pack_put(filename, (const gchar *) xmlBufferContent(buffer), xmlBufferLength(buffer), thumb, thumb_length);
+		g_free(thumb);
 	}
+	xmlBufferFree(buffer);
 }
 
 static gboolean
@@ -206,8 +207,10 @@ rs_metadata_cache_load(RSMetadata *metadata, const gchar *filename)
 	  return FALSE;
 
 	gboolean ret = FALSE;
-	gchar *cache_filename;
-	gchar *thumb_filename;
+	gchar *xml;
+	gchar *thumb;
+	gsize xml_length, thumb_length;
+	GdkPixbufLoader *loader;
 	xmlDocPtr doc;
 	xmlNodePtr cur;
 	xmlChar *val;
@@ -215,16 +218,16 @@ rs_metadata_cache_load(RSMetadata *metadata, const gchar *filename)
 
 	g_return_val_if_fail(RS_IS_METADATA(metadata), FALSE);
 
-	cache_filename = rs_metadata_dotdir_helper(filename, DOTDIR_METACACHE);
-	if (!g_file_test(cache_filename, G_FILE_TEST_IS_REGULAR))
-	{
-		g_free(cache_filename);
+	if (!rs_metadata_pack_get(filename, &xml, &xml_length, &thumb, &thumb_length))
 		return FALSE;
-	}
 
-	doc = xmlParseFile(cache_filename);
+	doc = xmlParseMemory(xml, xml_length);
+	g_free(xml);
 	if(!doc)
+	{
+		g_free(thumb);
 		return FALSE;
+	}
 
 	cur = xmlDocGetRootElement(doc);
 
@@ -383,6 +386,32 @@ rs_metadata_cache_load(RSMetadata *metadata, const gchar *filename)
 				metadata->fixed_lens_identifier = g_strdup((gchar *)val);
 				xmlFree(val);
 			}
+			else if ((!xmlStrcmp(cur->name, BAD_CAST "thumbnail")))
+			{
+				gchar **vals;
+				val = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
+				vals = g_strsplit((gchar *)val, " ", 2);
+				if (vals[0] && vals[1])
+				{
+					metadata->thumbnail_start = g_ascii_strtoull(vals[0], NULL, 10);
+					metadata->thumbnail_length = g_ascii_strtoull(vals[1], NULL, 10);
+				}
+				g_strfreev(vals);
+				xmlFree(val);
+			}
+			else if ((!xmlStrcmp(cur->name, BAD_CAST "preview")))
+			{
+				gchar **vals;
+				val = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
+				vals = g_strsplit((gchar *)val, " ", 2);
+				if (vals[0] && vals[1])
+				{
+					metadata->preview_start = g_ascii_strtoull(vals[0], NULL, 10);
+					metadata->preview_length = g_ascii_strtoull(vals[1], NULL, 10);
+				}
+				g_strfreev(vals);
+				xmlFree(val);
+			}
 
 			cur = cur->next;
 		}
@@ -390,24 +419,25 @@ rs_metadata_cache_load(RSMetadata *metadata, const gchar *filename)
 	}
 
 	xmlFreeDoc(doc);
-	g_free(cache_filename);
 
-	/* If the version is less than 4, delete the PNG thunbnail, we're using JPEG now */
-	if (version < 4)
+	if (ret == TRUE && thumb)
 	{
-		thumb_filename = rs_metadata_dotdir_helper(filename, DOTDIR_THUMB_PNG);
-		g_unlink(thumb_filename);
-		g_free(thumb_filename);
+		loader = gdk_pixbuf_loader_new();
+		if (gdk_pixbuf_loader_write(loader, (const guchar *) thumb, thumb_length, NULL)
+			&& gdk_pixbuf_loader_close(loader, NULL))
+		{
+			metadata->thumbnail = gdk_pixbuf_loader_get_pixbuf(loader);
+			if (metadata->thumbnail)
+				g_object_ref(metadata->thumbnail);
+		}
+		else
+			gdk_pixbuf_loader_close(loader, NULL);
+		g_object_unref(loader);
 	}
+	g_free(thumb);
 
-	if (ret == TRUE)
-	{
-		thumb_filename = rs_metadata_dotdir_helper(filename, DOTDIR_THUMB);
-		metadata->thumbnail = gdk_pixbuf_new_from_file(thumb_filename, NULL);
-		g_free(thumb_filename);
-		if (!metadata->thumbnail)
-			ret = FALSE;
-	}
+	if (!metadata->thumbnail)
+		ret = FALSE;
 
 	return ret;
 }
@@ -515,6 +545,62 @@ rs_metadata_load_from_file(RSMetadata *metadata, const gchar *filename)
 	return ret;
 }
 
+GdkPixbuf *
+rs_metadata_get_embedded_preview(RSMetadata *metadata, const gchar *filename, gint width, gint height)
+{
+	RAWFILE *rawfile;
+	GdkPixbuf *pixbuf = NULL;
+	GdkPixbuf *pixbuf2;
+	guint start[2], length[2];
+	guint best = 0, best_length = 0;
+	guchar soi[2];
+	gint i;
+
+	g_return_val_if_fail(RS_IS_METADATA(metadata), NULL);
+	g_return_val_if_fail(filename != NULL, NULL);
+
+	start[0] = metadata->preview_start;
+	length[0] = metadata->preview_length;
+	start[1] = metadata->thumbnail_start;
+	length[1] = metadata->thumbnail_length;
+
+	rawfile = raw_open_file(filename);
+	if (!rawfile)
+		return NULL;
+
+	/* Use the largest embedded JPEG, some formats point at uncompressed data */
+	for(i=0;i<2;i++)
+		if (start[i] > 0 && length[i] > best_length
+			&& raw_get_uchar(rawfile, start[i], &soi[0]) && raw_get_uchar(rawfile, start[i]+1, &soi[1])
+			&& soi[0] == 0xff && soi[1] == 0xd8)
+		{
+			best = start[i];
+			best_length = length[i];
+		}
+
+	if (best_length > 0)
+		pixbuf = raw_get_pixbuf_scaled(rawfile, best, best_length, width, height);
+	raw_close_file(rawfile);
+
+	if (pixbuf)
+		switch (metadata->orientation)
+		{
+			/* this is very COUNTER-intuitive - gdk_pixbuf_rotate_simple() is wierd */
+			case 90:
+				pixbuf2 = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_CLOCKWISE);
+				g_object_unref(pixbuf);
+				pixbuf = pixbuf2;
+				break;
+			case 270:
+				pixbuf2 = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
+				g_object_unref(pixbuf);
+				pixbuf = pixbuf2;
+				break;
+		}
+
+	return pixbuf;
+}
+
 void
 rs_metadata_normalize_wb(RSMetadata *metadata)
 {
@@ -582,7 +668,9 @@ rs_metadata_delete_cache(const gchar *filename)
 	gchar *cache_filename;
 	gchar *thumb_filename;
 
-	/* Delete the metadata cache itself */
+	rs_metadata_pack_remove(filename);
+
+	/* Delete files left by older versions */
 	cache_filename = rs_metadata_dotdir_helper(filename, DOTDIR_METACACHE);
 	g_unlink(cache_filename);
 	g_free(cache_filename);
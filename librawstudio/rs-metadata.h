@@ -109,10 +109,20 @@ extern void rs_metadata_normalize_wb(RSMetadata *metadata);
 extern gchar *rs_metadata_get_short_description(RSMetadata *metadata);
 extern GdkPixbuf *rs_metadata_get_thumbnail(RSMetadata *metadata);
 
+/**
+ * Decodes the largest JPEG preview embedded in a photo
+ * @param metadata Metadata loaded from filename
+ * @param filename The photo the metadata belongs to
+ * @param width The width of the box the preview will be shown in
+ * @param height The height of the box the preview will be shown in
+ * @return A new GdkPixbuf covering the box (DCT-scaled, not resampled) or NULL
+ */
+extern GdkPixbuf *rs_metadata_get_embedded_preview(RSMetadata *metadata, const gchar *filename, gint width, gint height);
+
 /* Attempts to load cached metadata first, then falls back to reading from file */
 extern gboolean rs_metadata_load(RSMetadata *metadata, const gchar *filename);
 
-/* Save metadata to cache xml file and sidecar thumbnail*/
+/* Save metadata and thumbnail to the cache pack of the directory */
 extern void rs_metadata_cache_save(RSMetadata *metadata, const gchar *filename);
 
 /**
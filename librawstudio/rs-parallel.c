@@ -0,0 +1,238 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <rawstudio.h>
+#include "rs-parallel.h"
+
+/* Number of chunks per thread when chunk size is automatic */
+#define CHUNKS_PER_THREAD 4
+
+typedef struct {
+	gint end;
+	gint chunk;
+	volatile gint next;
+	RSParallelFunc func;
+	gpointer user_data;
+	RSParallelPriority priority;
+
+	/* Protected by pool_lock */
+	gint max_workers;
+	gint workers;
+	gboolean queued;
+} RSParallelTask;
+
+static GStaticMutex init_lock = G_STATIC_MUTEX_INIT;
+static GMutex *pool_lock = NULL;
+static GCond *work_cond = NULL;
+static GCond *done_cond = NULL;
+static GQueue *tasks[RS_PARALLEL_PRIORITY_MAX];
+static gint num_threads = 0;
+static gint max_threads = 0;
+
+static void
+task_run(RSParallelTask *task)
+{
+	gint start;
+
+	/* Grab chunks until none are left */
+	while ((start = g_atomic_int_exchange_and_add(&task->next, task->chunk)) < task->end)
+		task->func(start, MIN(start + task->chunk, task->end), task->user_data);
+}
+
+/* Must be called with pool_lock held */
+static void
+task_dequeue(RSParallelTask *task)
+{
+	if (task->queued)
+	{
+		g_queue_remove(tasks[task->priority], task);
+		task->queued = FALSE;
+	}
+}
+
+static gpointer
+pool_worker(gpointer data)
+{
+	RSParallelTask *task;
+	GList *node;
+	gint i;
+
+	g_mutex_lock(pool_lock);
+	while (1)
+	{
+		task = NULL;
+		for(i = 0; i < RS_PARALLEL_PRIORITY_MAX && !task; i++)
+			for(node = tasks[i]->head; node && !task; node = node->next)
+				if (((RSParallelTask *) node->data)->workers < ((RSParallelTask *) node->data)->max_workers)
+					task = node->data;
+
+		if (!task)
+		{
+			g_cond_wait(work_cond, pool_lock);
+			continue;
+		}
+
+		task->workers++;
+		g_mutex_unlock(pool_lock);
+
+		task_run(task);
+
+		g_mutex_lock(pool_lock);
+		/* All chunks are handed out, nobody else should pick this up */
+		task_dequeue(task);
+		task->workers--;
+		if (task->workers == 0)
+			g_cond_broadcast(done_cond);
+	}
+	g_mutex_unlock(pool_lock);
+
+	return NULL;
+}
+
+static void
+init(void)
+{
+	gint i;
+
+	g_static_mutex_lock(&init_lock);
+	if (!pool_lock)
+	{
+		num_threads = MAX(1, rs_get_number_of_processor_cores());
+
+		pool_lock = g_mutex_new();
+		for(i = 0; i < RS_PARALLEL_PRIORITY_MAX; i++)
+			tasks[i] = g_queue_new();
+		work_cond = g_cond_new();
+		done_cond = g_cond_new();
+
+		/* The calling thread always participates, so we need one less */
+		for(i = 1; i < num_threads; i++)
+			g_thread_create(pool_worker, NULL, FALSE, NULL);
+	}
+	g_static_mutex_unlock(&init_lock);
+}
+
+/**
+ * Get the number of threads that will work on a rs_parallel_for() call,
+ * including the calling thread
+ * @return Number of threads
+ */
+gint
+rs_parallel_get_number_of_threads(void)
+{
+	init();
+
+	if (max_threads > 0)
+		return MIN(max_threads, num_threads);
+
+	return num_threads;
+}
+
+/**
+ * Limit the number of threads working on each rs_parallel_for() call,
+ * this is mostly useful for benchmarking
+ * @param threads Maximum number of threads including the calling thread, or
+ *                0 to use all cores
+ */
+void
+rs_parallel_set_number_of_threads(gint threads)
+{
+	init();
+
+	g_mutex_lock(pool_lock);
+	max_threads = MAX(0, threads);
+	g_mutex_unlock(pool_lock);
+}
+
+/**
+ * Split the range [start;end[ into chunks and process them using the shared
+ * worker pool. The calling thread will process chunks as well, and the call
+ * returns when all chunks has been processed. Chunks are handed out
+ * dynamically, so threads finishing early will take over remaining work.
+ * It is safe to call this from within a func.
+ * @param start First index
+ * @param end Index after the last index
+ * @param chunk Number of indices processed per call to func or 0 for automatic
+ * @param func A function to call for each chunk
+ * @param user_data Data to pass to func
+ */
+void
+rs_parallel_for(gint start, gint end, gint chunk, RSParallelFunc func, gpointer user_data)
+{
+	rs_parallel_for_full(start, end, chunk, RS_PARALLEL_PRIORITY_NORMAL, func, user_data);
+}
+
+/**
+ * Like rs_parallel_for(), but with a priority. Pool threads will always pick
+ * work of higher priority first
+ * @param start First index
+ * @param end Index after the last index
+ * @param chunk Number of indices processed per call to func or 0 for automatic
+ * @param priority The priority of the work
+ * @param func A function to call for each chunk
+ * @param user_data Data to pass to func
+ */
+void
+rs_parallel_for_full(gint start, gint end, gint chunk, RSParallelPriority priority, RSParallelFunc func, gpointer user_data)
+{
+	RSParallelTask task;
+	gint threads;
+
+	g_return_if_fail(func != NULL);
+	g_return_if_fail(priority < RS_PARALLEL_PRIORITY_MAX);
+
+	if (end <= start)
+		return;
+
+	threads = rs_parallel_get_number_of_threads();
+
+	if (chunk <= 0)
+		chunk = MAX(1, (end - start + threads * CHUNKS_PER_THREAD - 1) / (threads * CHUNKS_PER_THREAD));
+
+	/* Nothing to share, do it ourself */
+	if ((threads == 1) || ((end - start) <= chunk))
+	{
+		func(start, end, user_data);
+		return;
+	}
+
+	task.end = end;
+	task.chunk = chunk;
+	task.next = start;
+	task.func = func;
+	task.user_data = user_data;
+	task.priority = priority;
+	task.max_workers = threads - 1;
+	task.workers = 0;
+
+	g_mutex_lock(pool_lock);
+	g_queue_push_tail(tasks[priority], &task);
+	task.queued = TRUE;
+	g_cond_broadcast(work_cond);
+	g_mutex_unlock(pool_lock);
+
+	task_run(&task);
+
+	/* Wait for pool threads still working on chunks */
+	g_mutex_lock(pool_lock);
+	task_dequeue(&task);
+	while (task.workers > 0)
+		g_cond_wait(done_cond, pool_lock);
+	g_mutex_unlock(pool_lock);
+}
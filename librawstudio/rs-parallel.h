@@ -0,0 +1,89 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_PARALLEL_H
+#define RS_PARALLEL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	RS_PARALLEL_PRIORITY_HIGH = 0, /* Interactive rendering */
+	RS_PARALLEL_PRIORITY_NORMAL,
+	RS_PARALLEL_PRIORITY_LOW,      /* Background and batch work */
+	RS_PARALLEL_PRIORITY_MAX
+} RSParallelPriority;
+
+/**
+ * Function called by rs_parallel_for() for every chunk of work
+ * @param start First index of the chunk
+ * @param end Index after the last index of the chunk
+ * @param user_data The user_data passed to rs_parallel_for()
+ */
+typedef void (*RSParallelFunc)(gint start, gint end, gpointer user_data);
+
+/**
+ * Get the number of threads that will work on a rs_parallel_for() call,
+ * including the calling thread
+ * @return Number of threads
+ */
+extern gint
+rs_parallel_get_number_of_threads(void);
+
+/**
+ * Limit the number of threads working on each rs_parallel_for() call,
+ * this is mostly useful for benchmarking
+ * @param threads Maximum number of threads including the calling thread, or
+ *                0 to use all cores
+ */
+extern void
+rs_parallel_set_number_of_threads(gint threads);
+
+/**
+ * Split the range [start;end[ into chunks and process them using the shared
+ * worker pool. The calling thread will process chunks as well, and the call
+ * returns when all chunks has been processed. Chunks are handed out
+ * dynamically, so threads finishing early will take over remaining work.
+ * It is safe to call this from within a func.
+ * @param start First index
+ * @param end Index after the last index
+ * @param chunk Number of indices processed per call to func or 0 for automatic
+ * @param func A function to call for each chunk
+ * @param user_data Data to pass to func
+ */
+extern void
+rs_parallel_for(gint start, gint end, gint chunk, RSParallelFunc func, gpointer user_data);
+
+/**
+ * Like rs_parallel_for(), but with a priority. Pool threads will always pick
+ * work of higher priority first
+ * @param start First index
+ * @param end Index after the last index
+ * @param chunk Number of indices processed per call to func or 0 for automatic
+ * @param priority The priority of the work
+ * @param func A function to call for each chunk
+ * @param user_data Data to pass to func
+ */
+extern void
+rs_parallel_for_full(gint start, gint end, gint chunk, RSParallelPriority priority, RSParallelFunc func, gpointer user_data);
+
+G_END_DECLS
+
+#endif /* RS_PARALLEL_H */
@@ -29,6 +29,9 @@
  #include <sys/mman.h>
 #endif
 #include <string.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
 #include "rs-rawfile.h"
 
 struct _RAWFILE {
@@ -290,6 +293,157 @@ raw_get_pixbuf(RAWFILE *rawfile, guint pos, guint length)
 	return(pixbuf);
 }
 
+struct raw_jpeg_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf setjmp_buffer;
+};
+
+static void
+raw_jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct raw_jpeg_error *err = (struct raw_jpeg_error *) cinfo->err;
+
+	longjmp(err->setjmp_buffer, 1);
+}
+
+static void
+raw_jpeg_output_message(j_common_ptr cinfo)
+{
+	/* Embedded previews are often slightly broken, stay quiet */
+}
+
+static void
+raw_jpeg_init_source(j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+raw_jpeg_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+	/* We handed libjpeg everything we had, pretend the stream ended */
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
+
+static void
+raw_jpeg_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+	if (num_bytes <= 0)
+		return;
+
+	if ((size_t) num_bytes > cinfo->src->bytes_in_buffer)
+		raw_jpeg_fill_input_buffer(cinfo);
+	else
+	{
+		cinfo->src->next_input_byte += num_bytes;
+		cinfo->src->bytes_in_buffer -= num_bytes;
+	}
+}
+
+static void
+raw_jpeg_term_source(j_decompress_ptr cinfo)
+{
+}
+
+GdkPixbuf *
+raw_get_pixbuf_scaled(RAWFILE *rawfile, guint pos, guint length, gint width, gint height)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct raw_jpeg_error jerr;
+	struct jpeg_source_mgr src;
+	GdkPixbuf *volatile pixbuf = NULL;
+	JSAMPLE *volatile gray = NULL;
+	guchar *pixels;
+	gint rowstride;
+	gint denom;
+	guint x;
+
+	g_return_val_if_fail(rawfile != NULL, NULL);
+
+	if((rawfile->base+pos+length)>rawfile->size)
+		return(NULL);
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = raw_jpeg_error_exit;
+	jerr.pub.output_message = raw_jpeg_output_message;
+	if (setjmp(jerr.setjmp_buffer))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		g_free(gray);
+		if (pixbuf)
+			g_object_unref(pixbuf);
+		return(NULL);
+	}
+	jpeg_create_decompress(&cinfo);
+
+	/* Decode straight from the map, jpeg_mem_src() is not in libjpeg 6b */
+	src.next_input_byte = (JOCTET *) rawfile->map + rawfile->base + pos;
+	src.bytes_in_buffer = length;
+	src.init_source = raw_jpeg_init_source;
+	src.fill_input_buffer = raw_jpeg_fill_input_buffer;
+	src.skip_input_data = raw_jpeg_skip_input_data;
+	src.resync_to_restart = jpeg_resync_to_restart;
+	src.term_source = raw_jpeg_term_source;
+	cinfo.src = &src;
+
+	if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
+		longjmp(jerr.setjmp_buffer, 1);
+
+	if (cinfo.jpeg_color_space == JCS_GRAYSCALE)
+		cinfo.out_color_space = JCS_GRAYSCALE;
+	else if (cinfo.num_components == 3)
+		cinfo.out_color_space = JCS_RGB;
+	else
+		longjmp(jerr.setjmp_buffer, 1);
+
+	/* Let the IDCT do the downscaling - pick the smallest 1/n scale that
+	   still covers the bounding box */
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 1;
+	if (width > 0 && height > 0)
+		for(denom=8;denom>1;denom/=2)
+			if ((gint) cinfo.image_width/denom >= width || (gint) cinfo.image_height/denom >= height)
+			{
+				cinfo.scale_denom = denom;
+				break;
+			}
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+
+	jpeg_start_decompress(&cinfo);
+
+	pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, cinfo.output_width, cinfo.output_height);
+	if (!pixbuf)
+		longjmp(jerr.setjmp_buffer, 1);
+	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	if (cinfo.output_components == 1)
+		gray = g_new(JSAMPLE, cinfo.output_width);
+
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		JSAMPROW row = pixels + cinfo.output_scanline * rowstride;
+
+		if (gray)
+		{
+			jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &gray, 1);
+			for(x=0;x<cinfo.output_width;x++)
+				row[x*3] = row[x*3+1] = row[x*3+2] = gray[x];
+		}
+		else
+			jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	g_free(gray);
+
+	return(pixbuf);
+}
+
 RAWFILE *
 raw_create_from_memory(void *memory, guint size, guint first_ifd_offset, gushort byteorder)
 {
@@ -208,6 +208,8 @@ rs_get_number_of_processor_cores(void)
 	return num;
 }
 
+static guint cpu_features_mask = ~0;
+
 #if defined (__i386__) || defined (__x86_64__)
 
 #define xgetbv(index,eax,edx)                                   \
@@ -230,15 +232,30 @@ rs_detect_cpu_features(void)
        : "=a" (eax), "=c" (ecx),  "=d" (edx) \
        : "0" (cmd) \
      ); \
+} while(0)
+/* Structured extended features are returned in ebx, which we cannot clobber with PIC */
+#define cpuid_ebx(cmd, subcmd, ebx) \
+  do { \
+     guint _eax, _ecx; \
+     asm ( \
+       "push %%"REG_b"\n\t"\
+       "cpuid\n\t" \
+       "mov %%ebx, %%esi\n\t" \
+       "pop %%"REG_b"\n\t" \
+       : "=a" (_eax), "=c" (_ecx), "=S" (ebx) \
+       : "0" (cmd), "1" (subcmd) \
+       : "edx" \
+     ); \
 } while(0)
 	guint eax;
+	guint ebx;
 	guint edx;
 	guint ecx;
 	static GStaticMutex lock = G_STATIC_MUTEX_INIT;
 	static guint stored_cpuflags = -1;
 
 	if (stored_cpuflags != -1)
-		return stored_cpuflags;
+		return stored_cpuflags & cpu_features_mask;
 
 	g_static_mutex_lock(&lock);
 	if (stored_cpuflags == -1)
@@ -276,6 +293,8 @@ rs_detect_cpu_features(void)
 
 			if (std_dsc)
 			{
+				guint max_level = std_dsc;
+
 				/* Request for standard features */
 				cpuid(0x00000001, std_dsc, ecx, edx);
 
@@ -302,6 +321,14 @@ rs_detect_cpu_features(void)
 						if ((eax & 0x6) == 0x6)
 							cpuflags |= RS_CPU_FLAG_AVX;
 				}
+
+				/* AVX2 needs the same OS support as AVX */
+				if ((cpuflags & RS_CPU_FLAG_AVX) && max_level >= 7)
+				{
+					cpuid_ebx(0x00000007, 0, ebx);
+					if (ebx & 0x00000020)
+						cpuflags |= RS_CPU_FLAG_AVX2;
+				}
 			}
 
 			/* Is there extensions */
@@ -341,10 +368,12 @@ rs_detect_cpu_features(void)
 	report("SSE4.1",RS_CPU_FLAG_SSE4_1);
 	report("SSE4.2",RS_CPU_FLAG_SSE4_2);
 	report("AVX",RS_CPU_FLAG_AVX);
+	report("AVX2",RS_CPU_FLAG_AVX2);
 #undef report
 
-	return(stored_cpuflags);
+	return(stored_cpuflags & cpu_features_mask);
 #undef cpuid
+#undef cpuid_ebx
 }
 
 #else
@@ -355,6 +384,17 @@ rs_detect_cpu_features()
 }
 #endif /* __i386__ || __x86_64__ */
 
+/**
+ * Limit the features reported by rs_detect_cpu_features(), this can be used
+ * to test and benchmark the plain C versions of optimized code
+ * @param mask A bitmask of @RSCpuFlags to allow
+ */
+void
+rs_set_cpu_features_mask(guint mask)
+{
+	cpu_features_mask = mask;
+}
+
 /**
  * Return a path to the current config directory for Rawstudio - this is the
  * .rawstudio direcotry in home
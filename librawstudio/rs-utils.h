@@ -79,6 +79,14 @@ rs_get_number_of_processor_cores(void);
 guint
 rs_detect_cpu_features(void);
 
+/**
+ * Limit the features reported by rs_detect_cpu_features(), this can be used
+ * to test and benchmark the plain C versions of optimized code
+ * @param mask A bitmask of @RSCpuFlags to allow
+ */
+extern void
+rs_set_cpu_features_mask(guint mask);
+
 /**
  * Return a path to the current config directory for Rawstudio - this is the
  * .rawstudio direcotry in home
@@ -0,0 +1,338 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* A single resampling pass for everything moving pixels around. Filters
+   like lensfun describe their correction as a distortion, and the rotate
+   filter adds its affine transformation on top. Composing the two on a
+   sparse grid costs next to nothing, and saves a full frame intermediate
+   and a resampling pass. */
+
+#include <rawstudio.h>
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#include <string.h>
+#include "rs-warp.h"
+
+/* Distance in pixels between two grid nodes */
+#define GRID_STEP 8
+
+/* Floats per grid node: source x/y for three channels and the undistorted
+   position used for clipping against the image borders */
+#define NODE_SIZE 8
+
+struct _RSWarp {
+	GObject parent;
+	gint width;
+	gint height;
+	gboolean affine_set;
+	RS_MATRIX3 affine;
+	RSWarpDistortFunc distort;
+	gpointer distort_data;
+	GDestroyNotify distort_destroy;
+};
+
+typedef struct {
+	RSWarp *warp;
+	RS_IMAGE16 *input;
+	RS_IMAGE16 *output;
+	GdkRectangle roi;
+	gint grid_width;
+	gint grid_height;
+	gfloat *grid;
+	gboolean sse2;
+} WarpInfo;
+
+G_DEFINE_TYPE(RSWarp, rs_warp, G_TYPE_OBJECT)
+
+static void
+rs_warp_finalize(GObject *object)
+{
+	RSWarp *warp = RS_WARP(object);
+
+	if (warp->distort_destroy)
+		warp->distort_destroy(warp->distort_data);
+
+	G_OBJECT_CLASS (rs_warp_parent_class)->finalize (object);
+}
+
+static void
+rs_warp_class_init(RSWarpClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->finalize = rs_warp_finalize;
+}
+
+static void
+rs_warp_init(RSWarp *warp)
+{
+	warp->affine_set = FALSE;
+	matrix3_identity(&warp->affine);
+	warp->distort = NULL;
+	warp->distort_data = NULL;
+	warp->distort_destroy = NULL;
+}
+
+RSWarp *
+rs_warp_new(gint width, gint height)
+{
+	RSWarp *warp = g_object_new(RS_TYPE_WARP, NULL);
+
+	warp->width = width;
+	warp->height = height;
+
+	return warp;
+}
+
+void
+rs_warp_set_distortion(RSWarp *warp, RSWarpDistortFunc func, gpointer user_data, GDestroyNotify destroy)
+{
+	g_return_if_fail(RS_IS_WARP(warp));
+
+	if (warp->distort_destroy)
+		warp->distort_destroy(warp->distort_data);
+
+	warp->distort = func;
+	warp->distort_data = user_data;
+	warp->distort_destroy = destroy;
+}
+
+void
+rs_warp_set_affine(RSWarp *warp, const RS_MATRIX3 *affine)
+{
+	g_return_if_fail(RS_IS_WARP(warp));
+	g_return_if_fail(affine != NULL);
+
+	warp->affine = *affine;
+	warp->affine_set = TRUE;
+}
+
+static void
+evaluate_grid(gint start, gint end, gpointer user_data)
+{
+	WarpInfo *t = user_data;
+	RSWarp *warp = t->warp;
+	gint gx, gy;
+
+	for(gy = start; gy < end; gy++)
+		for(gx = 0; gx < t->grid_width; gx++)
+		{
+			gfloat *node = t->grid + (gy * t->grid_width + gx) * NODE_SIZE;
+			const gdouble x = t->roi.x + gx * GRID_STEP;
+			const gdouble y = t->roi.y + gy * GRID_STEP;
+			gfloat px = x;
+			gfloat py = y;
+
+			if (warp->affine_set)
+			{
+				px = x * warp->affine.coeff[0][0] + y * warp->affine.coeff[1][0] + warp->affine.coeff[2][0];
+				py = x * warp->affine.coeff[0][1] + y * warp->affine.coeff[1][1] + warp->affine.coeff[2][1];
+			}
+
+			if (warp->distort)
+				warp->distort(warp->distort_data, px, py, node);
+			else
+			{
+				node[0] = node[2] = node[4] = px;
+				node[1] = node[3] = node[5] = py;
+			}
+			node[6] = px;
+			node[7] = py;
+		}
+}
+
+/* How much of a pixel at an undistorted position is inside the image along
+   one axis, in 1/256. Borders are interpolated against black like bilinear
+   sampling */
+static inline gint
+coverage(gfloat pos, gint size)
+{
+	if (pos < 0.0f)
+		return MAX(0, (gint) ((1.0f + pos) * 256.0f));
+	if (pos > (gfloat) (size - 1))
+		return MAX(0, (gint) ((1.0f - (pos - (gfloat) (size - 1))) * 256.0f));
+	return 256;
+}
+
+/* Sample a single channel with clamping at the borders of the backed area,
+   the input may only hold the part requested from the previous filter */
+static inline gint
+sample(RS_IMAGE16 *in, gfloat x, gfloat y, gint channel)
+{
+	const gint m_x = in->area.x + in->area.width - 1;
+	const gint m_y = in->area.y + in->area.height - 1;
+	const gint ipos_x = CLAMP((gint) (x * 256.0f), in->area.x << 8, m_x << 8);
+	const gint ipos_y = CLAMP((gint) (y * 256.0f), in->area.y << 8, m_y << 8);
+	const gint nx = MIN((ipos_x>>8) + 1, m_x);
+	const gint ny = MIN((ipos_y>>8) + 1, m_y);
+
+	const gushort *a = GET_PIXEL(in, ipos_x>>8, ipos_y>>8);
+	const gushort *b = GET_PIXEL(in, nx, ipos_y>>8);
+	const gushort *c = GET_PIXEL(in, ipos_x>>8, ny);
+	const gushort *d = GET_PIXEL(in, nx, ny);
+
+	const gint diffx = ipos_x & 0xff;
+	const gint diffy = ipos_y & 0xff;
+	const gint inv_diffx = 256 - diffx;
+	const gint inv_diffy = 256 - diffy;
+
+	const gint aw = (inv_diffx * inv_diffy) >> 1; /* Weight is now 0.15 fp */
+	const gint bw = (diffx * inv_diffy) >> 1;
+	const gint cw = (inv_diffx * diffy) >> 1;
+	const gint dw = (diffx * diffy) >> 1;
+
+	return (a[channel]*aw + b[channel]*bw + c[channel]*cw + d[channel]*dw + 16384) >> 15;
+}
+
+#if defined (__SSE2__)
+/* Sample all channels at the same position, the position must be inside the
+   backed area and at least one pixel from its right and bottom border. Input
+   must have pixelsize 4 */
+static inline void
+sample_sse2(RS_IMAGE16 *in, gfloat x, gfloat y, gfloat scale, gushort *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const gint ix = (gint) x;
+	const gint iy = (gint) y;
+	const gfloat fx = x - (gfloat) ix;
+	const gfloat fy = y - (gfloat) iy;
+
+	/* a and b, c and d are neighbours, so we can load two pixels at once */
+	__m128i ab = _mm_loadu_si128((__m128i *) GET_PIXEL(in, ix, iy));
+	__m128i cd = _mm_loadu_si128((__m128i *) GET_PIXEL(in, ix, iy+1));
+
+	__m128 a = _mm_cvtepi32_ps(_mm_unpacklo_epi16(ab, zero));
+	__m128 b = _mm_cvtepi32_ps(_mm_unpackhi_epi16(ab, zero));
+	__m128 c = _mm_cvtepi32_ps(_mm_unpacklo_epi16(cd, zero));
+	__m128 d = _mm_cvtepi32_ps(_mm_unpackhi_epi16(cd, zero));
+
+	__m128 top = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_set1_ps(fx)));
+	__m128 bottom = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(d, c), _mm_set1_ps(fx)));
+	__m128 result = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), _mm_set1_ps(fy)));
+	result = _mm_add_ps(_mm_mul_ps(result, _mm_set1_ps(scale)), _mm_set1_ps(0.5f));
+
+	/* Pack to unsigned shorts, SSE2 only has signed saturation */
+	__m128i r = _mm_sub_epi32(_mm_cvttps_epi32(result), _mm_set1_epi32(32768));
+	r = _mm_packs_epi32(r, r);
+	r = _mm_xor_si128(r, _mm_set1_epi16((gshort) 0x8000));
+	_mm_storel_epi64((__m128i *) out, r);
+}
+#endif /* __SSE2__ */
+
+static void
+render_rows(gint start, gint end, gpointer user_data)
+{
+	WarpInfo *t = user_data;
+	RS_IMAGE16 *input = t->input;
+	RS_IMAGE16 *output = t->output;
+	const gint w = t->warp->width;
+	const gint h = t->warp->height;
+	const gfloat area_x1 = (gfloat) input->area.x;
+	const gfloat area_y1 = (gfloat) input->area.y;
+	const gfloat area_x2 = (gfloat) (input->area.x + input->area.width - 1);
+	const gfloat area_y2 = (gfloat) (input->area.y + input->area.height - 1);
+	gint row, col, i;
+
+	for(row = start; row < end; row++)
+	{
+		const gint gy = (row - t->roi.y) / GRID_STEP;
+		const gfloat fy = (gfloat) ((row - t->roi.y) % GRID_STEP) * (1.0f / GRID_STEP);
+		const gfloat *top = t->grid + gy * t->grid_width * NODE_SIZE;
+		const gfloat *bottom = top + t->grid_width * NODE_SIZE;
+		gushort *out = GET_PIXEL(output, t->roi.x, row);
+
+		for(col = 0; col < t->roi.width; col++, out += output->pixelsize)
+		{
+			const gint n = (col / GRID_STEP) * NODE_SIZE;
+			const gfloat fx = (gfloat) (col % GRID_STEP) * (1.0f / GRID_STEP);
+			gfloat pos[NODE_SIZE];
+
+			for(i = 0; i < NODE_SIZE; i++)
+			{
+				const gfloat a = top[n + i] + (top[n + NODE_SIZE + i] - top[n + i]) * fx;
+				const gfloat b = bottom[n + i] + (bottom[n + NODE_SIZE + i] - bottom[n + i]) * fx;
+				pos[i] = a + (b - a) * fy;
+			}
+
+			const gint cover = (coverage(pos[6], w) * coverage(pos[7], h) + 128) >> 8;
+			if (cover == 0)
+			{
+				out[R] = out[G] = out[B] = 0;
+				continue;
+			}
+
+#if defined (__SSE2__)
+			/* Without chromatic aberration correction all channels share
+			   position, this is by far the most common case */
+			if (t->sse2 && pos[0] == pos[2] && pos[0] == pos[4] && pos[1] == pos[3] && pos[1] == pos[5]
+				&& pos[0] >= area_x1 && pos[1] >= area_y1 && pos[0] < area_x2 && pos[1] < area_y2)
+			{
+				gushort pixel[4];
+				sample_sse2(input, pos[0], pos[1], (gfloat) cover * (1.0f / 256.0f), pixel);
+				out[R] = pixel[R];
+				out[G] = pixel[G];
+				out[B] = pixel[B];
+				continue;
+			}
+#endif /* __SSE2__ */
+			for(i = 0; i < 3; i++)
+				out[i] = (sample(input, pos[i*2], pos[i*2+1], i) * cover + 128) >> 8;
+		}
+	}
+}
+
+void
+rs_warp_render(RSWarp *warp, RS_IMAGE16 *input, RS_IMAGE16 *output, const GdkRectangle *roi)
+{
+	WarpInfo t;
+
+	g_return_if_fail(RS_IS_WARP(warp));
+	g_return_if_fail(RS_IS_IMAGE16(input));
+	g_return_if_fail(RS_IS_IMAGE16(output));
+
+	t.warp = warp;
+	t.input = input;
+	t.output = output;
+	if (roi)
+	{
+		t.roi.x = CLAMP(roi->x, 0, output->w - 1);
+		t.roi.y = CLAMP(roi->y, 0, output->h - 1);
+		t.roi.width = CLAMP(roi->width, 1, output->w - t.roi.x);
+		t.roi.height = CLAMP(roi->height, 1, output->h - t.roi.y);
+	}
+	else
+	{
+		t.roi.x = 0;
+		t.roi.y = 0;
+		t.roi.width = output->w;
+		t.roi.height = output->h;
+	}
+	t.sse2 = (input->pixelsize == 4) && !!(rs_detect_cpu_features() & RS_CPU_FLAG_SSE2);
+
+	/* Nodes cover the area including the last row and column */
+	t.grid_width = (t.roi.width - 1) / GRID_STEP + 2;
+	t.grid_height = (t.roi.height - 1) / GRID_STEP + 2;
+	t.grid = g_new(gfloat, t.grid_width * t.grid_height * NODE_SIZE);
+
+	rs_parallel_for(0, t.grid_height, 0, evaluate_grid, &t);
+	rs_parallel_for(t.roi.y, t.roi.y + t.roi.height, 0, render_rows, &t);
+
+	g_free(t.grid);
+}
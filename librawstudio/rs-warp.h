@@ -0,0 +1,104 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_WARP_H
+#define RS_WARP_H
+
+#include <glib-object.h>
+#include <gdk/gdk.h>
+#include "rs-types.h"
+
+G_BEGIN_DECLS
+
+#define RS_TYPE_WARP rs_warp_get_type()
+#define RS_WARP(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_WARP, RSWarp))
+#define RS_WARP_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_WARP, RSWarpClass))
+#define RS_IS_WARP(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), RS_TYPE_WARP))
+#define RS_IS_WARP_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), RS_TYPE_WARP))
+#define RS_WARP_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), RS_TYPE_WARP, RSWarpClass))
+
+/**
+ * Boolean request parameter. When set, filters doing geometry correction may
+ * skip resampling and return a RSWarp in the response instead, so the
+ * resampling can be combined with the one done by the requesting filter
+ */
+#define RS_WARP_REQUEST_DEFER "defer-warp"
+
+/**
+ * Name of the RSWarp object in a RSFilterResponse
+ */
+#define RS_WARP_RESPONSE "warp"
+
+typedef struct _RSWarp RSWarp;
+
+typedef struct {
+	GObjectClass parent_class;
+} RSWarpClass;
+
+/**
+ * Maps a point to source coordinates
+ * @param user_data The user_data given to rs_warp_set_distortion()
+ * @param x The x coordinate
+ * @param y The y coordinate
+ * @param pos Output, source x and y for the red, green and blue channel
+ */
+typedef void (*RSWarpDistortFunc)(gpointer user_data, gfloat x, gfloat y, gfloat pos[6]);
+
+GType rs_warp_get_type(void);
+
+/**
+ * Instantiate a new RSWarp, it will do nothing until a distortion or an
+ * affine transformation is set
+ * @param width The width of the image to warp
+ * @param height The height of the image to warp
+ * @return A new RSWarp with a refcount of 1
+ */
+RSWarp *rs_warp_new(gint width, gint height);
+
+/**
+ * Set a distortion, this is applied last - to the source coordinates
+ * @param warp A RSWarp
+ * @param func A function mapping points to source coordinates
+ * @param user_data Data passed to func
+ * @param destroy Called with user_data when no longer needed or NULL
+ */
+void rs_warp_set_distortion(RSWarp *warp, RSWarpDistortFunc func, gpointer user_data, GDestroyNotify destroy);
+
+/**
+ * Set an affine transformation from output coordinates to coordinates in the
+ * (undistorted) image. Points outside the image are rendered black
+ * @param warp A RSWarp
+ * @param affine The transformation, as used by matrix3_affine_*()
+ */
+void rs_warp_set_affine(RSWarp *warp, const RS_MATRIX3 *affine);
+
+/**
+ * Render output in a single resampling pass. The combined coordinate map is
+ * evaluated on a sparse grid and interpolated, the work is done in the
+ * shared worker pool
+ * @param warp A RSWarp
+ * @param input The image to sample from, sampling is clamped to its backed area
+ * @param output The image to render to
+ * @param roi The area of output to render or NULL for everything
+ */
+void rs_warp_render(RSWarp *warp, RS_IMAGE16 *input, RS_IMAGE16 *output, const GdkRectangle *roi);
+
+G_END_DECLS
+
+#endif /* RS_WARP_H */
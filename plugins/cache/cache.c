@@ -20,6 +20,7 @@
 /* Plugin tmpl version 4 */
 
 #include <rawstudio.h>
+#include <string.h>
 
 #if 0 /* Change to 1 to enable debugging info */
 #define filter_debug g_debug
@@ -27,6 +28,9 @@
 #define filter_debug(...)
 #endif
 
+/* Size of the square tiles stored for ROI requests */
+#define CACHE_TILE_SIZE 256
+
 #define RS_TYPE_CACHE (rs_cache_type)
 #define RS_CACHE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_CACHE, RSCache))
 #define RS_CACHE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_CACHE, RSCacheClass))
@@ -35,14 +39,39 @@
 typedef struct _RSCache RSCache;
 typedef struct _RSCacheClass RSCacheClass;
 
+typedef struct {
+	gint x; /* Tile column or -1 for a complete image */
+	gint y; /* Tile row or -1 for a complete image */
+	gint width; /* Size of the complete image */
+	gint height;
+	gboolean quick;
+	gboolean eight;
+	gpointer colorspace;
+} CacheKey;
+
+typedef struct {
+	CacheKey key;
+	GdkRectangle area; /* Area covered in the complete image */
+	RSFilterResponse *response; /* Params from upstream, no image data */
+	RS_IMAGE16 *image;
+	GdkPixbuf *image8;
+	gsize size;
+	guint stamp;
+	GList *link;
+} CacheEntry;
+
 struct _RSCache {
 	RSFilter parent;
 
-	RSFilterResponse *cached_image;
+	GHashTable *entries;
+	GQueue *lru; /* Most recently used first */
+	gsize used;
+	guint stamp;
 	gboolean ignore_changed;
 	RSFilterChangedMask mask;
 	gboolean ignore_roi;
 	gint latency;
+	gint memory_limit;
 	GMutex *cache_mutex;
 };
 
@@ -55,7 +84,8 @@ RS_DEFINE_FILTER(rs_cache, RSCache)
 enum {
 	PROP_0,
 	PROP_LATENCY,
-	PROP_IGNORE_ROI
+	PROP_IGNORE_ROI,
+	PROP_MEMORY_LIMIT
 };
 
 static void finalize(GObject *object);
@@ -63,6 +93,7 @@ static void get_property (GObject *object, guint property_id, GValue *value, GPa
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_image8(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterRoiSupport get_roi_support(RSFilter *filter);
 static void flush(RSCache *cache);
 static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
 
@@ -94,20 +125,52 @@ rs_cache_class_init(RSCacheClass *klass)
 			FALSE,
 			G_PARAM_READWRITE)
 	);
+	g_object_class_install_property(object_class,
+		PROP_MEMORY_LIMIT, g_param_spec_int(
+			"memory-limit", "memory-limit", "Maximum amount of image data to keep in megabytes, the most recent result is always kept",
+			0, 65535, 256,
+			G_PARAM_READWRITE)
+	);
 
 	filter_class->name = "Listen for changes and caches image data";
 	filter_class->get_image = get_image;
 	filter_class->get_image8 = get_image8;
+	filter_class->get_roi_support = get_roi_support;
 	filter_class->previous_changed = previous_changed;
 }
 
+static guint
+key_hash(gconstpointer v)
+{
+	const CacheKey *key = v;
+
+	return (key->x * 7919) ^ (key->y * 104729) ^ (key->width << 16) ^ key->height
+		^ (key->quick << 30) ^ (key->eight << 31) ^ g_direct_hash(key->colorspace);
+}
+
+static gboolean
+key_equal(gconstpointer a, gconstpointer b)
+{
+	const CacheKey *ka = a;
+	const CacheKey *kb = b;
+
+	return ka->x == kb->x && ka->y == kb->y
+		&& ka->width == kb->width && ka->height == kb->height
+		&& ka->quick == kb->quick && ka->eight == kb->eight
+		&& ka->colorspace == kb->colorspace;
+}
+
 static void
 rs_cache_init(RSCache *cache)
 {
 	cache->ignore_changed = FALSE;
 	cache->ignore_roi = FALSE;
 	cache->latency = 0;
-	cache->cached_image = rs_filter_response_new();
+	cache->memory_limit = 256;
+	cache->entries = g_hash_table_new(key_hash, key_equal);
+	cache->lru = g_queue_new();
+	cache->used = 0;
+	cache->stamp = 0;
 	cache->cache_mutex = g_mutex_new();
 }
 
@@ -116,6 +179,8 @@ finalize(GObject *object)
 {
 	RSCache *cache = RS_CACHE(object);
 	flush(cache);
+	g_hash_table_destroy(cache->entries);
+	g_queue_free(cache->lru);
 	g_mutex_free(cache->cache_mutex);
 }
 
@@ -132,6 +197,9 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_IGNORE_ROI:
 			g_value_set_boolean(value, cache->ignore_roi);
 			break;
+		case PROP_MEMORY_LIMIT:
+			g_value_set_int(value, cache->memory_limit);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -150,251 +218,385 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_IGNORE_ROI:
 			cache->ignore_roi = g_value_get_boolean(value);
 			break;
+		case PROP_MEMORY_LIMIT:
+			cache->memory_limit = g_value_get_int(value);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
 }
 
-static gboolean
-rectangle_is_inside(GdkRectangle *outer_rect, GdkRectangle *inner_rect)
+static void
+entry_remove(RSCache *cache, CacheEntry *entry)
 {
-	return inner_rect->x >= outer_rect->x &&
-		inner_rect->x + inner_rect->width <= outer_rect->x + outer_rect->width &&
-		inner_rect->y >= outer_rect->y && 
-		inner_rect->y + inner_rect->height <= outer_rect->y + outer_rect->height;
+	g_hash_table_remove(cache->entries, &entry->key);
+	g_queue_delete_link(cache->lru, entry->link);
+	cache->used -= entry->size;
+
+	if (entry->image)
+		g_object_unref(entry->image);
+	if (entry->image8)
+		g_object_unref(entry->image8);
+	g_object_unref(entry->response);
+	g_free(entry);
 }
 
-static gint get_cached_width(RSCache *cache)
+/* Lookup an entry, for quick requests a full quality entry is preferred */
+static CacheEntry *
+entry_lookup(RSCache *cache, CacheKey *key, gint x, gint y, gboolean quick)
 {
-	gint ret = -1;
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		ret = img->w;
-		g_object_unref(img);
+	CacheEntry *entry;
+
+	key->x = x;
+	key->y = y;
+	key->quick = FALSE;
+	entry = g_hash_table_lookup(cache->entries, key);
+
+	if (!entry && quick)
+	{
+		key->quick = TRUE;
+		entry = g_hash_table_lookup(cache->entries, key);
 	}
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		ret = gdk_pixbuf_get_width(img);
-		g_object_unref(img);
+	if (entry)
+	{
+		/* Move to front of LRU list */
+		g_queue_unlink(cache->lru, entry->link);
+		g_queue_push_head_link(cache->lru, entry->link);
+		entry->stamp = cache->stamp;
 	}
-	return ret;
+
+	return entry;
 }
 
-static gint get_cached_height(RSCache *cache)
+/**
+ * Insert a new entry covering area of the response image
+ * @note For tiles the image data is copied, complete images are referenced
+ */
+static CacheEntry *
+entry_insert(RSCache *cache, const CacheKey *key, RSFilterResponse *response, RSFilterResponse *meta, GdkRectangle *area)
 {
-	gint ret = -1;
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		ret = img->h;
-		g_object_unref(img);
-	}
+	CacheEntry *entry = g_new0(CacheEntry, 1);
+	CacheEntry *old;
+	gint row;
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		ret = gdk_pixbuf_get_height(img);
-		g_object_unref(img);
-	}
-	return ret;
-}
+	entry->key = *key;
+	entry->area = *area;
+	entry->response = g_object_ref(meta);
+	entry->stamp = cache->stamp;
 
-static void
-set_roi_to_full(RSCache *cache) {
-	GdkRectangle *r = g_new(GdkRectangle, 1);
-	r->x = 0;
-	r->y = 0;
-
-	if (rs_filter_response_has_image(cache->cached_image)) {
-		RS_IMAGE16 *img = rs_filter_response_get_image(cache->cached_image);
-		r->width = img->w;
-		r->height = img->h;
-		rs_filter_response_set_roi(cache->cached_image,r);
-		g_object_unref(img);
+	if (key->eight)
+	{
+		GdkPixbuf *image8 = rs_filter_response_get_image8(response);
+		if (key->x < 0)
+			entry->image8 = g_object_ref(image8);
+		else
+		{
+			entry->image8 = gdk_pixbuf_new(gdk_pixbuf_get_colorspace(image8), gdk_pixbuf_get_has_alpha(image8),
+				gdk_pixbuf_get_bits_per_sample(image8), area->width, area->height);
+			gdk_pixbuf_copy_area(image8, area->x, area->y, area->width, area->height, entry->image8, 0, 0);
+		}
+		entry->size = gdk_pixbuf_get_rowstride(entry->image8) * gdk_pixbuf_get_height(entry->image8);
+		g_object_unref(image8);
+	}
+	else
+	{
+		RS_IMAGE16 *image = rs_filter_response_get_image(response);
+		if (key->x < 0)
+			entry->image = g_object_ref(image);
+		else
+		{
+			entry->image = rs_image16_new(area->width, area->height, image->channels, image->pixelsize);
+			for(row = 0; row < area->height; row++)
+				memcpy(GET_PIXEL(entry->image, 0, row), GET_PIXEL(image, area->x, area->y+row), area->width * image->pixelsize * sizeof(gushort));
+		}
+		entry->size = entry->image->rowstride * entry->image->h * sizeof(gushort);
+		g_object_unref(image);
 	}
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-		GdkPixbuf *img  =  rs_filter_response_get_image8(cache->cached_image);
-		r->width = gdk_pixbuf_get_width(img);
-		r->height = gdk_pixbuf_get_height(img);
-		rs_filter_response_set_roi(cache->cached_image,r);
-		g_object_unref(img);
+	/* A full quality entry makes the quick one useless */
+	if (!key->quick)
+	{
+		CacheKey quick_key = *key;
+		quick_key.quick = TRUE;
+		if ((old = g_hash_table_lookup(cache->entries, &quick_key)))
+			entry_remove(cache, old);
 	}
-	filter_debug("Cache[%p]: Setting request ROI to full from cache!", cache);
-	filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", cache, r->x, r->y, r->width, r->height);
+	if ((old = g_hash_table_lookup(cache->entries, &entry->key)))
+		entry_remove(cache, old);
+
+	g_queue_push_head(cache->lru, entry);
+	entry->link = g_queue_peek_head_link(cache->lru);
+	g_hash_table_insert(cache->entries, &entry->key, entry);
+	cache->used += entry->size;
+
+	return entry;
 }
 
-static RSFilterResponse *
-get_image(RSFilter *filter, const RSFilterRequest *_request)
+/* Evict least recently used entries, but never what was used by the current request */
+static void
+evict(RSCache *cache)
 {
-	RSCache *cache = RS_CACHE(filter);
-	RSFilterRequest *request = rs_filter_request_clone(_request);
-	GdkRectangle *roi = rs_filter_request_get_roi(request);
-
-	filter_debug("Cache[%p]: getimage() called", filter);
+	const gsize limit = ((gsize) cache->memory_limit) * 1024 * 1024;
+	CacheEntry *entry;
 
-	g_mutex_lock(cache->cache_mutex);
-	if (roi && cache->ignore_roi)
+	while (cache->used > limit && (entry = g_queue_peek_tail(cache->lru)) && entry->stamp != cache->stamp)
 	{
-		roi = NULL;
-		rs_filter_request_set_roi(request, NULL);
-		filter_debug("Cache[%p]: Disabling ROI for upward calls", filter);
+		filter_debug("Cache[%p]: Evicting tile %d,%d", cache, entry->key.x, entry->key.y);
+		entry_remove(cache, entry);
 	}
+}
 
-	if (rs_filter_response_has_image(cache->cached_image)) {
-
-		if (rs_filter_response_get_quick(cache->cached_image) && !rs_filter_request_get_quick(request))
-		{
-			filter_debug("Cache[%p]: Cached image is quick and requested image is not!", filter);
-			flush(cache);
-		}
+static gboolean
+response_has_image(RSFilterResponse *response, gboolean eight)
+{
+	if (eight)
+		return rs_filter_response_has_image8(response);
+	else
+		return rs_filter_response_has_image(response);
+}
 
-		if (!rs_filter_response_get_roi(cache->cached_image) && roi)
-			set_roi_to_full(cache);
+static RSFilterResponse *
+response_from_entry(CacheEntry *entry, GdkRectangle *roi)
+{
+	RSFilterResponse *fr = rs_filter_response_clone(entry->response);
 
-		if (!roi && rs_filter_response_get_roi(cache->cached_image))
-		{
-				roi = g_new(GdkRectangle, 1);
-				roi->x = 0;
-				roi->y = 0;
-				roi->width = get_cached_width(cache);
-				roi->height = get_cached_height(cache);
-				rs_filter_request_set_roi(request, roi);
-				filter_debug("Cache[%p]: Setting request ROI from cache!", filter);
-		}
-		if (rs_filter_response_get_roi(cache->cached_image) && roi)
-		{
-			roi->x = MAX(0, roi->x);
-			roi->y = MAX(0, roi->y);
-			roi->width = MIN(roi->width, get_cached_width(cache));
-			roi->height = MIN(roi->height, get_cached_height(cache));
-		}
+	if (entry->image8)
+		rs_filter_response_set_image8(fr, entry->image8);
+	if (entry->image)
+		rs_filter_response_set_image(fr, entry->image);
+	if (roi)
+		rs_filter_response_set_roi(fr, roi);
+	if (entry->key.quick)
+		rs_filter_response_set_quick(fr);
 
-		if (!cache->ignore_roi && roi)
-		{
-			if (rs_filter_response_get_roi(cache->cached_image)) 
-				if (!rectangle_is_inside(rs_filter_response_get_roi(cache->cached_image), roi))
-				{
-					filter_debug("Cache[%p]: Cached image ROI does not cover requested ROI!", filter);
-#if 0
-					GdkRectangle *r = rs_filter_response_get_roi(cache->cached_image);
-					filter_debug("Cache[%p]: Request ROI x:%d, y:%d, w:%d, h:%d", filter, roi->x, roi->y, roi->width, roi->height);
-					filter_debug("Cache[%p]: Cached  ROI x:%d, y:%d, w:%d, h:%d", filter, r->x, r->y, r->width, r->height);
-#endif
-					flush(cache);
-				}
-		}
-	}
+	return fr;
+}
 
-	if (!rs_filter_response_has_image(cache->cached_image))
+/* Copy the part of every tile inside roi to a new image with the size of the
+   complete image, only the ROI is backed by memory */
+static RSFilterResponse *
+response_from_tiles(CacheEntry **tiles, gint num_tiles, GdkRectangle *roi)
+{
+	RSFilterResponse *fr = rs_filter_response_clone(tiles[0]->response);
+	const CacheKey *key = &tiles[0]->key;
+	RS_IMAGE16 *image = NULL;
+	GdkPixbuf *image8 = NULL;
+	GdkRectangle area;
+	gboolean quick = FALSE;
+	gint i, row;
+
+	if (key->eight)
+		image8 = rs_pixbuf_new_area(gdk_pixbuf_get_has_alpha(tiles[0]->image8), key->width, key->height, roi);
+	else
+		image = rs_image16_new_area(key->width, key->height, tiles[0]->image->channels, tiles[0]->image->pixelsize, roi);
+
+	for(i = 0; i < num_tiles; i++)
 	{
-		filter_debug("Cache[%p]: Cached image NOT found", filter);
-		g_object_unref(cache->cached_image);
-		cache->cached_image = rs_filter_get_image(filter->previous, request);
+		CacheEntry *tile = tiles[i];
+		quick |= tile->key.quick;
 
-		if (cache->cached_image && !roi)
-			set_roi_to_full(cache);
-		else
-		{
-			rs_filter_response_set_roi(cache->cached_image, roi);
-			if (roi)
-				filter_debug("Cache[%p]: Saved   ROI x:%d, y:%d, w:%d, h:%d", filter, roi->x, roi->y, roi->width, roi->height);
-		}
+		if (!gdk_rectangle_intersect(&tile->area, roi, &area))
+			continue;
 
-		if (rs_filter_request_get_quick(request))
-		{
-			rs_filter_response_set_quick(cache->cached_image);
-			filter_debug("Cache[%p]: Setting image as quick", filter);
-		}
+		if (image8)
+			gdk_pixbuf_copy_area(tile->image8, area.x - tile->area.x, area.y - tile->area.y, area.width, area.height, image8, area.x, area.y);
+		else
+			for(row = 0; row < area.height; row++)
+				memcpy(GET_PIXEL(image, area.x, area.y+row),
+					GET_PIXEL(tile->image, area.x - tile->area.x, area.y - tile->area.y + row),
+					area.width * image->pixelsize * sizeof(gushort));
 	}
 
-	RSFilterResponse *fr = rs_filter_response_clone(cache->cached_image);
-	RS_IMAGE16* img = rs_filter_response_get_image(cache->cached_image);
-	rs_filter_response_set_image(fr, img);
-
-	if (img)
-		g_object_unref(img);
-
-	g_object_unref(request);
-	g_mutex_unlock(cache->cache_mutex);
+	if (image8)
+	{
+		rs_filter_response_set_image8(fr, image8);
+		g_object_unref(image8);
+	}
+	else
+	{
+		rs_filter_response_set_image(fr, image);
+		g_object_unref(image);
+	}
+	rs_filter_response_set_roi(fr, roi);
+	if (quick)
+		rs_filter_response_set_quick(fr);
 
 	return fr;
 }
 
+static RSFilterResponse *
+get_upstream(RSFilter *filter, const RSFilterRequest *request, gboolean eight)
+{
+	if (eight)
+		return rs_filter_get_image8(filter->previous, request);
+	else
+		return rs_filter_get_image(filter->previous, request);
+}
+
+static gboolean
+response_matches_key(RSFilterResponse *response, const CacheKey *key)
+{
+	return response_has_image(response, key->eight)
+		&& rs_filter_response_get_width(response) == key->width
+		&& rs_filter_response_get_height(response) == key->height;
+}
 
 static RSFilterResponse *
-get_image8(RSFilter *filter, const RSFilterRequest *_request)
+get_cached(RSFilter *filter, const RSFilterRequest *_request, gboolean eight)
 {
 	RSCache *cache = RS_CACHE(filter);
 	RSFilterRequest *request = rs_filter_request_clone(_request);
-	GdkRectangle *roi = rs_filter_request_get_roi(request);
-	filter_debug("Cache[%p]: getimage8() called", filter);
+	const gboolean quick = rs_filter_request_get_quick(request);
+	RSFilterResponse *response;
+	RSFilterResponse *meta;
+	RSFilterResponse *fr = NULL;
+	CacheEntry *entry;
+	CacheKey key;
+	GdkRectangle roi, frame, area;
+	gboolean has_roi = FALSE;
 
 	g_mutex_lock(cache->cache_mutex);
-	if (roi && cache->ignore_roi)
-	{
-		roi = NULL;
-		rs_filter_request_set_roi(request, NULL);
-		filter_debug("Cache[%p]: Disabling ROI for upward calls", filter);
-	}
+	cache->stamp++;
 
-	if (rs_filter_response_has_image8(cache->cached_image)) {
-
-		if (rs_filter_response_get_quick(cache->cached_image) && !rs_filter_request_get_quick(request))
+	if (rs_filter_request_get_roi(request))
+	{
+		if (cache->ignore_roi)
 		{
-			filter_debug("Cache[%p]: Cached image is quick and requested image is not!", filter);
-			flush(cache);
+			rs_filter_request_set_roi(request, NULL);
+			filter_debug("Cache[%p]: Disabling ROI for upward calls", filter);
 		}
-
-		if (!rs_filter_response_get_roi(cache->cached_image) && roi)
+		else
 		{
-			set_roi_to_full(cache);
+			roi = *rs_filter_request_get_roi(request);
+			has_roi = TRUE;
 		}
+	}
 
-		if (!cache->ignore_roi && roi) 
-			if (rs_filter_response_get_roi(cache->cached_image)) 
-				if (!rectangle_is_inside(rs_filter_response_get_roi(cache->cached_image), roi))
-				{
-					filter_debug("Cache[%p]: Cached image ROI does not cover requested ROI!", filter);
-					flush(cache);
-				}
+	memset(&key, 0, sizeof(CacheKey));
+	key.eight = eight;
+	key.colorspace = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
+
+	if (!rs_filter_get_size_simple(filter->previous, request, &key.width, &key.height))
+	{
+		g_mutex_unlock(cache->cache_mutex);
+		response = get_upstream(filter, request, eight);
+		g_object_unref(request);
+		return response;
+	}
+
+	frame.x = 0;
+	frame.y = 0;
+	frame.width = key.width;
+	frame.height = key.height;
+
+	if (has_roi && !gdk_rectangle_intersect(&roi, &frame, &roi))
+		has_roi = FALSE;
 
-		if (!roi && rs_filter_response_get_roi(cache->cached_image))
+	/* A complete image will satisfy any request */
+	if ((entry = entry_lookup(cache, &key, -1, -1, quick)))
+	{
+		filter_debug("Cache[%p]: Complete image found", filter);
+		rs_filter_stats_add_cache(filter, 1, 0);
+		fr = response_from_entry(entry, has_roi ? &roi : NULL);
+	}
+	else if (!has_roi)
+	{
+		filter_debug("Cache[%p]: Complete image NOT found", filter);
+		rs_filter_stats_add_cache(filter, 0, 1);
+		response = get_upstream(filter, request, eight);
+
+		key.x = key.y = -1;
+		key.quick = quick;
+		if (response_matches_key(response, &key))
 		{
-			filter_debug("Cache[%p]: Cached image has ROI, but request does not.", filter);
-			flush(cache);
+			meta = rs_filter_response_clone(response);
+			entry = entry_insert(cache, &key, response, meta, &frame);
+			fr = response_from_entry(entry, NULL);
+			g_object_unref(meta);
+			g_object_unref(response);
 		}
+		else
+			fr = response;
+	}
+	else
+	{
+		const gint x1 = roi.x / CACHE_TILE_SIZE;
+		const gint y1 = roi.y / CACHE_TILE_SIZE;
+		const gint x2 = (roi.x + roi.width - 1) / CACHE_TILE_SIZE;
+		const gint y2 = (roi.y + roi.height - 1) / CACHE_TILE_SIZE;
+		const gint columns = x2 - x1 + 1;
+		const gint num_tiles = columns * (y2 - y1 + 1);
+		CacheEntry **tiles = g_new0(CacheEntry *, num_tiles);
+		gint mx1 = G_MAXINT, my1 = G_MAXINT, mx2 = -1, my2 = -1;
+		gint x, y, missing = 0;
+
+		for(y = y1; y <= y2; y++)
+			for(x = x1; x <= x2; x++)
+				if (!(tiles[(y-y1)*columns + (x-x1)] = entry_lookup(cache, &key, x, y, quick)))
+				{
+					missing++;
+					mx1 = MIN(mx1, x);
+					my1 = MIN(my1, y);
+					mx2 = MAX(mx2, x);
+					my2 = MAX(my2, y);
+				}
 
-		RSColorSpace *cached_space = NULL;
-		if (cache->cached_image)
-			cached_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(cache->cached_image), "colorspace", RS_TYPE_COLOR_SPACE);
-
-		RSColorSpace *requested_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
+		rs_filter_stats_add_cache(filter, num_tiles - missing, missing);
 
-		if (cached_space && requested_space)
-			if (cached_space != requested_space)
+		if (mx2 >= 0)
+		{
+			/* Render the bounding box of all missing tiles */
+			area.x = mx1 * CACHE_TILE_SIZE;
+			area.y = my1 * CACHE_TILE_SIZE;
+			area.width = (mx2 - mx1 + 1) * CACHE_TILE_SIZE;
+			area.height = (my2 - my1 + 1) * CACHE_TILE_SIZE;
+			gdk_rectangle_intersect(&area, &frame, &area);
+			filter_debug("Cache[%p]: Rendering ROI x:%d, y:%d, w:%d, h:%d", filter, area.x, area.y, area.width, area.height);
+
+			rs_filter_request_set_roi(request, &area);
+			response = get_upstream(filter, request, eight);
+
+			key.quick = quick;
+			if (response_matches_key(response, &key))
 			{
-				filter_debug("Cache[%p]: Colorspace does not match Cached:%s vs Requested:%s.", filter, 
-										 rs_color_space_get_name(cached_space), rs_color_space_get_name(requested_space));
-				flush(cache);
+				meta = rs_filter_response_clone(response);
+				for(y = my1; y <= my2; y++)
+					for(x = mx1; x <= mx2; x++)
+					{
+						gint i = (y-y1)*columns + (x-x1);
+						GdkRectangle tile_area = {x * CACHE_TILE_SIZE, y * CACHE_TILE_SIZE, CACHE_TILE_SIZE, CACHE_TILE_SIZE};
+
+						if (tiles[i])
+							continue;
+
+						gdk_rectangle_intersect(&tile_area, &frame, &tile_area);
+						key.x = x;
+						key.y = y;
+						tiles[i] = entry_insert(cache, &key, response, meta, &tile_area);
+					}
+				g_object_unref(meta);
+				g_object_unref(response);
 			}
-	}
+			else
+			{
+				/* Something we cannot cache, the tiles we have may not match
+				   it either. Pass on a render of the complete ROI */
+				g_object_unref(response);
+				rs_filter_request_set_roi(request, &roi);
+				fr = get_upstream(filter, request, eight);
+			}
+		}
+		else
+			filter_debug("Cache[%p]: All %d tiles found", filter, num_tiles);
 
-	if (!rs_filter_response_has_image8(cache->cached_image))
-	{
-		filter_debug("Cache[%p]: Cached image8 NOT found", filter);
-		g_object_unref(cache->cached_image);
-		cache->cached_image = rs_filter_get_image8(filter->previous, request);
-		rs_filter_response_set_roi(cache->cached_image, roi);
-		if (rs_filter_request_get_quick(request))
-			rs_filter_response_set_quick(cache->cached_image);
-	}
+		if (!fr)
+			fr = response_from_tiles(tiles, num_tiles, &roi);
 
-	RSFilterResponse *fr = rs_filter_response_clone(cache->cached_image);
-	GdkPixbuf* img = rs_filter_response_get_image8(cache->cached_image);
-	rs_filter_response_set_image8(fr, img);
+		g_free(tiles);
+	}
 
-	if (img)
-		g_object_unref(img);
+	evict(cache);
 
 	g_object_unref(request);
 	g_mutex_unlock(cache->cache_mutex);
@@ -402,13 +604,40 @@ get_image8(RSFilter *filter, const RSFilterRequest *_request)
 	return fr;
 }
 
+static RSFilterResponse *
+get_image(RSFilter *filter, const RSFilterRequest *request)
+{
+	filter_debug("Cache[%p]: getimage() called", filter);
+
+	return get_cached(filter, request, FALSE);
+}
+
+static RSFilterResponse *
+get_image8(RSFilter *filter, const RSFilterRequest *request)
+{
+	filter_debug("Cache[%p]: getimage8() called", filter);
+
+	return get_cached(filter, request, TRUE);
+}
+
+static RSFilterRoiSupport
+get_roi_support(RSFilter *filter)
+{
+	/* With ignore-roi we keep the complete image and serve every ROI from it */
+	if (RS_CACHE(filter)->ignore_roi)
+		return RS_FILTER_ROI_FULL_IMAGE;
+
+	return RS_FILTER_ROI_SUPPORTED;
+}
 
 static void
 flush(RSCache *cache)
 {
+	CacheEntry *entry;
+
 	filter_debug("Cache[%p]: Cache flushed", cache);
-	g_object_unref(cache->cached_image);
-	cache->cached_image = rs_filter_response_new();
+	while ((entry = g_queue_peek_head(cache->lru)))
+		entry_remove(cache, entry);
 }
 
 static void
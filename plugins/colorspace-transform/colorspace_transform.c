@@ -28,6 +28,7 @@
 #else
 #error "LCMS v1 or LCMS v2 required"
 #endif
+#include <conf_interface.h>
 #include "rs-cmm.h"
 #include "colorspace_transform.h"
 
@@ -36,6 +37,7 @@ struct _RSColorspaceTransform {
 	RSFilter parent;
 	gfloat premul[4];
 	gboolean has_premul;
+	gboolean planar_float;
 
 	RSCmm *cmm;
 };
@@ -48,13 +50,16 @@ RS_DEFINE_FILTER(rs_colorspace_transform, RSColorspaceTransform)
 
 enum {
 	PROP_0,
-	PROP_CHANGEME
+	PROP_PLANAR_FLOAT
 };
 
+static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
+static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_image8(RSFilter *filter, const RSFilterRequest *request);
 static gboolean convert_colorspace16(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *input_image, RS_IMAGE16 *output_image, RSColorSpace *input_space, RSColorSpace *output_space, GdkRectangle *_roi);
-static void convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *input_image, GdkPixbuf *output_image, RSColorSpace *input_space, RSColorSpace *output_space, GdkRectangle *roi);
+static RSFilterResponse *get_image8_float(RSColorspaceTransform *colorspace_transform, const RSFilterRequest *request, RSFilterResponse *previous_response, RSColorSpace *output_space);
+static void convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *input_image, GdkPixbuf *output_image, RSColorSpace *input_space, RSColorSpace *output_space, GdkRectangle *roi, RSParallelPriority priority);
 
 static RSFilterClass *rs_colorspace_transform_parent_class = NULL;
 
@@ -78,9 +83,19 @@ static void
 rs_colorspace_transform_class_init(RSColorspaceTransformClass *klass)
 {
 	RSFilterClass *filter_class = RS_FILTER_CLASS (klass);
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
 
 	rs_colorspace_transform_parent_class = g_type_class_peek_parent (klass);
 
+	object_class->get_property = get_property;
+	object_class->set_property = set_property;
+
+	g_object_class_install_property(object_class,
+		PROP_PLANAR_FLOAT, g_param_spec_boolean(
+			"planar-float", "planar-float", "Render final 8 bit output through the planar float path",
+			DEFAULT_CONF_RENDER_FLOAT, G_PARAM_READWRITE)
+	);
+
 	filter_class->name = "ColorspaceTransform filter";
 	filter_class->get_image = get_image;
 	filter_class->get_image8 = get_image8;
@@ -91,7 +106,41 @@ rs_colorspace_transform_init(RSColorspaceTransform *colorspace_transform)
 {
 	/* FIXME: unref this at some point */
 	colorspace_transform->cmm = rs_cmm_new();
-	rs_cmm_set_num_threads(colorspace_transform->cmm, rs_get_number_of_processor_cores());
+	rs_cmm_set_num_threads(colorspace_transform->cmm, rs_parallel_get_number_of_threads());
+
+	/* The float path is scalar, the 16 bit path has SIMD all the way */
+	rs_conf_get_boolean_with_default(CONF_RENDER_FLOAT, &colorspace_transform->planar_float, DEFAULT_CONF_RENDER_FLOAT);
+}
+
+static void
+get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec)
+{
+	RSColorspaceTransform *colorspace_transform = RS_COLORSPACE_TRANSFORM(object);
+
+	switch (property_id)
+	{
+		case PROP_PLANAR_FLOAT:
+			g_value_set_boolean(value, colorspace_transform->planar_float);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+	}
+}
+
+static void
+set_property(GObject *object, guint property_id, const GValue *value, GParamSpec *pspec)
+{
+	RSColorspaceTransform *colorspace_transform = RS_COLORSPACE_TRANSFORM(object);
+
+	switch (property_id)
+	{
+		case PROP_PLANAR_FLOAT:
+			colorspace_transform->planar_float = g_value_get_boolean(value);
+			rs_filter_changed(RS_FILTER(object), RS_FILTER_CHANGED_PIXELDATA);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+	}
 }
 
 static RSFilterResponse *
@@ -126,7 +175,11 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 			colorspace_transform->has_premul = rs_filter_param_get_float4(RS_FILTER_PARAM(request), "premul", colorspace_transform->premul);
 		rs_cmm_set_premul(colorspace_transform->cmm, colorspace_transform->premul);
 
-		output = rs_image16_copy(input, FALSE);
+		/* Only the ROI is rendered, so only the ROI needs memory */
+		if (roi)
+			output = rs_image16_new_area(input->w, input->h, input->channels, input->pixelsize, roi);
+		else
+			output = rs_image16_copy(input, FALSE);
 
 		if (convert_colorspace16(colorspace_transform, input, output, input_space, output_space, roi))
 		{
@@ -167,14 +220,38 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 	GdkRectangle *roi;
 	int i;
 
-	previous_response = rs_filter_get_image(filter->previous, request);
-	input = rs_filter_response_get_image(previous_response);
+	RSColorSpace *output_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
+
+	/* Final renders can be requested as planar float, this avoids quantizing
+	 * between the float capable filters. It is opt-in, as the float filters
+	 * are slower than their 16 bit SIMD versions. Quick requests stay 16 bit */
+	if (colorspace_transform->planar_float && !rs_filter_request_get_quick(request)
+		&& output_space && !RS_COLOR_SPACE_REQUIRES_CMS(output_space))
+	{
+		previous_response = rs_filter_get_image_float(filter->previous, request);
+		response = get_image8_float(colorspace_transform, request, previous_response, output_space);
+		if (response)
+			return response;
+		input = NULL;
+		if (rs_filter_response_has_image_float(previous_response))
+		{
+			/* Input requires a CMS, use the 16 bit path */
+			RSImage *input_float = rs_filter_response_get_image_float(previous_response);
+			input = rs_image_to_image16(input_float, NULL);
+			g_object_unref(input_float);
+		}
+	}
+	else
+	{
+		previous_response = rs_filter_get_image(filter->previous, request);
+		input = rs_filter_response_get_image(previous_response);
+	}
+
 	if (!RS_IS_IMAGE16(input))
 		return previous_response;
 
 	roi = rs_filter_request_get_roi(request);
 	RSColorSpace *input_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(previous_response), "colorspace", RS_TYPE_COLOR_SPACE);
-	RSColorSpace *output_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(request), "colorspace", RS_TYPE_COLOR_SPACE);
 
 	response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
@@ -197,10 +274,192 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 	printf("\033[33m8 output_space: %s\n\033[0m", (output_space) ? G_OBJECT_TYPE_NAME(output_space) : "none");
 #endif
 
-	output = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, input->w, input->h);
+	/* Only the ROI is rendered, so only the ROI needs memory */
+	if (roi)
+		output = rs_pixbuf_new_area(TRUE, input->w, input->h, roi);
+	else
+		output = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, input->w, input->h);
 
 	/* Process output */
-	convert_colorspace8(colorspace_transform, input, output, input_space, output_space, roi);
+	convert_colorspace8(colorspace_transform, input, output, input_space, output_space, roi, rs_filter_request_get_priority(request));
+
+	rs_filter_response_set_image8(response, output);
+	rs_filter_param_set_object(RS_FILTER_PARAM(response), "colorspace", output_space);
+	g_object_unref(output);
+	g_object_unref(input);
+	return response;
+}
+
+typedef struct {
+	RSImage *input;
+	GdkPixbuf *output;
+	gint start_x;
+	gint end_x;
+	RS_MATRIX3 *matrix;
+	const guchar *table8;
+} FloatInfo;
+
+typedef struct {
+	const RS1dFunction *input_gamma;
+	const RS1dFunction *output_gamma;
+	guchar table8[65536];
+} GammaTable8;
+
+static GStaticMutex gamma_tables_lock = G_STATIC_MUTEX_INIT;
+static GSList *gamma_tables = NULL;
+
+/* Get a table converting 16 bit values from input gamma to 8 bit output
+ * gamma. Tables are built once for every pair of gamma functions and never
+ * freed, the color spaces using this are singletons */
+static const guchar *
+get_gamma_table8(const RS1dFunction *input_gamma, const RS1dFunction *output_gamma)
+{
+	GammaTable8 *table = NULL;
+	GSList *node;
+	gint i;
+
+	g_static_mutex_lock(&gamma_tables_lock);
+	for(node = gamma_tables; node; node = node->next)
+	{
+		GammaTable8 *t = node->data;
+		if (t->input_gamma == input_gamma && t->output_gamma == output_gamma)
+		{
+			table = t;
+			break;
+		}
+	}
+
+	if (!table)
+	{
+		table = g_new(GammaTable8, 1);
+		table->input_gamma = input_gamma;
+		table->output_gamma = output_gamma;
+		for(i=0;i<65536;i++)
+		{
+			gdouble nd = ((gdouble) i) * (1.0/65535.0);
+
+			nd = rs_1d_function_evaluate_inverse(input_gamma, nd);
+			nd = rs_1d_function_evaluate(output_gamma, nd);
+
+			/* 8 bit output */
+			gint res = (gint) (nd*255.0 + 0.5f);
+			_CLAMP255(res);
+			table->table8[i] = res;
+		}
+		gamma_tables = g_slist_prepend(gamma_tables, table);
+	}
+	g_static_mutex_unlock(&gamma_tables_lock);
+
+	return table->table8;
+}
+
+static void
+transform8_float(gint start, gint end, gpointer _info)
+{
+	FloatInfo *info = _info;
+	RSImage *input = info->input;
+	const RS_MATRIX3 *mat = info->matrix;
+	const guchar *table8 = info->table8;
+	gint o_channels = gdk_pixbuf_get_n_channels(info->output);
+	gint row, x;
+
+	for(row = start; row < end; row++)
+	{
+		const gfloat *ir = RS_IMAGE_GET_ROW(input, R, row);
+		const gfloat *ig = RS_IMAGE_GET_ROW(input, G, row);
+		const gfloat *ib = RS_IMAGE_GET_ROW(input, B, row);
+		guchar *o = GET_PIXBUF_PIXEL(info->output, info->start_x, row);
+
+		for(x = info->start_x; x < info->end_x; x++)
+		{
+			gfloat r = (ir[x] * mat->coeff[0][0] + ig[x] * mat->coeff[0][1] + ib[x] * mat->coeff[0][2]) * 65535.0f;
+			gfloat g = (ir[x] * mat->coeff[1][0] + ig[x] * mat->coeff[1][1] + ib[x] * mat->coeff[1][2]) * 65535.0f;
+			gfloat b = (ir[x] * mat->coeff[2][0] + ig[x] * mat->coeff[2][1] + ib[x] * mat->coeff[2][2]) * 65535.0f;
+
+			o[R] = table8[(gint) (CLAMP(r, 0.0f, 65535.0f) + 0.5f)];
+			o[G] = table8[(gint) (CLAMP(g, 0.0f, 65535.0f) + 0.5f)];
+			o[B] = table8[(gint) (CLAMP(b, 0.0f, 65535.0f) + 0.5f)];
+			o[3] = 255;
+
+			o += o_channels;
+		}
+	}
+}
+
+/* Render a planar float response to 8 bit. Returns NULL if the response
+ * cannot be handled here, previous_response is consumed otherwise */
+static RSFilterResponse *
+get_image8_float(RSColorspaceTransform *colorspace_transform, const RSFilterRequest *request, RSFilterResponse *previous_response, RSColorSpace *output_space)
+{
+	RSFilterResponse *response;
+	RSImage *input;
+	GdkPixbuf *output;
+	GdkRectangle area;
+	GdkRectangle *roi;
+	gint i;
+
+	RSColorSpace *input_space = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(previous_response), "colorspace", RS_TYPE_COLOR_SPACE);
+	if (!input_space || RS_COLOR_SPACE_REQUIRES_CMS(input_space) || !rs_filter_response_has_image_float(previous_response))
+		return NULL;
+
+	input = rs_filter_response_get_image_float(previous_response);
+	if (rs_image_get_number_of_planes(input) < 3)
+	{
+		g_object_unref(input);
+		return NULL;
+	}
+
+	response = rs_filter_response_clone(previous_response);
+	g_object_unref(previous_response);
+
+	for( i = 0; i < 4; i++)
+		colorspace_transform->premul[i] = 1.0f;
+	colorspace_transform->has_premul = FALSE;
+
+	gboolean is_premultiplied = FALSE;
+	rs_filter_param_get_boolean(RS_FILTER_PARAM(response), "is-premultiplied", &is_premultiplied);
+
+	if (!is_premultiplied)
+		colorspace_transform->has_premul = rs_filter_param_get_float4(RS_FILTER_PARAM(request), "premul", colorspace_transform->premul);
+
+	if (colorspace_transform->has_premul)
+		rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "is-premultiplied", TRUE);
+
+	if ((roi = rs_filter_request_get_roi(request)))
+		area = *roi;
+	else
+	{
+		area.x = 0;
+		area.y = 0;
+		area.width = input->width;
+		area.height = input->height;
+	}
+
+	const RS_VECTOR3 vec = {{colorspace_transform->premul[0]},{colorspace_transform->premul[1]},{colorspace_transform->premul[2]}};
+	const RS_MATRIX3 mul_vec = vector3_as_diagonal(&vec);
+	const RS_MATRIX3 a = rs_color_space_get_matrix_from_pcs(input_space);
+	RS_MATRIX3 a_premul;
+	matrix3_multiply(&a, &mul_vec, &a_premul);
+	const RS_MATRIX3 b = rs_color_space_get_matrix_to_pcs(output_space);
+	RS_MATRIX3 mat;
+	matrix3_multiply(&b, &a_premul, &mat);
+
+	const guchar *table8 = get_gamma_table8(rs_color_space_get_gamma_function(input_space),
+		rs_color_space_get_gamma_function(output_space));
+
+	if (roi)
+		output = rs_pixbuf_new_area(TRUE, input->width, input->height, &area);
+	else
+		output = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, input->width, input->height);
+
+	FloatInfo info;
+	info.input = input;
+	info.output = output;
+	info.start_x = area.x;
+	info.end_x = area.x + area.width;
+	info.matrix = &mat;
+	info.table8 = table8;
+	rs_parallel_for_full(area.y, area.y + area.height, 16, rs_filter_request_get_priority(request), transform8_float, &info);
 
 	rs_filter_response_set_image8(response, output);
 	rs_filter_param_set_object(RS_FILTER_PARAM(response), "colorspace", output_space);
@@ -321,11 +580,9 @@ convert_colorspace16(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *in
 	GdkRectangle *roi = _roi;
 	if (!roi) 
 	{
+		/* Only the backed part of a partial image */
 		roi = g_new(GdkRectangle, 1);
-		roi->x = 0;
-		roi->y = 0;
-		roi->width = input_image->w;
-		roi->height = input_image->h;
+		*roi = input_image->area;
 	}
 
 	/* A few sanity checks */
@@ -357,22 +614,26 @@ convert_colorspace16(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *in
 		matrix3_multiply(&a, &mul_vec, &a_premul);
 		const RS_MATRIX3 b = rs_color_space_get_matrix_to_pcs(output_space);
 		RS_MATRIX3 mat;
+		gint y;
 		matrix3_multiply(&b, &a_premul, &mat);
 
-		transform16_c(
-			GET_PIXEL(input_image, 0, 0),
-			GET_PIXEL(output_image, 0, 0),
-			input_image->h * input_image->pitch,
-			input_image->pixelsize,
-			&mat);
+		for(y = roi->y; y < roi->y + roi->height; y++)
+			transform16_c(
+				GET_PIXEL(input_image, roi->x, y),
+				GET_PIXEL(output_image, roi->x, y),
+				roi->width,
+				input_image->pixelsize,
+				&mat);
 	}
+	/* If we created the ROI here, free it */
+	if (!_roi)
+		g_free(roi);
 	return TRUE;
 }
 
-gpointer
-start_single_cs8_transform_thread(gpointer _thread_info)
+static void
+transform8_band(ThreadInfo *t)
 {
-	ThreadInfo* t = _thread_info;
 	RS_IMAGE16 *input_image = t->input; 
 	GdkPixbuf *output = (GdkPixbuf*) t->output;
 	RSColorSpace *input_space = t->input_space;
@@ -389,64 +650,58 @@ start_single_cs8_transform_thread(gpointer _thread_info)
 	if (avx_available && rs_color_space_new_singleton("RSSrgb") == output_space)
 	{
 		transform8_srgb_avx(t);
-		return (NULL);
+		return;
 	}
 	if (avx_available && rs_color_space_new_singleton("RSAdobeRGB") == output_space)
 	{
 		t->output_gamma = 1.0 / 2.19921875;
 		transform8_otherrgb_avx(t);
-		return (NULL);
+		return;
 	}
 	if (avx_available && rs_color_space_new_singleton("RSProphoto") == output_space)
 	{
 		t->output_gamma = 1.0 / 1.8;
 		transform8_otherrgb_avx(t);
-		return (NULL);
+		return;
 	}
 
 	if (sse2_available && rs_color_space_new_singleton("RSSrgb") == output_space)
 	{
 		transform8_srgb_sse2(t);
-		return (NULL);
+		return;
 	}
 	if (sse2_available && rs_color_space_new_singleton("RSAdobeRGB") == output_space)
 	{
 		t->output_gamma = 1.0 / 2.19921875;
 		transform8_otherrgb_sse2(t);
-		return (NULL);
+		return;
 	}
 	if (sse2_available && rs_color_space_new_singleton("RSProphoto") == output_space)
 	{
 		t->output_gamma = 1.0 / 1.8;
 		transform8_otherrgb_sse2(t);
-		return (NULL);
+		return;
 	}
 	
 	/* Fall back to C-functions */
-	/* Calculate our gamma table */
-	const RS1dFunction *input_gamma = rs_color_space_get_gamma_function(input_space);
-	const RS1dFunction *output_gamma = rs_color_space_get_gamma_function(output_space);
-	guchar table8[65536];
-	gint i;
-	for(i=0;i<65536;i++)
-	{
-		gdouble nd = ((gdouble) i) * (1.0/65535.0);
+	t->table8 = (guchar *) get_gamma_table8(rs_color_space_get_gamma_function(input_space),
+		rs_color_space_get_gamma_function(output_space));
+	transform8_c(t);
+}
 
-		nd = rs_1d_function_evaluate_inverse(input_gamma, nd);
-		nd = rs_1d_function_evaluate(output_gamma, nd);
+static void
+transform8_rows(gint start, gint end, gpointer _thread_info)
+{
+	/* transform8_band() sets the gamma of its ThreadInfo, so every chunk gets a copy */
+	ThreadInfo t = *(ThreadInfo *) _thread_info;
 
-		/* 8 bit output */
-		gint res = (gint) (nd*255.0 + 0.5f);
-		_CLAMP255(res);
-		table8[i] = res;
-	}
-	t->table8 = table8;
-	transform8_c(t);
-	return (NULL);
+	t.start_y = start;
+	t.end_y = end;
+	transform8_band(&t);
 }
 
 static void
-convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *input_image, GdkPixbuf *output_image, RSColorSpace *input_space, RSColorSpace *output_space, GdkRectangle *_roi)
+convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *input_image, GdkPixbuf *output_image, RSColorSpace *input_space, RSColorSpace *output_space, GdkRectangle *_roi, RSParallelPriority priority)
 {
 	g_assert(RS_IS_IMAGE16(input_image));
 	g_assert(GDK_IS_PIXBUF(output_image));
@@ -495,45 +750,23 @@ convert_colorspace8(RSColorspaceTransform *colorspace_transform, RS_IMAGE16 *inp
 		matrix3_multiply(&b, &a_premul, &mat);
 
 
-		gint i;
-		guint y_offset, y_per_thread, threaded_h;
-		guint threads = rs_get_number_of_processor_cores();
-		if (roi->height * roi->width < 200*200)
-			threads = 1;
-		
-		ThreadInfo *t = g_new(ThreadInfo, threads);
-
-		threaded_h = roi->height;
-		y_per_thread = (threaded_h + threads-1)/threads;
-		y_offset = roi->y;
-
-		for (i = 0; i < threads; i++)
-		{
-			t[i].input = input_image;
-			t[i].output = output_image;
-			t[i].start_y = y_offset;
-			t[i].start_x = roi->x;
-			t[i].end_x = roi->x + roi->width;
-			t[i].cst = colorspace_transform;
-			t[i].input_space = input_space;
-			t[i].output_space = output_space;
-			y_offset += y_per_thread;
-			y_offset = MIN(input_image->h, y_offset);
-			t[i].end_y = y_offset;
-			t[i].matrix = &mat;
-			t[i].table8 = NULL;
-			t[i].single_thread = (threads == 1);
-			if (threads == 1)
-				start_single_cs8_transform_thread(&t[0]);
-			else
-				t[i].threadid = g_thread_create(start_single_cs8_transform_thread, &t[i], TRUE, NULL);
-		}
+		ThreadInfo t;
 
-		/* Wait for threads to finish */
-		for(i = 0; threads > 1 && i < threads; i++)
-			g_thread_join(t[i].threadid);
+		t.input = input_image;
+		t.output = output_image;
+		t.start_x = roi->x;
+		t.end_x = roi->x + roi->width;
+		t.cst = colorspace_transform;
+		t.input_space = input_space;
+		t.output_space = output_space;
+		t.matrix = &mat;
+		t.table8 = NULL;
 
-		g_free(t);
+		/* Rows are handed out in chunks, so threads finishing early take over */
+		if (roi->height * roi->width < 200*200)
+			transform8_rows(roi->y, roi->y + roi->height, &t);
+		else
+			rs_parallel_for_full(roi->y, roi->y + roi->height, 16, priority, transform8_rows, &t);
 	}
 	/* If we created the ROI here, free it */
 	if (!_roi) 
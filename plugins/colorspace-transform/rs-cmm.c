@@ -65,9 +65,6 @@ static GMutex *is_profile_gamma_22_corrected_linear_lock = NULL;
 
 typedef struct {
 	RSCmm *cmm;
-	GThread *threadid;
-	gint start_y;
-	gint end_y;
 	gint start_x;
 	gint end_x;
 	RS_IMAGE16 *input;
@@ -265,34 +262,27 @@ rs_cmm_transform8(RSCmm *cmm, RS_IMAGE16 *input, GdkPixbuf *output, gint start_x
 	}
 }
 
-gpointer
-start_single_transform_thread(gpointer _thread_info)
+static void
+transform_rows(gint start_y, gint end_y, gpointer _thread_info)
 {
 	ThreadInfo* t = _thread_info;
 
 	if (t->sixteen16)
 	{
-		rs_cmm_transform16(t->cmm, t->input, t->output, t->start_x, t->end_x, t->start_y, t->end_y);
+		rs_cmm_transform16(t->cmm, t->input, t->output, t->start_x, t->end_x, start_y, end_y);
 	}
 	else /* 16 -> 8 bit */
 	{
-		rs_cmm_transform8(t->cmm, t->input, t->output, t->start_x, t->end_x, t->start_y, t->end_y);
+		rs_cmm_transform8(t->cmm, t->input, t->output, t->start_x, t->end_x, start_y, end_y);
 	}
-	return NULL;
 }
 
 void
 rs_cmm_transform(RSCmm *cmm, RS_IMAGE16 *input, void *output, gboolean sixteen_to_16)
 {
-	gint i;
-	guint y_offset, y_per_thread, threaded_h;
-	gint threads = cmm->num_threads;
-	ThreadInfo *t = g_new(ThreadInfo, threads);
-
+	ThreadInfo t;
 	const GdkRectangle *roi = cmm->roi;
-	threaded_h = roi->height;
-	y_per_thread = (threaded_h + threads-1)/threads;
-	y_offset = roi->y;
+	gint end_y = MIN(input->h, roi->y + roi->height);
 
 	if (sixteen_to_16)
 	{
@@ -305,27 +295,17 @@ rs_cmm_transform(RSCmm *cmm, RS_IMAGE16 *input, void *output, gboolean sixteen_t
 			prepare8(cmm);
 	}
 
-	for (i = 0; i < threads; i++)
-	{
-		t[i].cmm = cmm;
-		t[i].sixteen16 = sixteen_to_16;
-		t[i].input = input;
-		t[i].output = output;
-		t[i].start_y = y_offset;
-		t[i].start_x = roi->x;
-		t[i].end_x = roi->x + roi->width;
-		y_offset += y_per_thread;
-		y_offset = MIN(input->h, y_offset);
-		t[i].end_y = y_offset;
-
-		t[i].threadid = g_thread_create(start_single_transform_thread, &t[i], TRUE, NULL);
-	}
-
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	t.cmm = cmm;
+	t.sixteen16 = sixteen_to_16;
+	t.input = input;
+	t.output = output;
+	t.start_x = roi->x;
+	t.end_x = roi->x + roi->width;
 
-	g_free(t);
+	if (cmm->num_threads > 1)
+		rs_parallel_for(roi->y, end_y, 0, transform_rows, &t);
+	else
+		transform_rows(roi->y, end_y, &t);
 }
 
 static void
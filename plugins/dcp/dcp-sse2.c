@@ -1003,6 +1003,63 @@ render_SSE2(ThreadInfo* t)
 #undef SETFLOAT4
 #undef SETFLOAT4_SAME
 
+/* Apply the baked 3D LUT, one pixel at a time with R, G and B in parallel */
+gboolean
+render_lut_SSE2(ThreadInfo* t)
+{
+	RS_IMAGE16 *image = t->tmp;
+	const gfloat *lut = t->dcp->lut;
+	const gint n = DCP_LUT_SIZE;
+	gint x, y, o1, o2;
+	gint idx[4] __attribute__ ((aligned (16)));
+	gfloat frac[4] __attribute__ ((aligned (16)));
+	gfloat w[3];
+
+	__m128 inv_16_bit = _mm_set1_ps(1.0f / 65535.0f);
+	__m128 lut_scale = _mm_set1_ps((gfloat) (n - 1));
+	__m128 max_index = _mm_set1_ps((gfloat) (n - 2));
+	__m128 out_scale = _mm_set1_ps(65535.0f);
+	__m128 zero_ps = _mm_setzero_ps();
+	__m128i zero = _mm_setzero_si128();
+	__m128i sub_32 = _mm_set1_epi32(32768);
+	__m128i signxor = _mm_set1_epi16((gshort) 0x8000);
+
+	for(y = t->start_y ; y < t->end_y; y++)
+	{
+		gushort *pixel = GET_PIXEL(image, t->start_x, y);
+		for(x = t->start_x; x < image->w; x++)
+		{
+			/* Index in gamma 2.0 */
+			__m128i p = _mm_loadl_epi64((__m128i*) pixel);
+			__m128 u = _mm_cvtepi32_ps(_mm_unpacklo_epi16(p, zero));
+			u = _mm_mul_ps(_mm_sqrt_ps(_mm_mul_ps(u, inv_16_bit)), lut_scale);
+			__m128 i_f = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(u)), max_index);
+			_mm_store_ps(frac, _mm_sub_ps(u, i_f));
+			_mm_store_si128((__m128i*) idx, _mm_cvttps_epi32(i_f));
+
+			dcp_lut_tetrahedron(frac, &o1, &o2, w);
+
+			const gfloat *c0 = &lut[((idx[0] * n + idx[1]) * n + idx[2]) * 4];
+			__m128 v0 = _mm_load_ps(c0);
+			__m128 v1 = _mm_load_ps(c0 + o1);
+			__m128 v2 = _mm_load_ps(c0 + o1 + o2);
+			__m128 v3 = _mm_load_ps(c0 + (n * n + n + 1) * 4);
+
+			__m128 out = _mm_add_ps(v0, _mm_mul_ps(_mm_set1_ps(w[0]), _mm_sub_ps(v1, v0)));
+			out = _mm_add_ps(out, _mm_mul_ps(_mm_set1_ps(w[1]), _mm_sub_ps(v2, v1)));
+			out = _mm_add_ps(out, _mm_mul_ps(_mm_set1_ps(w[2]), _mm_sub_ps(v3, v2)));
+
+			/* Convert to 16 bit, truncating like the C version */
+			out = _mm_min_ps(_mm_max_ps(_mm_mul_ps(out, out_scale), zero_ps), out_scale);
+			__m128i out_i = _mm_sub_epi32(_mm_cvttps_epi32(out), sub_32);
+			out_i = _mm_xor_si128(_mm_packs_epi32(out_i, out_i), signxor);
+			_mm_storel_epi64((__m128i*) pixel, out_i);
+			pixel += 4;
+		}
+	}
+	return TRUE;
+}
+
 #else // if not __SSE2__
 
 gboolean
@@ -1011,6 +1068,12 @@ render_SSE2(ThreadInfo* t)
 	return FALSE;
 }
 
+gboolean
+render_lut_SSE2(ThreadInfo* t)
+{
+	return FALSE;
+}
+
 void
 calc_hsm_constants(const RSHuesatMap *map, PrecalcHSM* table)  
 {
@@ -33,20 +33,26 @@ enum {
 	PROP_SETTINGS,
 	PROP_PROFILE,
 	PROP_USE_PROFILE,
-	PROP_READ_OUT_CURVE
+	PROP_READ_OUT_CURVE,
+	PROP_USE_LUT
 };
 
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterResponse *get_image_float(RSFilter *filter, const RSFilterRequest *request);
 static void settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp);
 static void settings_weak_notify(gpointer data, GObject *where_the_object_was);
 static RS_xy_COORD neutral_to_xy(RSDcp *dcp, const RS_VECTOR3 *neutral);
 static RS_MATRIX3 find_xyz_to_camera(RSDcp *dcp, const RS_xy_COORD *white_xy, RS_MATRIX3 *forward_matrix);
 static void set_white_xy(RSDcp *dcp, const RS_xy_COORD *xy);
 static void precalc(RSDcp *dcp);
-static void pre_cache_tables(RSDcp *dcp);
+static void pre_cache_tables(RSDcp *dcp, gboolean simd);
 static void render(ThreadInfo* t);
+static void render_float(ThreadInfo* t);
+static void bake_lut(RSDcp *dcp);
+static void render_lut(ThreadInfo* t);
+static void render_lut_float(ThreadInfo* t);
 static void read_profile(RSDcp *dcp, RSDcpFile *dcp_file);
 static void free_dcp_profile(RSDcp *dcp);
 static void set_prophoto_wb(RSDcp *dcp, gfloat warmth, gfloat tint);
@@ -66,6 +72,9 @@ finalize(GObject *object)
 
 	if (dcp->curve_samples)
 		free(dcp->curve_samples);
+	if (dcp->lut)
+		free(dcp->lut);
+	g_free(dcp->curve_knots);
 	g_free(dcp->_huesatmap_precalc_unaligned);
 	g_free(dcp->_looktable_precalc_unaligned);
 
@@ -115,8 +124,15 @@ rs_dcp_class_init(RSDcpClass *klass)
 			RS_CURVE_TYPE_WIDGET, G_PARAM_READWRITE)
 	);
 
+	g_object_class_install_property(object_class,
+		PROP_USE_LUT, g_param_spec_boolean(
+			"use-lut", "use-lut", "Bake the complete transform into a 3D LUT, faster for many photos with identical settings",
+			FALSE, G_PARAM_READWRITE)
+	);
+
 	filter_class->name = "Adobe DNG camera profile filter";
 	filter_class->get_image = get_image;
+	filter_class->get_image_float = get_image_float;
 }
 
 static void
@@ -124,29 +140,38 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp)
 {
 	gboolean changed = FALSE;
 
+	/* Only flag a change - and rebuild tables - if a value actually differs,
+	 * setting the same values again happens a lot when switching photos */
+#define UPDATE(field, value) do { \
+	if ((field) != (value)) { (field) = (value); changed = TRUE; } \
+} while (0)
+
 	if (mask & MASK_EXPOSURE)
 	{
-		g_object_get(settings, "exposure", &dcp->exposure, NULL);
-		changed = TRUE;
+		gfloat exposure;
+		g_object_get(settings, "exposure", &exposure, NULL);
+		UPDATE(dcp->exposure, exposure);
 	}
 
 	if (mask & MASK_SATURATION)
 	{
-		g_object_get(settings, "saturation", &dcp->saturation, NULL);
-		changed = TRUE;
+		gfloat saturation;
+		g_object_get(settings, "saturation", &saturation, NULL);
+		UPDATE(dcp->saturation, saturation);
 	}
 	
 	if (mask & MASK_CONTRAST)
 	{
-		g_object_get(settings, "contrast", &dcp->contrast, NULL);
-		changed = TRUE;
+		gfloat contrast;
+		g_object_get(settings, "contrast", &contrast, NULL);
+		UPDATE(dcp->contrast, contrast);
 	}
 
 	if (mask & MASK_HUE)
 	{
-		g_object_get(settings, "hue", &dcp->hue, NULL);
-		dcp->hue /= 60.0;
-		changed = TRUE;
+		gfloat hue;
+		g_object_get(settings, "hue", &hue, NULL);
+		UPDATE(dcp->hue, (gfloat) (hue / 60.0));
 	}
 
 	if (mask & MASK_CHANNELMIXER)
@@ -159,23 +184,22 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp)
 			"channelmixer_green", &channelmixer_green,
 			"channelmixer_blue", &channelmixer_blue,
 			NULL);
-		dcp->channelmixer_red = channelmixer_red / 100.0f;
-		dcp->channelmixer_green = channelmixer_green / 100.0f;
-		dcp->channelmixer_blue = channelmixer_blue / 100.0f;
-		changed = TRUE;
+		UPDATE(dcp->channelmixer_red, channelmixer_red / 100.0f);
+		UPDATE(dcp->channelmixer_green, channelmixer_green / 100.0f);
+		UPDATE(dcp->channelmixer_blue, channelmixer_blue / 100.0f);
 	}
 
 	if (mask & MASK_WB)
 	{
-		dcp->warmth = -1.0;
-		dcp->tint = -1.0;
+		gfloat warmth = -1.0;
+		gfloat tint = -1.0;
 		gfloat premul_warmth = -1.0;
 		gfloat pre_mul_tint = -1.0;
 		gboolean recalc = FALSE;
 
 		g_object_get(settings,
-			"dcp-temp", &dcp->warmth,
-			"dcp-tint", &dcp->tint,
+			"dcp-temp", &warmth,
+			"dcp-tint", &tint,
 			"warmth", &premul_warmth,
 			"tint", &pre_mul_tint,
 			"recalc-temp", &recalc,
@@ -184,9 +208,9 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp)
 		RS_xy_COORD whitepoint;
 		RS_VECTOR3 neutral;
 		/* This is messy, but we're essentially converting from warmth/tint to cameraneutral */
-		dcp->pre_mul.x = (1.0+premul_warmth)*(2.0-pre_mul_tint);
-		dcp->pre_mul.y = 1.0;
-		dcp->pre_mul.z = (1.0-premul_warmth)*(2.0-pre_mul_tint);
+		UPDATE(dcp->pre_mul.x, (gfloat) ((1.0+premul_warmth)*(2.0-pre_mul_tint)));
+		UPDATE(dcp->pre_mul.y, 1.0f);
+		UPDATE(dcp->pre_mul.z, (gfloat) ((1.0-premul_warmth)*(2.0-pre_mul_tint)));
 
 		if (recalc)
 		{
@@ -201,41 +225,65 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp)
 
 			if (dcp->use_profile)
 			{
-				rs_color_whitepoint_to_temp(&whitepoint, &dcp->warmth, &dcp->tint);
+				rs_color_whitepoint_to_temp(&whitepoint, &warmth, &tint);
 			} else {
-				dcp->warmth = 5000;
-				dcp->tint = 0;
+				warmth = 5000;
+				tint = 0;
 			}
-			dcp->warmth = CLAMP(dcp->warmth, 2000, 12000);
-			dcp->tint = CLAMP(dcp->tint, -150, 150);
+			warmth = CLAMP(warmth, 2000, 12000);
+			tint = CLAMP(tint, -150, 150);
 			g_object_set(settings,
-				"dcp-temp", dcp->warmth,
-				"dcp-tint", dcp->tint,
+				"dcp-temp", warmth,
+				"dcp-tint", tint,
 				"recalc-temp", FALSE,
 				NULL);
 			g_signal_emit_by_name(settings, "wb-recalculated");
 		}
-		if (dcp->use_profile)
-		{
-			whitepoint = rs_color_temp_to_whitepoint(dcp->warmth, dcp->tint);
-			set_white_xy(dcp, &whitepoint);
-			precalc(dcp);
-		}
-		else
+
+		/* The color matrices and huesat tables only depend on temperature and tint */
+		if (!dcp->wb_valid || warmth != dcp->warmth || tint != dcp->tint)
 		{
-			set_prophoto_wb(dcp, dcp->warmth, dcp->tint);
+			g_static_rec_mutex_lock(&dcp_mutex);
+			dcp->warmth = warmth;
+			dcp->tint = tint;
+			if (dcp->use_profile)
+			{
+				whitepoint = rs_color_temp_to_whitepoint(dcp->warmth, dcp->tint);
+				set_white_xy(dcp, &whitepoint);
+				precalc(dcp);
+			}
+			else
+			{
+				set_prophoto_wb(dcp, dcp->warmth, dcp->tint);
+			}
+			dcp->wb_valid = TRUE;
+			g_static_rec_mutex_unlock(&dcp_mutex);
+			changed = TRUE;
 		}
-		changed = TRUE;
 	}
 
 	if (mask & MASK_CURVE)
 	{
 		const gint nknots = rs_settings_get_curve_nknots(settings);
+		gfloat *knots = (nknots > 1) ? rs_settings_get_curve_knots(settings) : NULL;
 		gint i;
 
-		if (nknots > 1)
+		/* Resampling the curve is expensive, only do it for new knots */
+		if (knots && nknots == dcp->nknots && dcp->curve_knots
+			&& memcmp(knots, dcp->curve_knots, sizeof(gfloat) * 2 * nknots) == 0)
+		{
+			g_free(knots);
+		}
+		else if (!knots && dcp->curve_is_flat)
 		{
-			gfloat *knots = rs_settings_get_curve_knots(settings);
+			/* Still flat */
+		}
+		else
+		{
+			g_static_rec_mutex_lock(&dcp_mutex);
+			g_free(dcp->curve_knots);
+			dcp->curve_knots = NULL;
+
 			if (knots)
 			{
 				dcp->nknots = nknots;
@@ -276,21 +324,24 @@ settings_changed(RSSettings *settings, RSSettingsMask mask, RSDcp *dcp)
 					}
 					dcp->curve_samples[256*2-1] = dcp->curve_samples[256*2] = dcp->curve_samples[256*2+1] = dcp->curve_samples[255*2];
 				}
+				/* Keep the knots to compare against next time */
+				dcp->curve_knots = knots;
 			}
-			if (knots)
-				g_free(knots);
-		}
-		else
-			dcp->curve_is_flat = TRUE;
+			else
+				dcp->curve_is_flat = TRUE;
 
-		for(i=0;i<257*2;i++)
-			dcp->curve_samples[i] = MIN(1.0f, MAX(0.0f, dcp->curve_samples[i]));
+			for(i=0;i<257*2;i++)
+				dcp->curve_samples[i] = MIN(1.0f, MAX(0.0f, dcp->curve_samples[i]));
+			g_static_rec_mutex_unlock(&dcp_mutex);
 
-		changed = TRUE;
+			changed = TRUE;
+		}
 	}
+#undef UPDATE
 
 	if (changed)
 	{
+		dcp->lut_valid = FALSE;
 		rs_filter_changed(RS_FILTER(dcp), RS_FILTER_CHANGED_PIXELDATA);
 	}
 }
@@ -311,6 +362,9 @@ free_dcp_profile(RSDcp *dcp)
 		g_object_unref(dcp->huesatmap2);
 	if (dcp->tone_curve_lut)
 		free(dcp->tone_curve_lut);
+	if (dcp->dcp_file)
+		g_object_unref(dcp->dcp_file);
+	dcp->dcp_file = NULL;
 	dcp->huesatmap1 = NULL;
 	dcp->huesatmap2 = NULL;
 	dcp->huesatmap_interpolated = NULL;
@@ -329,6 +383,9 @@ free_dcp_profile(RSDcp *dcp)
 		free(dcp->looktable_precalc->lookups);
 		dcp->looktable_precalc->lookups = NULL;
 	}
+	dcp->huesatmap_precalc_valid = FALSE;
+	dcp->looktable_precalc_valid = FALSE;
+	dcp->wb_valid = FALSE;
 	dcp->temp1 = dcp->temp2 = 0;
 	dcp->has_color_matrix1 = dcp->has_color_matrix2 = dcp->has_forward_matrix1 = dcp->has_forward_matrix2 = FALSE;
 	
@@ -405,6 +462,9 @@ get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspe
 		case PROP_READ_OUT_CURVE:
 			g_value_set_object(value, dcp->read_out_curve);
 			break;
+		case PROP_USE_LUT:
+			g_value_set_boolean(value, dcp->use_lut);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -438,8 +498,13 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 			break;
 		case PROP_PROFILE:
 			g_static_rec_mutex_lock(&dcp_mutex);
-			read_profile(dcp, g_value_get_object(value));
-			changed = TRUE;
+			/* Photos sharing a profile can keep all tables read from it */
+			temp = g_value_get_object(value);
+			if (!dcp->use_profile || temp != (gpointer) dcp->dcp_file)
+			{
+				read_profile(dcp, temp);
+				changed = TRUE;
+			}
 			g_static_rec_mutex_unlock(&dcp_mutex);
 			break;
 		case PROP_READ_OUT_CURVE:
@@ -451,18 +516,29 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 		case PROP_USE_PROFILE:
 			g_static_rec_mutex_lock(&dcp_mutex);
 			dcp->use_profile = g_value_get_boolean(value);
+			dcp->wb_valid = FALSE;
+			dcp->lut_valid = FALSE;
 			if (!dcp->use_profile)
 				free_dcp_profile(dcp);
 			else
 				precalc(dcp);
 			g_static_rec_mutex_unlock(&dcp_mutex);
 			break;
+		case PROP_USE_LUT:
+			/* Output is not identical, so this is a change */
+			if (dcp->use_lut != g_value_get_boolean(value))
+				changed = TRUE;
+			dcp->use_lut = g_value_get_boolean(value);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
 
 	if (changed)
+	{
+		dcp->lut_valid = FALSE;
 		rs_filter_changed(filter, RS_FILTER_CHANGED_PIXELDATA);
+	}
 }
 
 static void
@@ -473,14 +549,29 @@ settings_weak_notify(gpointer data, GObject *where_the_object_was)
 }
 
 
-gpointer
-start_single_dcp_thread(gpointer _thread_info)
+static void
+render_band(ThreadInfo *t)
 {
-	ThreadInfo* t = _thread_info;
 	RS_IMAGE16 *tmp = t->tmp;
 
-	pre_cache_tables(t->dcp);
-	if (tmp->pixelsize == 4  && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && !t->dcp->read_out_curve)
+	/* Everything is baked into the LUT, no other tables are needed */
+	if (t->dcp->use_lut && t->dcp->lut_valid && !t->dcp->read_out_curve)
+	{
+		if (t->tmp_float)
+			render_lut_float(t);
+		else if (!(tmp->pixelsize == 4 && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && render_lut_SSE2(t)))
+			render_lut(t);
+		return;
+	}
+
+	/* There is no SIMD version for planar float yet */
+	gboolean simd = !t->tmp_float && tmp->pixelsize == 4  && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && !t->dcp->read_out_curve;
+
+	pre_cache_tables(t->dcp, simd);
+
+	if (t->tmp_float)
+		render_float(t);
+	else if (simd)
 	{
 		if ((rs_detect_cpu_features() & RS_CPU_FLAG_AVX) && render_AVX(t))
 		{
@@ -518,11 +609,16 @@ start_single_dcp_thread(gpointer _thread_info)
 	}
 	else
 		render(t);
+}
 
-	if (!t->single_thread)
-		g_thread_exit(NULL);
+static void
+render_bands(gint start, gint end, gpointer _thread_info)
+{
+	ThreadInfo* t = _thread_info;
+	gint i;
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+	for(i = start; i < end; i++)
+		render_band(&t[i]);
 }
 
 static inline void 
@@ -543,6 +639,74 @@ bit_blt(char* dstp, int dst_pitch, const char* srcp, int src_pitch, int row_size
 	}
 }
 
+/* Approximate number of pixels in each tile handed to the worker pool */
+#define TILE_PIXELS (64*1024)
+
+/* Render a 16 bit image or the area of a planar float image in place */
+static void
+render_image(RSDcp *dcp, RS_IMAGE16 *tmp, RSImage *tmp_float, const GdkRectangle *area, RSParallelPriority priority)
+{
+	guint i, j, tiles;
+	gint x1 = 0, x2 = 0, y1 = 0, y2, width, tile_h;
+
+	if (tmp_float)
+	{
+		x1 = area->x;
+		x2 = area->x + area->width;
+		y1 = area->y;
+		y2 = area->y + area->height;
+	}
+	else
+		y2 = tmp->h;
+
+	/* Split in small row tiles, so cores finishing early can pick up the
+	 * remaining work - the cost per pixel varies a lot across the image */
+	width = (tmp_float) ? (x2 - x1) : tmp->w;
+	tile_h = MAX(1, TILE_PIXELS / MAX(1, width));
+	if ((y2 - y1) * width < 200*200)
+		tile_h = MAX(1, y2 - y1);
+	tiles = (MAX(0, y2 - y1) + tile_h - 1) / tile_h;
+
+	g_static_rec_mutex_lock(&dcp_mutex);
+	init_exposure(dcp);
+
+	/* The histogram needs the values before the curve, so it can't use the LUT */
+	if (dcp->use_lut && !dcp->lut_valid && !dcp->read_out_curve)
+		bake_lut(dcp);
+
+	/* Histogram counts are kept per tile, so tiles can run on any thread */
+	ThreadInfo *t = g_new0(ThreadInfo, tiles);
+
+	for (i = 0; i < tiles; i++)
+	{
+		t[i].tmp = tmp;
+		t[i].tmp_float = tmp_float;
+		t[i].start_y = y1 + i * tile_h;
+		t[i].end_y = MIN(y2, t[i].start_y + tile_h);
+		t[i].start_x = x1;
+		t[i].end_x = x2;
+		t[i].dcp = dcp;
+	}
+
+	/* Tiles are pulled one at a time from the shared worker pool */
+	rs_parallel_for_full(0, tiles, 1, priority, render_bands, t);
+
+	/* Settings can change now */
+	g_static_rec_mutex_unlock(&dcp_mutex);
+
+	/* If we must deliver histogram data, do it now */
+	if (dcp->read_out_curve)
+	{
+		gint *values = g_malloc0(256*sizeof(gint));
+		for(i = 0; i < tiles; i++)
+			for(j = 0; j < 256; j++)
+				values[j] += t[i].curve_input_values[j];
+		rs_curve_set_histogram_data(RS_CURVE_WIDGET(dcp->read_out_curve), values);
+		g_free(values);
+	}
+	g_free(t);
+}
+
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
 {
@@ -555,8 +719,6 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *output;
 	RS_IMAGE16 *tmp;
 
-	gint j;
-
 	RSFilterRequest *request_clone = rs_filter_request_clone(request);
 
 	if (!dcp->use_profile)
@@ -586,7 +748,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		roi->width += (roi->x&1);
 		roi->x -= (roi->x&1);
 		roi->width = MIN(input->w - roi->x, roi->width);
-		output = rs_image16_copy(input, FALSE);
+		output = rs_image16_new_area(input->w, input->h, input->channels, input->pixelsize, roi);
 		tmp = rs_image16_new_subframe(output, roi);
 		bit_blt((char*)GET_PIXEL(tmp,0,0), tmp->rowstride * 2, 
 			(const char*)GET_PIXEL(input,roi->x,roi->y), input->rowstride * 2, tmp->w * tmp->pixelsize * 2, tmp->h);
@@ -600,57 +762,72 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	rs_filter_response_set_image(response, output);
 	g_object_unref(output);
 
-	g_static_rec_mutex_lock(&dcp_mutex);
-	init_exposure(dcp);
+	render_image(dcp, tmp, NULL, NULL, rs_filter_request_get_priority(request));
+	g_object_unref(tmp);
 
-	guint i, y_offset, y_per_thread, threaded_h;
-	guint threads = rs_get_number_of_processor_cores();
-	if (tmp->h * tmp->w < 200*200)
-		threads = 1;
+	return response;
+}
 
-	ThreadInfo *t = g_new(ThreadInfo, threads);
+static RSFilterResponse *
+get_image_float(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSDcp *dcp = RS_DCP(filter);
+	RSDcpClass *klass = RS_DCP_GET_CLASS(dcp);
+	GdkRectangle *roi;
+	GdkRectangle area;
+	RSFilterResponse *previous_response;
+	RSFilterResponse *response;
+	RSImage *input;
+	RSImage *output;
 
-	threaded_h = tmp->h;
-	y_per_thread = (threaded_h + threads-1)/threads;
-	y_offset = 0;
+	RSFilterRequest *request_clone = rs_filter_request_clone(request);
 
-	for (i = 0; i < threads; i++)
+	if (!dcp->use_profile)
 	{
-		t[i].tmp = tmp;
-		t[i].start_y = y_offset;
-		t[i].start_x = 0;
-		t[i].dcp = dcp;
-		y_offset += y_per_thread;
-		y_offset = MIN(tmp->h, y_offset);
-		t[i].end_y = y_offset;
-		for(j = 0; j < 256; j++)
-			t[i].curve_input_values[j] = 0;
-		t[i].single_thread = (threads == 1);
-		if (threads == 1)
-			start_single_dcp_thread(&t[0]);
-		else	
-			t[i].threadid = g_thread_create(start_single_dcp_thread, &t[i], TRUE, NULL);
-	}
-
-	/* Wait for threads to finish */
-	for(i = 0; threads > 1 && i < threads; i++)
-		g_thread_join(t[i].threadid);
+		gfloat premul[4] = {dcp->pre_mul.x, dcp->pre_mul.y, dcp->pre_mul.z, 1.0};
+		rs_filter_param_set_float4(RS_FILTER_PARAM(request_clone), "premul", premul);
+	}
 
-	/* Settings can change now */
-	g_static_rec_mutex_unlock(&dcp_mutex);
+	rs_filter_param_set_object(RS_FILTER_PARAM(request_clone), "colorspace", klass->prophoto);
+	previous_response = rs_filter_get_image_float(filter->previous, request_clone);
+	g_object_unref(request_clone);
 
-	/* If we must deliver histogram data, do it now */
-	if (dcp->read_out_curve)
+	input = rs_filter_response_get_image_float(previous_response);
+	if (!input)
+		return previous_response;
+
+	if (input->number_of_planes < 3)
 	{
-		gint *values = g_malloc0(256*sizeof(gint));
-		for(i = 0; i < threads; i++)
-			for(j = 0; j < 256; j++)
-				values[j] += t[i].curve_input_values[j];
-		rs_curve_set_histogram_data(RS_CURVE_WIDGET(dcp->read_out_curve), values);
-		g_free(values);
+		g_object_unref(input);
+		return previous_response;
 	}
-	g_free(t);
-	g_object_unref(tmp);
+
+	response = rs_filter_response_clone(previous_response);
+	rs_filter_param_set_object(RS_FILTER_PARAM(response), "colorspace", klass->prophoto);
+	g_object_unref(previous_response);
+
+	if ((roi = rs_filter_request_get_roi(request)))
+		area = *roi;
+	else
+	{
+		area.x = 0;
+		area.y = 0;
+		area.width = input->width;
+		area.height = input->height;
+	}
+
+	/* Render into a copy of the area, the input may be cached upstream */
+	if (roi)
+		output = rs_image_new_area(input->width, input->height, input->number_of_planes, &area);
+	else
+		output = rs_image_new(input->width, input->height, input->number_of_planes);
+	rs_image_copy_area(input, area.x, area.y, area.width, area.height, output, area.x, area.y);
+	g_object_unref(input);
+
+	render_image(dcp, NULL, output, &area, rs_filter_request_get_priority(request));
+
+	rs_filter_response_set_image_float(response, output);
+	g_object_unref(output);
 
 	return response;
 }
@@ -1034,8 +1211,10 @@ rgb_tone(gfloat *_r, gfloat *_g, gfloat *_b, const gfloat * const tone_lut)
 
 }
 
+/* Only the tables used by the selected render path are touched, SIMD
+ * versions use the precalculated huesat tables, C uses the maps directly */
 static void 
-pre_cache_tables(RSDcp *dcp)
+pre_cache_tables(RSDcp *dcp, gboolean simd)
 {
 	int i;
 	gfloat unused = 0;
@@ -1054,7 +1233,7 @@ pre_cache_tables(RSDcp *dcp)
 			unused = dcp->tone_curve_lut[i];
 	}
 
-	if (dcp->huesatmap_precalc->lookups || dcp->looktable_precalc->lookups)
+	if (simd && (dcp->huesatmap_precalc->lookups || dcp->looktable_precalc->lookups))
 	{
 		if (dcp->huesatmap_precalc->lookups)
 		{
@@ -1097,29 +1276,169 @@ pre_cache_tables(RSDcp *dcp)
 	dcp->junk_value = unused;
 }
 
+/* Constants used by render_pixel(), these only depend on settings */
+typedef struct {
+	gboolean do_contrast;
+	gboolean do_highrec;
+	gfloat contr_base;
+	gfloat recover_radius;
+	gfloat inv_recover_radius;
+	RS_VECTOR3 clip;
+} RenderParams;
+
+static void
+render_params(RSDcp *dcp, RenderParams *p)
+{
+	float exposure_simple = MAX(1.0, powf(2.0f, dcp->exposure));
+
+	p->do_contrast = (dcp->contrast > 1.001f);
+	p->do_highrec = (dcp->contrast < 0.999f);
+	p->contr_base = 0.5;
+	p->recover_radius = 0.5 * exposure_simple;
+	p->inv_recover_radius = 1.0f / p->recover_radius;
+	p->recover_radius = 1.0 - p->recover_radius;
+
+	p->clip.R = dcp->camera_white.R;
+	p->clip.G = dcp->camera_white.G;
+	p->clip.B = dcp->camera_white.B;
+}
+
+/* Render a single pixel, input and output is linear camera RGB/ProPhoto in the
+   range 0.0 - 1.0 */
+static inline void
+render_pixel(ThreadInfo* t, const RenderParams *p, gfloat *_r, gfloat *_g, gfloat *_b)
+{
+	RSDcp *dcp = t->dcp;
+	gfloat h, s, v;
+	gfloat r = *_r, g = *_g, b = *_b;
+	RS_VECTOR3 pix;
+
+	if (dcp->use_profile)
+	{
+		r = MIN(p->clip.R, r);
+		g = MIN(p->clip.G, g);
+		b = MIN(p->clip.B, b);
+	}
+
+	pix.R = r;
+	pix.G = g;
+	pix.B = b;
+	pix = vector3_multiply_matrix(&pix, &dcp->camera_to_prophoto);
+		
+	r = pix.R;
+	g = pix.G;
+	b = pix.B;
+
+	r = CLAMP(r * dcp->channelmixer_red, 0.0, 1.0);
+	g = CLAMP(g * dcp->channelmixer_green, 0.0, 1.0);
+	b = CLAMP(b * dcp->channelmixer_blue, 0.0, 1.0);
+
+	/* To HSV */
+	RGBtoHSV(r, g, b, &h, &s, &v);
+
+	if (dcp->huesatmap)
+		huesat_map(dcp->huesatmap, &h, &s, &v);
+
+	/* Saturation */
+	if (dcp->saturation > 1.0)
+	{
+		/* Apply curved saturation, when we add saturation */
+		float sat_val = dcp->saturation - 1.0f;
+		
+		s = (sat_val * (s * 2.0f - (s * s))) + ((1.0f - sat_val) * s);
+		s = MIN(s, 1.0);
+	}
+	else
+	{
+		s *= dcp->saturation;
+		s = MIN(s, 1.0);
+	}
+
+	/* Hue */
+	h += dcp->hue;
+
+	/* Back to RGB */
+	HSVtoRGB(h, s, v, &r, &g, &b);
+	
+	/* Exposure Compensation */
+	r = exposure_ramp(dcp, r);
+	g = exposure_ramp(dcp, g);
+	b = exposure_ramp(dcp, b);
+	
+	/* Contrast in gamma 2.0 */
+	if (p->do_contrast)
+	{
+		r = MAX((sqrtf(r) - p->contr_base) * dcp->contrast + p->contr_base, 0.0f);
+		r *= r;
+		g = MAX((sqrtf(g) - p->contr_base) * dcp->contrast + p->contr_base, 0.0f);
+		g *= g;
+		b = MAX((sqrtf(b) - p->contr_base) * dcp->contrast + p->contr_base, 0.0f);
+		b *= b;
+	}
+	else if (p->do_highrec)
+	{
+		/* Distance from 1.0 - radius */
+		float dist = v - p->recover_radius;
+		/* Scale so distance is normalized, clamp */
+		float dist_scaled = MIN(1.0, dist * p->inv_recover_radius);
+
+		float mul_val = 1.0 - dist_scaled * (1.0 - dcp->contrast);
+		r = r * mul_val;
+		g = g * mul_val;
+		b = b * mul_val;
+	}
+	/* To HSV */
+	r = MIN(r, 1.0f);
+	g = MIN(g, 1.0f);
+	b = MIN(b, 1.0f);
+	
+	RGBtoHSV(r, g, b, &h, &s, &v);
+
+	/* Curve */
+	if (dcp->read_out_curve)
+	{
+		gfloat t1 = v,t2,t3;
+		if (dcp->tone_curve_lut) 
+		{
+			t2 = t3 = v;
+			rgb_tone(&t1, &t2, &t3, dcp->tone_curve_lut);
+		}
+		int input = (int)(CLAMP(sqrtf(t1) * 256.0f, 0.0f, 255.9999f));
+		t->curve_input_values[input]++;
+	}
+	if (!dcp->curve_is_flat)
+	{
+		gfloat lookup = CLAMP(v * 256.0f, 0.0f, 255.9999f);
+		gfloat v0 = dcp->curve_samples[(gint)lookup*2];
+		gfloat v1 = dcp->curve_samples[(gint)lookup*2 + 1];
+		lookup -= floorf(lookup);
+		v = v0 * (1.0f - lookup) + v1 * lookup;
+	}
+
+	if (dcp->looktable)
+		huesat_map(dcp->looktable, &h, &s, &v);
+
+	/* Back to RGB */
+	HSVtoRGB(h, s, v, &r, &g, &b);
+
+	/* Apply tone curve */
+	if (dcp->tone_curve_lut) 
+		rgb_tone(&r, &g, &b, dcp->tone_curve_lut);
+
+	*_r = r;
+	*_g = g;
+	*_b = b;
+}
+
 static void
 render(ThreadInfo* t)
 {
 	RS_IMAGE16 *image = t->tmp;
-	RSDcp *dcp = t->dcp;
-
+	RenderParams p;
 	gint x, y;
-	gfloat h, s, v;
 	gfloat r, g, b;
-	RS_VECTOR3 pix;
-	gboolean do_contrast = (dcp->contrast > 1.001f);
-	gboolean do_highrec = (dcp->contrast < 0.999f);
-	float contr_base = 0.5;
-	float exposure_simple = MAX(1.0, powf(2.0f, dcp->exposure));
-	float recover_radius = 0.5 * exposure_simple;
-	float inv_recover_radius = 1.0f / recover_radius;
-	recover_radius = 1.0 - recover_radius;
 
-	RS_VECTOR3 clip;
-
-	clip.R = dcp->camera_white.R;
-	clip.G = dcp->camera_white.G;
-	clip.B = dcp->camera_white.B;
+	render_params(t->dcp, &p);
 
 	for(y = t->start_y ; y < t->end_y; y++)
 	{
@@ -1132,119 +1451,126 @@ render(ThreadInfo* t)
 			g = _F(pixel[G]);
 			b = _F(pixel[B]);
 
-			if (dcp->use_profile)
-			{
-				r = MIN(clip.R, r);
-				g = MIN(clip.G, g);
-				b = MIN(clip.B, b);
-			}
+			render_pixel(t, &p, &r, &g, &b);
 
-			pix.R = r;
-			pix.G = g;
-			pix.B = b;
-			pix = vector3_multiply_matrix(&pix, &dcp->camera_to_prophoto);
-				
-			r = pix.R;
-			g = pix.G;
-			b = pix.B;
+			/* Save as gushort */
+			pixel[R] = _S(r);
+			pixel[G] = _S(g);
+			pixel[B] = _S(b);
+		}
+	}
+}
+
+/* Render planar float, no conversion or quantization is needed */
+static void
+render_float(ThreadInfo* t)
+{
+	RSImage *image = t->tmp_float;
+	RenderParams p;
+	gint x, y;
 
-			r = CLAMP(r * dcp->channelmixer_red, 0.0, 1.0);
-			g = CLAMP(g * dcp->channelmixer_green, 0.0, 1.0);
-			b = CLAMP(b * dcp->channelmixer_blue, 0.0, 1.0);
+	render_params(t->dcp, &p);
 
-			/* To HSV */
-			RGBtoHSV(r, g, b, &h, &s, &v);
+	for(y = t->start_y ; y < t->end_y; y++)
+	{
+		gfloat *rp = RS_IMAGE_GET_ROW(image, R, y);
+		gfloat *gp = RS_IMAGE_GET_ROW(image, G, y);
+		gfloat *bp = RS_IMAGE_GET_ROW(image, B, y);
 
-			if (dcp->huesatmap)
-				huesat_map(dcp->huesatmap, &h, &s, &v);
+		for(x = t->start_x; x < t->end_x; x++)
+			render_pixel(t, &p, &rp[x], &gp[x], &bp[x]);
+	}
+}
 
-			/* Saturation */
-			if (dcp->saturation > 1.0)
-			{
-				/* Apply curved saturation, when we add saturation */
-				float sat_val = dcp->saturation - 1.0f;
-				
-				s = (sat_val * (s * 2.0f - (s * s))) + ((1.0f - sat_val) * s);
-				s = MIN(s, 1.0);
-			}
-			else
+/* Bake everything render_pixel() does into a 3D LUT. Entries are spaced
+   evenly in gamma 2.0 to get more precision in the shadows */
+static void
+bake_lut(RSDcp *dcp)
+{
+	const gint n = DCP_LUT_SIZE;
+	const gfloat scale = 1.0f / (gfloat) (n - 1);
+	ThreadInfo t;
+	RenderParams p;
+	gint r, g, b;
+	gfloat *entry;
+
+	if (!dcp->lut)
+		g_assert(0 == posix_memalign((void**)&dcp->lut, 16, sizeof(gfloat) * 4 * n * n * n));
+
+	memset(&t, 0, sizeof(ThreadInfo));
+	t.dcp = dcp;
+	render_params(dcp, &p);
+
+	entry = dcp->lut;
+	for (r = 0; r < n; r++)
+		for (g = 0; g < n; g++)
+			for (b = 0; b < n; b++)
 			{
-				s *= dcp->saturation;
-				s = MIN(s, 1.0);
+				gfloat rv = r * scale, gv = g * scale, bv = b * scale;
+				rv *= rv;
+				gv *= gv;
+				bv *= bv;
+				render_pixel(&t, &p, &rv, &gv, &bv);
+				entry[0] = rv;
+				entry[1] = gv;
+				entry[2] = bv;
+				/* Like the SIMD renderers, fill the unused channel with blue */
+				entry[3] = bv;
+				entry += 4;
 			}
 
-			/* Hue */
-			h += dcp->hue;
-
-			/* Back to RGB */
-			HSVtoRGB(h, s, v, &r, &g, &b);
-			
-			/* Exposure Compensation */
-			r = exposure_ramp(dcp, r);
-			g = exposure_ramp(dcp, g);
-			b = exposure_ramp(dcp, b);
-			
-			/* Contrast in gamma 2.0 */
-			if (do_contrast)
-			{
-				r = MAX((sqrtf(r) - contr_base) * dcp->contrast + contr_base, 0.0f);
-				r *= r;
-				g = MAX((sqrtf(g) - contr_base) * dcp->contrast + contr_base, 0.0f);
-				g *= g;
-				b = MAX((sqrtf(b) - contr_base) * dcp->contrast + contr_base, 0.0f);
-				b *= b;
-			}
-			else if (do_highrec)
-			{
-				/* Distance from 1.0 - radius */
-				float dist = v - recover_radius;
-				/* Scale so distance is normalized, clamp */
-				float dist_scaled = MIN(1.0, dist *  inv_recover_radius);
-
-				float mul_val = 1.0 - dist_scaled * (1.0 - dcp->contrast);
-				r = r * mul_val;
-				g = g * mul_val;
-				b = b * mul_val;
-			}
-			/* To HSV */
-			r = MIN(r, 1.0f);
-			g = MIN(g, 1.0f);
-			b = MIN(b, 1.0f);
-			
-			RGBtoHSV(r, g, b, &h, &s, &v);
-
-			/* Curve */
-			if (dcp->read_out_curve)
-			{
-				gfloat t1 = v,t2,t3;
-				if (dcp->tone_curve_lut) 
-				{
-					t2 = t3 = v;
-					rgb_tone(&t1, &t2, &t3, dcp->tone_curve_lut);
-				}
-				int input = (int)(CLAMP(sqrtf(t1) * 256.0f, 0.0f, 255.9999f));
-				t->curve_input_values[input]++;
-			}
-			if (!dcp->curve_is_flat)
-			{
-				gfloat lookup = CLAMP(v * 256.0f, 0.0f, 255.9999f);
-				gfloat v0 = dcp->curve_samples[(gint)lookup*2];
-				gfloat v1 = dcp->curve_samples[(gint)lookup*2 + 1];
-				lookup -= floorf(lookup);
-				v = v0 * (1.0f - lookup) + v1 * lookup;
-			}
+	dcp->lut_valid = TRUE;
+}
 
-			if (dcp->looktable)
-				huesat_map(dcp->looktable, &h, &s, &v);
+/* Tetrahedral interpolation in the baked LUT, input is clamped to 0.0 - 1.0 */
+static inline void
+lut_pixel(const gfloat *lut, gfloat *_r, gfloat *_g, gfloat *_b)
+{
+	const gint n = DCP_LUT_SIZE;
+	gfloat f[3], w[3];
+	gint i[3], c, o1, o2;
+
+	f[0] = sqrtf(CLAMP(*_r, 0.0f, 1.0f)) * (n - 1);
+	f[1] = sqrtf(CLAMP(*_g, 0.0f, 1.0f)) * (n - 1);
+	f[2] = sqrtf(CLAMP(*_b, 0.0f, 1.0f)) * (n - 1);
+	for (c = 0; c < 3; c++)
+	{
+		i[c] = MIN((gint) f[c], n - 2);
+		f[c] -= (gfloat) i[c];
+	}
 
-			/* Back to RGB */
-			HSVtoRGB(h, s, v, &r, &g, &b);
+	dcp_lut_tetrahedron(f, &o1, &o2, w);
 
-			/* Apply tone curve */
-			if (dcp->tone_curve_lut) 
-				rgb_tone(&r, &g, &b, dcp->tone_curve_lut);
+	const gfloat *c0 = &lut[((i[0] * n + i[1]) * n + i[2]) * 4];
+	const gfloat *c1 = c0 + o1;
+	const gfloat *c2 = c1 + o2;
+	const gfloat *c3 = &c0[(n * n + n + 1) * 4];
+
+	*_r = c0[0] + w[0] * (c1[0] - c0[0]) + w[1] * (c2[0] - c1[0]) + w[2] * (c3[0] - c2[0]);
+	*_g = c0[1] + w[0] * (c1[1] - c0[1]) + w[1] * (c2[1] - c1[1]) + w[2] * (c3[1] - c2[1]);
+	*_b = c0[2] + w[0] * (c1[2] - c0[2]) + w[1] * (c2[2] - c1[2]) + w[2] * (c3[2] - c2[2]);
+}
+
+static void
+render_lut(ThreadInfo* t)
+{
+	RS_IMAGE16 *image = t->tmp;
+	const gfloat *lut = t->dcp->lut;
+	gint x, y;
+	gfloat r, g, b;
+
+	for(y = t->start_y ; y < t->end_y; y++)
+	{
+		for(x=t->start_x; x < image->w; x++)
+		{
+			gushort *pixel = GET_PIXEL(image, x, y);
+
+			r = _F(pixel[R]);
+			g = _F(pixel[G]);
+			b = _F(pixel[B]);
+
+			lut_pixel(lut, &r, &g, &b);
 
-			/* Save as gushort */
 			pixel[R] = _S(r);
 			pixel[G] = _S(g);
 			pixel[B] = _S(b);
@@ -1252,6 +1578,38 @@ render(ThreadInfo* t)
 	}
 }
 
+/* The LUT only covers 0.0 - 1.0, float input can go beyond that. Those
+   pixels are rendered exactly instead of being clipped by the lookup */
+#define LUT_IN_RANGE(v) ((v) >= 0.0f && (v) <= 1.0f)
+
+static void
+render_lut_float(ThreadInfo* t)
+{
+	RSImage *image = t->tmp_float;
+	const gfloat *lut = t->dcp->lut;
+	RenderParams p;
+	gint x, y;
+
+	render_params(t->dcp, &p);
+
+	for(y = t->start_y ; y < t->end_y; y++)
+	{
+		gfloat *rp = RS_IMAGE_GET_ROW(image, R, y);
+		gfloat *gp = RS_IMAGE_GET_ROW(image, G, y);
+		gfloat *bp = RS_IMAGE_GET_ROW(image, B, y);
+
+		for(x = t->start_x; x < t->end_x; x++)
+		{
+			if (LUT_IN_RANGE(rp[x]) && LUT_IN_RANGE(gp[x]) && LUT_IN_RANGE(bp[x]))
+				lut_pixel(lut, &rp[x], &gp[x], &bp[x]);
+			else
+				render_pixel(t, &p, &rp[x], &gp[x], &bp[x]);
+		}
+	}
+}
+
+#undef LUT_IN_RANGE
+
 #undef _F
 #undef _S
 
@@ -1327,7 +1685,7 @@ calculate_huesat_maps(RSDcp *dcp, gfloat temp)
 		alpha = (invT - (1.0 / dcp->temp2)) / ((1.0 / dcp->temp1) - (1.0 / dcp->temp2));
 	}
 
-	dcp->huesatmap = 0;
+	RSHuesatMap *map = NULL;
 	if (dcp->huesatmap1 != NULL &&  dcp->huesatmap2 != NULL) 
 	{
 		gint hd = dcp->huesatmap1->hue_divisions;
@@ -1338,41 +1696,52 @@ calculate_huesat_maps(RSDcp *dcp, gfloat temp)
 		{
 			if (temp > dcp->temp1 && temp < dcp->temp2)
 			{
-				if (dcp->huesatmap_interpolated)
-					g_object_unref(dcp->huesatmap_interpolated);
-
-				dcp->huesatmap_interpolated = rs_huesat_map_new(hd, sd, vd);
-				float t1_weight = alpha;
-				float t2_weight = 1.0f - alpha;
-
-				int vals = hd * sd * vd;
-				RS_VECTOR3 *t_out = dcp->huesatmap_interpolated->deltas;
-				RS_VECTOR3 *t1 = dcp->huesatmap1->deltas;
-				RS_VECTOR3 *t2 = dcp->huesatmap2->deltas;
-				gint i;
-				for (i = 0; i < vals; i++)
+				/* The interpolated map only depends on alpha, keep it if that is unchanged */
+				if (!(dcp->huesatmap_interpolated && alpha == dcp->huesatmap_alpha))
 				{
-					t_out[i].x = t1[i].x * t1_weight + t2[i].x * t2_weight;
-					t_out[i].y = t1[i].y * t1_weight + t2[i].y * t2_weight;
-					t_out[i].z = t1[i].z * t1_weight + t2[i].z * t2_weight;
+					if (!dcp->huesatmap_interpolated)
+						dcp->huesatmap_interpolated = rs_huesat_map_new(hd, sd, vd);
+					dcp->huesatmap_alpha = alpha;
+					float t1_weight = alpha;
+					float t2_weight = 1.0f - alpha;
+
+					int vals = hd * sd * vd;
+					RS_VECTOR3 *t_out = dcp->huesatmap_interpolated->deltas;
+					RS_VECTOR3 *t1 = dcp->huesatmap1->deltas;
+					RS_VECTOR3 *t2 = dcp->huesatmap2->deltas;
+					gint i;
+					for (i = 0; i < vals; i++)
+					{
+						t_out[i].x = t1[i].x * t1_weight + t2[i].x * t2_weight;
+						t_out[i].y = t1[i].y * t1_weight + t2[i].y * t2_weight;
+						t_out[i].z = t1[i].z * t1_weight + t2[i].z * t2_weight;
+					}
+
+					/* Same map, new content */
+					dcp->huesatmap_precalc_valid = FALSE;
 				}
-//				printf("T1:%f, T2:%f, Cam:%f, t1w:%f, t2w:%f, vals:%d\n",dcp->temp1, dcp->temp2, temp, t1_weight, t2_weight, vals );
-			} 
+				map = dcp->huesatmap_interpolated;
+			}
 			else if (temp <= dcp->temp1)
-				dcp->huesatmap = dcp->huesatmap1;
-			else
-				dcp->huesatmap = dcp->huesatmap2;
+				map = dcp->huesatmap1;
+			else if (temp >= dcp->temp2)
+				map = dcp->huesatmap2;
 		}
 	}
-	/* If we don't have two huesatmaps, it will still be 0. */
+	/* If we don't have two huesatmaps, it will still be NULL. */
 	/* If that is the case, set it to the one that is present */
-	if (dcp->huesatmap == 0) 
+	if (map == NULL) 
 	{
-		if (dcp->huesatmap1 != 0)
-			dcp->huesatmap = dcp->huesatmap1;
+		if (dcp->huesatmap1 != NULL)
+			map = dcp->huesatmap1;
 		else
-			dcp->huesatmap = dcp->huesatmap2;
+			map = dcp->huesatmap2;
 	}
+
+	/* The precalculated table must follow the map in use */
+	if (map != dcp->huesatmap)
+		dcp->huesatmap_precalc_valid = FALSE;
+	dcp->huesatmap = map;
 }
 
 /* Verified to behave like dng_camera_profile::NormalizeForwardMatrix */
@@ -1461,10 +1830,17 @@ precalc(RSDcp *dcp)
 	g_static_rec_mutex_lock(&dcp_mutex);
 	if (dcp->use_profile)
 		matrix3_multiply(&xyz_to_prophoto, &dcp->camera_to_pcs, &dcp->camera_to_prophoto); /* verified by SDK */
-	if (dcp->huesatmap && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2))
+	if (dcp->huesatmap && !dcp->huesatmap_precalc_valid && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2))
+	{
 		calc_hsm_constants(dcp->huesatmap, dcp->huesatmap_precalc); 
-	if (dcp->looktable && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2))
+		dcp->huesatmap_precalc_valid = TRUE;
+	}
+	/* The look table doesn't depend on white balance, it is only built once per profile */
+	if (dcp->looktable && !dcp->looktable_precalc_valid && (rs_detect_cpu_features() & RS_CPU_FLAG_SSE2))
+	{
 		calc_hsm_constants(dcp->looktable, dcp->looktable_precalc); 
+		dcp->looktable_precalc_valid = TRUE;
+	}
 	g_static_rec_mutex_unlock(&dcp_mutex);
 }
 
@@ -1473,6 +1849,7 @@ read_profile(RSDcp *dcp, RSDcpFile *dcp_file)
 {
 	gint i;
 	free_dcp_profile(dcp);
+	dcp->dcp_file = g_object_ref(dcp_file);
 	
 	/* ColorMatrix */
 	dcp->has_color_matrix1 = rs_dcp_file_get_color_matrix1(dcp_file, &dcp->color_matrix1);
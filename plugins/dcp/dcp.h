@@ -28,6 +28,9 @@
 #define RS_IS_DCP(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), RS_TYPE_DCP))
 #define RS_DCP_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), RS_TYPE_DCP, RSDcpClass))
 
+/* Points per axis in the baked 3D LUT, indexed in gamma 2.0 */
+#define DCP_LUT_SIZE 33
+
 typedef struct _RSDcp RSDcp;
 typedef struct _RSDcpClass RSDcpClass;
 
@@ -60,6 +63,7 @@ struct _RSDcp {
 	RS_xy_COORD white_xy;
 
 	gint nknots;
+	gfloat *curve_knots;
 	gfloat *curve_samples;
 	gboolean curve_is_flat;
 
@@ -99,6 +103,18 @@ struct _RSDcp {
 	gfloat exposure_radius;
 	gfloat exposure_qscale;
 
+	/* Tables below are only rebuilt when what they depend on changes */
+	RSDcpFile *dcp_file;
+	gboolean wb_valid;
+	gfloat huesatmap_alpha;
+	gboolean huesatmap_precalc_valid;
+	gboolean looktable_precalc_valid;
+
+	/* Complete transform baked into DCP_LUT_SIZE^3 RGBA entries, 16 byte aligned */
+	gboolean use_lut;
+	gboolean lut_valid;
+	gfloat *lut;
+
 	PrecalcHSM *huesatmap_precalc;
 	PrecalcHSM *looktable_precalc;
 	void* _huesatmap_precalc_unaligned;
@@ -115,16 +131,52 @@ struct _RSDcpClass {
 
 typedef struct {
 	RSDcp *dcp;
-	GThread *threadid;
 	gint start_x;
+	gint end_x; /* Only used for tmp_float */
 	gint start_y;
 	gint end_y;
 	RS_IMAGE16 *tmp;
+	RSImage *tmp_float;
 	guint curve_input_values[256];
-	gboolean single_thread;
 } ThreadInfo;
 
+/**
+ * Find the tetrahedron of a LUT cube containing a point
+ * @param f Fractional position inside the cube for R, G and B
+ * @param o1 Offset in floats from the base corner to the second corner
+ * @param o2 Offset in floats from the second corner to the third corner
+ * @param w Weights of the three edges walked from the base corner
+ */
+static inline void
+dcp_lut_tetrahedron(const gfloat *f, gint *o1, gint *o2, gfloat *w)
+{
+	const gint off_r = DCP_LUT_SIZE * DCP_LUT_SIZE * 4;
+	const gint off_g = DCP_LUT_SIZE * 4;
+	const gint off_b = 4;
+
+	/* Walk the edges in order of decreasing fraction */
+	if (f[0] >= f[1])
+	{
+		if (f[1] >= f[2])
+			{ *o1 = off_r; *o2 = off_g; w[0] = f[0]; w[1] = f[1]; w[2] = f[2]; }
+		else if (f[0] >= f[2])
+			{ *o1 = off_r; *o2 = off_b; w[0] = f[0]; w[1] = f[2]; w[2] = f[1]; }
+		else
+			{ *o1 = off_b; *o2 = off_r; w[0] = f[2]; w[1] = f[0]; w[2] = f[1]; }
+	}
+	else
+	{
+		if (f[2] >= f[1])
+			{ *o1 = off_b; *o2 = off_g; w[0] = f[2]; w[1] = f[1]; w[2] = f[0]; }
+		else if (f[2] >= f[0])
+			{ *o1 = off_g; *o2 = off_b; w[0] = f[1]; w[1] = f[2]; w[2] = f[0]; }
+		else
+			{ *o1 = off_g; *o2 = off_r; w[0] = f[1]; w[1] = f[0]; w[2] = f[2]; }
+	}
+}
+
 gboolean render_SSE2(ThreadInfo* t);
+gboolean render_lut_SSE2(ThreadInfo* t);
 gboolean render_SSE4(ThreadInfo* t);
 gboolean render_AVX(ThreadInfo* t);
 void calc_hsm_constants(const RSHuesatMap *map, PrecalcHSM* table); 
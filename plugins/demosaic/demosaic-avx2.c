@@ -0,0 +1,213 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#include "demosaic.h"
+
+#if defined (__AVX2__)
+
+#include <immintrin.h>
+
+/* Unsigned 16 bit helpers */
+#define ABSDIFF_U16(a, b) _mm256_or_si256(_mm256_subs_epu16(a, b), _mm256_subs_epu16(b, a))
+
+gboolean
+expand_cfa_data_AVX2(const ThreadInfo* t)
+{
+	RS_IMAGE16* input  = t->image;
+	RS_IMAGE16* output = t->output;
+	guint filters = t->filters;
+	gint col, row;
+
+	if (!t->bayer)
+		return FALSE;
+
+	for(row=t->start_y; row<t->end_y; row++)
+	{
+		gushort* src = GET_PIXEL(input, 0, row);
+		gushort* dest = GET_PIXEL(output, 0, row);
+		/* Each pixel is a 64 bit lane, shift the sample to the channel of its color */
+		const __m256i shift = _mm256_set_epi64x(FC(row, 1) * 16, FC(row, 0) * 16, FC(row, 1) * 16, FC(row, 0) * 16);
+
+		for(col = 0; col + 8 <= output->w; col += 8)
+		{
+			__m256i a = _mm256_cvtepu16_epi64(_mm_loadl_epi64((__m128i*)&src[col]));
+			__m256i b = _mm256_cvtepu16_epi64(_mm_loadl_epi64((__m128i*)&src[col + 4]));
+			_mm256_storeu_si256((__m256i*)&dest[col*4], _mm256_sllv_epi64(a, shift));
+			_mm256_storeu_si256((__m256i*)&dest[col*4 + 16], _mm256_sllv_epi64(b, shift));
+		}
+		for(; col < output->w; col++)
+			dest[col*4 + FC(row, col)] = src[col];
+	}
+	return TRUE;
+}
+
+gboolean
+hotpixel_detect_AVX2(const ThreadInfo* t)
+{
+	RS_IMAGE16 *image = t->image;
+	const __m256i threshold = _mm256_set1_epi16(2000);
+	const __m256i zero = _mm256_setzero_si256();
+	gint x, y, end_y;
+
+	if (!t->bayer)
+		return FALSE;
+
+	y = MAX( 4, t->start_y);
+	end_y = MIN(t->end_y, image->h - 4);
+
+	for(; y < end_y; y++)
+	{
+		gint col_end = image->w - 4;
+		gushort* img = GET_PIXEL(image, 0, y);
+		gint p = image->rowstride * 2;
+		gint p_one = image->rowstride;
+
+		for (x = 4; x + 16 <= col_end; x += 16)
+		{
+			__m256i c = _mm256_loadu_si256((__m256i*)&img[x]);
+			__m256i left = _mm256_loadu_si256((__m256i*)&img[x - 2]);
+			__m256i right = _mm256_loadu_si256((__m256i*)&img[x + 2]);
+			__m256i up = _mm256_loadu_si256((__m256i*)&img[x - p]);
+			__m256i down = _mm256_loadu_si256((__m256i*)&img[x + p]);
+
+			__m256i d = ABSDIFF_U16(c, left);
+			d = _mm256_min_epu16(d, ABSDIFF_U16(c, right));
+			d = _mm256_min_epu16(d, ABSDIFF_U16(c, up));
+			d = _mm256_min_epu16(d, ABSDIFF_U16(c, down));
+			__m256i d2 = _mm256_max_epu16(ABSDIFF_U16(left, right), ABSDIFF_U16(up, down));
+
+			/* d2 * 8, saturating is fine since d can never exceed it then */
+			d2 = _mm256_adds_epu16(d2, d2);
+			d2 = _mm256_adds_epu16(d2, d2);
+			d2 = _mm256_adds_epu16(d2, d2);
+
+			/* Lanes where d <= d2 * 8 or d <= 2000 are not hot */
+			__m256i cold = _mm256_or_si256(
+				_mm256_cmpeq_epi16(_mm256_subs_epu16(d, d2), zero),
+				_mm256_cmpeq_epi16(_mm256_subs_epu16(d, threshold), zero));
+			guint mask = (guint) _mm256_movemask_epi8(cold);
+
+			/* Candidates are rare, do the full test from the first one, since
+			 * corrected pixels are read by the following pixels */
+			if (mask != 0xffffffff)
+			{
+				gint i = x + g_bit_nth_lsf(~mask, -1) / 2;
+				for (; i < x + 16; i++)
+					hotpixel_pixel(img, i, p, p_one);
+			}
+		}
+		for (; x < col_end; x++)
+			hotpixel_pixel(img, x, p, p_one);
+	}
+	return TRUE;
+}
+
+gboolean
+ppg_green_AVX2(const ThreadInfo* t)
+{
+	RS_IMAGE16 *image = t->output;
+	RS_IMAGE16 *raw = t->image;
+	const unsigned int filters = t->filters;
+	const int start_y = MAX(3, t->start_y);
+	const int end_y = MIN(image->h-3, t->end_y);
+	const int p = image->pitch;
+	const int rs = raw->rowstride;
+	const __m256i even = _mm256_set1_epi32(0xffff);
+	gint out[8] __attribute__ ((aligned (32)));
+	int row, col, c, i;
+
+	if (!t->bayer)
+		return FALSE;
+
+	/* All values read by the green pass are CFA samples, so we read them from
+	 * the single channel input, where eight neighbours are in one register */
+	for (row=start_y; row < end_y; row++)
+	{
+		const gushort *src = GET_PIXEL(raw, 0, row);
+		col = 3+(FC(row,3) & 1);
+		c = FC(row,col);
+
+		for (; col + 18 < image->w; col += 16)
+		{
+#define LOAD(offset) _mm256_and_si256(_mm256_loadu_si256((const __m256i*)&src[col + (offset)]), even)
+			__m256i cc = LOAD(0);
+			__m256i l1 = LOAD(-1);
+			__m256i r1 = LOAD(1);
+			__m256i l2 = LOAD(-2);
+			__m256i r2 = LOAD(2);
+			__m256i l3 = LOAD(-3);
+			__m256i r3 = LOAD(3);
+			__m256i u1 = LOAD(-rs);
+			__m256i d1 = LOAD(rs);
+			__m256i u2 = LOAD(-2*rs);
+			__m256i d2 = LOAD(2*rs);
+			__m256i u3 = LOAD(-3*rs);
+			__m256i d3 = LOAD(3*rs);
+#undef LOAD
+			__m256i guessA = _mm256_sub_epi32(_mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(l1, cc), r1), 1), _mm256_add_epi32(l2, r2));
+			__m256i diffA = _mm256_add_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(l2, cc)), _mm256_abs_epi32(_mm256_sub_epi32(r2, cc))), _mm256_abs_epi32(_mm256_sub_epi32(l1, r1)));
+			__m256i diffA2 = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(r3, r1)), _mm256_abs_epi32(_mm256_sub_epi32(l3, l1)));
+			diffA = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(diffA, 1), diffA), _mm256_slli_epi32(diffA2, 1));
+
+			__m256i guessB = _mm256_sub_epi32(_mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(u1, cc), d1), 1), _mm256_add_epi32(u2, d2));
+			__m256i diffB = _mm256_add_epi32(_mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(u2, cc)), _mm256_abs_epi32(_mm256_sub_epi32(d2, cc))), _mm256_abs_epi32(_mm256_sub_epi32(u1, d1)));
+			__m256i diffB2 = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(d3, d1)), _mm256_abs_epi32(_mm256_sub_epi32(u3, u1)));
+			diffB = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(diffB, 1), diffB), _mm256_slli_epi32(diffB2, 1));
+
+			/* ULIM(guess >> 2, a, b) */
+			guessA = _mm256_srai_epi32(guessA, 2);
+			guessA = _mm256_min_epi32(_mm256_max_epi32(guessA, _mm256_min_epi32(l1, r1)), _mm256_max_epi32(l1, r1));
+			guessB = _mm256_srai_epi32(guessB, 2);
+			guessB = _mm256_min_epi32(_mm256_max_epi32(guessB, _mm256_min_epi32(u1, d1)), _mm256_max_epi32(u1, d1));
+
+			__m256i g = _mm256_blendv_epi8(guessA, guessB, _mm256_cmpgt_epi32(diffA, diffB));
+			_mm256_store_si256((__m256i*)out, g);
+
+			gushort (*pix)[4] = (gushort (*)[4])GET_PIXEL(image, col, row);
+			for (i = 0; i < 8; i++)
+				pix[i*2][1] = out[i];
+		}
+		for (; col < image->w-3; col+=2)
+			ppg_green_pixel((gushort (*)[4])GET_PIXEL(image, col, row), c, p);
+	}
+	return TRUE;
+}
+
+#else /* if not __AVX2__ */
+
+gboolean
+expand_cfa_data_AVX2(const ThreadInfo* t)
+{
+	return FALSE;
+}
+
+gboolean
+hotpixel_detect_AVX2(const ThreadInfo* t)
+{
+	return FALSE;
+}
+
+gboolean
+ppg_green_AVX2(const ThreadInfo* t)
+{
+	return FALSE;
+}
+
+#endif /* __AVX2__ */
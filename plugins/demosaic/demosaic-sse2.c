@@ -0,0 +1,236 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#include "demosaic.h"
+
+#if defined (__SSE2__)
+
+#include <emmintrin.h>
+
+/* Unsigned 16 bit helpers, SSE2 has no unsigned min/max or abs */
+#define ABSDIFF_U16(a, b) _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a))
+#define MIN_U16(a, b) _mm_sub_epi16(a, _mm_subs_epu16(a, b))
+#define MAX_U16(a, b) _mm_add_epi16(b, _mm_subs_epu16(a, b))
+
+/* Signed 32 bit helpers */
+#define SEL_32(mask, a, b) _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+#define MIN_32(a, b) SEL_32(_mm_cmpgt_epi32(a, b), b, a)
+#define MAX_32(a, b) SEL_32(_mm_cmpgt_epi32(a, b), a, b)
+
+static inline __m128i
+abs_epi32(__m128i a)
+{
+	__m128i sign = _mm_srai_epi32(a, 31);
+	return _mm_sub_epi32(_mm_xor_si128(a, sign), sign);
+}
+
+gboolean
+expand_cfa_data_SSE2(const ThreadInfo* t)
+{
+	RS_IMAGE16* input  = t->image;
+	RS_IMAGE16* output = t->output;
+	guint filters = t->filters;
+	gint col, row;
+
+	if (!t->bayer)
+		return FALSE;
+
+	for(row=t->start_y; row<t->end_y; row++)
+	{
+		gushort* src = GET_PIXEL(input, 0, row);
+		gushort* dest = GET_PIXEL(output, 0, row);
+		const gint c0 = FC(row, 0);
+		const gint c1 = FC(row, 1);
+		gushort m[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		m[c0] = 0xffff;
+		m[4 + c1] = 0xffff;
+		const __m128i mask = _mm_loadu_si128((__m128i*)m);
+
+		/* Spread 8 samples to 8 pixels, zeroing the missing colors */
+		for(col = 0; col + 8 <= output->w; col += 8)
+		{
+			__m128i in = _mm_loadu_si128((__m128i*)&src[col]);
+			__m128i lo = _mm_unpacklo_epi16(in, in);
+			__m128i hi = _mm_unpackhi_epi16(in, in);
+			__m128i *out = (__m128i*)&dest[col*4];
+			_mm_store_si128(out, _mm_and_si128(_mm_unpacklo_epi32(lo, lo), mask));
+			_mm_store_si128(out + 1, _mm_and_si128(_mm_unpackhi_epi32(lo, lo), mask));
+			_mm_store_si128(out + 2, _mm_and_si128(_mm_unpacklo_epi32(hi, hi), mask));
+			_mm_store_si128(out + 3, _mm_and_si128(_mm_unpackhi_epi32(hi, hi), mask));
+		}
+		for(; col < output->w; col++)
+			dest[col*4 + FC(row, col)] = src[col];
+	}
+	return TRUE;
+}
+
+gboolean
+hotpixel_detect_SSE2(const ThreadInfo* t)
+{
+	RS_IMAGE16 *image = t->image;
+	const __m128i threshold = _mm_set1_epi16(2000);
+	const __m128i zero = _mm_setzero_si128();
+	gint x, y, end_y;
+
+	if (!t->bayer)
+		return FALSE;
+
+	y = MAX( 4, t->start_y);
+	end_y = MIN(t->end_y, image->h - 4);
+
+	for(; y < end_y; y++)
+	{
+		gint col_end = image->w - 4;
+		gushort* img = GET_PIXEL(image, 0, y);
+		gint p = image->rowstride * 2;
+		gint p_one = image->rowstride;
+
+		for (x = 4; x + 8 <= col_end; x += 8)
+		{
+			__m128i c = _mm_loadu_si128((__m128i*)&img[x]);
+			__m128i left = _mm_loadu_si128((__m128i*)&img[x - 2]);
+			__m128i right = _mm_loadu_si128((__m128i*)&img[x + 2]);
+			__m128i up = _mm_loadu_si128((__m128i*)&img[x - p]);
+			__m128i down = _mm_loadu_si128((__m128i*)&img[x + p]);
+
+			__m128i d = ABSDIFF_U16(c, left);
+			d = MIN_U16(d, ABSDIFF_U16(c, right));
+			d = MIN_U16(d, ABSDIFF_U16(c, up));
+			d = MIN_U16(d, ABSDIFF_U16(c, down));
+			__m128i d2 = MAX_U16(ABSDIFF_U16(left, right), ABSDIFF_U16(up, down));
+
+			/* d2 * 8, saturating is fine since d can never exceed it then */
+			d2 = _mm_adds_epu16(d2, d2);
+			d2 = _mm_adds_epu16(d2, d2);
+			d2 = _mm_adds_epu16(d2, d2);
+
+			/* Lanes where d <= d2 * 8 or d <= 2000 are not hot */
+			__m128i cold = _mm_or_si128(
+				_mm_cmpeq_epi16(_mm_subs_epu16(d, d2), zero),
+				_mm_cmpeq_epi16(_mm_subs_epu16(d, threshold), zero));
+			gint mask = _mm_movemask_epi8(cold);
+
+			/* Candidates are rare, do the full test from the first one, since
+			 * corrected pixels are read by the following pixels */
+			if (mask != 0xffff)
+			{
+				gint i = x + g_bit_nth_lsf(~mask & 0xffff, -1) / 2;
+				for (; i < x + 8; i++)
+					hotpixel_pixel(img, i, p, p_one);
+			}
+		}
+		for (; x < col_end; x++)
+			hotpixel_pixel(img, x, p, p_one);
+	}
+	return TRUE;
+}
+
+gboolean
+ppg_green_SSE2(const ThreadInfo* t)
+{
+	RS_IMAGE16 *image = t->output;
+	RS_IMAGE16 *raw = t->image;
+	const unsigned int filters = t->filters;
+	const int start_y = MAX(3, t->start_y);
+	const int end_y = MIN(image->h-3, t->end_y);
+	const int p = image->pitch;
+	const int rs = raw->rowstride;
+	const __m128i even = _mm_set1_epi32(0xffff);
+	int row, col, c;
+
+	if (!t->bayer)
+		return FALSE;
+
+	/* All values read by the green pass are CFA samples, so we read them from
+	 * the single channel input, where four neighbours are in one register */
+	for (row=start_y; row < end_y; row++)
+	{
+		const gushort *src = GET_PIXEL(raw, 0, row);
+		col = 3+(FC(row,3) & 1);
+		c = FC(row,col);
+
+		for (; col + 10 < image->w; col += 8)
+		{
+#define LOAD(offset) _mm_and_si128(_mm_loadu_si128((const __m128i*)&src[col + (offset)]), even)
+			__m128i cc = LOAD(0);
+			__m128i l1 = LOAD(-1);
+			__m128i r1 = LOAD(1);
+			__m128i l2 = LOAD(-2);
+			__m128i r2 = LOAD(2);
+			__m128i l3 = LOAD(-3);
+			__m128i r3 = LOAD(3);
+			__m128i u1 = LOAD(-rs);
+			__m128i d1 = LOAD(rs);
+			__m128i u2 = LOAD(-2*rs);
+			__m128i d2 = LOAD(2*rs);
+			__m128i u3 = LOAD(-3*rs);
+			__m128i d3 = LOAD(3*rs);
+#undef LOAD
+			__m128i guessA = _mm_sub_epi32(_mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(l1, cc), r1), 1), _mm_add_epi32(l2, r2));
+			__m128i diffA = _mm_add_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(l2, cc)), abs_epi32(_mm_sub_epi32(r2, cc))), abs_epi32(_mm_sub_epi32(l1, r1)));
+			__m128i diffA2 = _mm_add_epi32(abs_epi32(_mm_sub_epi32(r3, r1)), abs_epi32(_mm_sub_epi32(l3, l1)));
+			diffA = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(diffA, 1), diffA), _mm_slli_epi32(diffA2, 1));
+
+			__m128i guessB = _mm_sub_epi32(_mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(u1, cc), d1), 1), _mm_add_epi32(u2, d2));
+			__m128i diffB = _mm_add_epi32(_mm_add_epi32(abs_epi32(_mm_sub_epi32(u2, cc)), abs_epi32(_mm_sub_epi32(d2, cc))), abs_epi32(_mm_sub_epi32(u1, d1)));
+			__m128i diffB2 = _mm_add_epi32(abs_epi32(_mm_sub_epi32(d3, d1)), abs_epi32(_mm_sub_epi32(u3, u1)));
+			diffB = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(diffB, 1), diffB), _mm_slli_epi32(diffB2, 1));
+
+			/* ULIM(guess >> 2, a, b) */
+			guessA = _mm_srai_epi32(guessA, 2);
+			guessA = MIN_32(MAX_32(guessA, MIN_32(l1, r1)), MAX_32(l1, r1));
+			guessB = _mm_srai_epi32(guessB, 2);
+			guessB = MIN_32(MAX_32(guessB, MIN_32(u1, d1)), MAX_32(u1, d1));
+
+			__m128i g = SEL_32(_mm_cmpgt_epi32(diffA, diffB), guessB, guessA);
+
+			gushort (*pix)[4] = (gushort (*)[4])GET_PIXEL(image, col, row);
+			pix[0][1] = _mm_extract_epi16(g, 0);
+			pix[2][1] = _mm_extract_epi16(g, 2);
+			pix[4][1] = _mm_extract_epi16(g, 4);
+			pix[6][1] = _mm_extract_epi16(g, 6);
+		}
+		for (; col < image->w-3; col+=2)
+			ppg_green_pixel((gushort (*)[4])GET_PIXEL(image, col, row), c, p);
+	}
+	return TRUE;
+}
+
+#else /* if not __SSE2__ */
+
+gboolean
+expand_cfa_data_SSE2(const ThreadInfo* t)
+{
+	return FALSE;
+}
+
+gboolean
+hotpixel_detect_SSE2(const ThreadInfo* t)
+{
+	return FALSE;
+}
+
+gboolean
+ppg_green_SSE2(const ThreadInfo* t)
+{
+	return FALSE;
+}
+
+#endif /* __SSE2__ */
@@ -21,25 +21,18 @@
 
 #include <rawstudio.h>
 #include <string.h>
+#include "demosaic.h"
 
 #define RS_TYPE_DEMOSAIC (rs_demosaic_type)
 #define RS_DEMOSAIC(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_DEMOSAIC, RSDemosaic))
 #define RS_DEMOSAIC_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_DEMOSAIC, RSDemosaicClass))
 #define RS_IS_DEMOSAIC(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), RS_TYPE_DEMOSAIC))
 
-typedef struct {
-	gint start_y;
-	gint end_y;
-	RS_IMAGE16 *image;
-	RS_IMAGE16 *output;
-	guint filters;
-	GThread *threadid;
-} ThreadInfo;
-
 typedef enum {
 	RS_DEMOSAIC_NONE,
 	RS_DEMOSAIC_BILINEAR,
 	RS_DEMOSAIC_PPG,
+	RS_DEMOSAIC_DIRECTIONAL,
 	RS_DEMOSAIC_MAX,
 	RS_DEMOSAIC_NONE_HALF
 } RS_DEMOSAIC;
@@ -47,7 +40,8 @@ typedef enum {
 const static gchar *rs_demosaic_ascii[RS_DEMOSAIC_MAX] = {
 	"none",
 	"bilinear",
-	"pixel-grouping"
+	"pixel-grouping",
+	"directional"
 };
 
 typedef struct _RSDemosaic RSDemosaic;
@@ -75,11 +69,13 @@ enum {
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterRoiSupport get_roi_support(RSFilter *filter);
 static inline int fc_INDI (const unsigned int filters, const int row, const int col);
 static void border_interpolate_INDI (const ThreadInfo* t, int colors, int border);
 static void lin_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors);
-static void ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors);
-static void none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors, gboolean half_size);
+static void ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors, RSParallelPriority priority);
+static void directional_interpolate(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, RSParallelPriority priority);
+static void none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors, gboolean half_size, RSParallelPriority priority);
 static void hotpixel_detect(const ThreadInfo* t);
 static void expand_cfa_data(const ThreadInfo* t);
 
@@ -105,7 +101,7 @@ rs_demosaic_class_init(RSDemosaicClass *klass)
 
 	g_object_class_install_property(object_class,
 		PROP_METHOD, g_param_spec_string(
-			"method", "demosaic method", "The demosaic algorithm to use (\"bilinear\" or \"pixel-grouping\")",
+			"method", "demosaic method", "The demosaic algorithm to use (\"bilinear\", \"pixel-grouping\" or \"directional\")",
 			rs_demosaic_ascii[RS_DEMOSAIC_PPG], G_PARAM_READWRITE)
 	);
 
@@ -117,6 +113,14 @@ rs_demosaic_class_init(RSDemosaicClass *klass)
 
 	filter_class->name = "Demosaic filter";
 	filter_class->get_image = get_image;
+	filter_class->get_roi_support = get_roi_support;
+}
+
+static RSFilterRoiSupport
+get_roi_support(RSFilter *filter)
+{
+	/* We always demosaic the complete image */
+	return RS_FILTER_ROI_IGNORED;
 }
 
 static void
@@ -168,15 +172,23 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 	}
 }
 
-/*
-   In order to inline this calculation, I make the risky
-   assumption that all filter patterns can be described
-   by a repeating pattern of eight rows and two columns
+/* Returns TRUE if the pattern is a 2x2 bayer pattern with green in a checkerboard */
+static gboolean
+is_bayer(const guint filters)
+{
+	if (filters == 1)
+		return FALSE;
 
-   Return values are either 0/1/2/3 = G/M/C/Y or 0/1/2/3 = R/G1/B/G2
- */
-#define FC(row,col) \
-  (int)(filters >> ((((row) << 1 & 14) + ((col) & 1)) << 1) & 3)
+	if (! ( (filters & 0xff ) == ((filters >> 8) & 0xff) &&
+		((filters >> 16) & 0xff) == ((filters >> 24) & 0xff) &&
+		(filters & 0xff) == ((filters >> 24) &0xff)))
+		return FALSE;
+
+	if (FC(0,0) == 1)
+		return (FC(1,1) == 1 && FC(0,1) != 1 && FC(1,0) != 1 && FC(0,1) != FC(1,0));
+	else
+		return (FC(0,1) == 1 && FC(1,0) == 1 && FC(0,0) != 1 && FC(1,1) != 1 && FC(0,0) != FC(1,1));
+}
 
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
@@ -188,6 +200,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *output = NULL;
 	guint filters;
 	RS_DEMOSAIC method;
+	RSParallelPriority priority = rs_filter_request_get_priority(request);
 
 	previous_response = rs_filter_get_image(filter->previous, request);
 
@@ -257,13 +270,19 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 			lin_interpolate_INDI(input, output, filters, 3);
 			break;
 	  case RS_DEMOSAIC_PPG:
-			ppg_interpolate_INDI(input,output, filters, 3);
+			ppg_interpolate_INDI(input, output, filters, 3, priority);
+			break;
+	  case RS_DEMOSAIC_DIRECTIONAL:
+			if (is_bayer(filters) && input->w > 16 && input->h > 16)
+				directional_interpolate(input, output, filters, priority);
+			else
+				ppg_interpolate_INDI(input, output, filters, 3, priority);
 			break;
 		case RS_DEMOSAIC_NONE:
-			none_interpolate_INDI(input, output, filters, 3, FALSE);
+			none_interpolate_INDI(input, output, filters, 3, FALSE, priority);
 			break;
 		case RS_DEMOSAIC_NONE_HALF:
-			none_interpolate_INDI(input, output, filters, 3, TRUE);
+			none_interpolate_INDI(input, output, filters, 3, TRUE, priority);
 			break;
 		default:
 			/* Do nothing */
@@ -344,12 +363,14 @@ border_interpolate_INDI (const ThreadInfo* t, int colors, int border)
 static void
 lin_interpolate_INDI(RS_IMAGE16 *input, RS_IMAGE16 *output, const unsigned int filters, const int colors) /*UF*/
 {
-	ThreadInfo *t = g_new(ThreadInfo, 1);
+	ThreadInfo thread_info;
+	ThreadInfo *t = &thread_info;
 	t->image = input;
 	t->output = output;
 	t->filters = filters;
+	t->bayer = is_bayer(filters) && input->pixelsize == 1 && output->pixelsize == 4;
 	t->start_y = 0;
-	t->end_y = input->w;
+	t->end_y = input->h;
 
 	expand_cfa_data(t);
 	RS_IMAGE16* image = output;
@@ -394,6 +415,11 @@ lin_interpolate_INDI(RS_IMAGE16 *input, RS_IMAGE16 *output, const unsigned int f
 static void
 expand_cfa_data(const ThreadInfo* t) {
 
+	if ((rs_detect_cpu_features() & RS_CPU_FLAG_AVX2) && expand_cfa_data_AVX2(t))
+		return;
+	if ((rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && expand_cfa_data_SSE2(t))
+		return;
+
 	RS_IMAGE16* input  = t->image;
 	RS_IMAGE16* output = t->output;
 	guint filters = t->filters;
@@ -419,64 +445,86 @@ expand_cfa_data(const ThreadInfo* t) {
 inline guint clampbits16(gint x) { guint32 _y_temp; if( (_y_temp=x>>16) ) x = ~_y_temp >> 16; return x;}
 
 #define CLIP(x) clampbits16(x)
-#define ULIM(x,y,z) ((y) < (z) ? CLAMP(x,y,z) : CLAMP(x,z,y))
+
+typedef struct {
+	RS_IMAGE16 *image;
+	RS_IMAGE16 *output;
+	guint filters;
+} PPGInfo;
 
 static void
-interpolate_INDI_part(ThreadInfo *t)
+ppg_prepare(gint start_y, gint end_y, gpointer _info, void (*func)(const ThreadInfo *t))
 {
-  RS_IMAGE16 *image = t->output;
-  const unsigned int filters = t->filters;
-  
-  /* Subtract 3 from top and bottom  */
-  const int start_y = MAX(3, t->start_y);
-  const int end_y = MIN(image->h-3, t->end_y);
-  int row, col, c, d;
-	int diffA, diffB, guessA, guessB;
-	int p = image->pitch;
-	int p3 = p*3;
-  gushort (*pix)[4];
+	PPGInfo *info = _info;
+	ThreadInfo t;
+
+	t.start_y = start_y;
+	t.end_y = end_y;
+	t.image = info->image;
+	t.output = info->output;
+	t.filters = info->filters;
+	t.bayer = is_bayer(info->filters) && info->image->pixelsize == 1 && info->output->pixelsize == 4;
+
+	func(&t);
+}
 
-  {
 /*  Fill in the green layer with gradients and pattern recognition: */
-  for (row=start_y; row < end_y; row++)
-    for (col=3+(FC(row,3) & 1), c=FC(row,col); col < image->w-3; col+=2) {
-      pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-
-	guessA = (pix[-1][1] + pix[0][c] + pix[1][1]) * 2
-		      - pix[-2*1][c] - pix[2*1][c];
-	diffA = ( ABS(pix[-2*1][c] - pix[ 0][c]) +
-		    ABS(pix[ 2*1][c] - pix[ 0][c]) +
-		    ABS(pix[  -1][1] - pix[ 1][1]) ) * 3 +
-		  ( ABS(pix[ 3*1][1] - pix[ 1][1]) +
-		    ABS(pix[-3*1][1] - pix[-1][1]) ) * 2;
-
-	guessB = (pix[-p][1] + pix[0][c] + pix[p][1]) * 2
-		      - pix[-2*p][c] - pix[2*p][c];
-	diffB = ( ABS(pix[-2*p][c] - pix[ 0][c]) +
-		    ABS(pix[ 2*p][c] - pix[ 0][c]) +
-		    ABS(pix[  -p][1] - pix[ p][1]) ) * 3 +
-		  ( ABS(pix[ p3][1] - pix[ p][1]) +
-		    ABS(pix[-p3][1] - pix[-p][1]) ) * 2;
-
-		if (diffA > diffB)
-			pix[0][1] = ULIM(guessB >> 2, pix[p][1], pix[-p][1]);
-		else
-			pix[0][1] = ULIM(guessA >> 2, pix[1][1], pix[-1][1]);
-    }
+static void
+ppg_green(const ThreadInfo *t)
+{
+	RS_IMAGE16 *image = t->output;
+	const unsigned int filters = t->filters;
+	const int start_y = MAX(3, t->start_y);
+	const int end_y = MIN(image->h-3, t->end_y);
+	const int p = image->pitch;
+	int row, col, c;
+
+	border_interpolate_INDI(t, 3, 3);
+
+	if ((rs_detect_cpu_features() & RS_CPU_FLAG_AVX2) && ppg_green_AVX2(t))
+		return;
+	if ((rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && ppg_green_SSE2(t))
+		return;
+
+	for (row=start_y; row < end_y; row++)
+		for (col=3+(FC(row,3) & 1), c=FC(row,col); col < image->w-3; col+=2)
+			ppg_green_pixel((gushort (*)[4])GET_PIXEL(image, col, row), c, p);
+}
+
 /*  Calculate red and blue for each green pixel:		*/
-  for (row=start_y-2; row < end_y+2; row++)
-    for (col=1+(FC(row,2) & 1), c=FC(row,col+1); col < image->w-1; col+=2) {
-      pix = (gushort (*)[4])GET_PIXEL(image, col, row);
-      pix[0][c] = CLIP((pix[-1][c] + pix[1][c] + 2*pix[0][1]
-          - pix[-1][1] - pix[1][1]) >> 1);
-      c=2-c;
-      pix[0][c] = CLIP((pix[-p][c] + pix[p][c] + 2*pix[0][1]
-          - pix[-p][1] - pix[p][1]) >> 1);
-      c=2-c;
-    }
+static void
+ppg_color_green(const ThreadInfo *t)
+{
+	RS_IMAGE16 *image = t->output;
+	const unsigned int filters = t->filters;
+	const int p = image->pitch;
+	int row, col, c;
+	gushort (*pix)[4];
+
+	for (row=t->start_y; row < t->end_y; row++)
+		for (col=1+(FC(row,2) & 1), c=FC(row,col+1); col < image->w-1; col+=2) {
+			pix = (gushort (*)[4])GET_PIXEL(image, col, row);
+			pix[0][c] = CLIP((pix[-1][c] + pix[1][c] + 2*pix[0][1]
+				- pix[-1][1] - pix[1][1]) >> 1);
+			c=2-c;
+			pix[0][c] = CLIP((pix[-p][c] + pix[p][c] + 2*pix[0][1]
+				- pix[-p][1] - pix[p][1]) >> 1);
+			c=2-c;
+		}
+}
 
 /*  Calculate blue for red pixels and vice versa:		*/
-	for (row=start_y-2; row < end_y+2; row++)
+static void
+ppg_color_other(const ThreadInfo *t)
+{
+	RS_IMAGE16 *image = t->output;
+	const unsigned int filters = t->filters;
+	const int p = image->pitch;
+	int row, col, c, d;
+	int diffA, diffB, guessA, guessB;
+	gushort (*pix)[4];
+
+	for (row=t->start_y; row < t->end_y; row++)
 		for (col=1+(FC(row,1) & 1), c=2-FC(row,col); col < image->w-1; col+=2) {
 			pix = (gushort (*)[4])GET_PIXEL(image, col, row);
 			d = 1 + p;
@@ -498,56 +546,397 @@ interpolate_INDI_part(ThreadInfo *t)
 			else
 				pix[0][c] = CLIP(guessA >> 1);
 		}
+}
+
+static void
+ppg_hotpixel_rows(gint start_y, gint end_y, gpointer _info)
+{
+	ppg_prepare(start_y, end_y, _info, hotpixel_detect);
+}
+
+static void
+ppg_expand_rows(gint start_y, gint end_y, gpointer _info)
+{
+	ppg_prepare(start_y, end_y, _info, expand_cfa_data);
+}
+
+static void
+ppg_green_rows(gint start_y, gint end_y, gpointer _info)
+{
+	ppg_prepare(start_y, end_y, _info, ppg_green);
+}
+
+static void
+ppg_color_green_rows(gint start_y, gint end_y, gpointer _info)
+{
+	ppg_prepare(start_y, end_y, _info, ppg_color_green);
+}
+
+static void
+ppg_color_other_rows(gint start_y, gint end_y, gpointer _info)
+{
+	ppg_prepare(start_y, end_y, _info, ppg_color_other);
+}
+
+static void
+ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors, RSParallelPriority priority)
+{
+	PPGInfo info;
+
+	info.image = image;
+	info.output = output;
+	info.filters = filters;
+
+	/* Every pass reads rows around it written by the previous pass, so the
+	   passes are kept apart and rows are handed out in small chunks */
+	rs_parallel_for_full(0, image->h, 0, priority, ppg_hotpixel_rows, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, ppg_expand_rows, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, ppg_green_rows, &info);
+	rs_parallel_for_full(1, image->h-1, 0, priority, ppg_color_green_rows, &info);
+	rs_parallel_for_full(1, image->h-1, 0, priority, ppg_color_other_rows, &info);
+}
+
+
+/*
+   Directional interpolation with a posteriori decision, in the spirit of
+   Menon, Andriani & Calvagno (2007). Green minus red/blue is estimated both
+   horizontally and vertically, the direction where this color difference
+   is smoothest wins. Red and blue are then interpolated from color
+   differences to the final green, and finally the color differences are
+   median filtered to suppress false colors.
+*/
+typedef struct {
+	RS_IMAGE16 *image;
+	RS_IMAGE16 *output;
+	guint filters;
+	gint *dh;		/* Horizontal green - red/blue estimate */
+	gint *dv;		/* Vertical green - red/blue estimate */
+	guchar *dir;		/* Chosen direction for red and blue pixels */
+} DirectionalInfo;
+
+enum {
+	DIRECTION_H,
+	DIRECTION_V,
+	DIRECTION_BOTH
+};
+
+static void
+directional_prepare(gint start_y, gint end_y, gpointer _info, void (*func)(const ThreadInfo *t))
+{
+	DirectionalInfo *info = _info;
+	ThreadInfo t;
+
+	t.start_y = start_y;
+	t.end_y = end_y;
+	t.image = info->image;
+	t.output = info->output;
+	t.filters = info->filters;
+	t.bayer = info->image->pixelsize == 1 && info->output->pixelsize == 4;
+
+	func(&t);
+}
+
+static void
+directional_hotpixel(gint start_y, gint end_y, gpointer _info)
+{
+	directional_prepare(start_y, end_y, _info, hotpixel_detect);
+}
+
+static void
+directional_expand(gint start_y, gint end_y, gpointer _info)
+{
+	directional_prepare(start_y, end_y, _info, expand_cfa_data);
+}
+
+static void
+directional_border(const ThreadInfo *t)
+{
+	border_interpolate_INDI(t, 3, 6);
+}
+
+static void
+directional_borders(gint start_y, gint end_y, gpointer _info)
+{
+	directional_prepare(start_y, end_y, _info, directional_border);
+}
+
+/* Estimate color differences in both directions */
+static void
+directional_differences(gint start_y, gint end_y, gpointer _info)
+{
+	DirectionalInfo *info = _info;
+	const guint filters = info->filters;
+	const gint w = info->image->w;
+	const gint rs = info->image->rowstride;
+	gint row, col;
+
+	start_y = MAX(2, start_y);
+	end_y = MIN(info->image->h - 2, end_y);
+
+	for (row = start_y; row < end_y; row++)
+	{
+		const gushort *src = GET_PIXEL(info->image, 0, row);
+		gint *dh = &info->dh[row * w];
+		gint *dv = &info->dv[row * w];
+
+		for (col = 2; col < w - 2; col++)
+		{
+			/* Hamilton-Adams estimate of the missing color */
+			gint h = ((src[col-1] + src[col+1]) * 2 + src[col] * 2 - src[col-2] - src[col+2]) >> 2;
+			gint v = ((src[col-rs] + src[col+rs]) * 2 + src[col] * 2 - src[col-2*rs] - src[col+2*rs]) >> 2;
+
+			if (FC(row, col) == 1)
+			{
+				dh[col] = src[col] - CLIP(h);
+				dv[col] = src[col] - CLIP(v);
+			}
+			else
+			{
+				/* Keep green between its neighbours like PPG, this avoids overshoot at edges */
+				h = ULIM(h, src[col-1], src[col+1]);
+				v = ULIM(v, src[col-rs], src[col+rs]);
+				dh[col] = h - src[col];
+				dv[col] = v - src[col];
+			}
+		}
 	}
 }
 
-gpointer
-start_interp_thread(gpointer _thread_info)
+/* Choose the green direction with the smoothest color differences */
+static void
+directional_green(gint start_y, gint end_y, gpointer _info)
 {
-	ThreadInfo* t = _thread_info;
-	hotpixel_detect(t);
-	expand_cfa_data(t);
-	border_interpolate_INDI (t, 3, 3);
-	interpolate_INDI_part(t);
-	g_thread_exit(NULL);
+	DirectionalInfo *info = _info;
+	const guint filters = info->filters;
+	const gint w = info->image->w;
+	gint row, col, i, j;
+
+	start_y = MAX(4, start_y);
+	end_y = MIN(info->image->h - 4, end_y);
+
+	for (row = start_y; row < end_y; row++)
+	{
+		const gushort *src = GET_PIXEL(info->image, 0, row);
+		const gint *dh = &info->dh[row * w];
+		const gint *dv = &info->dv[row * w];
+		guchar *dir = &info->dir[row * w];
+		gushort (*pix)[4] = (gushort (*)[4]) GET_PIXEL(info->output, 0, row);
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+		for (col = 4 + (FC(row, 4) == 1); col < w - 4; col += 2)
+		{
+			gint ch = 0, cv = 0, d;
+
+			/* Sum gradients of the color differences in a 5x5 window */
+			for (j = -2; j <= 2; j++)
+				for (i = -2; i < 2; i++)
+				{
+					ch += ABS(dh[j*w + col+i] - dh[j*w + col+i+1]);
+					cv += ABS(dv[i*w + col+j] - dv[(i+1)*w + col+j]);
+				}
+
+			if (ch < cv)
+			{
+				d = dh[col];
+				dir[col] = DIRECTION_H;
+			}
+			else if (cv < ch)
+			{
+				d = dv[col];
+				dir[col] = DIRECTION_V;
+			}
+			else
+			{
+				d = (dh[col] + dv[col]) >> 1;
+				dir[col] = DIRECTION_BOTH;
+			}
+
+			pix[col][1] = CLIP(src[col] + d);
+		}
+	}
 }
 
+/* Interpolate red and blue at green pixels from color differences to the final green */
 static void
-ppg_interpolate_INDI(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, const int colors)
+directional_color_green(gint start_y, gint end_y, gpointer _info)
 {
-	guint i, y_offset, y_per_thread, threaded_h;
-	const guint threads = rs_get_number_of_processor_cores();
-	ThreadInfo *t = g_new(ThreadInfo, threads);
+	DirectionalInfo *info = _info;
+	RS_IMAGE16 *image = info->output;
+	const guint filters = info->filters;
+	const gint p = image->pitch;
+	gint row, col;
 
-	threaded_h = image->h;
-	y_per_thread = (threaded_h + threads-1)/threads;
-	y_offset = 0;
+	start_y = MAX(5, start_y);
+	end_y = MIN(image->h - 5, end_y);
 
-	for (i = 0; i < threads; i++)
+	for (row = start_y; row < end_y; row++)
 	{
-		t[i].image = image;
-		t[i].output = output;
-		t[i].filters = filters;
-		t[i].start_y = y_offset;
-		y_offset += y_per_thread;
-		y_offset = MIN(image->h, y_offset);
-		t[i].end_y = y_offset;
-
-		t[i].threadid = g_thread_create(start_interp_thread, &t[i], TRUE, NULL);
+		const gint ch = FC(row, 5 + (FC(row, 5) != 1) + 1);
+		const gint cv = 2 - ch;
+
+		for (col = 5 + (FC(row, 5) != 1); col < image->w - 5; col += 2)
+		{
+			gushort (*pix)[4] = (gushort (*)[4]) GET_PIXEL(image, col, row);
+			pix[0][ch] = CLIP(pix[0][1] + ((pix[-1][ch] - pix[-1][1] + pix[1][ch] - pix[1][1]) >> 1));
+			pix[0][cv] = CLIP(pix[0][1] + ((pix[-p][cv] - pix[-p][1] + pix[p][cv] - pix[p][1]) >> 1));
+		}
 	}
+}
+
+/* Interpolate blue at red pixels and vice versa, in the direction chosen for green */
+static void
+directional_color_other(gint start_y, gint end_y, gpointer _info)
+{
+	DirectionalInfo *info = _info;
+	RS_IMAGE16 *image = info->output;
+	const guint filters = info->filters;
+	const gint p = image->pitch;
+	const gint w = image->w;
+	gint row, col, d;
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	start_y = MAX(6, start_y);
+	end_y = MIN(image->h - 6, end_y);
+
+	for (row = start_y; row < end_y; row++)
+	{
+		const guchar *dir = &info->dir[row * w];
+
+		for (col = 6 + (FC(row, 6) == 1); col < w - 6; col += 2)
+		{
+			gushort (*pix)[4] = (gushort (*)[4]) GET_PIXEL(image, col, row);
+			const gint o = 2 - FC(row, col);
+
+			if (dir[col] == DIRECTION_H)
+				d = (pix[-1][o] - pix[-1][1] + pix[1][o] - pix[1][1]) >> 1;
+			else if (dir[col] == DIRECTION_V)
+				d = (pix[-p][o] - pix[-p][1] + pix[p][o] - pix[p][1]) >> 1;
+			else
+				d = (pix[-1][o] - pix[-1][1] + pix[1][o] - pix[1][1] +
+					pix[-p][o] - pix[-p][1] + pix[p][o] - pix[p][1]) >> 2;
 
-	g_free(t);
+			pix[0][o] = CLIP(pix[0][1] + d);
+		}
+	}
+}
+
+/* Store red - green and blue - green of the interpolated image, reusing the direction buffers */
+static void
+directional_color_differences(gint start_y, gint end_y, gpointer _info)
+{
+	DirectionalInfo *info = _info;
+	RS_IMAGE16 *image = info->output;
+	const gint w = image->w;
+	gint row, col;
+
+	for (row = start_y; row < end_y; row++)
+	{
+		gushort (*pix)[4] = (gushort (*)[4]) GET_PIXEL(image, 0, row);
+		gint *rg = &info->dh[row * w];
+		gint *bg = &info->dv[row * w];
+
+		for (col = 0; col < w; col++)
+		{
+			rg[col] = pix[col][R] - pix[col][G];
+			bg[col] = pix[col][B] - pix[col][G];
+		}
+	}
+}
+
+#define PIX_SORT(a,b) { gint _t = MIN(a,b); b = MAX(a,b); a = _t; }
+
+/* Median of 9 values using a 19 exchange sorting network, p is destroyed */
+static inline gint
+median9(gint *p)
+{
+	PIX_SORT(p[1], p[2]); PIX_SORT(p[4], p[5]); PIX_SORT(p[7], p[8]);
+	PIX_SORT(p[0], p[1]); PIX_SORT(p[3], p[4]); PIX_SORT(p[6], p[7]);
+	PIX_SORT(p[1], p[2]); PIX_SORT(p[4], p[5]); PIX_SORT(p[7], p[8]);
+	PIX_SORT(p[0], p[3]); PIX_SORT(p[5], p[8]); PIX_SORT(p[4], p[7]);
+	PIX_SORT(p[3], p[6]); PIX_SORT(p[1], p[4]); PIX_SORT(p[2], p[5]);
+	PIX_SORT(p[4], p[7]); PIX_SORT(p[4], p[2]); PIX_SORT(p[6], p[4]);
+	PIX_SORT(p[4], p[2]);
+	return p[4];
+}
+
+#undef PIX_SORT
+
+/* Rebuild the interpolated colors from 3x3 median filtered color differences */
+static void
+directional_refine(gint start_y, gint end_y, gpointer _info)
+{
+	DirectionalInfo *info = _info;
+	RS_IMAGE16 *image = info->output;
+	const guint filters = info->filters;
+	const gint w = image->w;
+	gint row, col, i, j;
+	gint rg[9], bg[9];
+
+	start_y = MAX(6, start_y);
+	end_y = MIN(image->h - 6, end_y);
+
+	for (row = start_y; row < end_y; row++)
+		for (col = 6; col < w - 6; col++)
+		{
+			gushort *pix = GET_PIXEL(image, col, row);
+			gint n = 0;
+
+			for (j = -1; j <= 1; j++)
+				for (i = -1; i <= 1; i++)
+				{
+					rg[n] = info->dh[(row+j)*w + col+i];
+					bg[n] = info->dv[(row+j)*w + col+i];
+					n++;
+				}
+			const gint d_rg = median9(rg);
+			const gint d_bg = median9(bg);
+
+			switch (FC(row, col))
+			{
+				case R:
+					pix[G] = CLIP(pix[R] - d_rg);
+					pix[B] = CLIP(pix[G] + d_bg);
+					break;
+				case B:
+					pix[G] = CLIP(pix[B] - d_bg);
+					pix[R] = CLIP(pix[G] + d_rg);
+					break;
+				default:
+					pix[R] = CLIP(pix[G] + d_rg);
+					pix[B] = CLIP(pix[G] + d_bg);
+					break;
+			}
+		}
 }
 
+static void
+directional_interpolate(RS_IMAGE16 *image, RS_IMAGE16 *output, const unsigned int filters, RSParallelPriority priority)
+{
+	DirectionalInfo info;
+
+	info.image = image;
+	info.output = output;
+	info.filters = filters;
+	info.dh = g_new(gint, image->w * image->h);
+	info.dv = g_new(gint, image->w * image->h);
+	info.dir = g_new(guchar, image->w * image->h);
+
+	/* Every pass reads rows of the previous pass, so these cannot be fused */
+	rs_parallel_for_full(0, image->h, 0, priority, directional_hotpixel, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_expand, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_borders, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_differences, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_green, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_color_green, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_color_other, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_color_differences, &info);
+	rs_parallel_for_full(0, image->h, 0, priority, directional_refine, &info);
+
+	g_free(info.dh);
+	g_free(info.dv);
+	g_free(info.dir);
+}
 
-gpointer
-start_none_thread(gpointer _thread_info)
+static void
+none_rows(gint start_y, gint end_y, gpointer _thread_info)
 {
 	gint row, col;
 	gushort *src;
@@ -558,7 +947,7 @@ start_none_thread(gpointer _thread_info)
 	gint ors = t->output->rowstride;
 	guint filters = t->filters;
 
-	for(row=t->start_y; row < t->end_y; row++)
+	for(row=start_y; row < end_y; row++)
 	{
 		src = GET_PIXEL(t->image, 0, row);
 		dest = GET_PIXEL(t->output, 0, row);
@@ -615,20 +1004,17 @@ start_none_thread(gpointer _thread_info)
 			}
 		}
 		/*  Duplicate first & last line */
-		if (t->end_y == t->output->h - 1) 
+		if (end_y == t->output->h - 1) 
 		{
-			memcpy(GET_PIXEL(t->output, 0, t->end_y), GET_PIXEL(t->output, 0, t->end_y - 1), t->output->rowstride * 2);
+			memcpy(GET_PIXEL(t->output, 0, end_y), GET_PIXEL(t->output, 0, end_y - 1), t->output->rowstride * 2);
 			memcpy(GET_PIXEL(t->output, 0, 0), GET_PIXEL(t->output, 0, 1), t->output->rowstride * 2);
 		}
 	}
-	g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
 }
 
 
-gpointer
-start_none_thread_half(gpointer _thread_info)
+static void
+none_rows_half(gint start_y, gint end_y, gpointer _thread_info)
 {
 	gint row, col, i, j;
 	gushort *src;
@@ -638,7 +1024,7 @@ start_none_thread_half(gpointer _thread_info)
 	guint filters = t->filters;
 	gint col_end = t->output->w;
 
-	for(row=t->start_y; row < t->end_y; row++)
+	for(row=start_y; row < end_y; row++)
 	{
 		gint src_row = row*2;
 		src = GET_PIXEL(t->image, 0, src_row);
@@ -671,50 +1057,32 @@ start_none_thread_half(gpointer _thread_info)
 		}
 
 	}
-	g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
 }
 
 
 static void
-none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors, gboolean half_size)
+none_interpolate_INDI(RS_IMAGE16 *in, RS_IMAGE16 *out, const unsigned int filters, const int colors, gboolean half_size, RSParallelPriority priority)
 {
-	guint i, y_offset, y_per_thread, threaded_h;
-	const guint threads = rs_get_number_of_processor_cores();
-	ThreadInfo *t = g_new(ThreadInfo, threads);
+	ThreadInfo t;
 
-	/* Subtract 1 from bottom  */
-	threaded_h = out->h-1;
-	y_per_thread = (threaded_h + threads-1)/threads;
-	y_offset = 0;
-
-	for (i = 0; i < threads; i++)
-	{
-		t[i].image = in;
-		t[i].filters = filters;
-		t[i].start_y = y_offset;
-		t[i].output = out;
-		y_offset += y_per_thread;
-		y_offset = MIN(out->h-1, y_offset);
-		t[i].end_y = y_offset;
-
-		if (half_size)
-			t[i].threadid = g_thread_create(start_none_thread_half, &t[i], TRUE, NULL);
-		else
-			t[i].threadid = g_thread_create(start_none_thread, &t[i], TRUE, NULL);
-	}
-
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	t.image = in;
+	t.output = out;
+	t.filters = filters;
 
-	g_free(t);
+	/* Subtract 1 from bottom  */
+	if (half_size)
+		rs_parallel_for_full(0, out->h-1, 0, priority, none_rows_half, &t);
+	else
+		rs_parallel_for_full(0, out->h-1, 0, priority, none_rows, &t);
 }
 
 static void
 hotpixel_detect(const ThreadInfo* t)
 {
+	if ((rs_detect_cpu_features() & RS_CPU_FLAG_AVX2) && hotpixel_detect_AVX2(t))
+		return;
+	if ((rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && hotpixel_detect_SSE2(t))
+		return;
 
 	RS_IMAGE16 *image = t->image;
 
@@ -728,57 +1096,7 @@ hotpixel_detect(const ThreadInfo* t)
 		gushort* img = GET_PIXEL(image, 0, y);
 		gint p = image->rowstride * 2;
 		gint p_one = image->rowstride;
-		for (x = 4; x < col_end ; x++) {
-			/* Calculate minimum difference to surrounding pixels */
-			gint left = (int)img[x - 2];
-			gint c = (int)img[x];
-			gint right = (int)img[x + 2];
-			gint up = (int)img[x - p];
-			gint down = (int)img[x + p];
-
-			gint d = ABS(c - left);
-			d = MIN(d, ABS(c - right));
-			d = MIN(d, ABS(c - up));
-			d = MIN(d, ABS(c - down));
-
-			/* Also calculate maximum difference between surrounding pixels themselves */
-			gint d2 = ABS(left - right);
-			d2 = MAX(d2, ABS(up - down));
-
-			/* If difference larger than surrounding pixels by a factor of 4,
-				replace with left/right pixel interpolation */
-
-			if ((d > d2 * 8) && (d > 2000)) {
-				/* Do extended test! */
-				left = (int)img[x - 4];
-				right = (int)img[x + 4];
-				up = (int)img[x - p * 2];
-				down = (int)img[x + p * 2];
-
-				d = MIN(d, ABS(c - left));
-				d = MIN(d, ABS(c - right));
-				d = MIN(d, ABS(c - up));
-				d = MIN(d, ABS(c - down));
-
-				/* Create threshold for surrounding pixels - also include other colors */
-				d2 = MAX(d2, ABS(left - right));
-				d2 = MAX(d2, ABS(up - down));
-				d = MIN(d, ABS(c - (int)img[x - 2 - p]));
-				d = MIN(d, ABS(c - (int)img[x + 2 - p]));
-				d = MIN(d, ABS(c - (int)img[x - 2 + p]));
-				d = MIN(d, ABS(c - (int)img[x + 2 + p]));
-				d2 = MAX(d2, ABS((int)img[x - 1] - (int)img[x + 1]));
-				d2 = MAX(d2, ABS((int)img[x - p_one] - (int)img[x + p_one]));
-				d2 = MAX(d2, ABS((int)img[x - 1 - p_one] - (int)img[x + 1 + p_one]));
-				d2 = MAX(d2, ABS((int)img[x - 1 + p_one] - (int)img[x + 1 - p_one]));
-				d2 = MAX(d2, ABS((int)img[x - 2 - p] - (int)img[x + 2 + p]));
-				d2 = MAX(d2, ABS((int)img[x - 2 + p] - (int)img[x + 2 - p]));
-
-				if ((d > d2 * 4) && (d > 1600)) {
-					img[x] = (gushort)(((gint)img[x-2] + (gint)img[x+2] + 1) >> 1);
-				}
-			}
-
-		}
+		for (x = 4; x < col_end ; x++)
+			hotpixel_pixel(img, x, p, p_one);
 	}
 }
@@ -0,0 +1,141 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef DEMOSAIC_H
+#define DEMOSAIC_H
+
+#include <rawstudio.h>
+
+typedef struct {
+	gint start_y;
+	gint end_y;
+	RS_IMAGE16 *image;
+	RS_IMAGE16 *output;
+	guint filters;
+	gboolean bayer;		/* 2x2 pattern with green in a checkerboard, 1 and 4 channel images */
+} ThreadInfo;
+
+/*
+   In order to inline this calculation, I make the risky
+   assumption that all filter patterns can be described
+   by a repeating pattern of eight rows and two columns
+
+   Return values are either 0/1/2/3 = G/M/C/Y or 0/1/2/3 = R/G1/B/G2
+ */
+#define FC(row,col) \
+  (int)(filters >> ((((row) << 1 & 14) + ((col) & 1)) << 1) & 3)
+
+#define ULIM(x,y,z) ((y) < (z) ? CLAMP(x,y,z) : CLAMP(x,z,y))
+
+/* Hot pixel test and correction of a single CFA pixel. p is two rows, p_one is one row */
+static inline void
+hotpixel_pixel(gushort *img, gint x, gint p, gint p_one)
+{
+	/* Calculate minimum difference to surrounding pixels */
+	gint left = (int)img[x - 2];
+	gint c = (int)img[x];
+	gint right = (int)img[x + 2];
+	gint up = (int)img[x - p];
+	gint down = (int)img[x + p];
+
+	gint d = ABS(c - left);
+	d = MIN(d, ABS(c - right));
+	d = MIN(d, ABS(c - up));
+	d = MIN(d, ABS(c - down));
+
+	/* Also calculate maximum difference between surrounding pixels themselves */
+	gint d2 = ABS(left - right);
+	d2 = MAX(d2, ABS(up - down));
+
+	/* If difference larger than surrounding pixels by a factor of 4,
+		replace with left/right pixel interpolation */
+
+	if ((d > d2 * 8) && (d > 2000)) {
+		/* Do extended test! */
+		left = (int)img[x - 4];
+		right = (int)img[x + 4];
+		up = (int)img[x - p * 2];
+		down = (int)img[x + p * 2];
+
+		d = MIN(d, ABS(c - left));
+		d = MIN(d, ABS(c - right));
+		d = MIN(d, ABS(c - up));
+		d = MIN(d, ABS(c - down));
+
+		/* Create threshold for surrounding pixels - also include other colors */
+		d2 = MAX(d2, ABS(left - right));
+		d2 = MAX(d2, ABS(up - down));
+		d = MIN(d, ABS(c - (int)img[x - 2 - p]));
+		d = MIN(d, ABS(c - (int)img[x + 2 - p]));
+		d = MIN(d, ABS(c - (int)img[x - 2 + p]));
+		d = MIN(d, ABS(c - (int)img[x + 2 + p]));
+		d2 = MAX(d2, ABS((int)img[x - 1] - (int)img[x + 1]));
+		d2 = MAX(d2, ABS((int)img[x - p_one] - (int)img[x + p_one]));
+		d2 = MAX(d2, ABS((int)img[x - 1 - p_one] - (int)img[x + 1 + p_one]));
+		d2 = MAX(d2, ABS((int)img[x - 1 + p_one] - (int)img[x + 1 - p_one]));
+		d2 = MAX(d2, ABS((int)img[x - 2 - p] - (int)img[x + 2 + p]));
+		d2 = MAX(d2, ABS((int)img[x - 2 + p] - (int)img[x + 2 - p]));
+
+		if ((d > d2 * 4) && (d > 1600)) {
+			img[x] = (gushort)(((gint)img[x-2] + (gint)img[x+2] + 1) >> 1);
+		}
+	}
+}
+
+/* PPG green interpolation of a single red or blue pixel, p is the pitch in pixels */
+static inline void
+ppg_green_pixel(gushort (*pix)[4], const int c, const int p)
+{
+	const int p3 = p*3;
+	int diffA, diffB, guessA, guessB;
+
+	guessA = (pix[-1][1] + pix[0][c] + pix[1][1]) * 2
+		- pix[-2*1][c] - pix[2*1][c];
+	diffA = ( ABS(pix[-2*1][c] - pix[ 0][c]) +
+		ABS(pix[ 2*1][c] - pix[ 0][c]) +
+		ABS(pix[  -1][1] - pix[ 1][1]) ) * 3 +
+		( ABS(pix[ 3*1][1] - pix[ 1][1]) +
+		ABS(pix[-3*1][1] - pix[-1][1]) ) * 2;
+
+	guessB = (pix[-p][1] + pix[0][c] + pix[p][1]) * 2
+		- pix[-2*p][c] - pix[2*p][c];
+	diffB = ( ABS(pix[-2*p][c] - pix[ 0][c]) +
+		ABS(pix[ 2*p][c] - pix[ 0][c]) +
+		ABS(pix[  -p][1] - pix[ p][1]) ) * 3 +
+		( ABS(pix[ p3][1] - pix[ p][1]) +
+		ABS(pix[-p3][1] - pix[-p][1]) ) * 2;
+
+	if (diffA > diffB)
+		pix[0][1] = ULIM(guessB >> 2, pix[p][1], pix[-p][1]);
+	else
+		pix[0][1] = ULIM(guessA >> 2, pix[1][1], pix[-1][1]);
+}
+
+/* SSE2 optimized functions, these return FALSE if not compiled with SSE2 */
+gboolean expand_cfa_data_SSE2(const ThreadInfo* t);
+gboolean hotpixel_detect_SSE2(const ThreadInfo* t);
+gboolean ppg_green_SSE2(const ThreadInfo* t);
+
+/* AVX2 optimized functions, these return FALSE if not compiled with AVX2 */
+gboolean expand_cfa_data_AVX2(const ThreadInfo* t);
+gboolean hotpixel_detect_AVX2(const ThreadInfo* t);
+gboolean ppg_green_AVX2(const ThreadInfo* t);
+
+#endif /* DEMOSAIC_H */
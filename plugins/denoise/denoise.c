@@ -25,6 +25,9 @@
 #include "denoiseinterface.h"
 #include <string.h> /* memcpy */
 
+/* Largest area we will denoise for quick requests, above this we bail out */
+#define QUICK_MAX_PIXELS (4*1024*1024)
+
 #define RS_TYPE_DENOISE (rs_denoise_type)
 #define RS_DENOISE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_DENOISE, RSDenoise))
 #define RS_DENOISE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_DENOISE, RSDenoiseClass))
@@ -62,7 +65,10 @@ enum {
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static void settings_weak_notify(gpointer data, GObject *where_the_object_was);
+static gboolean quick_affordable(const RSFilterRequest *request, gint width, gint height);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterResponse *get_image_float(RSFilter *filter, const RSFilterRequest *request);
+static gint get_border(RSFilter *filter, const RSFilterRequest *request);
 static void settings_changed(RSSettings *settings, RSSettingsMask mask, RSDenoise *denoise);
 
 static RSFilterClass *rs_denoise_parent_class = NULL;
@@ -107,6 +113,8 @@ rs_denoise_class_init(RSDenoiseClass *klass)
 
 	filter_class->name = "FFT denoise filter";
 	filter_class->get_image = get_image;
+	filter_class->get_image_float = get_image_float;
+	filter_class->get_border = get_border;
 }
 
 
@@ -224,6 +232,43 @@ bit_blt(char* dstp, int dst_pitch, const char* srcp, int src_pitch, int row_size
 }
 
 
+static void
+set_parameters(RSDenoise *denoise, gfloat scale)
+{
+	denoise->info.sigmaLuma = ((float) denoise->denoise_luma * scale) / 3.0;
+	denoise->info.sigmaChroma = ((float) denoise->denoise_chroma * scale) / 2.0;
+	denoise->info.sharpenLuma = 1.5f * (float) denoise->sharpen / 20.0f;
+	denoise->info.sharpenLuma *= fminf(1.0f, 0.25 + ((100.0f - fminf(100.0f,denoise->denoise_luma)) / 100.0f));
+	denoise->info.sharpenCutoffLuma = 0.07f * scale;
+	denoise->info.betaLuma = 1.0 + denoise->info.sigmaLuma * 0.015;
+	denoise->info.sharpenChroma = 0.0f;
+	denoise->info.sharpenMinSigmaLuma = denoise->info.sigmaLuma * 1.0;
+	denoise->info.sharpenMaxSigmaLuma = denoise->info.sharpenMinSigmaLuma + denoise->info.sharpenLuma * 3.0f;
+	denoise->info.redCorrection = 1.0f;
+	denoise->info.blueCorrection = 1.0f;
+}
+
+/**
+ * Check if a quick request is small enough to be denoised at quick settings
+ * @param request The request to check
+ * @param width The width of the input image
+ * @param height The height of the input image
+ * @return TRUE if the area to be denoised is within QUICK_MAX_PIXELS
+ */
+static gboolean
+quick_affordable(const RSFilterRequest *request, gint width, gint height)
+{
+	GdkRectangle *roi = rs_filter_request_get_roi(request);
+
+	if (roi)
+	{
+		width = MIN(width, roi->width);
+		height = MIN(height, roi->height);
+	}
+
+	return ((gint64) width * (gint64) height) <= QUICK_MAX_PIXELS;
+}
+
 static RSFilterResponse *
 get_image(RSFilter *filter, const RSFilterRequest *request)
 {
@@ -251,8 +296,9 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
 
-	/* If the request is marked as "quick", bail out, we're slow */
-	if (rs_filter_request_get_quick(request))
+	/* Quick requests get a cheaper denoise, unless the area is too large
+	 * to keep up - then bail out, we're slow */
+	if (rs_filter_request_get_quick(request) && !quick_affordable(request, input->w, input->h))
 	{
 		rs_filter_response_set_image(response, input);
 		rs_filter_response_set_quick(response);
@@ -269,7 +315,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		roi->width += (roi->x&1);
 		roi->x -= (roi->x&1);
 		roi->width = MIN(input->w - roi->x, roi->width);
-		output = rs_image16_copy(input, FALSE);
+		output = rs_image16_new_area(input->w, input->h, input->channels, input->pixelsize, roi);
 		tmp = rs_image16_new_subframe(output, roi);
 		bit_blt((char*)GET_PIXEL(tmp,0,0), tmp->rowstride * 2, 
 			(const char*)GET_PIXEL(input,roi->x,roi->y), input->rowstride * 2, tmp->w * tmp->pixelsize * 2, tmp->h);
@@ -285,20 +331,122 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	g_object_unref(output);
 
 	denoise->info.image = tmp;
-	denoise->info.sigmaLuma = ((float) denoise->denoise_luma * scale) / 3.0;
-	denoise->info.sigmaChroma = ((float) denoise->denoise_chroma * scale) / 2.0;
-	denoise->info.sharpenLuma = 1.5f * (float) denoise->sharpen / 20.0f;
-	denoise->info.sharpenLuma *= fminf(1.0f, 0.25 + ((100.0f - fminf(100.0f,denoise->denoise_luma)) / 100.0f));
-	denoise->info.sharpenCutoffLuma = 0.07f * scale;
-	denoise->info.betaLuma = 1.0 + denoise->info.sigmaLuma * 0.015;
-	denoise->info.sharpenChroma = 0.0f;
-	denoise->info.sharpenMinSigmaLuma = denoise->info.sigmaLuma * 1.0;
-	denoise->info.sharpenMaxSigmaLuma = denoise->info.sharpenMinSigmaLuma + denoise->info.sharpenLuma * 3.0f;
-	denoise->info.redCorrection = 1.0f;
-	denoise->info.blueCorrection = 1.0f;
+	set_parameters(denoise, scale);
+	denoise->info.quick = rs_filter_request_get_quick(request);
 
 	denoiseImage(&denoise->info);
 	g_object_unref(tmp);
 
+	/* Let the preview come back for the full quality version */
+	if (denoise->info.quick)
+		rs_filter_response_set_quick(response);
+
 	return response;
 }
+
+static RSFilterResponse *
+get_image_float(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSDenoise *denoise = RS_DENOISE(filter);
+	GdkRectangle *roi;
+	GdkRectangle area;
+	RSFilterResponse *previous_response;
+	RSFilterResponse *response;
+	RSImage *input;
+	RSImage *output;
+	RSImage *tmp;
+
+	previous_response = rs_filter_get_image_float(filter->previous, request);
+
+	if (!RS_IS_FILTER(filter->previous))
+		return previous_response;
+
+	if ((denoise->sharpen + denoise->denoise_luma + denoise->denoise_chroma) == 0)
+		return previous_response;
+
+	input = rs_filter_response_get_image_float(previous_response);
+
+	if (!input)
+		return previous_response;
+
+	response = rs_filter_response_clone(previous_response);
+	g_object_unref(previous_response);
+
+	/* Quick requests get a cheaper denoise, unless the area is too large
+	 * to keep up - then bail out, we're slow */
+	if ((rs_filter_request_get_quick(request) && !quick_affordable(request, input->width, input->height))
+		|| rs_image_get_number_of_planes(input) != 3)
+	{
+		rs_filter_response_set_image_float(response, input);
+		if (rs_filter_request_get_quick(request))
+			rs_filter_response_set_quick(response);
+		g_object_unref(input);
+		return response;
+	}
+
+	gfloat scale = 1.0;
+	rs_filter_get_recursive(RS_FILTER(denoise), "scale", &scale, NULL);
+
+	if ((roi = rs_filter_request_get_roi(request)))
+	{
+		/* Align so we start at even pixel counts */
+		area = *roi;
+		area.width += (area.x&1);
+		area.x -= (area.x&1);
+		area.width = MIN(input->width - area.x, area.width);
+	}
+	else
+	{
+		area.x = 0;
+		area.y = 0;
+		area.width = input->width;
+		area.height = input->height;
+	}
+
+	/* Denoise a copy of the area, planes cannot be shared like subframes */
+	tmp = rs_image_new(area.width, area.height, input->number_of_planes);
+	rs_image_copy_area(input, area.x, area.y, area.width, area.height, tmp, 0, 0);
+
+	denoise->info.image = NULL;
+	denoise->info.imageFloat = tmp;
+	set_parameters(denoise, scale);
+	denoise->info.quick = rs_filter_request_get_quick(request);
+
+	denoiseImage(&denoise->info);
+	denoise->info.imageFloat = NULL;
+
+	/* Without a ROI the copy is the complete image */
+	if (roi)
+	{
+		output = rs_image_new_area(input->width, input->height, input->number_of_planes, &area);
+		rs_image_copy_area(tmp, 0, 0, area.width, area.height, output, area.x, area.y);
+		g_object_unref(tmp);
+	}
+	else
+		output = tmp;
+	g_object_unref(input);
+
+	rs_filter_response_set_image_float(response, output);
+	g_object_unref(output);
+
+	/* Let the preview come back for the full quality version */
+	if (denoise->info.quick)
+		rs_filter_response_set_quick(response);
+
+	return response;
+}
+
+static gint
+get_border(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSDenoise *denoise = RS_DENOISE(filter);
+
+	/* We don't touch pixels with no denoise/sharpen */
+	if ((denoise->sharpen + denoise->denoise_luma + denoise->denoise_chroma) == 0)
+		return 0;
+
+	/* Blocks are overlapping, so we need half a block of surrounding pixels
+	 * to avoid seams at ROI edges. This is FFT_BLOCK_SIZE/2, also for
+	 * quick requests, they only use less overlap */
+	return 64;
+}
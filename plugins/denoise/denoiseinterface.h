@@ -37,6 +37,7 @@ typedef enum {
 typedef struct {
   InitDenoiseMode processMode;  // Set this before initializing, DO NOT modify after that.
   RS_IMAGE16* image;            // This will be input and output
+  RSImage* imageFloat;          // Planar float input and output, used instead of image if set (YUV mode only)
   float sigmaLuma;              // In RGB mode this is used for all planes, YUV mode only luma.
   float sigmaChroma;            // Used only in YUV mode.
   float betaLuma;               // In RGB mode this is used for all planes, YUV mode only luma.
@@ -54,6 +55,7 @@ typedef struct {
 
   float redCorrection;          // Red coefficient, multiplid to R in YUV conversion. (default: 1.0)
   float blueCorrection;         // Blue coefficient, multiplid to R in YUV conversion. (default: 1.0)
+  gboolean quick;               // Faster approximation using less block overlap, for previews (default: FALSE)
   void* _this;                  // Do not modify this value.
 } FFTDenoiseInfo;
 
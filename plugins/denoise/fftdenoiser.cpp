@@ -20,6 +20,7 @@
 #include "fftdenoiser.h"
 #include "complexblock.h"
 #include "fftdenoiseryuv.h"
+#include "fftplancache.h"
 
 #ifdef WIN32
 int rs_get_number_of_processor_cores(){return 4;}
@@ -32,6 +33,7 @@ namespace FFTFilter {
 FFTDenoiser::FFTDenoiser(void)
 {
   nThreads = rs_get_number_of_processor_cores();
+  overlap = FFT_BLOCK_OVERLAP;
   threads = new DenoiseThread[nThreads];
   initializeFFT();
   FloatPlanarImage::initConvTable();
@@ -39,9 +41,8 @@ FFTDenoiser::FFTDenoiser(void)
 
 FFTDenoiser::~FFTDenoiser(void)
 {
+  // Plans are owned by FFTPlanCache
   delete[] threads;
-  fftwf_destroy_plan(plan_forward);
-  fftwf_destroy_plan(plan_reverse); 
 }
 
 void FFTDenoiser::denoiseImage( RS_IMAGE16* image )
@@ -49,8 +50,8 @@ void FFTDenoiser::denoiseImage( RS_IMAGE16* image )
   FloatPlanarImage img;
   img.bw = FFT_BLOCK_SIZE;
   img.bh = FFT_BLOCK_SIZE;
-  img.ox = FFT_BLOCK_OVERLAP;
-  img.oy = FFT_BLOCK_OVERLAP;
+  img.ox = overlap;
+  img.oy = overlap;
 
   if ((image->w < FFT_BLOCK_SIZE) || (image->h < FFT_BLOCK_SIZE))
      return;   // Image too small to denoise
@@ -91,6 +92,12 @@ void FFTDenoiser::denoiseImage( RS_IMAGE16* image )
   }
 }
 
+void FFTDenoiser::denoiseImageFloat( RSImage* image )
+{
+  // Only implemented in YUV mode
+  g_warning("Planar float denoising is only supported in YUV mode");
+}
+
 void FFTDenoiser::processJobs(FloatPlanarImage &img, FloatPlanarImage &outImg)
 {
   // Prepare for reassembling the image
@@ -152,17 +159,11 @@ void FFTDenoiser::waitForJobs(JobQueue *waiting_jobs)
   delete finished_jobs;
 }
 
+// Get plans from the cache, this is cheap and picks up measured plans once
+// they are ready. Block data is allocated with 16 byte alignment.
 gboolean FFTDenoiser::initializeFFT()
 {
-  // Create dummy block
-  FloatImagePlane plane(FFT_BLOCK_SIZE,FFT_BLOCK_SIZE);
-  plane.allocateImage();
-  ComplexBlock complex(FFT_BLOCK_SIZE,FFT_BLOCK_SIZE);
-  int dim[2];
-  dim[0] = FFT_BLOCK_SIZE;
-  dim[1] = FFT_BLOCK_SIZE;
-  plan_forward = fftwf_plan_dft_r2c(2, dim, plane.data, complex.complex,FFTW_MEASURE|FFTW_DESTROY_INPUT);
-  plan_reverse = fftwf_plan_dft_c2r(2, dim, complex.complex, plane.data,FFTW_MEASURE|FFTW_DESTROY_INPUT);
+  FFTPlanCache::getPlans(FFT_BLOCK_SIZE, FFT_BLOCK_SIZE, 16, &plan_forward, &plan_reverse);
   for (guint i = 0; i < nThreads; i++) {
     threads[i].forward = plan_forward;
     threads[i].reverse = plan_reverse;
@@ -179,6 +180,7 @@ void FFTDenoiser::setParameters( FFTDenoiseInfo *info )
   sharpenCutoff = info->sharpenCutoffLuma;
   sharpenMinSigma = info->sharpenMinSigmaLuma*SIGMA_FACTOR;
   sharpenMaxSigma = info->sharpenMaxSigmaLuma*SIGMA_FACTOR;
+  overlap = info->quick ? FFT_BLOCK_OVERLAP_QUICK : FFT_BLOCK_OVERLAP;
 }
 
 }}// namespace RawStudio::FFTFilter
@@ -215,13 +217,20 @@ extern "C" {
     info->sharpenMaxSigmaChroma = 20.0f;
     info->redCorrection = 1.0f;
     info->blueCorrection = 1.0f;
+    info->quick = FALSE;
+    info->image = NULL;
+    info->imageFloat = NULL;
   }
 
   void denoiseImage(FFTDenoiseInfo* info) {
     RawStudio::FFTFilter::FFTDenoiser *t = (RawStudio::FFTFilter::FFTDenoiser*)info->_this;  
     t->abort = false;
+    t->initializeFFT();
     t->setParameters(info);
-    t->denoiseImage(info->image);
+    if (info->imageFloat)
+      t->denoiseImageFloat(info->imageFloat);
+    else
+      t->denoiseImage(info->image);
   }
 
   void destroyDenoiser(FFTDenoiseInfo* info) {
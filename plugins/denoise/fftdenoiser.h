@@ -29,6 +29,7 @@ namespace FFTFilter {
 
 #define FFT_BLOCK_SIZE 128       // Preferable able to be factorized into primes, must be divideable by 4.
 #define FFT_BLOCK_OVERLAP 24    // Must be dividable by 4 (OVERLAP * 2 must be < SIZE)
+#define FFT_BLOCK_OVERLAP_QUICK 8 // Used for quick previews, half the blocks but may show faint seams
 #define SIGMA_FACTOR 0.25f;    // Amount to multiply sigma by to give reasonable amount
 
 class FFTDenoiser
@@ -39,6 +40,7 @@ public:
   gboolean initializeFFT();
   virtual void setParameters( FFTDenoiseInfo *info);
   virtual void denoiseImage(RS_IMAGE16* image);
+  virtual void denoiseImageFloat(RSImage* image);
   gboolean abort;
 protected:
   virtual void processJobs(FloatPlanarImage &img, FloatPlanarImage &outImg);
@@ -47,6 +49,7 @@ protected:
   DenoiseThread *threads;
   fftwf_plan plan_forward;
   fftwf_plan plan_reverse;
+  int overlap;             // Block overlap, FFT_BLOCK_OVERLAP unless quick
   float sigma;
   float beta;
   float sharpen;           
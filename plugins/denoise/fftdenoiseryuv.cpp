@@ -36,8 +36,8 @@ void FFTDenoiserYUV::denoiseImage( RS_IMAGE16* image )
   FloatPlanarImage img;
   img.bw = FFT_BLOCK_SIZE;
   img.bh = FFT_BLOCK_SIZE;
-  img.ox = FFT_BLOCK_OVERLAP;
-  img.oy = FFT_BLOCK_OVERLAP;
+  img.ox = overlap;
+  img.oy = overlap;
 
   img.redCorrection = redCorrection;
   img.blueCorrection = blueCorrection;
@@ -52,9 +52,51 @@ void FFTDenoiserYUV::denoiseImage( RS_IMAGE16* image )
 
   if (abort) return;
 
-  img.mirrorEdges();
+  FloatPlanarImage outImg(img);
+
+  if (!denoisePlanes(img, outImg))
+    return;
+
+  // Convert back
+  waitForJobs(outImg.getPackInterleavedYUVJobs(image));
+}
+
+void FFTDenoiserYUV::denoiseImageFloat( RSImage* image )
+{
+  FloatPlanarImage img;
+  img.bw = FFT_BLOCK_SIZE;
+  img.bh = FFT_BLOCK_SIZE;
+  img.ox = overlap;
+  img.oy = overlap;
+
+  img.redCorrection = redCorrection;
+  img.blueCorrection = blueCorrection;
+
+  if ((image->width < FFT_BLOCK_SIZE) || (image->height < FFT_BLOCK_SIZE))
+     return;   // Image too small to denoise
+
+  if (image->number_of_planes != 3)
+     return;   // No conversion possible with this image
+
+  waitForJobs(img.getUnpackFloatYUVJobs(image));
+
   if (abort) return;
 
+  FloatPlanarImage outImg(img);
+
+  if (!denoisePlanes(img, outImg))
+    return;
+
+  // Convert back
+  waitForJobs(outImg.getPackFloatYUVJobs(image));
+}
+
+// Denoise the unpacked planes of img into outImg. Returns false if aborted
+bool FFTDenoiserYUV::denoisePlanes(FloatPlanarImage &img, FloatPlanarImage &outImg)
+{
+  img.mirrorEdges();
+  if (abort) return false;
+
   FFTWindow window(img.bw,img.bh);
   window.createHalfCosineWindow(img.ox, img.oy);
 
@@ -70,13 +112,9 @@ void FFTDenoiserYUV::denoiseImage( RS_IMAGE16* image )
   filter->setSharpen(sharpenChroma, sharpenMinSigmaChroma, sharpenMaxSigmaChroma, sharpenCutoffChroma);
   img.setFilter(2,filter,&window);
 
-  FloatPlanarImage outImg(img);
-
   processJobs(img, outImg);
-  if (abort) return;
 
-  // Convert back
-  waitForJobs(outImg.getPackInterleavedYUVJobs(image));
+  return !abort;
 }
 
 
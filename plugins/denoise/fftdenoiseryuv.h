@@ -32,7 +32,11 @@ public:
   FFTDenoiserYUV();
   virtual ~FFTDenoiserYUV(void);
   virtual void denoiseImage(RS_IMAGE16* image);
+  virtual void denoiseImageFloat(RSImage* image);
   virtual void setParameters( FFTDenoiseInfo *info);
+protected:
+  bool denoisePlanes(FloatPlanarImage &img, FloatPlanarImage &outImg);
+public:
   float betaChroma;
   float sigmaLuma;
   float sigmaChroma;
@@ -0,0 +1,176 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "fftplancache.h"
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>  /* posix_memalign() */
+#include <unistd.h>  /* close() */
+
+namespace RawStudio {
+namespace FFTFilter {
+
+#define WISDOM_FILENAME "fftw-wisdom"
+
+std::map<guint, FFTPlans*> FFTPlanCache::cache;
+
+// Protects the cache
+static GStaticMutex cache_lock = G_STATIC_MUTEX_INIT;
+// The FFTW planner and wisdom are not thread safe
+static GStaticMutex planner_lock = G_STATIC_MUTEX_INIT;
+
+void FFTPlanCache::getPlans(int w, int h, int alignment, fftwf_plan *forward, fftwf_plan *reverse)
+{
+  guint key = (w << 16) | (h << 7) | alignment;
+  FFTPlans *plans;
+
+  g_assert(w < 32768 && h < 512 && alignment <= 64);
+
+  g_static_mutex_lock(&cache_lock);
+  if (cache.find(key) == cache.end()) {
+    plans = new FFTPlans();
+    plans->w = w;
+    plans->h = h;
+    plans->alignment = alignment;
+    plans->measured = FALSE;
+
+    loadWisdom();
+
+    // Measured or patient plans from wisdom are free, else estimate and measure later
+    if (createPlans(plans, FFTW_PATIENT|FFTW_WISDOM_ONLY) || createPlans(plans, FFTW_MEASURE|FFTW_WISDOM_ONLY)) {
+      plans->measured = TRUE;
+    } else {
+      if (!createPlans(plans, FFTW_ESTIMATE))
+        g_error("FFTW could not create plans for %dx%d blocks", w, h);
+      g_thread_create(measureThread, plans, FALSE, NULL);
+    }
+    cache[key] = plans;
+  }
+  plans = cache[key];
+  *forward = plans->forward;
+  *reverse = plans->reverse;
+  g_static_mutex_unlock(&cache_lock);
+}
+
+gpointer FFTPlanCache::measureThread(gpointer data)
+{
+  FFTPlans *plans = (FFTPlans*)data;
+  FFTPlans measured = *plans;
+
+  if (!createPlans(&measured, FFTW_MEASURE))
+    return NULL;
+
+  // The estimated plans may still be in use, so they are left alone
+  g_static_mutex_lock(&cache_lock);
+  plans->forward = measured.forward;
+  plans->reverse = measured.reverse;
+  plans->measured = TRUE;
+  g_static_mutex_unlock(&cache_lock);
+
+  saveWisdom();
+  return NULL;
+}
+
+// Plan on arrays with exactly the requested alignment, FFTW will then only
+// use instructions that are safe for all arrays aligned like that.
+gboolean FFTPlanCache::createPlans(FFTPlans *plans, unsigned flags)
+{
+  int dim[2];
+  dim[0] = plans->h;
+  dim[1] = plans->w;
+  gsize real_size = plans->w * plans->h * sizeof(float);
+  gsize complex_size = plans->h * (plans->w/2+1) * sizeof(fftwf_complex);
+  gchar *real_mem;
+  gchar *complex_mem;
+  int offset = plans->alignment < 64 ? plans->alignment : 0;
+
+  g_assert(0 == posix_memalign((void**)&real_mem, 64, real_size + 64));
+  g_assert(0 == posix_memalign((void**)&complex_mem, 64, complex_size + 64));
+  float *real = (float*)(real_mem + offset);
+  fftwf_complex *complex = (fftwf_complex*)(complex_mem + offset);
+
+  g_static_mutex_lock(&planner_lock);
+  fftwf_plan forward = fftwf_plan_dft_r2c(2, dim, real, complex, flags|FFTW_DESTROY_INPUT);
+  fftwf_plan reverse = NULL;
+  if (forward)
+    reverse = fftwf_plan_dft_c2r(2, dim, complex, real, flags|FFTW_DESTROY_INPUT);
+  if (forward && !reverse) {
+    fftwf_destroy_plan(forward);
+    forward = NULL;
+  }
+  g_static_mutex_unlock(&planner_lock);
+
+  free(real_mem);
+  free(complex_mem);
+
+  if (!forward)
+    return FALSE;
+
+  plans->forward = forward;
+  plans->reverse = reverse;
+  return TRUE;
+}
+
+void FFTPlanCache::loadWisdom()
+{
+  static gboolean loaded = FALSE;
+
+  if (loaded)
+    return;
+  loaded = TRUE;
+
+  gchar *filename = g_build_filename(rs_confdir_get(), WISDOM_FILENAME, NULL);
+  FILE *f = g_fopen(filename, "r");
+  if (f) {
+    g_static_mutex_lock(&planner_lock);
+    if (!fftwf_import_wisdom_from_file(f))
+      g_warning("Could not read FFTW wisdom from %s", filename);
+    g_static_mutex_unlock(&planner_lock);
+    fclose(f);
+  }
+  g_free(filename);
+}
+
+// Write to a temporary file first, other instances may read the wisdom
+void FFTPlanCache::saveWisdom()
+{
+  gchar *filename = g_build_filename(rs_confdir_get(), WISDOM_FILENAME, NULL);
+  gchar *tmpname = g_strconcat(filename, ".XXXXXX", NULL);
+  gint fd = g_mkstemp(tmpname);
+  FILE *f = (fd >= 0) ? fdopen(fd, "w") : NULL;
+
+  if (fd >= 0 && !f) {
+    close(fd);
+    g_unlink(tmpname);
+  }
+
+  if (f) {
+    g_static_mutex_lock(&planner_lock);
+    fftwf_export_wisdom_to_file(f);
+    g_static_mutex_unlock(&planner_lock);
+    if (fclose(f) == 0)
+      g_rename(tmpname, filename);
+    else
+      g_unlink(tmpname);
+  }
+  g_free(tmpname);
+  g_free(filename);
+}
+
+}}// namespace RawStudio::FFTFilter
@@ -0,0 +1,63 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef fftplancache_h__
+#define fftplancache_h__
+
+#include "fftw3.h"
+#include <rawstudio.h>
+#include <map>
+
+namespace RawStudio {
+namespace FFTFilter {
+
+/* Forward and reverse plans for one block size and alignment */
+class FFTPlans
+{
+public:
+  fftwf_plan forward;
+  fftwf_plan reverse;
+  int w;
+  int h;
+  int alignment;
+  gboolean measured;      // FALSE while the plans are estimated
+};
+
+/* Process wide plan cache, shared by all denoisers. Plans are never destroyed
+ * while the plugin is loaded, so users may keep the plans they got.
+ * FFTW wisdom is loaded from and saved to the Rawstudio config directory, so
+ * measured plans are available at once in later sessions. */
+class FFTPlanCache
+{
+public:
+  /* Get plans for w*h blocks, for arrays aligned to alignment bytes. If no
+   * measured plans are known, estimated plans are returned at once and
+   * measuring is started in the background. */
+  static void getPlans(int w, int h, int alignment, fftwf_plan *forward, fftwf_plan *reverse);
+private:
+  static gpointer measureThread(gpointer data);
+  static gboolean createPlans(FFTPlans *plans, unsigned flags);
+  static void loadWisdom();
+  static void saveWisdom();
+  static std::map<guint, FFTPlans*> cache;
+};
+
+}} // namespace RawStudio::FFTFilter
+
+#endif // fftplancache_h__
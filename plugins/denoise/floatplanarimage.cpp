@@ -163,6 +163,9 @@ JobQueue* FloatPlanarImage::getUnpackInterleavedYUVJobs(RS_IMAGE16* image) {
 
 void FloatPlanarImage::unpackInterleavedYUV( const ImgConvertJob* j )
 {
+  if (j->rsf)
+    return unpackFloatYUV(j);
+
   RS_IMAGE16* image = j->rs;
 
   // We cannot allow red/blue to become negative, since we need to square root it for gamma correction
@@ -231,6 +234,9 @@ JobQueue* FloatPlanarImage::getPackInterleavedYUVJobs(RS_IMAGE16* image) {
 
 void FloatPlanarImage::packInterleavedYUV( const ImgConvertJob* j)
 {
+  if (j->rsf)
+    return packFloatYUV(j);
+
   RS_IMAGE16* image = j->rs;
   guint cpu = rs_detect_cpu_features();
 #if defined (__x86_64__)
@@ -274,6 +280,122 @@ void FloatPlanarImage::packInterleavedYUV( const ImgConvertJob* j)
 }
 
 
+JobQueue* FloatPlanarImage::getUnpackFloatYUVJobs(RSImage* image) {
+  JobQueue* queue = new JobQueue();
+
+  if (image->number_of_planes != 3)
+    return queue;
+
+  g_assert(p == 0);
+  nPlanes = 3;
+  p = new FloatImagePlane*[nPlanes];
+
+  for (int i = 0; i < nPlanes; i++)
+    p[i] = new FloatImagePlane(image->width+ox*2, image->height+oy*2, i);
+
+  allocate_planes();
+  int threads = rs_get_number_of_processor_cores()*4;
+  int hEvery = MAX(1,(image->height+threads)/threads);
+  for (int i = 0; i < threads; i++) {
+    ImgConvertJob *j = new ImgConvertJob(this,JOB_CONVERT_TOFLOAT_YUV);
+    j->start_y = i*hEvery;
+    j->end_y = MIN((i+1)*hEvery,image->height);
+    j->rsf = image;
+    queue->addJob(j);
+  }
+  return queue;
+}
+
+// Same as unpackInterleavedYUV, but without the lookup and quantization
+void FloatPlanarImage::unpackFloatYUV( const ImgConvertJob* j )
+{
+  RSImage* image = j->rsf;
+
+  redCorrection = MAX(0.0f, redCorrection);
+  blueCorrection = MAX(0.0f, blueCorrection);
+
+  const float redc = 65535.0f * redCorrection;
+  const float greenc = 65535.0f;
+  const float bluec = 65535.0f * blueCorrection;
+
+  for (int y = j->start_y; y < j->end_y; y++ ) {
+    const gfloat* rp = RS_IMAGE_GET_ROW(image, 0, y);
+    const gfloat* gp = RS_IMAGE_GET_ROW(image, 1, y);
+    const gfloat* bp = RS_IMAGE_GET_ROW(image, 2, y);
+    gfloat *Y = p[0]->getAt(ox, y+oy);
+    gfloat *Cb = p[1]->getAt(ox, y+oy);
+    gfloat *Cr = p[2]->getAt(ox, y+oy);
+    for (int x=0; x<image->width; x++) {
+      float r = sqrtf(MAX(0.0f, rp[x] * redc));
+      float g = sqrtf(MAX(0.0f, gp[x] * greenc));
+      float b = sqrtf(MAX(0.0f, bp[x] * bluec));
+      *Y++ = r * 0.299 + g * 0.587 + b * 0.114 ;
+      float cb = r * -0.169 + g * -0.331 + b * 0.499;
+      float cr = r * 0.499 + g * -0.418 + b * -0.0813;
+      if (cr > 0.0f)   /* 50% Stronger denoise on red/blue */
+        cr *= 0.5f;
+      if (cb > 0.0f)
+        cb *= 0.5f;
+      *Cb++ = cb;
+      *Cr++ = cr;
+    }
+  }
+}
+
+JobQueue* FloatPlanarImage::getPackFloatYUVJobs(RSImage* image) {
+  JobQueue* queue = new JobQueue();
+
+  if (image->number_of_planes != 3)
+    return queue;
+
+  for (int i = 0; i < nPlanes; i++) {
+    g_assert(p[i]->w == image->width+ox*2);
+    g_assert(p[i]->h == image->height+oy*2);
+  }
+
+  int threads = rs_get_number_of_processor_cores()*4;
+  int hEvery = MAX(1,(image->height+threads)/threads);
+  for (int i = 0; i < threads; i++) {
+    ImgConvertJob *j = new ImgConvertJob(this,JOB_CONVERT_FROMFLOAT_YUV);
+    j->start_y = i*hEvery;
+    j->end_y = MIN((i+1)*hEvery,image->height);
+    j->rsf = image;
+    queue->addJob(j);
+  }
+  return queue;
+}
+
+void FloatPlanarImage::packFloatYUV( const ImgConvertJob* j)
+{
+  RSImage* image = j->rsf;
+  const gfloat r_factor = (1.0f/redCorrection) / 65535.0f;
+  const gfloat g_factor = 1.0f / 65535.0f;
+  const gfloat b_factor = (1.0f/blueCorrection) / 65535.0f;
+
+  for (int y = j->start_y; y < j->end_y; y++ ) {
+    gfloat *Y = p[0]->getAt(ox, y+oy);
+    gfloat *Cb = p[1]->getAt(ox, y+oy);
+    gfloat *Cr = p[2]->getAt(ox, y+oy);
+    gfloat* rp = RS_IMAGE_GET_ROW(image, 0, y);
+    gfloat* gp = RS_IMAGE_GET_ROW(image, 1, y);
+    gfloat* bp = RS_IMAGE_GET_ROW(image, 2, y);
+    for (int x=0; x<image->width; x++) {
+      float cr = Cr[x];
+      float cb = Cb[x];
+      if (cr > 0.0f) /* 50% Stronger denoise on red/blue */
+        cr += cr;
+      if (cb > 0.0f)
+        cb += cb;
+      float fr = (Y[x] + 1.402 * cr);
+      float fg = Y[x] - 0.344 * cb - 0.714 * cr;
+      float fb = (Y[x] + 1.772 * cb) ;
+      rp[x] = fr*fr* r_factor;
+      gp[x] = fg*fg* g_factor;
+      bp[x] = fb*fb* b_factor;
+    }
+  }
+}
+
 JobQueue* FloatPlanarImage::getJobs(FloatPlanarImage &outImg) {
   JobQueue *jobs = new JobQueue();
 
@@ -59,6 +59,10 @@ public:
   void packInterleavedYUV( const ImgConvertJob* j);
   JobQueue* getUnpackInterleavedYUVJobs(RS_IMAGE16* image);
   JobQueue* getPackInterleavedYUVJobs(RS_IMAGE16* image);
+  JobQueue* getUnpackFloatYUVJobs(RSImage* image);
+  JobQueue* getPackFloatYUVJobs(RSImage* image);
+  void unpackFloatYUV( const ImgConvertJob* j );
+  void packFloatYUV( const ImgConvertJob* j );
   FloatImagePlane* getPlaneSliceFrom(int plane, int x, int y);
 
   int bw;  // Block width
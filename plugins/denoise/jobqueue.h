@@ -55,9 +55,10 @@ public:
 class ImgConvertJob : public Job
 {
 public:
-  ImgConvertJob(FloatPlanarImage *_img, JobType _type) : Job(_type), img(_img) {};
+  ImgConvertJob(FloatPlanarImage *_img, JobType _type) : Job(_type), rs(0), rsf(0), img(_img) {};
   virtual ~ImgConvertJob(void) {};
   RS_IMAGE16 *rs;
+  RSImage *rsf;         // Planar float image, used instead of rs if set
   FloatPlanarImage *img;
   int start_y;
   int end_y;
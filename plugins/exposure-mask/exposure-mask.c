@@ -123,8 +123,9 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 	RSFilterResponse *response;
 	GdkPixbuf *input;
 	GdkPixbuf *output;
-	gint width, col;
-	gint height, row;
+	GdkRectangle *roi;
+	GdkRectangle area;
+	gint col, row;
 	guchar *in_pixel;
 	guchar *out_pixel;
 	gint channels;
@@ -134,20 +135,26 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 	response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
 
-	/* FIXME: Support ROI */
-	if (exposure_mask->exposure_mask)
+	if (exposure_mask->exposure_mask && input)
 	{
-		output = gdk_pixbuf_copy(input);
-		width = gdk_pixbuf_get_width(input);
-		height = gdk_pixbuf_get_height(input);
+		area.x = 0;
+		area.y = 0;
+		area.width = gdk_pixbuf_get_width(input);
+		area.height = gdk_pixbuf_get_height(input);
+
+		/* Only the ROI is rendered, the input may not have pixels elsewhere */
+		if ((roi = rs_filter_request_get_roi(request)))
+			gdk_rectangle_intersect(roi, &area, &area);
+
+		output = rs_pixbuf_new_area(gdk_pixbuf_get_has_alpha(input), gdk_pixbuf_get_width(input), gdk_pixbuf_get_height(input), &area);
 		channels = gdk_pixbuf_get_n_channels(input);
 
 		g_assert(channels == gdk_pixbuf_get_n_channels(output));
-		for(row=0;row<height;row++)
+		for(row=area.y;row<area.y+area.height;row++)
 		{
-			in_pixel = GET_PIXBUF_PIXEL(input, 0, row);
-			out_pixel = GET_PIXBUF_PIXEL(output, 0, row);
-			for(col=0;col<width;col++)
+			in_pixel = GET_PIXBUF_PIXEL(input, area.x, row);
+			out_pixel = GET_PIXBUF_PIXEL(output, area.x, row);
+			for(col=0;col<area.width;col++)
 			{
 				/* Catch pixels overexposed and color them red */
 				if ((in_pixel[R]==0xFF) || (in_pixel[G]==0xFF) || (in_pixel[B]==0xFF))
@@ -172,6 +179,8 @@ get_image8(RSFilter *filter, const RSFilterRequest *request)
 					out_pixel[G] = tmp;
 					out_pixel[B] = tmp;
 				}
+				if (channels == 4)
+					out_pixel[3] = in_pixel[3];
 				out_pixel += channels;
 				in_pixel += channels;
 			}
@@ -52,6 +52,7 @@ static void get_property (GObject *object, guint property_id, GValue *value, GPa
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_size(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterRoiSupport get_roi_support(RSFilter *filter);
 
 static RSFilterClass *rs_fuji_rotate_parent_class = NULL;
 
@@ -84,6 +85,7 @@ rs_fuji_rotate_class_init(RSFujiRotateClass *klass)
 	filter_class->name = "FujiRotate filter";
 	filter_class->get_image = get_image;
 	filter_class->get_size = get_size;
+	filter_class->get_roi_support = get_roi_support;
 }
 
 static void
@@ -220,3 +222,10 @@ get_size(RSFilter *filter, const RSFilterRequest *request)
 
 	return response;
 }
+
+static RSFilterRoiSupport
+get_roi_support(RSFilter *filter)
+{
+	/* Rotating always renders the complete image */
+	return RS_FILTER_ROI_IGNORED;
+}
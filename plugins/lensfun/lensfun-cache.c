@@ -0,0 +1,234 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* The lens database is shared by all lensfun filters, and coordinate maps
+   for geometry correction are cached, so rendering the same photo again
+   doesn't touch the lensfun math. Maps are stored on a coarse grid and
+   interpolated bilinearly, the correction is smooth enough for this to be
+   indistinguishable from per pixel results. */
+
+#include <rawstudio.h>
+#include <string.h>
+#include <math.h> /* floorf() */
+#include "lensfun-cache.h"
+
+/* Distance in pixels between two grid nodes */
+#define MAP_GRID_STEP 8
+
+/* Maximum number of maps kept, maps for a 24 megapixel image are ~9MB */
+#define MAP_CACHE_SIZE 4
+
+struct _RSLensfunMap {
+	gchar *key;
+	gint width;
+	gint height;
+	gint grid_width;
+	gint grid_height;
+	gfloat *nodes; /* 6 floats per node */
+	gint refcount;
+};
+
+typedef struct {
+	lfModifier *mod;
+	RSLensfunMap *map;
+} MapThreadInfo;
+
+static GStaticMutex db_lock = G_STATIC_MUTEX_INIT;
+static lfDatabase *db = NULL;
+static gboolean db_tried = FALSE;
+
+static GStaticMutex map_lock = G_STATIC_MUTEX_INIT;
+static GQueue map_cache = G_QUEUE_INIT; /* Most recently used first */
+
+lfDatabase *
+rs_lensfun_get_db(void)
+{
+	g_static_mutex_lock(&db_lock);
+	if (!db_tried)
+	{
+		db = lf_db_new();
+		if (db)
+			lf_db_load(db);
+		db_tried = TRUE;
+	}
+	g_static_mutex_unlock(&db_lock);
+
+	return db;
+}
+
+static void
+map_free(RSLensfunMap *map)
+{
+	g_free(map->key);
+	g_free(map->nodes);
+	g_free(map);
+}
+
+static void
+map_compute(gint start, gint end, gpointer user_data)
+{
+	MapThreadInfo *t = user_data;
+	RSLensfunMap *map = t->map;
+	gint gx, gy;
+
+	for(gy = start; gy < end; gy++)
+		for(gx = 0; gx < map->grid_width; gx++)
+			lf_modifier_apply_subpixel_geometry_distortion(t->mod,
+				(gfloat) (gx * MAP_GRID_STEP), (gfloat) (gy * MAP_GRID_STEP), 1, 1,
+				map->nodes + (gy * map->grid_width + gx) * 6);
+}
+
+/* Must be called with map_lock held */
+static RSLensfunMap *
+map_lookup(const gchar *key, gint width, gint height)
+{
+	GList *node;
+
+	for(node = map_cache.head; node; node = node->next)
+	{
+		RSLensfunMap *map = node->data;
+		if (map->width == width && map->height == height && g_str_equal(map->key, key))
+		{
+			/* Move to front */
+			g_queue_unlink(&map_cache, node);
+			g_queue_push_head_link(&map_cache, node);
+			map->refcount++;
+			return map;
+		}
+	}
+
+	return NULL;
+}
+
+RSLensfunMap *
+rs_lensfun_map_get(const gchar *key, lfModifier *mod, gint width, gint height)
+{
+	RSLensfunMap *map, *existing;
+	MapThreadInfo t;
+
+	g_return_val_if_fail(key != NULL, NULL);
+	g_return_val_if_fail(mod != NULL, NULL);
+
+	g_static_mutex_lock(&map_lock);
+	map = map_lookup(key, width, height);
+	g_static_mutex_unlock(&map_lock);
+
+	if (map)
+		return map;
+
+	/* Nodes cover the image including the last row and column */
+	map = g_new0(RSLensfunMap, 1);
+	map->key = g_strdup(key);
+	map->width = width;
+	map->height = height;
+	map->grid_width = (width - 1) / MAP_GRID_STEP + 2;
+	map->grid_height = (height - 1) / MAP_GRID_STEP + 2;
+	map->nodes = g_new(gfloat, map->grid_width * map->grid_height * 6);
+	map->refcount = 1;
+
+	t.mod = mod;
+	t.map = map;
+	rs_parallel_for(0, map->grid_height, 0, map_compute, &t);
+
+	g_static_mutex_lock(&map_lock);
+	/* Someone else could have computed the same map while we did */
+	existing = map_lookup(key, width, height);
+	if (existing)
+	{
+		map_free(map);
+		map = existing;
+	}
+	else
+	{
+		map->refcount++; /* Reference held by the cache */
+		g_queue_push_head(&map_cache, map);
+		while (g_queue_get_length(&map_cache) > MAP_CACHE_SIZE)
+		{
+			RSLensfunMap *old = g_queue_pop_tail(&map_cache);
+			if (--old->refcount == 0)
+				map_free(old);
+		}
+	}
+	g_static_mutex_unlock(&map_lock);
+
+	return map;
+}
+
+void
+rs_lensfun_map_unref(RSLensfunMap *map)
+{
+	gboolean free_map;
+
+	if (!map)
+		return;
+
+	g_static_mutex_lock(&map_lock);
+	free_map = (--map->refcount == 0);
+	g_static_mutex_unlock(&map_lock);
+
+	if (free_map)
+		map_free(map);
+}
+
+void
+rs_lensfun_map_row(const RSLensfunMap *map, gint x, gint y, gint width, gfloat *pos)
+{
+	const gint gy = y / MAP_GRID_STEP;
+	const gfloat fy = (gfloat) (y - gy * MAP_GRID_STEP) * (1.0f / MAP_GRID_STEP);
+	const gfloat *top = map->nodes + gy * map->grid_width * 6;
+	const gfloat *bottom = top + map->grid_width * 6;
+	gint col, i;
+
+	g_assert(gy + 1 < map->grid_height);
+	g_assert((x + width - 1) / MAP_GRID_STEP + 1 < map->grid_width);
+
+	for(col = x; col < x + width; col++)
+	{
+		const gint n = (col / MAP_GRID_STEP) * 6;
+		const gfloat fx = (gfloat) (col % MAP_GRID_STEP) * (1.0f / MAP_GRID_STEP);
+
+		for(i = 0; i < 6; i++)
+		{
+			const gfloat t = top[n + i] + (top[n + 6 + i] - top[n + i]) * fx;
+			const gfloat b = bottom[n + i] + (bottom[n + 6 + i] - bottom[n + i]) * fx;
+			*pos++ = t + (b - t) * fy;
+		}
+	}
+}
+
+void
+rs_lensfun_map_lookup(const RSLensfunMap *map, gfloat x, gfloat y, gfloat *pos)
+{
+	const gfloat gxf = x * (1.0f / MAP_GRID_STEP);
+	const gfloat gyf = y * (1.0f / MAP_GRID_STEP);
+	const gint gx = CLAMP((gint) floorf(gxf), 0, map->grid_width - 2);
+	const gint gy = CLAMP((gint) floorf(gyf), 0, map->grid_height - 2);
+	const gfloat fx = gxf - (gfloat) gx;
+	const gfloat fy = gyf - (gfloat) gy;
+	const gfloat *top = map->nodes + (gy * map->grid_width + gx) * 6;
+	const gfloat *bottom = top + map->grid_width * 6;
+	gint i;
+
+	for(i = 0; i < 6; i++)
+	{
+		const gfloat t = top[i] + (top[6 + i] - top[i]) * fx;
+		const gfloat b = bottom[i] + (bottom[6 + i] - bottom[i]) * fx;
+		pos[i] = t + (b - t) * fy;
+	}
+}
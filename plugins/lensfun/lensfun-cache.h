@@ -0,0 +1,79 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_LENSFUN_CACHE_H
+#define RS_LENSFUN_CACHE_H
+
+#include <glib.h>
+#include <lensfun.h>
+
+typedef struct _RSLensfunMap RSLensfunMap;
+
+/**
+ * Get the lens database shared by all lensfun filters, it's loaded on first
+ * use and never freed
+ * @return The database or NULL if it could not be created
+ */
+lfDatabase *
+rs_lensfun_get_db(void);
+
+/**
+ * Get a coordinate map for the geometry correction done by a modifier. Maps
+ * are kept in a small cache, a map is only computed if key is not found
+ * @param key A string uniquely describing everything that affects the
+ *            geometry correction (lens, focal length, image size...)
+ * @param mod An initialized lfModifier used if the map must be computed
+ * @param width The width of the image
+ * @param height The height of the image
+ * @return A map, must be released with rs_lensfun_map_unref()
+ */
+RSLensfunMap *
+rs_lensfun_map_get(const gchar *key, lfModifier *mod, gint width, gint height);
+
+/**
+ * Release a map returned by rs_lensfun_map_get()
+ * @param map A RSLensfunMap
+ */
+void
+rs_lensfun_map_unref(RSLensfunMap *map);
+
+/**
+ * Interpolate source coordinates for a row of pixels, the output matches
+ * lf_modifier_apply_subpixel_geometry_distortion()
+ * @param map A RSLensfunMap
+ * @param x The first column
+ * @param y The row
+ * @param width The number of pixels
+ * @param pos Output, 6 floats per pixel (red, green and blue x/y)
+ */
+void
+rs_lensfun_map_row(const RSLensfunMap *map, gint x, gint y, gint width, gfloat *pos);
+
+/**
+ * Interpolate source coordinates for a single point, points outside the
+ * image are extrapolated from the border of the map
+ * @param map A RSLensfunMap
+ * @param x The x coordinate
+ * @param y The y coordinate
+ * @param pos Output, source x and y for red, green and blue
+ */
+void
+rs_lensfun_map_lookup(const RSLensfunMap *map, gfloat x, gfloat y, gfloat *pos);
+
+#endif /* RS_LENSFUN_CACHE_H */
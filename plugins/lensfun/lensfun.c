@@ -26,6 +26,7 @@
 #endif /* __SSE2__ */
 #include <rs-lens.h>
 #include "lensfun-version.h"
+#include "lensfun-cache.h"
 #include <math.h>  /* fabsf */
 
 static guint rs_lf_version = 0;
@@ -98,6 +99,12 @@ extern gboolean is_avx_compiled(void);
 extern void rs_image16_bilinear_nomeasure_avx(RS_IMAGE16 *in, gushort *out, gfloat *pos);
 static RSFilterClass *rs_lensfun_parent_class = NULL;
 
+static void
+warp_distort(gpointer user_data, gfloat x, gfloat y, gfloat pos[6])
+{
+	rs_lensfun_map_lookup(user_data, x, y, pos);
+}
+
 G_MODULE_EXPORT void
 rs_plugin_load(RSPlugin *plugin)
 {
@@ -116,8 +123,7 @@ finalize(GObject *object)
 	}
 	lensfun->settings_signal_id = 0;
 	lensfun->settings = NULL;
-	if (lensfun->ldb)
-		lf_db_destroy(lensfun->ldb);
+	/* The database is shared, see rs_lensfun_get_db() */
 	lensfun->ldb = NULL;
 	g_free(lensfun->model);
 	g_free(lensfun->make);
@@ -211,9 +217,8 @@ rs_lensfun_init(RSLensfun *lensfun)
 	lensfun->settings_signal_id = 0;
 	lensfun->settings = NULL;
 
-	/* Initialize Lensfun database */
-	lensfun->ldb = lf_db_new ();
-	lf_db_load (lensfun->ldb);
+	/* The database is loaded on first use */
+	lensfun->ldb = NULL;
 }
 
 static void
@@ -350,19 +355,17 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 }
 
 typedef struct {
-	gint start_y;
-	gint end_y;
 	lfModifier *mod;
+	RSLensfunMap *map;
 	RS_IMAGE16 *input;
 	RS_IMAGE16 *output;
-	GThread *threadid;
 	gint effective_flags;
 	GdkRectangle *roi;
 	gint stage;
 } ThreadInfo;
 
-static gpointer
-thread_func(gpointer _thread_info)
+static void
+thread_func(gint start_y, gint end_y, gpointer _thread_info)
 {
 	gint x, y;
 	ThreadInfo* t = _thread_info;
@@ -372,12 +375,12 @@ thread_func(gpointer _thread_info)
 		/* Do lensfun vignetting */
 		if (t->effective_flags & LF_MODIFY_VIGNETTING)
 		{
-			lf_modifier_apply_color_modification (t->mod, GET_PIXEL(t->input, t->roi->x, t->start_y), 
-					t->roi->x, t->start_y, t->roi->width, t->end_y - t->start_y,
+			lf_modifier_apply_color_modification (t->mod, GET_PIXEL(t->input, t->roi->x, start_y), 
+					t->roi->x, start_y, t->roi->width, end_y - start_y,
 				LF_CR_4 (RED, GREEN, BLUE, UNKNOWN),
 				t->input->rowstride*2);
 		}
-		return NULL;
+		return;
 	}
 
 	gboolean sse2_available = !!(rs_detect_cpu_features() & RS_CPU_FLAG_SSE2) && is_sse2_compiled();
@@ -393,10 +396,10 @@ thread_func(gpointer _thread_info)
 		gfloat *pos = g_new0(gfloat, t->input->w*6);
 		const gint pixelsize = t->output->pixelsize;
 		
-		for(y = t->start_y; y < t->end_y; y++)
+		for(y = start_y; y < end_y; y++)
 		{
 			gushort *target;
-			lf_modifier_apply_subpixel_geometry_distortion(t->mod, t->roi->x, (gfloat) y, t->roi->width, 1, pos);
+			rs_lensfun_map_row(t->map, t->roi->x, y, t->roi->width, pos);
 			target = GET_PIXEL(t->output, t->roi->x, y);
 			gfloat* l_pos = pos;
 
@@ -439,7 +442,6 @@ thread_func(gpointer _thread_info)
 		}
 		g_free(pos);
 	}
-	return NULL;
 }
 
 
@@ -475,7 +477,8 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	if (!RS_IS_IMAGE16(input))
 		return response;
 
-	gint i;
+	if (!lensfun->ldb)
+		lensfun->ldb = rs_lensfun_get_db();
 
 	if (!lensfun->ldb)
 	{
@@ -657,76 +660,69 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 			
 		if (effective_flags > 0)
 		{
-			const guint threads = rs_get_number_of_processor_cores();
-			ThreadInfo *t = g_new(ThreadInfo, threads);
+			ThreadInfo t;
+			t.mod = mod;
+			t.effective_flags = effective_flags;
 
-			/* Set up job description for individual threads */
-			for (i = 0; i < threads; i++)
-			{
-				t[i].mod = mod;
-				t[i].effective_flags = effective_flags;
-			}
-
-			/* Start threads to apply phase 2, Vignetting and CA Correction */
+			/* Apply phase 2, Vignetting and CA Correction in the shared worker pool */
 			if (effective_flags & (LF_MODIFY_VIGNETTING /* | LF_MODIFY_CCI */)) 
 			{
 				/* Phase 2 is corrected inplace, so copy input first */
-				guint y_offset, y_per_thread, threaded_h;
-				threaded_h = vign_roi->height;
-				y_per_thread = (threaded_h + threads-1)/threads;
-				y_offset = vign_roi->y;
 				output = rs_image16_copy(input, TRUE);
 				g_object_unref(input);
-				for (i = 0; i < threads; i++)
-				{
-					t[i].input = t[i].output = output;
-					t[i].stage = 2;
-					t[i].roi = vign_roi;
-					t[i].start_y = y_offset;
-					y_offset += y_per_thread;
-					y_offset = MIN(vign_roi->y + vign_roi->height, y_offset);
-					t[i].end_y = y_offset;
-					t[i].threadid = g_thread_create(thread_func, &t[i], TRUE, NULL);
-				}
-				
-				/* Wait for threads to finish */
-				for(i = 0; i < threads; i++)
-					g_thread_join(t[i].threadid);
+				t.input = t.output = output;
+				t.stage = 2;
+				t.roi = vign_roi;
+				rs_parallel_for_full(vign_roi->y, vign_roi->y + vign_roi->height, 0, rs_filter_request_get_priority(request), thread_func, &t);
 
 				input = output;
 			}
 			
-			/* Start threads to apply phase 1+3, Chromatic abberation and distortion Correction */
+			/* Apply phase 1+3, Chromatic abberation and distortion Correction */
 			if (effective_flags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY)) 
 			{
-				guint y_offset, y_per_thread, threaded_h;
-				output = rs_image16_copy(input, FALSE);
-				threaded_h = roi->height;
-				y_per_thread = (threaded_h + threads-1)/threads;
-				y_offset = roi->y;
-
-				for (i = 0; i < threads; i++)
+				/* Everything affecting the geometry correction, the map is
+				 * only computed if we haven't seen this combination before */
+				gchar *key = g_strdup_printf("%s|%s|%s|%s|%.3f|%.2f|%.2f|%.4f|%.4f|%d|%d",
+					lensfun->selected_lens->Maker ? lensfun->selected_lens->Maker : "",
+					lensfun->selected_lens->Model ? lensfun->selected_lens->Model : "",
+					lensfun->selected_camera->Maker ? lensfun->selected_camera->Maker : "",
+					lensfun->selected_camera->Model ? lensfun->selected_camera->Model : "",
+					lensfun->selected_camera->CropFactor, lensfun->focal, lensfun->aperture,
+					lensfun->tca_kr, lensfun->tca_kb, lensfun->defish,
+					effective_flags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY));
+
+				RSLensfunMap *map = rs_lensfun_map_get(key, mod, input->w, input->h);
+				g_free(key);
+
+				gboolean defer = FALSE;
+				rs_filter_param_get_boolean(RS_FILTER_PARAM(request), RS_WARP_REQUEST_DEFER, &defer);
+				if (defer)
+				{
+					/* The requesting filter resamples anyway, let it do our
+					 * correction in the same pass */
+					RSWarp *warp = rs_warp_new(input->w, input->h);
+					rs_warp_set_distortion(warp, warp_distort, map, (GDestroyNotify) rs_lensfun_map_unref);
+					rs_filter_param_set_object(RS_FILTER_PARAM(response), RS_WARP_RESPONSE, warp);
+					g_object_unref(warp);
+					output = g_object_ref(input);
+				}
+				else
 				{
-					t[i].input = input;
-					t[i].output = output;
-					t[i].roi = roi;
-					t[i].start_y = y_offset;
-					y_offset += y_per_thread;
-					y_offset = MIN(roi->y + roi->height, y_offset);
-					t[i].end_y = y_offset;
-					t[i].stage = 3;
-					t[i].threadid = g_thread_create(thread_func, &t[i], TRUE, NULL);
+					output = rs_image16_copy(input, FALSE);
+					t.input = input;
+					t.output = output;
+					t.roi = roi;
+					t.stage = 3;
+					t.map = map;
+					rs_parallel_for_full(roi->y, roi->y + roi->height, 0, rs_filter_request_get_priority(request), thread_func, &t);
+					rs_lensfun_map_unref(map);
 				}
-				
-				/* Wait for threads to finish */
-				for(i = 0; i < threads; i++)
-					g_thread_join(t[i].threadid);
 			}
 			else
 			{
 				output = rs_image16_copy(input, TRUE);
 			}
-			g_free(t);
 			rs_filter_response_set_image(response, output);
 			g_object_unref(output);
 		}
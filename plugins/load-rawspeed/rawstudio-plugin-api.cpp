@@ -23,11 +23,56 @@
 #include "RawDecoder.h"
 #include "CameraMetaData.h"
 #include "rawstudio-plugin-api.h"
+#ifndef WIN32
+#include <sys/mman.h> /* madvise() */
+#endif
 
 #define TIME_LOAD 1
 
+/* RawSpeed bit pumps may read a few bytes beyond the end of the file, files
+ * ending this close to a page boundary are read into memory instead */
+#define MAP_MARGIN 32
+#define MAP_PAGE_SIZE 4096
+
 using namespace RawSpeed;
 
+/* Map a file copy-on-write, the returned FileMap does not own the data.
+ * Some decoders patch the buffer in place, decrypting Sony SR2 for example,
+ * so the mapping must be writable. Changes are private and never reach the file */
+static FileMap *
+map_file(const gchar *filename, GMappedFile **mapped)
+{
+	gsize length;
+	gsize tail;
+
+	*mapped = g_mapped_file_new(filename, TRUE, NULL);
+	if (!*mapped)
+		return NULL;
+
+	length = g_mapped_file_get_length(*mapped);
+	tail = length % MAP_PAGE_SIZE;
+	if (length == 0 || tail == 0 || tail > MAP_PAGE_SIZE - MAP_MARGIN)
+	{
+		g_mapped_file_free(*mapped);
+		*mapped = NULL;
+		return NULL;
+	}
+
+#ifndef WIN32
+	/* Ask the kernel to start reading the whole file ahead, the pages are faulted
+	   in later by decodeRaw(), after the I/O lock has been released */
+	madvise(g_mapped_file_get_contents(*mapped), length, MADV_WILLNEED);
+#endif
+
+	return new FileMap((uchar8 *) g_mapped_file_get_contents(*mapped), length);
+}
+
+static void
+release_raw_image(gpointer data)
+{
+	delete (RawImage *) data;
+}
+
 extern "C" {
 
 RSFilterResponse*
@@ -60,6 +105,7 @@ load_rawspeed(const gchar *filename)
 	FileReader f((LPCWSTR) filename);
 	RawDecoder *d = 0;
 	FileMap* m = 0;
+	GMappedFile *mapped = NULL;
 
 #ifdef TIME_LOAD
 		GTimer *gt = g_timer_new();
@@ -69,7 +115,9 @@ load_rawspeed(const gchar *filename)
 	try
 	{
 		rs_io_lock();
-		m = f.readFile();
+		m = map_file(filename, &mapped);
+		if (!m)
+			m = f.readFile();
 		rs_io_unlock();
 	}
 	catch (FileIOException &e)
@@ -113,6 +161,9 @@ load_rawspeed(const gchar *filename)
 			RawImage r = d->mRaw;
 			delete d; d = NULL;
 			delete m; m = NULL;
+			if (mapped)
+				g_mapped_file_free(mapped);
+			mapped = NULL;
 
       r->scaleBlackWhite();
 
@@ -120,45 +171,51 @@ load_rawspeed(const gchar *filename)
 	  RS_DEBUG(PERFORMANCE, "RawSpeed Decode %s: %.03fs\n", filename, g_timer_elapsed(gt, NULL));
       g_timer_destroy(gt);
 #endif
-			cpp = r->getCpp();
-			if (cpp == 1) 
-				image = rs_image16_new(r->dim.x, r->dim.y, cpp, cpp);
-			else if (cpp == 3) 
-				image = rs_image16_new(r->dim.x, r->dim.y, 3, 4);
-			else {
-				g_warning("RawSpeed: Unsupported component per pixel count\n");
+			if (r->getDataType() != TYPE_USHORT16)
+			{
+				g_warning("RawSpeed: Unsupported data type\n");
 				return rs_filter_response_new();
 			}
 
-			if (r->getDataType() != TYPE_USHORT16)
+			cpp = r->getCpp();
+			if (cpp == 1)
 			{
-				g_warning("RawSpeed: Unsupported data type\n");
+				/* Use the RawSpeed buffer directly if the layout allows it,
+				 * the RawImage is kept alive until the image is finalized */
+				RawImage *keep = new RawImage(r);
+				image = rs_image16_new_wrap(r->dim.x, r->dim.y, cpp, cpp,
+					(gushort *) r->getData(0,0), r->pitch/2, release_raw_image, keep);
+				if (!image)
+				{
+					delete keep;
+					image = rs_image16_new(r->dim.x, r->dim.y, cpp, cpp);
+					BitBlt((uchar8 *)(GET_PIXEL(image,0,0)),image->pitch*2,
+						r->getData(0,0), r->pitch, r->getBpp()*r->dim.x, r->dim.y);
+				}
+			}
+			else if (cpp == 3)
+			{
+				image = rs_image16_new(r->dim.x, r->dim.y, 3, 4);
+				for(row=0;row<image->h;row++)
+				{
+					gushort *inpixel = (gushort*)&r->getData()[row*r->pitch];
+					gushort *outpixel = GET_PIXEL(image, 0, row);
+					for(col=0;col<image->w;col++)
+					{
+						*outpixel++ =  *inpixel++;
+						*outpixel++ =  *inpixel++;
+						*outpixel++ =  *inpixel++;
+						outpixel++;
+					}
+				}
+			}
+			else {
+				g_warning("RawSpeed: Unsupported component per pixel count\n");
 				return rs_filter_response_new();
 			}
 
 			if (r->isCFA)
 				image->filters = r->cfa.getDcrawFilter();
-
-
-      if (cpp == 1) 
-      {
-        BitBlt((uchar8 *)(GET_PIXEL(image,0,0)),image->pitch*2,
-          r->getData(0,0), r->pitch, r->getBpp()*r->dim.x, r->dim.y);
-      } else 
-      {
-        for(row=0;row<image->h;row++)
-        {
-          gushort *inpixel = (gushort*)&r->getData()[row*r->pitch];
-          gushort *outpixel = GET_PIXEL(image, 0, row);
-          for(col=0;col<image->w;col++)
-          {
-            *outpixel++ =  *inpixel++;
-            *outpixel++ =  *inpixel++;
-            *outpixel++ =  *inpixel++;
-            outpixel++;
-          }
-        }
-      }
 	}
 		catch (RawDecoderException &e)
 		{
@@ -176,6 +233,7 @@ load_rawspeed(const gchar *filename)
 
 	if (d) delete d;
 	if (m) delete m;
+	if (mapped) g_mapped_file_free(mapped);
 
 	RSFilterResponse* response = rs_filter_response_new();
 	if (image)
@@ -2025,6 +2025,7 @@ raw_thumbnail_reader(const gchar *service, RSMetadata *meta)
 	RSFilterRequest *request = rs_filter_request_new();
 	rs_filter_request_set_roi(request, FALSE);
 	rs_filter_request_set_quick(request, TRUE);
+	rs_filter_request_set_priority(request, RS_PARALLEL_PRIORITY_LOW);
 
 
 	if (dcp)
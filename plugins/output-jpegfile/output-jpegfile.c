@@ -19,6 +19,7 @@
 
 #include "config.h"
 #include <rawstudio.h>
+#include <glib/gstdio.h>
 #ifdef WIN32
 #define HAVE_BOOLEAN
 #define _BASETSD_H_
@@ -217,84 +218,354 @@ rs_jpeg_write_icc_profile(j_compress_ptr cinfo, const JOCTET *icc_data_ptr, guin
 	return;
 }
 
-static gboolean
-execute(RSOutput *output, RSFilter *filter)
+/* Rows pulled from the filter chain at a time, this matches the cache tiles
+ * and is a whole number of MCU rows for any sampling */
+#define STRIP_ROWS 256
+
+/* Destination manager collecting the compressed data in memory */
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	GByteArray *data;
+	JOCTET buffer[16384];
+} MemoryDestination;
+
+static void
+memory_init_destination(j_compress_ptr cinfo)
 {
-	RSJpegfile *jpegfile = RS_JPEGFILE(output);
+	MemoryDestination *dest = (MemoryDestination *) cinfo->dest;
+
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = sizeof(dest->buffer);
+}
+
+static boolean
+memory_empty_output_buffer(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *) cinfo->dest;
+
+	g_byte_array_append(dest->data, dest->buffer, sizeof(dest->buffer));
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = sizeof(dest->buffer);
+
+	return TRUE;
+}
+
+static void
+memory_term_destination(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *) cinfo->dest;
+
+	g_byte_array_append(dest->data, dest->buffer, sizeof(dest->buffer) - dest->pub.free_in_buffer);
+}
+
+/* One strip of the image, compressed on its own between restart markers */
+typedef struct {
+	gint index;
+	gint width;
+	gint height;
+	guchar *pixels;
+	GByteArray *data;
+} Segment;
+
+typedef struct {
+	RSJpegfile *jpegfile;
+	FILE *file;
+	gint width;
+	gint height;
+	gchar *icc_data;
+	gsize icc_length;
+
+	/* Sequential encoder, used if restart markers cannot be used */
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
-	FILE * outfile;
+	gboolean sequential;
+
+	/* Parallel encoder */
+	guint restart_interval;
+	Segment *pending;
+	gint num_pending;
+	gint max_pending;
+	gint segments_written;
+	gboolean error;
+} JpegWriter;
+
+static void
+setup_compress(JpegWriter *writer, j_compress_ptr cinfo, gint height)
+{
+	cinfo->image_width = writer->width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_RGB;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, writer->jpegfile->quality, TRUE);
+}
+
+/* Must be called right after jpeg_start_compress() */
+static void
+write_markers(JpegWriter *writer, j_compress_ptr cinfo)
+{
+	if (writer->icc_data)
+		rs_jpeg_write_icc_profile(cinfo, (guchar *) writer->icc_data, writer->icc_length);
+}
+
+static void
+encode_segment(JpegWriter *writer, Segment *segment)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	MemoryDestination dest;
 	JSAMPROW row_pointer[1];
-	gint x,y;
-	
-	
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	dest.pub.init_destination = memory_init_destination;
+	dest.pub.empty_output_buffer = memory_empty_output_buffer;
+	dest.pub.term_destination = memory_term_destination;
+	dest.data = segment->data = g_byte_array_sized_new(segment->width * segment->height);
+	cinfo.dest = &dest.pub;
+
+	/* Every segment is a restart interval, so DC prediction starts over
+	 * exactly like it would in a single pass */
+	setup_compress(writer, &cinfo, segment->height);
+	cinfo.restart_interval = writer->restart_interval;
+	jpeg_start_compress(&cinfo, TRUE);
+	if (segment->index == 0)
+		write_markers(writer, &cinfo);
+
+	while (cinfo.next_scanline < cinfo.image_height)
+	{
+		row_pointer[0] = segment->pixels + cinfo.next_scanline * segment->width * 3;
+		jpeg_write_scanlines(&cinfo, row_pointer, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+}
+
+static void
+encode_segments(gint start, gint end, gpointer user_data)
+{
+	JpegWriter *writer = user_data;
+	gint i;
+
+	for(i = start; i < end; i++)
+		encode_segment(writer, &writer->pending[i]);
+}
+
+/* Find the first byte of entropy coded data after the SOS header, and
+ * patch the image height in the frame header on the way */
+static gsize
+find_scan_data(guchar *data, gsize length, gint height)
+{
+	gsize pos = 2; /* SOI */
+
+	while (pos + 4 <= length && data[pos] == 0xff)
+	{
+		const guchar marker = data[pos+1];
+		const gsize marker_length = (data[pos+2] << 8) | data[pos+3];
+
+		/* SOF0-SOF2 */
+		if (marker >= 0xc0 && marker <= 0xc2 && pos + 7 <= length)
+		{
+			data[pos+5] = (height >> 8) & 0xff;
+			data[pos+6] = height & 0xff;
+		}
+
+		pos += 2 + marker_length;
+
+		if (marker == 0xda) /* SOS */
+			return pos;
+	}
+
+	return 0;
+}
+
+/* Compress all pending segments in parallel and write them in order */
+static void
+flush_segments(JpegWriter *writer)
+{
+	gint i;
+
+	rs_parallel_for_full(0, writer->num_pending, 1, RS_PARALLEL_PRIORITY_LOW, encode_segments, writer);
+
+	rs_io_lock();
+	for(i = 0; i < writer->num_pending; i++)
+	{
+		Segment *segment = &writer->pending[i];
+		GByteArray *data = segment->data;
+		gsize scan = find_scan_data(data->data, data->len, writer->height);
+
+		/* Compressed data ends with EOI */
+		if (scan == 0 || data->len < scan + 2)
+			writer->error = TRUE;
+		else if (segment->index == 0)
+		{
+			/* Headers are taken from the first segment */
+			fwrite(data->data, data->len - 2, 1, writer->file);
+		}
+		else
+		{
+			const guchar rst[2] = { 0xff, 0xd0 + ((segment->index - 1) & 7) };
+			fwrite(rst, 2, 1, writer->file);
+			fwrite(data->data + scan, data->len - 2 - scan, 1, writer->file);
+		}
+
+		g_byte_array_free(data, TRUE);
+		g_free(segment->pixels);
+		writer->segments_written++;
+	}
+	rs_io_unlock();
+
+	writer->num_pending = 0;
+}
+
+static gboolean
+write_strip(RSFilter *filter, GdkPixbuf *pixbuf, const GdkRectangle *rect, gpointer user_data)
+{
+	JpegWriter *writer = user_data;
+	const gint channels = gdk_pixbuf_get_n_channels(pixbuf);
+	guchar *pixels = g_new(guchar, rect->width * rect->height * 3);
+	gint x, y;
+
+	for(y = 0; y < rect->height; y++)
+	{
+		guchar *in = GET_PIXBUF_PIXEL(pixbuf, 0, y);
+		guchar *out = pixels + y * rect->width * 3;
+		for(x = 0; x < rect->width; x++)
+		{
+			out[0] = in[0];
+			out[1] = in[1];
+			out[2] = in[2];
+			in += channels;
+			out += 3;
+		}
+	}
+
+	if (writer->sequential)
+	{
+		JSAMPROW row_pointer[1];
+
+		rs_io_lock();
+		for(y = 0; y < rect->height; y++)
+		{
+			row_pointer[0] = pixels + y * rect->width * 3;
+			jpeg_write_scanlines(&writer->cinfo, row_pointer, 1);
+		}
+		rs_io_unlock();
+		g_free(pixels);
+	}
+	else
+	{
+		Segment *segment = &writer->pending[writer->num_pending++];
+		segment->index = writer->segments_written + writer->num_pending - 1;
+		segment->width = rect->width;
+		segment->height = rect->height;
+		segment->pixels = pixels;
+
+		if (writer->num_pending == writer->max_pending)
+			flush_segments(writer);
+	}
+
+	return !writer->error;
+}
+
+static gboolean
+execute(RSOutput *output, RSFilter *filter)
+{
+	RSJpegfile *jpegfile = RS_JPEGFILE(output);
+	JpegWriter writer;
+	gboolean ret;
+
 	RSFilterRequest *request = rs_filter_request_new();
 	rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
+	rs_filter_request_set_priority(request, RS_PARALLEL_PRIORITY_LOW);
 	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", jpegfile->color_space);
-	RSFilterResponse *response = rs_filter_get_image8(filter, request);
-	
-	g_object_unref(request);
-	GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
-	g_object_unref(response);
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	if ((outfile = fopen(jpegfile->filename, "wb")) == NULL)
+	memset(&writer, 0, sizeof(JpegWriter));
+	writer.jpegfile = jpegfile;
+	if (!rs_filter_get_size_simple(filter, request, &writer.width, &writer.height))
+	{
+		g_object_unref(request);
+		return FALSE;
+	}
+
+	if ((writer.file = fopen(jpegfile->filename, "wb")) == NULL)
+	{
+		g_object_unref(request);
 		return(FALSE);
-	jpeg_stdio_dest(&cinfo, outfile);
-	cinfo.image_width = gdk_pixbuf_get_width(pixbuf);
-	cinfo.image_height = gdk_pixbuf_get_height(pixbuf);
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, jpegfile->quality, TRUE);
-	rs_io_lock();
-	jpeg_start_compress(&cinfo, TRUE);
+	}
+
 	if (jpegfile->color_space && !g_str_equal(G_OBJECT_TYPE_NAME(jpegfile->color_space), "RSSrgb"))
 	{
 		const RSIccProfile *profile = rs_color_space_get_icc_profile(jpegfile->color_space, FALSE);
 		if (profile)
-		{
-			gchar *data;
-			gsize data_length;
-			rs_icc_profile_get_data(profile, &data, &data_length);
-			rs_jpeg_write_icc_profile(&cinfo, (guchar *) data, data_length);
-			g_free(data);
-		}
+			rs_icc_profile_get_data(profile, &writer.icc_data, &writer.icc_length);
+	}
+
+	/* Use the frame setup to find the MCU size for the restart interval */
+	writer.cinfo.err = jpeg_std_error(&writer.jerr);
+	jpeg_create_compress(&writer.cinfo);
+	setup_compress(&writer, &writer.cinfo, writer.height);
+	const gint mcu_width = writer.cinfo.comp_info[0].h_samp_factor * DCTSIZE;
+	const gint mcu_height = writer.cinfo.comp_info[0].v_samp_factor * DCTSIZE;
+	const guint mcus = ((writer.width + mcu_width - 1) / mcu_width) * (STRIP_ROWS / mcu_height);
+
+	writer.max_pending = rs_parallel_get_number_of_threads();
+	writer.sequential = (writer.max_pending < 2) || (mcus > 65535) || (writer.height <= STRIP_ROWS);
+
+	if (writer.sequential)
+	{
+		jpeg_stdio_dest(&writer.cinfo, writer.file);
+		rs_io_lock();
+		jpeg_start_compress(&writer.cinfo, TRUE);
+		write_markers(&writer, &writer.cinfo);
+		rs_io_unlock();
 	}
+	else
+	{
+		writer.restart_interval = mcus;
+		writer.pending = g_new0(Segment, writer.max_pending);
+	}
+
+	/* Encode strips as they are rendered. The complete 8 bit image is only
+	 * held in memory if the chain cannot render a ROI, a chain with a
+	 * demosaic cache renders only the strip */
+	ret = rs_filter_get_image8_tiled(filter, request, -1, STRIP_ROWS, write_strip, &writer);
+	g_object_unref(request);
 
-	if (gdk_pixbuf_get_n_channels(pixbuf) == 4)
+	if (writer.sequential)
 	{
-		GdkPixbuf *out = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, cinfo.image_width, cinfo.image_height);
-		for( y = 0; y < cinfo.image_height; y++){
-			gint* in = (gint*)GET_PIXBUF_PIXEL(pixbuf, 0, y);
-			guchar* o = GET_PIXBUF_PIXEL(out, 0, y);
-			for( x = 0; x < cinfo.image_width ; x++) {
-				guint i = *in++;
-				o[0] = i&0xff;
-				o[1] = (i>>8)&0xff;
-				o[2] = (i>>16)&0xff;
-				o+=3;
-			}
-		}
-		g_object_unref(pixbuf);
-		pixbuf = out;
+		rs_io_lock();
+		if (ret)
+			jpeg_finish_compress(&writer.cinfo);
+		else
+			jpeg_abort_compress(&writer.cinfo);
+		rs_io_unlock();
 	}
+	else
+	{
+		const guchar eoi[2] = { 0xff, 0xd9 };
+		if (writer.num_pending > 0)
+			flush_segments(&writer);
+		fwrite(eoi, 2, 1, writer.file);
+		g_free(writer.pending);
+	}
+	jpeg_destroy_compress(&writer.cinfo);
+	fclose(writer.file);
+	g_free(writer.icc_data);
 
-	while (cinfo.next_scanline < cinfo.image_height)
+	ret = ret && !writer.error;
+	if (!ret)
 	{
-		row_pointer[0] = GET_PIXBUF_PIXEL(pixbuf, 0, cinfo.next_scanline);
-		if (jpeg_write_scanlines(&cinfo, row_pointer, 1) != 1)
-			break;
+		/* Don't leave a partial JPEG behind, it may lack the EOI marker */
+		g_unlink(jpegfile->filename);
+		return FALSE;
 	}
-	jpeg_finish_compress(&cinfo);
-	fclose(outfile);
-	jpeg_destroy_compress(&cinfo);
-	g_object_unref(pixbuf);
 
 	gchar *input_filename = NULL;
 	rs_filter_get_recursive(filter, "filename", &input_filename, NULL);
 
+	rs_io_lock();
 	if (jpegfile->copy_metadata)
 		rs_exif_copy(input_filename, jpegfile->filename, G_OBJECT_TYPE_NAME(jpegfile->color_space), RS_EXIF_FILE_TYPE_JPEG);
 	else
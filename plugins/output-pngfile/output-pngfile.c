@@ -22,9 +22,17 @@
 #include "config.h"
 #include <rawstudio.h>
 #include <gettext.h>
+#include <glib/gstdio.h>
 #include <png.h>
 #include <zlib.h>
 
+/* Rows in each strip pulled from the filter chain, every strip is filtered
+ * and deflated on its own thread */
+#define STRIP_ROWS 256
+
+/* Deflate window, the tail of the previous strip is used as dictionary */
+#define WINDOW_SIZE 32768
+
 #define RS_TYPE_PNGFILE (rs_pngfile_type)
 #define RS_PNGFILE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_PNGFILE, RSPngfile))
 #define RS_PNGFILE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_PNGFILE, RSPngfileClass))
@@ -175,31 +183,392 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 	}
 }
 
+typedef struct {
+	gint rows;
+	guchar *raw;
+	const guchar *prior;
+	guchar *filtered;
+	gsize filtered_length;
+	const guchar *dictionary;
+	gsize dictionary_length;
+	guchar *compressed;
+	gsize compressed_length;
+	uLong adler;
+	gboolean last;
+} Strip;
+
+typedef struct {
+	png_structp png_ptr;
+	gint height;
+	gint bpp;
+	gsize rowbytes;
+	Strip *pending;
+	gint num_pending;
+	gint max_pending;
+	gint rows_done;
+	guchar *last_row;
+	guchar window[WINDOW_SIZE];
+	gsize window_length;
+	uLong adler;
+	gboolean header_written;
+	gboolean error;
+} PngWriter;
+
+static inline gint
+paeth(gint a, gint b, gint c)
+{
+	const gint p = a + b - c;
+	const gint pa = ABS(p - a);
+	const gint pb = ABS(p - b);
+	const gint pc = ABS(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+/* Filter a single row with all five PNG filters and keep the one with the
+ * lowest sum of absolute differences, the same heuristic as libpng */
+static void
+filter_row(const guchar *row, const guchar *prior, guchar *out, guchar *scratch, gint rowbytes, gint bpp)
+{
+	guint best_sum = G_MAXUINT;
+	gint best = 0;
+	gint type, i;
+
+	for(type = 0; type < 5; type++)
+	{
+		guchar *dest = scratch + type * rowbytes;
+		guint sum = 0;
+
+		for(i = 0; i < rowbytes; i++)
+		{
+			const gint a = (i >= bpp) ? row[i - bpp] : 0;
+			const gint b = prior ? prior[i] : 0;
+			const gint c = (prior && i >= bpp) ? prior[i - bpp] : 0;
+			guchar value;
+
+			switch (type)
+			{
+				case 0: value = row[i]; break;
+				case 1: value = row[i] - a; break;
+				case 2: value = row[i] - b; break;
+				case 3: value = row[i] - ((a + b) >> 1); break;
+				default: value = row[i] - paeth(a, b, c); break;
+			}
+			dest[i] = value;
+			sum += ABS((gint)(gint8) value);
+		}
+
+		if (sum < best_sum)
+		{
+			best_sum = sum;
+			best = type;
+		}
+	}
+
+	out[0] = best;
+	memcpy(out + 1, scratch + best * rowbytes, rowbytes);
+}
+
+static void
+filter_strips(gint start, gint end, gpointer user_data)
+{
+	PngWriter *writer = user_data;
+	guchar *scratch = g_new(guchar, writer->rowbytes * 5);
+	gint i, row;
+
+	for(i = start; i < end; i++)
+	{
+		Strip *strip = &writer->pending[i];
+		const guchar *prior = strip->prior;
+
+		strip->filtered_length = strip->rows * (writer->rowbytes + 1);
+		strip->filtered = g_new(guchar, strip->filtered_length);
+		for(row = 0; row < strip->rows; row++)
+		{
+			const guchar *raw = strip->raw + row * writer->rowbytes;
+			filter_row(raw, prior, strip->filtered + row * (writer->rowbytes + 1), scratch, writer->rowbytes, writer->bpp);
+			prior = raw;
+		}
+	}
+
+	g_free(scratch);
+}
+
+/* Deflate each strip as an independent raw deflate stream primed with the
+ * tail of the previous strip. All but the last strip end with a sync flush,
+ * so the strips can be concatenated into a single zlib stream */
+static void
+deflate_strips(gint start, gint end, gpointer user_data)
+{
+	PngWriter *writer = user_data;
+	gint i;
+
+	for(i = start; i < end; i++)
+	{
+		Strip *strip = &writer->pending[i];
+		z_stream stream;
+		gsize size;
+		gint ret;
+
+		memset(&stream, 0, sizeof(z_stream));
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK)
+		{
+			writer->error = TRUE;
+			continue;
+		}
+
+		if (strip->dictionary_length > 0)
+			deflateSetDictionary(&stream, strip->dictionary, strip->dictionary_length);
+
+		size = deflateBound(&stream, strip->filtered_length) + 16;
+		strip->compressed = g_malloc(size);
+		stream.next_in = strip->filtered;
+		stream.avail_in = strip->filtered_length;
+		stream.next_out = strip->compressed;
+		stream.avail_out = size;
+
+		while (TRUE)
+		{
+			ret = deflate(&stream, strip->last ? Z_FINISH : Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END)
+			{
+				writer->error = TRUE;
+				break;
+			}
+			/* A flush is complete when deflate() leaves room in the buffer */
+			if (stream.avail_out > 0 && (!strip->last || ret == Z_STREAM_END))
+				break;
+			strip->compressed = g_realloc(strip->compressed, size * 2);
+			stream.next_out = strip->compressed + size;
+			stream.avail_out = size;
+			size *= 2;
+		}
+
+		strip->compressed_length = size - stream.avail_out;
+		strip->adler = adler32(adler32(0L, Z_NULL, 0), strip->filtered, strip->filtered_length);
+		deflateEnd(&stream);
+	}
+}
+
+static void
+update_window(PngWriter *writer, const guchar *data, gsize length)
+{
+	if (length >= WINDOW_SIZE)
+	{
+		memcpy(writer->window, data + length - WINDOW_SIZE, WINDOW_SIZE);
+		writer->window_length = WINDOW_SIZE;
+	}
+	else
+	{
+		const gsize keep = MIN(writer->window_length, WINDOW_SIZE - length);
+		memmove(writer->window, writer->window + writer->window_length - keep, keep);
+		memcpy(writer->window + keep, data, length);
+		writer->window_length = keep + length;
+	}
+}
+
+/* Filter and compress all pending strips in parallel and write them as IDAT
+ * chunks in order */
+static void
+flush_strips(PngWriter *writer)
+{
+	gint i;
+
+	rs_parallel_for_full(0, writer->num_pending, 1, RS_PARALLEL_PRIORITY_LOW, filter_strips, writer);
+
+	for(i = 0; i < writer->num_pending; i++)
+	{
+		Strip *strip = &writer->pending[i];
+		if (i == 0)
+		{
+			strip->dictionary = writer->window;
+			strip->dictionary_length = writer->window_length;
+		}
+		else
+		{
+			Strip *previous = &writer->pending[i-1];
+			strip->dictionary_length = MIN(previous->filtered_length, WINDOW_SIZE);
+			strip->dictionary = previous->filtered + previous->filtered_length - strip->dictionary_length;
+		}
+	}
+
+	rs_parallel_for_full(0, writer->num_pending, 1, RS_PARALLEL_PRIORITY_LOW, deflate_strips, writer);
+
+	rs_io_lock();
+	for(i = 0; i < writer->num_pending; i++)
+	{
+		Strip *strip = &writer->pending[i];
+		png_byte header[2] = { 0x78, 0x9c }; /* Deflate, 32K window, default level */
+		png_byte trailer[4];
+		gsize length = strip->compressed_length;
+
+		writer->adler = adler32_combine(writer->adler, strip->adler, strip->filtered_length);
+		if (!writer->header_written)
+			length += sizeof(header);
+		if (strip->last)
+			length += sizeof(trailer);
+
+		png_write_chunk_start(writer->png_ptr, (png_bytep) "IDAT", length);
+		if (!writer->header_written)
+		{
+			png_write_chunk_data(writer->png_ptr, header, sizeof(header));
+			writer->header_written = TRUE;
+		}
+		png_write_chunk_data(writer->png_ptr, strip->compressed, strip->compressed_length);
+		if (strip->last)
+		{
+			trailer[0] = (writer->adler >> 24) & 0xff;
+			trailer[1] = (writer->adler >> 16) & 0xff;
+			trailer[2] = (writer->adler >> 8) & 0xff;
+			trailer[3] = writer->adler & 0xff;
+			png_write_chunk_data(writer->png_ptr, trailer, sizeof(trailer));
+		}
+		png_write_chunk_end(writer->png_ptr);
+	}
+	rs_io_unlock();
+
+	/* Keep what the next batch needs: the last unfiltered row and the tail
+	 * of the filtered data */
+	for(i = 0; i < writer->num_pending; i++)
+	{
+		Strip *strip = &writer->pending[i];
+		update_window(writer, strip->filtered, strip->filtered_length);
+		if (i == writer->num_pending - 1)
+			memcpy(writer->last_row, strip->raw + (strip->rows - 1) * writer->rowbytes, writer->rowbytes);
+		g_free(strip->raw);
+		g_free(strip->filtered);
+		g_free(strip->compressed);
+	}
+
+	writer->num_pending = 0;
+}
+
+static void
+add_strip(PngWriter *writer, guchar *raw, gint rows)
+{
+	Strip *strip = &writer->pending[writer->num_pending];
+
+	memset(strip, 0, sizeof(Strip));
+	strip->rows = rows;
+	strip->raw = raw;
+	if (writer->num_pending > 0)
+	{
+		Strip *previous = &writer->pending[writer->num_pending - 1];
+		strip->prior = previous->raw + (previous->rows - 1) * writer->rowbytes;
+	}
+	else if (writer->rows_done > 0)
+		strip->prior = writer->last_row;
+
+	writer->rows_done += rows;
+	strip->last = (writer->rows_done >= writer->height);
+	writer->num_pending++;
+
+	if (writer->num_pending == writer->max_pending || strip->last)
+		flush_strips(writer);
+}
+
+static gboolean
+write_strip16(RSFilter *filter, RS_IMAGE16 *image, const GdkRectangle *rect, gpointer user_data)
+{
+	PngWriter *writer = user_data;
+	guchar *raw = g_new(guchar, rect->height * writer->rowbytes);
+	gint row, col, c;
+
+	for(row = 0; row < rect->height; row++)
+	{
+		gushort *buf = GET_PIXEL(image, 0, row);
+		guchar *line = raw + row * writer->rowbytes;
+		/* PNG samples are big endian */
+		for(col = 0; col < rect->width; col++)
+			for(c = 0; c < 3; c++)
+			{
+				const gushort value = buf[col*image->pixelsize + c];
+				*line++ = value >> 8;
+				*line++ = value & 0xff;
+			}
+	}
+
+	add_strip(writer, raw, rect->height);
+
+	return !writer->error;
+}
+
+static gboolean
+write_strip8(RSFilter *filter, GdkPixbuf *pixbuf, const GdkRectangle *rect, gpointer user_data)
+{
+	PngWriter *writer = user_data;
+	const gint input_channels = gdk_pixbuf_get_n_channels(pixbuf);
+	guchar *raw = g_new(guchar, rect->height * writer->rowbytes);
+	gint row, col;
+
+	for(row = 0; row < rect->height; row++)
+	{
+		guchar *buf = GET_PIXBUF_PIXEL(pixbuf, 0, row);
+		guchar *line = raw + row * writer->rowbytes;
+		for(col = 0; col < rect->width; col++)
+		{
+			line[col*3 + R] = buf[col*input_channels + R];
+			line[col*3 + G] = buf[col*input_channels + G];
+			line[col*3 + B] = buf[col*input_channels + B];
+		}
+	}
+
+	add_strip(writer, raw, rect->height);
+
+	return !writer->error;
+}
+
 static gboolean
 execute(RSOutput *output, RSFilter *filter)
 {
 	RSPngfile *pngfile = RS_PNGFILE(output);
-	png_bytep *row_pointers;
+	PngWriter writer;
+	gint width, height;
+	gboolean ret;
+
+	RSFilterRequest *request = rs_filter_request_new();
+	rs_filter_request_set_quick(RS_FILTER_REQUEST(request), pngfile->quick);
+	rs_filter_request_set_priority(request, RS_PARALLEL_PRIORITY_LOW);
+	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", pngfile->color_space);
+
+	if (!rs_filter_get_size_simple(filter, request, &width, &height))
+	{
+		g_object_unref(request);
+		return FALSE;
+	}
+
 	FILE *fp = fopen(pngfile->filename, "wb");
 	if (!fp)
-	  return FALSE;
+	{
+		g_object_unref(request);
+		return FALSE;
+	}
 
 	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp)NULL, NULL, NULL);
 
 	if (!png_ptr)
+	{
+		fclose(fp);
+		g_unlink(pngfile->filename);
+		g_object_unref(request);
 		return FALSE;
+	}
 
 	png_infop info_ptr = png_create_info_struct(png_ptr);
 	if (!info_ptr)
 	{
 		png_destroy_write_struct(&png_ptr,(png_infopp)NULL);
-       return FALSE;
-    }
+		fclose(fp);
+		g_unlink(pngfile->filename);
+		g_object_unref(request);
+		return FALSE;
+	}
 
 	png_init_io(png_ptr, fp);
-	/* set the zlib compression level */
-	png_set_compression_level(png_ptr, Z_DEFAULT_COMPRESSION);
-
 
 	if (pngfile->color_space == rs_color_space_new_singleton("RSSrgb") && !pngfile->save16bit)
 	{
@@ -217,76 +586,55 @@ execute(RSOutput *output, RSFilter *filter)
 			png_set_gAMA(png_ptr, info_ptr, 1.0);
 	}
 
-	RSFilterResponse *response;
-	RSFilterRequest *request = rs_filter_request_new();
-	rs_filter_request_set_quick(RS_FILTER_REQUEST(request), pngfile->quick);
-	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", pngfile->color_space);
+	png_set_IHDR(png_ptr, info_ptr, width, height,
+		pngfile->save16bit ? 16 : 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	png_write_info(png_ptr, info_ptr);
+
+	memset(&writer, 0, sizeof(PngWriter));
+	writer.png_ptr = png_ptr;
+	writer.height = height;
+	writer.bpp = pngfile->save16bit ? 6 : 3;
+	writer.rowbytes = width * writer.bpp;
+	writer.last_row = g_new(guchar, writer.rowbytes);
+	writer.adler = adler32(0L, Z_NULL, 0);
+
+	/* Image data is filtered and deflated by libpng in a single thread, we do
+	 * it ourselves instead - one strip per thread */
+	writer.max_pending = rs_parallel_get_number_of_threads();
+	writer.pending = g_new0(Strip, writer.max_pending);
 
 	if (pngfile->save16bit)
-	{
-		response = rs_filter_get_image(filter, request);
-		RS_IMAGE16 *image = rs_filter_response_get_image(response);
-
-		gint n_channels = image->pixelsize;
-		gint width = image->w;
-		gint height = image->h;
-
-		png_set_IHDR(png_ptr, info_ptr, width, height,
-					16, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-					PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-		png_write_info(png_ptr, info_ptr);
-
-		row_pointers = g_malloc(sizeof(png_bytep*)*height);
-		gint i;
-		for( i = 0; i < height; i++)
-			row_pointers[i] = (png_bytep)GET_PIXEL(image, 0, i);
-
-		if (n_channels == 4)
-			png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
-#ifdef G_BIG_ENDIAN
-		png_set_swap(png_ptr);
-#endif
-		rs_io_lock();
-		png_write_image(png_ptr, row_pointers);
-		g_object_unref(image);
-	}
-	else  // 8 bit
-	{
-		response = rs_filter_get_image8(filter, request);
-		GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
-
-		gint n_channels = gdk_pixbuf_get_n_channels (pixbuf);
-		gint width = gdk_pixbuf_get_width (pixbuf);
-		gint height = gdk_pixbuf_get_height (pixbuf);
-		gint rowstride = gdk_pixbuf_get_rowstride (pixbuf);
-		guchar* pixels = gdk_pixbuf_get_pixels (pixbuf);
-
-		png_set_IHDR(png_ptr, info_ptr, width, height,
-			8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-		png_write_info(png_ptr, info_ptr);
-
-		row_pointers = g_malloc(sizeof(png_bytep*)*height);
-		gint i;
-		for( i = 0; i < height; i++)
-			row_pointers[i] = (png_bytep)(pixels + i * rowstride);
-
-		if (n_channels == 4)
-			png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
-		
-		rs_io_lock();
-		png_write_image(png_ptr, row_pointers);
-		g_object_unref(pixbuf);
-	}
+		ret = rs_filter_get_image_tiled(filter, request, -1, STRIP_ROWS, write_strip16, &writer);
+	else
+		ret = rs_filter_get_image8_tiled(filter, request, -1, STRIP_ROWS, write_strip8, &writer);
+	g_object_unref(request);
 
-	png_write_end(png_ptr, NULL);
+	/* Only left over if rendering was aborted */
+	while (writer.num_pending > 0)
+		g_free(writer.pending[--writer.num_pending].raw);
+	g_free(writer.pending);
+	g_free(writer.last_row);
+
+	if (writer.error || writer.rows_done != height)
+		ret = FALSE;
+
+	/* png_write_end() would refuse to finish, as libpng never saw our IDAT
+	 * chunks, so IEND is written by hand */
+	rs_io_lock();
+	if (ret)
+		png_write_chunk(png_ptr, (png_bytep) "IEND", NULL, 0);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 	fclose(fp);
-	g_object_unref(request);
-	g_object_unref(response);
-	g_free(row_pointers);
+
+	if (!ret)
+	{
+		/* Don't leave a truncated PNG behind */
+		g_unlink(pngfile->filename);
+		rs_io_unlock();
+		return FALSE;
+	}
 
 	gchar *input_filename = NULL;
 	rs_filter_get_recursive(filter, "filename", &input_filename, NULL);
@@ -19,9 +19,18 @@
 
 #include "config.h"
 #include <rawstudio.h>
+#include <glib/gstdio.h>
 #include <tiffio.h>
+#include <zlib.h>
 #include <gettext.h>
 
+/* Rows in each TIFF strip, strips are pulled from the filter chain one at a
+ * time. This matches the cache tiles */
+#define STRIP_ROWS 256
+
+/* Same as ZIPQUALITY in rs_tiff_generic_init() */
+#define DEFLATE_LEVEL 9
+
 #define RS_TYPE_TIFFFILE (rs_tifffile_type)
 #define RS_TIFFFILE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), RS_TYPE_TIFFFILE, RSTifffile))
 #define RS_TIFFFILE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), RS_TYPE_TIFFFILE, RSTifffileClass))
@@ -205,90 +214,207 @@ rs_tiff_generic_init(TIFF *output, guint w, guint h, const guint samples_per_pix
 		}
 
 	}
-	TIFFSetField(output, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(output, 0));
+	TIFFSetField(output, TIFFTAG_ROWSPERSTRIP, STRIP_ROWS);
 }
 
-static gboolean
-execute(RSOutput *output, RSFilter *filter)
-{
-	RSFilterResponse *response;
-	RSTifffile *tifffile = RS_TIFFFILE(output);
-	const RSIccProfile *profile = NULL;
+typedef struct {
+	gint index;
+	guchar *data;
+	gsize length;
+	guchar *compressed;
+	gsize compressed_length;
+} Strip;
+
+typedef struct {
+	RSTifffile *tifffile;
 	TIFF *tiff;
-	gint row;
+	Strip *pending;
+	gint num_pending;
+	gint max_pending;
+	gint strips_written;
+	gboolean error;
+} TiffWriter;
+
+/* Deflate a strip exactly like libtiff would, so it can be written raw */
+static void
+compress_strips(gint start, gint end, gpointer user_data)
+{
+	TiffWriter *writer = user_data;
+	gint i;
 
-	if((tiff = TIFFOpen(tifffile->filename, "w")) == NULL)
-		return(FALSE);
+	for(i = start; i < end; i++)
+	{
+		Strip *strip = &writer->pending[i];
+		uLongf length = compressBound(strip->length);
 
-	if (tifffile->color_space)
-		profile = rs_color_space_get_icc_profile(tifffile->color_space, tifffile->save16bit);
+		strip->compressed = g_malloc(length);
+		if (compress2(strip->compressed, &length, strip->data, strip->length, DEFLATE_LEVEL) == Z_OK)
+			strip->compressed_length = length;
+		else
+		{
+			/* Let libtiff have a go at it */
+			g_free(strip->compressed);
+			strip->compressed = NULL;
+		}
+	}
+}
 
-	RSFilterRequest *request = rs_filter_request_new();
-	rs_filter_request_set_quick(request, FALSE);
-	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", tifffile->color_space);
+/* Compress pending strips in parallel and write them in order */
+static void
+flush_strips(TiffWriter *writer)
+{
+	gint i;
 
-	if (tifffile->save16bit)
+	if (!writer->tifffile->uncompressed)
+		rs_parallel_for_full(0, writer->num_pending, 1, RS_PARALLEL_PRIORITY_LOW, compress_strips, writer);
+
+	rs_io_lock();
+	for(i = 0; i < writer->num_pending; i++)
+	{
+		Strip *strip = &writer->pending[i];
+		tsize_t written;
+
+		if (strip->compressed)
+			written = TIFFWriteRawStrip(writer->tiff, strip->index, strip->compressed, strip->compressed_length);
+		else
+			written = TIFFWriteEncodedStrip(writer->tiff, strip->index, strip->data, strip->length);
+
+		if (written < 0)
+			writer->error = TRUE;
+
+		g_free(strip->compressed);
+		g_free(strip->data);
+		writer->strips_written++;
+	}
+	rs_io_unlock();
+
+	writer->num_pending = 0;
+}
+
+static void
+add_strip(TiffWriter *writer, guchar *data, gsize length)
+{
+	Strip *strip = &writer->pending[writer->num_pending++];
+
+	strip->index = writer->strips_written + writer->num_pending - 1;
+	strip->data = data;
+	strip->length = length;
+	strip->compressed = NULL;
+
+	if (writer->num_pending == writer->max_pending)
+		flush_strips(writer);
+}
+
+static gboolean
+write_strip16(RSFilter *filter, RS_IMAGE16 *image, const GdkRectangle *rect, gpointer user_data)
+{
+	TiffWriter *writer = user_data;
+	gushort *data = g_new(gushort, rect->width * rect->height * 3);
+	gint row, col;
+
+	g_assert(image->channels == 3);
+
+	for(row = 0; row < rect->height; row++)
 	{
-		gint col;
-		response = rs_filter_get_image(filter, request);
-		RS_IMAGE16 *image = rs_filter_response_get_image(response);
-		rs_tiff_generic_init(tiff, image->w, image->h, 3, profile, tifffile->uncompressed);
-		gushort *line = g_new(gushort, image->w*3);
-
-		g_assert(image->channels == 3);
-		g_assert(image->pixelsize == 4);
-
-		TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 16);
-		printf("pixelsize: %d\n", image->pixelsize);
-		rs_io_lock();
-		for(row=0;row<image->h;row++)
+		gushort *buf = GET_PIXEL(image, 0, row);
+		gushort *line = data + row * rect->width * 3;
+		for(col = 0; col < rect->width; col++)
 		{
-			gushort *buf = GET_PIXEL(image, 0, row);
-			for(col=0;col<image->w; col++)
-			{
-				line[col*3 + R] = buf[col*4 + R];
-				line[col*3 + G] = buf[col*4 + G];
-				line[col*3 + B] = buf[col*4 + B];
-			}
-			TIFFWriteScanline(tiff, line, row, 0);
+			line[col*3 + R] = buf[col*image->pixelsize + R];
+			line[col*3 + G] = buf[col*image->pixelsize + G];
+			line[col*3 + B] = buf[col*image->pixelsize + B];
 		}
-
-		g_object_unref(image);
-		g_object_unref(response);
-		g_free(line);
 	}
-	else
+
+	add_strip(writer, (guchar *) data, rect->width * rect->height * 3 * sizeof(gushort));
+
+	return !writer->error;
+}
+
+static gboolean
+write_strip8(RSFilter *filter, GdkPixbuf *pixbuf, const GdkRectangle *rect, gpointer user_data)
+{
+	TiffWriter *writer = user_data;
+	const gint input_channels = gdk_pixbuf_get_n_channels(pixbuf);
+	guchar *data = g_new(guchar, rect->width * rect->height * 3);
+	gint row, col;
+
+	for(row = 0; row < rect->height; row++)
 	{
-		gint col;
-		response = rs_filter_get_image8(filter, request);
-		GdkPixbuf *pixbuf = rs_filter_response_get_image8(response);
-		gint width = gdk_pixbuf_get_width(pixbuf);
-		gint height = gdk_pixbuf_get_height(pixbuf);
-		gint input_channels = gdk_pixbuf_get_n_channels(pixbuf);
-		rs_tiff_generic_init(tiff, width, height, 3, profile, tifffile->uncompressed);
-		gchar *line = g_new(gchar, width * 3);
-
-		TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
-		rs_io_lock();
-		for(row=0;row<height;row++)
+		guchar *buf = GET_PIXBUF_PIXEL(pixbuf, 0, row);
+		guchar *line = data + row * rect->width * 3;
+		for(col = 0; col < rect->width; col++)
 		{
-			guchar *buf = GET_PIXBUF_PIXEL(pixbuf, 0, row);
-			for(col=0; col<width; col++)
-			{
-				line[col*3 + R] = buf[col*input_channels + R];
-				line[col*3 + G] = buf[col*input_channels + G];
-				line[col*3 + B] = buf[col*input_channels + B];
-			}
-			TIFFWriteScanline(tiff, line, row, 0);
+			line[col*3 + R] = buf[col*input_channels + R];
+			line[col*3 + G] = buf[col*input_channels + G];
+			line[col*3 + B] = buf[col*input_channels + B];
 		}
+	}
+
+	add_strip(writer, data, rect->width * rect->height * 3);
+
+	return !writer->error;
+}
+
+static gboolean
+execute(RSOutput *output, RSFilter *filter)
+{
+	RSTifffile *tifffile = RS_TIFFFILE(output);
+	const RSIccProfile *profile = NULL;
+	TiffWriter writer;
+	gint width, height;
+	gboolean ret;
 
-		g_free(line);
-		g_object_unref(pixbuf);
-		g_object_unref(response);
+	RSFilterRequest *request = rs_filter_request_new();
+	rs_filter_request_set_quick(request, FALSE);
+	rs_filter_request_set_priority(request, RS_PARALLEL_PRIORITY_LOW);
+	rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", tifffile->color_space);
+
+	if (!rs_filter_get_size_simple(filter, request, &width, &height))
+	{
+		g_object_unref(request);
+		return FALSE;
 	}
+
+	memset(&writer, 0, sizeof(TiffWriter));
+	writer.tifffile = tifffile;
+	if((writer.tiff = TIFFOpen(tifffile->filename, "w")) == NULL)
+	{
+		g_object_unref(request);
+		return(FALSE);
+	}
+
+	if (tifffile->color_space)
+		profile = rs_color_space_get_icc_profile(tifffile->color_space, tifffile->save16bit);
+
+	rs_tiff_generic_init(writer.tiff, width, height, 3, profile, tifffile->uncompressed);
+	TIFFSetField(writer.tiff, TIFFTAG_BITSPERSAMPLE, tifffile->save16bit ? 16 : 8);
+
+	/* Strips are written as soon as they are rendered, so only a few strips
+	 * are held in memory. Deflating is done in parallel, one strip per thread */
+	writer.max_pending = tifffile->uncompressed ? 1 : rs_parallel_get_number_of_threads();
+	writer.pending = g_new0(Strip, writer.max_pending);
+
+	if (tifffile->save16bit)
+		ret = rs_filter_get_image_tiled(filter, request, -1, STRIP_ROWS, write_strip16, &writer);
+	else
+		ret = rs_filter_get_image8_tiled(filter, request, -1, STRIP_ROWS, write_strip8, &writer);
 	g_object_unref(request);
 
-	TIFFClose(tiff);
+	if (writer.num_pending > 0)
+		flush_strips(&writer);
+	g_free(writer.pending);
+
+	rs_io_lock();
+	TIFFClose(writer.tiff);
+
+	if (!ret || writer.error)
+	{
+		/* Don't leave a truncated TIFF behind */
+		g_unlink(tifffile->filename);
+		rs_io_unlock();
+		return FALSE;
+	}
 
 	gchar *input_filename = NULL;
 	rs_filter_get_recursive(filter, "filename", &input_filename, NULL);
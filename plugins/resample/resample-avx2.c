@@ -0,0 +1,157 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>,
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Plugin tmpl version 4 */
+
+#include <rawstudio.h>
+
+typedef struct {
+	gint fir_filter_size;		/* Number of weights per output pixel */
+	gint pairs;					/* Number of tap pairs per output pixel, last can be half */
+	gint *offsets;				/* First input pixel used for every output pixel */
+	gint *weights;				/* fir_filter_size FPScale weights for every output pixel */
+	gshort *pair_weights;		/* Weights interleaved as w0,w1,w0,w1... 8 for every pair of taps */
+	gshort *_pair_weights_unaligned;
+} ResampleWeights;
+
+extern void ResizeV_row_SSE2(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out);
+extern void ResizeH_row_SSE2(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out);
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+
+const static gint FPScale = 16384; /* fixed point scaler */
+const static gint FPScaleShift = 14; /* fixed point scaler */
+
+/* Same as ResizeV_row_SSE2(), but 4 pixels per loop. The 128 bit pair weights
+   are broadcast to both lanes */
+void
+ResizeV_row_AVX2(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out)
+{
+	const gint fir_filter_size = w->fir_filter_size;
+	const gint pairs = fir_filter_size / 2;
+	const gint rowstride = input->rowstride;
+	const __m128i *pair_weights = (const __m128i *) &w->pair_weights[y*w->pairs*8];
+	const gushort *in = GET_PIXEL(input, start_x, w->offsets[y]);
+	const gint end = (end_x - start_x) * 4;
+	const __m256i sign = _mm256_set1_epi16(-32768);
+	const __m256i round = _mm256_set1_epi32(FPScale/2);
+	gint x, i;
+
+	for (x = 0; x <= end - 16; x += 16)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		__m256i acc_h = _mm256_setzero_si256();
+		__m256i a, b, weight;
+
+		for (i = 0; i < pairs; i++)
+		{
+			weight = _mm256_broadcastsi128_si256(_mm_load_si128(&pair_weights[i]));
+			a = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) &in[(i*2)*rowstride + x]), sign);
+			b = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) &in[(i*2+1)*rowstride + x]), sign);
+			/* Lanes hold pixel 0 and 2 in acc, pixel 1 and 3 in acc_h */
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weight));
+			acc_h = _mm256_add_epi32(acc_h, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weight));
+		}
+
+		/* Odd filter, the last tap has a zero weight for its pair */
+		if (fir_filter_size & 1)
+		{
+			weight = _mm256_broadcastsi128_si256(_mm_load_si128(&pair_weights[i]));
+			a = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) &in[(i*2)*rowstride + x]), sign);
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, a), weight));
+			acc_h = _mm256_add_epi32(acc_h, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, a), weight));
+		}
+
+		acc = _mm256_srai_epi32(_mm256_add_epi32(acc, round), FPScaleShift);
+		acc_h = _mm256_srai_epi32(_mm256_add_epi32(acc_h, round), FPScaleShift);
+		/* Packing is per lane, which puts the pixels back in order */
+		_mm256_storeu_si256((__m256i *) &out[x], _mm256_xor_si256(_mm256_packs_epi32(acc, acc_h), sign));
+	}
+
+	/* Remaining pixels */
+	if (x < end)
+		ResizeV_row_SSE2(input, w, y, start_x + x/4, end_x, &out[x]);
+}
+
+/* Same as ResizeH_row_SSE2(), but two pairs of taps per loop */
+void
+ResizeH_row_AVX2(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out)
+{
+	const gint pairs = w->fir_filter_size / 2;
+	const gboolean odd = w->fir_filter_size & 1;
+	const __m256i sign = _mm256_set1_epi16(-32768);
+	const __m128i sign128 = _mm_set1_epi16(-32768);
+	const __m128i round = _mm_set1_epi32(FPScale/2);
+	gint x, i;
+
+	for (x = start_x; x < end_x; x++)
+	{
+		const gushort *p = &in[(w->offsets[x] - in_x) * 4];
+		const gshort *pair_weights = &w->pair_weights[x*w->pairs*8];
+		__m256i acc256 = _mm256_setzero_si256();
+		__m256i src256;
+		__m128i acc, src;
+
+		for (i = 0; i <= pairs - 2; i += 2)
+		{
+			/* Four neighbour pixels, every lane interleaved as r0 r1 g0 g1 b0 b1 a0 a1 */
+			src256 = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) &p[i*8]), sign);
+			src256 = _mm256_unpacklo_epi16(src256, _mm256_srli_si256(src256, 8));
+			acc256 = _mm256_add_epi32(acc256, _mm256_madd_epi16(src256, _mm256_loadu_si256((__m256i *) &pair_weights[i*8])));
+		}
+
+		acc = _mm_add_epi32(_mm256_castsi256_si128(acc256), _mm256_extracti128_si256(acc256, 1));
+
+		/* An odd number of pairs and the last half pair */
+		for (; i < pairs; i++)
+		{
+			src = _mm_xor_si128(_mm_loadu_si128((__m128i *) &p[i*8]), sign128);
+			src = _mm_unpacklo_epi16(src, _mm_srli_si128(src, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(src, _mm_load_si128((__m128i *) &pair_weights[i*8])));
+		}
+
+		if (odd)
+		{
+			src = _mm_xor_si128(_mm_loadl_epi64((__m128i *) &p[i*8]), sign128);
+			src = _mm_unpacklo_epi16(src, _mm_srli_si128(src, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(src, _mm_load_si128((__m128i *) &pair_weights[i*8])));
+		}
+
+		acc = _mm_srai_epi32(_mm_add_epi32(acc, round), FPScaleShift);
+		acc = _mm_xor_si128(_mm_packs_epi32(acc, acc), sign128);
+		_mm_storel_epi64((__m128i *) &out[(x - start_x) * 4], acc);
+	}
+}
+
+#else // not defined (__AVX2__)
+
+void
+ResizeV_row_AVX2(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out)
+{
+	ResizeV_row_SSE2(input, w, y, start_x, end_x, out);
+}
+
+void
+ResizeH_row_AVX2(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out)
+{
+	ResizeH_row_SSE2(in, in_x, w, start_x, end_x, out);
+}
+
+#endif // not defined (__AVX2__)
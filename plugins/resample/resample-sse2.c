@@ -35,15 +35,27 @@ typedef struct {
 	guint new_size;				/* New size in the direction of the resampler */
 	guint dest_offset_other;	/* Where in the unchanged direction should we begin writing? */
 	guint dest_end_other;		/* Where in the unchanged direction should we stop writing? */
+	guint dest_offset;			/* Where in the resampled direction should we begin writing? */
+	guint dest_end;				/* Where in the resampled direction should we stop writing? */
 	guint (*resample_support)(void);
 	gfloat (*resample_func)(gfloat);
-	GThread *threadid;
 	gboolean use_compatible;	/* Use compatible resampler if pixelsize != 4 */
 	gboolean use_fast;		/* Use nearest neighbour resampler, also compatible*/
 } ResampleInfo;
 
+typedef struct {
+	gint fir_filter_size;		/* Number of weights per output pixel */
+	gint pairs;					/* Number of tap pairs per output pixel, last can be half */
+	gint *offsets;				/* First input pixel used for every output pixel */
+	gint *weights;				/* fir_filter_size FPScale weights for every output pixel */
+	gshort *pair_weights;		/* Weights interleaved as w0,w1,w0,w1... 8 for every pair of taps */
+	gshort *_pair_weights_unaligned;
+} ResampleWeights;
+
 extern void ResizeV(ResampleInfo *info);
 extern void ResizeV_fast(ResampleInfo *info);
+extern void ResizeV_row(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out);
+extern void ResizeH_row(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out);
 static inline guint clampbits(gint x, guint n) { guint32 _y_temp; if( (_y_temp=x>>n) ) x = ~_y_temp >> (32-n); return x;}
 
 static guint
@@ -148,7 +160,7 @@ ResizeV_SSE2(ResampleInfo *info)
 	}
 
 	guint y,x;
-	gint *wg = weights;
+	gint *wg = &weights[info->dest_offset * fir_filter_size];
 
 	/* 24 pixels = 48 bytes/loop */
 	gint end_x_sse = (end_x/24)*24;
@@ -161,7 +173,7 @@ ResizeV_SSE2(ResampleInfo *info)
 	__m128i add_32 = _mm_set_epi32(add_round_sub, add_round_sub, add_round_sub, add_round_sub);
 	__m128i signxor = _mm_set_epi32(0x80008000, 0x80008000, 0x80008000, 0x80008000);
 
-	for (y = 0; y < new_size ; y++)
+	for (y = info->dest_offset; y < info->dest_end; y++)
 	{
 		gushort *in = GET_PIXEL(input, start_x / input->pixelsize, offsets[y]);
 		gushort *out = GET_PIXEL(output, 0, y);
@@ -340,7 +352,7 @@ ResizeV_SSE2(ResampleInfo *info)
 	}
 
 	guint y,x;
-	gint *wg = weights;
+	gint *wg = &weights[info->dest_offset * fir_filter_size];
 
 	/* 8 pixels = 16 bytes/loop */
 	gint end_x_sse = (end_x/8)*8;
@@ -352,7 +364,7 @@ ResizeV_SSE2(ResampleInfo *info)
 	/* 0.5 pixel value is lost to rounding times fir_filter_size, compensate */
 	add_round_sub += fir_filter_size * (FPScale >> 2);
 
-	for (y = 0; y < new_size ; y++)
+	for (y = info->dest_offset; y < info->dest_end; y++)
 	{
 		gushort *in = GET_PIXEL(input, start_x / input->pixelsize, offsets[y]);
 		gushort *out = GET_PIXEL(output, 0, y);
@@ -440,4 +452,114 @@ ResizeV_SSE2(ResampleInfo *info)
 
 #endif // not defined (__x86_64__) and not defined (__SSE2__)
 
+/* Row resizers for the fused resampler. Samples are biased by -32768 to fit
+ * pmaddwd, the weights add up to FPScale, so the bias is removed again by
+ * the signed saturation in packssdw. The result is identical to the C version.
+ */
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+
+void
+ResizeV_row_SSE2(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out)
+{
+	const gint fir_filter_size = w->fir_filter_size;
+	const gint pairs = fir_filter_size / 2;
+	const gint rowstride = input->rowstride;
+	const gint *wg = &w->weights[y*fir_filter_size];
+	const __m128i *pair_weights = (const __m128i *) &w->pair_weights[y*w->pairs*8];
+	const gushort *in = GET_PIXEL(input, start_x, w->offsets[y]);
+	const gint end = (end_x - start_x) * 4;
+	const __m128i sign = _mm_set1_epi16(-32768);
+	const __m128i round = _mm_set1_epi32(FPScale/2);
+	gint x, i;
+
+	/* 2 pixels per loop */
+	for (x = 0; x <= end - 8; x += 8)
+	{
+		__m128i acc = _mm_setzero_si128();
+		__m128i acc_h = _mm_setzero_si128();
+
+		for (i = 0; i < pairs; i++)
+		{
+			__m128i a = _mm_xor_si128(_mm_loadu_si128((__m128i *) &in[(i*2)*rowstride + x]), sign);
+			__m128i b = _mm_xor_si128(_mm_loadu_si128((__m128i *) &in[(i*2+1)*rowstride + x]), sign);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair_weights[i]));
+			acc_h = _mm_add_epi32(acc_h, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), pair_weights[i]));
+		}
+
+		/* Odd filter, the last tap has a zero weight for its pair */
+		if (fir_filter_size & 1)
+		{
+			__m128i a = _mm_xor_si128(_mm_loadu_si128((__m128i *) &in[(i*2)*rowstride + x]), sign);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, a), pair_weights[i]));
+			acc_h = _mm_add_epi32(acc_h, _mm_madd_epi16(_mm_unpackhi_epi16(a, a), pair_weights[i]));
+		}
+
+		acc = _mm_srai_epi32(_mm_add_epi32(acc, round), FPScaleShift);
+		acc_h = _mm_srai_epi32(_mm_add_epi32(acc_h, round), FPScaleShift);
+		_mm_storeu_si128((__m128i *) &out[x], _mm_xor_si128(_mm_packs_epi32(acc, acc_h), sign));
+	}
+
+	/* Process remaining pixels */
+	for (; x < end; x++)
+	{
+		gint acc = 0;
+		for (i = 0; i < fir_filter_size; i++)
+			acc += in[i*rowstride + x] * wg[i];
+		out[x] = clampbits((acc + (FPScale/2)) >> FPScaleShift, 16);
+	}
+}
+
+void
+ResizeH_row_SSE2(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out)
+{
+	const gint pairs = w->fir_filter_size / 2;
+	const gboolean odd = w->fir_filter_size & 1;
+	const __m128i sign = _mm_set1_epi16(-32768);
+	const __m128i round = _mm_set1_epi32(FPScale/2);
+	gint x, i;
+
+	for (x = start_x; x < end_x; x++)
+	{
+		const gushort *p = &in[(w->offsets[x] - in_x) * 4];
+		const __m128i *pair_weights = (const __m128i *) &w->pair_weights[x*w->pairs*8];
+		__m128i acc = _mm_setzero_si128();
+		__m128i src;
+
+		for (i = 0; i < pairs; i++)
+		{
+			/* Two neighbour pixels, interleaved as r0 r1 g0 g1 b0 b1 a0 a1 */
+			src = _mm_xor_si128(_mm_loadu_si128((__m128i *) &p[i*8]), sign);
+			src = _mm_unpacklo_epi16(src, _mm_srli_si128(src, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(src, pair_weights[i]));
+		}
+
+		if (odd)
+		{
+			src = _mm_xor_si128(_mm_loadl_epi64((__m128i *) &p[i*8]), sign);
+			src = _mm_unpacklo_epi16(src, _mm_srli_si128(src, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(src, pair_weights[i]));
+		}
+
+		acc = _mm_srai_epi32(_mm_add_epi32(acc, round), FPScaleShift);
+		acc = _mm_xor_si128(_mm_packs_epi32(acc, acc), sign);
+		_mm_storel_epi64((__m128i *) &out[(x - start_x) * 4], acc);
+	}
+}
+
+#else // not defined (__SSE2__)
+
+void
+ResizeV_row_SSE2(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out)
+{
+	ResizeV_row(input, w, y, start_x, end_x, out);
+}
+
+void
+ResizeH_row_SSE2(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out)
+{
+	ResizeH_row(in, in_x, w, start_x, end_x, out);
+}
 
+#endif // not defined (__SSE2__)
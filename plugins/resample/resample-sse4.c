@@ -35,9 +35,10 @@ typedef struct {
 	guint new_size;				/* New size in the direction of the resampler */
 	guint dest_offset_other;	/* Where in the unchanged direction should we begin writing? */
 	guint dest_end_other;		/* Where in the unchanged direction should we stop writing? */
+	guint dest_offset;			/* Where in the resampled direction should we begin writing? */
+	guint dest_end;				/* Where in the resampled direction should we stop writing? */
 	guint (*resample_support)(void);
 	gfloat (*resample_func)(gfloat);
-	GThread *threadid;
 	gboolean use_compatible;	/* Use compatible resampler if pixelsize != 4 */
 	gboolean use_fast;		/* Use nearest neighbour resampler, also compatible*/
 } ResampleInfo;
@@ -149,7 +150,7 @@ ResizeV_SSE4(ResampleInfo *info)
 	}
 
 	guint y,x;
-	gint *wg = weights;
+	gint *wg = &weights[info->dest_offset * fir_filter_size];
 
 	/* 24 pixels = 48 bytes/loop */
 	gint end_x_sse = (end_x/24)*24;
@@ -159,7 +160,7 @@ ResizeV_SSE4(ResampleInfo *info)
 	
 	__m128i add_32 = _mm_set_epi32(add_round_sub, add_round_sub, add_round_sub, add_round_sub);
 
-	for (y = 0; y < new_size ; y++)
+	for (y = info->dest_offset; y < info->dest_end; y++)
 	{
 		gushort *in = GET_PIXEL(input, start_x / input->pixelsize, offsets[y]);
 		gushort *out = GET_PIXEL(output, 0, y);
@@ -325,7 +326,7 @@ ResizeV_SSE4(ResampleInfo *info)
 	}
 
 	guint y,x;
-	gint *wg = weights;
+	gint *wg = &weights[info->dest_offset * fir_filter_size];
 
 	/* 8 pixels = 16 bytes/loop */
 	gint end_x_sse = (end_x/8)*8;
@@ -335,7 +336,7 @@ ResizeV_SSE4(ResampleInfo *info)
 	/* 0.5 pixel value is lost to rounding times fir_filter_size, compensate */
 	add_round_sub += fir_filter_size * (FPScale >> 1);
 
-	for (y = 0; y < new_size ; y++)
+	for (y = info->dest_offset; y < info->dest_end; y++)
 	{
 		gushort *in = GET_PIXEL(input, start_x / input->pixelsize, offsets[y]);
 		gushort *out = GET_PIXEL(output, 0, y);
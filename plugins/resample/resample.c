@@ -21,7 +21,6 @@
 
 #include <rawstudio.h>
 #include <math.h>
-#include <string.h>  /*memcpy */
 
 
 
@@ -43,6 +42,7 @@ struct _RSResample {
 	gfloat scale;
 	gboolean bounding_box;
 	gboolean never_quick;
+	GStaticRecMutex lock;
 };
 
 struct _RSResampleClass {
@@ -56,13 +56,59 @@ typedef struct {
 	guint new_size;				/* New size in the direction of the resampler */
 	guint dest_offset_other;	/* Where in the unchanged direction should we begin writing? */
 	guint dest_end_other;		/* Where in the unchanged direction should we stop writing? */
+	guint dest_offset;			/* Where in the resampled direction should we begin writing? */
+	guint dest_end;				/* Where in the resampled direction should we stop writing? */
 	guint (*resample_support)(void);
 	gfloat (*resample_func)(gfloat);
-	GThread *threadid;
 	gboolean use_compatible;	/* Use compatible resampler if pixelsize != 4 */
 	gboolean use_fast;		/* Use nearest neighbour resampler, also compatible*/
 } ResampleInfo;
 
+typedef struct {
+	gint fir_filter_size;		/* Number of weights per output pixel */
+	gint pairs;					/* Number of tap pairs per output pixel, last can be half */
+	gint *offsets;				/* First input pixel used for every output pixel */
+	gint *weights;				/* fir_filter_size FPScale weights for every output pixel */
+	gshort *pair_weights;		/* Weights interleaved as w0,w1,w0,w1... 8 for every pair of taps */
+	gshort *_pair_weights_unaligned;
+} ResampleWeights;
+
+typedef void (*ResizeRowV)(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out);
+typedef void (*ResizeRowH)(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out);
+
+typedef struct {
+	RS_IMAGE16 *input;
+	RS_IMAGE16 *output;
+	gint input_x;				/* First input column needed */
+	gint input_end_x;			/* Input column after the last needed */
+	gint output_x;				/* First output column to write */
+	gint output_end_x;			/* Output column after the last to write */
+	gboolean vertical;			/* Resample vertically, else input rows are used as is */
+	ResampleWeights v;
+	ResampleWeights h;
+	ResizeRowV resize_v_row;
+	ResizeRowH resize_h_row;
+} ResampleFusedInfo;
+
+typedef struct {
+	gint fir_filter_size;		/* Number of weights per output pixel */
+	gint *offsets;				/* First input pixel used for every output pixel */
+	gfloat *weights;			/* fir_filter_size weights for every output pixel */
+} ResampleFloatWeights;
+
+typedef struct {
+	RSImage *input;
+	RSImage *output;
+	gint input_x;				/* First input column needed */
+	gint input_end_x;			/* Input column after the last needed */
+	gint output_x;				/* First output column to write */
+	gint output_end_x;			/* Output column after the last to write */
+	gboolean vertical;			/* Resample vertically, else input rows are used as is */
+	gboolean horizontal;		/* Resample horizontally, else vertical rows are written directly */
+	ResampleFloatWeights v;
+	ResampleFloatWeights h;
+} ResampleFloatInfo;
+
 RS_DEFINE_FILTER(rs_resample, RSResample)
 
 enum {
@@ -74,13 +120,15 @@ enum {
 	PROP_SCALE
 };
 
+static void finalize(GObject *object);
 static void get_property (GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
 static void set_property (GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
 static void previous_changed(RSFilter *filter, RSFilter *parent, RSFilterChangedMask mask);
 static RSFilterChangedMask recalculate_dimensions(RSResample *resample);
 static RSFilterResponse *get_image(RSFilter *filter, const RSFilterRequest *request);
+static RSFilterResponse *get_image_float(RSFilter *filter, const RSFilterRequest *request);
 static RSFilterResponse *get_size(RSFilter *filter, const RSFilterRequest *request);
-static void ResizeH(ResampleInfo *info);
+static guint lanczos_taps(void);
 void ResizeV(ResampleInfo *info);
 extern void ResizeV_SSE2(ResampleInfo *info);
 extern void ResizeV_SSE4(ResampleInfo *info);
@@ -89,10 +137,17 @@ static void ResizeH_compatible(ResampleInfo *info);
 static void ResizeV_compatible(ResampleInfo *info);
 static void ResizeH_fast(ResampleInfo *info);
 void ResizeV_fast(ResampleInfo *info);
+static gboolean resample_weights(ResampleWeights *w, guint old_size, guint new_size, gint start, gint end);
+static void resample_weights_free(ResampleWeights *w);
+void ResizeV_row(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out);
+void ResizeH_row(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out);
+extern void ResizeV_row_SSE2(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out);
+extern void ResizeH_row_SSE2(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out);
+extern void ResizeV_row_AVX2(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out);
+extern void ResizeH_row_AVX2(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out);
 
 static RSFilterClass *rs_resample_parent_class = NULL;
 static inline guint clampbits(gint x, guint n) { guint32 _y_temp; if( (_y_temp=x>>n) ) x = ~_y_temp >> (32-n); return x;}
-static GStaticRecMutex resampler_mutex = G_STATIC_REC_MUTEX_INIT;
 
 G_MODULE_EXPORT void
 rs_plugin_load(RSPlugin *plugin)
@@ -110,6 +165,7 @@ rs_resample_class_init(RSResampleClass *klass)
 
 	object_class->get_property = get_property;
 	object_class->set_property = set_property;
+	object_class->finalize = finalize;
 
 	g_object_class_install_property(object_class,
 		PROP_WIDTH, g_param_spec_int(
@@ -139,6 +195,7 @@ rs_resample_class_init(RSResampleClass *klass)
 
 	filter_class->name = "Resample filter";
 	filter_class->get_image = get_image;
+	filter_class->get_image_float = get_image_float;
 	filter_class->get_size = get_size;
 	filter_class->previous_changed = previous_changed;
 }
@@ -153,6 +210,17 @@ rs_resample_init(RSResample *resample)
 	resample->bounding_box = FALSE;
 	resample->scale = 1.0;
 	resample->never_quick = FALSE;
+	g_static_rec_mutex_init(&resample->lock);
+}
+
+static void
+finalize(GObject *object)
+{
+	RSResample *resample = RS_RESAMPLE(object);
+
+	g_static_rec_mutex_free(&resample->lock);
+
+	G_OBJECT_CLASS(rs_resample_parent_class)->finalize(object);
 }
 
 static void
@@ -188,7 +256,7 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 	RSResample *resample = RS_RESAMPLE(object);
 	RSFilterChangedMask mask = 0;
 
-	g_static_rec_mutex_lock(&resampler_mutex);
+	g_static_rec_mutex_lock(&resample->lock);
 
 	switch (property_id)
 	{
@@ -224,7 +292,7 @@ set_property(GObject *object, guint property_id, const GValue *value, GParamSpec
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
 
-	g_static_rec_mutex_unlock(&resampler_mutex);
+	g_static_rec_mutex_unlock(&resample->lock);
 	if (mask)
 		rs_filter_changed(RS_FILTER(object), mask);
 }
@@ -245,7 +313,7 @@ recalculate_dimensions(RSResample *resample)
 	gint new_width, new_height;
 	gint previous_width = 0;
 	gint previous_height = 0;
-	g_static_rec_mutex_lock(&resampler_mutex);
+	g_static_rec_mutex_lock(&resample->lock);
 
 	if (RS_FILTER(resample)->previous)
 		rs_filter_get_size_simple(RS_FILTER(resample)->previous, RS_FILTER_REQUEST_QUICK, &previous_width, &previous_height);
@@ -284,45 +352,23 @@ recalculate_dimensions(RSResample *resample)
 	if (new_width < 0 || new_height < 0)
 		resample->scale = 1.0f;
 
-	g_static_rec_mutex_unlock(&resampler_mutex);
+	g_static_rec_mutex_unlock(&resample->lock);
 	return mask;
 }
 
-static inline void 
-bit_blt(char* dstp, int dst_pitch, const char* srcp, int src_pitch, int row_size, int height) 
-{
-	if (height == 1 || (dst_pitch == src_pitch && src_pitch == row_size)) 
-	{
-		memcpy(dstp, srcp, row_size*height);
-		return;
-	}
-
-	int y;
-	for (y = height; y > 0; --y)
-	{
-		memcpy(dstp, srcp, row_size);
-		dstp += dst_pitch;
-		srcp += src_pitch;
-	}
-}
-
-gpointer
-start_thread_resampler(gpointer _thread_info)
+static void
+resample_part(ResampleInfo *t)
 {
-	ResampleInfo* t = _thread_info;
-
 	if (!t->input)
 	{
 		g_debug("Resampler: input is NULL");
-		g_thread_exit(NULL);
-		return NULL;
+		return;
 	}
 
 	if (!t->output)
 	{
 		g_debug("Resampler: output is NULL");
-		g_thread_exit(NULL);
-		return NULL;
+		return;
 	}
 
 	if (t->input->h != t->output->h)
@@ -345,21 +391,250 @@ start_thread_resampler(gpointer _thread_info)
 	} 
 	else if (t->input->w != t->output->w)
 	{
+		/* The common case is handled by resample_fused() */
 		if (t->use_fast)
 			ResizeH_fast(t);
-		else if (t->use_compatible)
+		else
 			ResizeH_compatible(t);
+	}
+}
+
+static void
+resample_slice(gint start, gint end, gpointer _resample_info)
+{
+	ResampleInfo t = *(ResampleInfo *) _resample_info;
+
+	t.dest_offset_other = start;
+	t.dest_end_other = end;
+
+	resample_part(&t);
+}
+
+/* Resample in two passes with a complete intermediate image, this handles all
+   pixel layouts and the nearest neighbour resampler */
+static RS_IMAGE16 *
+resample_two_pass(RS_IMAGE16 *input, const GdkRectangle *input_roi, const GdkRectangle *roi, gint new_width, gint new_height, gboolean use_compatible, gboolean use_fast, RSParallelPriority priority)
+{
+	const gint threads = rs_parallel_get_number_of_threads();
+	ResampleInfo h_resample;
+	ResampleInfo v_resample;
+	RS_IMAGE16 *afterVertical;
+	RS_IMAGE16 *output;
+
+	if (input->h == new_height)
+		afterVertical = g_object_ref(input);
+	else
+	{
+		/* Only the input columns of the output rows are needed */
+		const GdkRectangle area = {input_roi->x, roi->y, input_roi->width, roi->height};
+		afterVertical = rs_image16_new_area(input->w, new_height, input->channels, input->pixelsize, &area);
+
+		/* Vertical pass is split by columns, keep every slice 16 byte aligned */
+		gint output_x_per_slice = ((input_roi->width + threads*4 - 1) / (threads*4));
+		while (((output_x_per_slice * input->pixelsize) & 15) != 0)
+			output_x_per_slice++;
+
+		/* Set info for Vertical resampler */
+		v_resample.input = input;
+		v_resample.output  = afterVertical;
+		v_resample.old_size = input->h;
+		v_resample.new_size = new_height;
+		v_resample.dest_offset = roi->y;
+		v_resample.dest_end = roi->y + roi->height;
+		v_resample.use_compatible = use_compatible;
+		v_resample.use_fast = use_fast;
+
+		rs_parallel_for_full(input_roi->x, input_roi->x + input_roi->width, output_x_per_slice, priority, resample_slice, &v_resample);
+	}
+
+	if (input->w == new_width)
+		output = g_object_ref(afterVertical);
+	else
+	{
+		output = rs_image16_new_area(new_width, new_height, afterVertical->channels, afterVertical->pixelsize, roi);
+
+		/* Set info for Horizontal resampler */
+		h_resample.input = afterVertical;
+		h_resample.output  = output;
+		h_resample.old_size = input->w;
+		h_resample.new_size = new_width;
+		h_resample.dest_offset = roi->x;
+		h_resample.dest_end = roi->x + roi->width;
+		h_resample.use_compatible = use_compatible;
+		h_resample.use_fast = use_fast;
+
+		/* Horizontal pass is split by rows */
+		rs_parallel_for_full(roi->y, roi->y + roi->height, 0, priority, resample_slice, &h_resample);
+	}
+
+	g_object_unref(afterVertical);
+
+	return output;
+}
+
+static void
+resample_fused(gint start, gint end, gpointer _info)
+{
+	const ResampleFusedInfo *info = _info;
+	gushort *row = NULL;
+	gint y;
+
+	if (info->vertical)
+		row = g_new(gushort, (info->input_end_x - info->input_x) * 4 + 8);
+
+	for (y = start; y < end; y++)
+	{
+		gushort *out = GET_PIXEL(info->output, info->output_x, y);
+
+		if (info->vertical)
+			info->resize_v_row(info->input, &info->v, y, info->input_x, info->input_end_x, row);
 		else
-			ResizeH(t);
+			row = GET_PIXEL(info->input, info->input_x, y);
+
+		info->resize_h_row(row, info->input_x, &info->h, info->output_x, info->output_end_x, out);
+	}
+
+	if (info->vertical)
+		g_free(row);
+}
+
+/* Resample a row at a time, the vertically resampled row stays in cache for
+   the horizontal pass. Returns NULL if the image is too small for this */
+static RS_IMAGE16 *
+resample_fused_image(RS_IMAGE16 *input, const GdkRectangle *input_roi, const GdkRectangle *roi, gint new_width, gint new_height, RSParallelPriority priority)
+{
+	guint cpu = rs_detect_cpu_features();
+	ResampleFusedInfo info;
+
+	/* Only a vertical pass, the column split resizers are faster */
+	if (input->w == new_width)
+		return NULL;
+
+	info.vertical = (input->h != new_height);
+
+	if (!resample_weights(&info.h, input->w, new_width, roi->x, roi->x + roi->width))
+		return NULL;
+
+	if (info.vertical && !resample_weights(&info.v, input->h, new_height, roi->y, roi->y + roi->height))
+	{
+		resample_weights_free(&info.h);
+		return NULL;
+	}
+
+	info.input = input;
+	info.output = rs_image16_new_area(new_width, new_height, input->channels, input->pixelsize, roi);
+	info.input_x = input_roi->x;
+	info.input_end_x = input_roi->x + input_roi->width;
+	info.output_x = roi->x;
+	info.output_end_x = roi->x + roi->width;
+	if (cpu & RS_CPU_FLAG_AVX2)
+	{
+		info.resize_v_row = ResizeV_row_AVX2;
+		info.resize_h_row = ResizeH_row_AVX2;
+	}
+	else if (cpu & RS_CPU_FLAG_SSE2)
+	{
+		info.resize_v_row = ResizeV_row_SSE2;
+		info.resize_h_row = ResizeH_row_SSE2;
+	}
+	else
+	{
+		info.resize_v_row = ResizeV_row;
+		info.resize_h_row = ResizeH_row;
+	}
+
+	rs_parallel_for_full(roi->y, roi->y + roi->height, 0, priority, resample_fused, &info);
+
+	resample_weights_free(&info.h);
+	if (info.vertical)
+		resample_weights_free(&info.v);
+
+	return info.output;
+}
+
+/* Read the output size, the properties can be changed from another thread */
+static void
+get_new_size(RSResample *resample, gint *new_width, gint *new_height)
+{
+	g_static_rec_mutex_lock(&resample->lock);
+	*new_width = resample->new_width;
+	*new_height = resample->new_height;
+	g_static_rec_mutex_unlock(&resample->lock);
+}
+
+/* Find the input pixels read by the resizers when producing output pixels
+   start to start+size-1. This mirrors the tap placement used for the weights,
+   plus a pixel of slack for the accumulated position */
+static void
+input_span(gint start, gint size, gint old_size, gint new_size, gint *in_start, gint *in_end)
+{
+	gfloat pos_step = ((gfloat) old_size) / ((gfloat)new_size);
+	gfloat filter_step = MIN(1.0 / pos_step, 1.0);
+	gfloat filter_support = (gfloat) lanczos_taps() / filter_step;
+	gint fir_filter_size = (gint) (ceil(filter_support*2));
+	gint first, last;
+
+	/* This direction is passed through untouched */
+	if (old_size == new_size)
+	{
+		*in_start = start;
+		*in_end = start + size;
+		return;
+	}
+
+	first = MIN((gint) (start * pos_step + filter_support), old_size-1) - fir_filter_size + 1;
+	last = MIN((gint) ((start + size - 1) * pos_step + filter_support), old_size-1);
+
+	*in_start = MAX(first - 1, 0);
+	*in_end = MIN(last + 2, old_size);
+}
+
+/* Clone request for the previous filter, with the ROI mapped to input pixels */
+static RSFilterRequest *
+previous_request(const RSFilterRequest *request, gint input_width, gint input_height, gint new_width, gint new_height, GdkRectangle *input_roi)
+{
+	RSFilterRequest *new_request = rs_filter_request_clone(request);
+	GdkRectangle *roi = rs_filter_request_get_roi(request);
+	gint end_x, end_y;
+
+	input_roi->x = 0;
+	input_roi->y = 0;
+	input_roi->width = input_width;
+	input_roi->height = input_height;
+
+	if (roi)
+	{
+		input_span(roi->x, roi->width, input_width, new_width, &input_roi->x, &end_x);
+		input_span(roi->y, roi->height, input_height, new_height, &input_roi->y, &end_y);
+
+		/* Vertical SSE2/AVX resamplers need 16 byte aligned columns */
+		input_roi->x &= ~7;
+		input_roi->width = end_x - input_roi->x;
+		input_roi->height = end_y - input_roi->y;
+		rs_filter_request_set_roi(new_request, input_roi);
 	}
-	/* Unchanged in both directions, have thread 0 copy all the image */
-	else if (t->dest_offset_other == 0)
-		bit_blt((char*)GET_PIXEL(t->output,0,0), t->output->rowstride * 2, 
-			(const char*)GET_PIXEL(t->input,0,0), t->input->rowstride * 2, t->input->rowstride * 2, t->input->h);
 
-	g_thread_exit(NULL);
+	return new_request;
+}
 
-	return NULL; /* Make the compiler shut up - we'll never return */
+/* Find the output area to render. If the previous filter didn't deliver the
+   size we asked for (half-size), everything is resampled */
+static void
+output_roi(const RSFilterRequest *request, gint input_width, gint input_height, gint width, gint height, gint new_width, gint new_height, GdkRectangle *input_roi, GdkRectangle *roi)
+{
+	if (rs_filter_request_get_roi(request) && (width == input_width) && (height == input_height))
+		*roi = *rs_filter_request_get_roi(request);
+	else
+	{
+		roi->x = 0;
+		roi->y = 0;
+		roi->width = new_width;
+		roi->height = new_height;
+		input_roi->x = 0;
+		input_roi->y = 0;
+		input_roi->width = width;
+		input_roi->height = height;
+	}
 }
 
 static RSFilterResponse *
@@ -367,45 +642,45 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 {
 	gboolean use_fast = FALSE;
 	RSResample *resample = RS_RESAMPLE(filter);
+	RSFilterRequest *new_request;
 	RSFilterResponse *previous_response;
 	RSFilterResponse *response;
-	RS_IMAGE16 *afterVertical;
 	RS_IMAGE16 *input;
 	RS_IMAGE16 *output = NULL;
+	GdkRectangle input_roi;
+	GdkRectangle roi;
 	gint input_width;
 	gint input_height;
+	gint new_width;
+	gint new_height;
 
 	rs_filter_get_size_simple(filter->previous, request, &input_width, &input_height);
+	get_new_size(resample, &new_width, &new_height);
 
 	/* Return the input, if the new size is uninitialized */
-	if ((resample->new_width == -1) || (resample->new_height == -1))
+	if ((new_width == -1) || (new_height == -1))
 		return rs_filter_get_image(filter->previous, request);
 
 	/* Simply return the input, if we don't scale */
-	if ((input_width == resample->new_width) && (input_height == resample->new_height))
+	if ((input_width == new_width) && (input_height == new_height))
 		return rs_filter_get_image(filter->previous, request);	
-	
-	/* Remove ROI, it doesn't make sense across resampler */
-	if (rs_filter_request_get_roi(request))
-	{
-		RSFilterRequest *new_request = rs_filter_request_clone(request);
-		rs_filter_request_set_roi(new_request, NULL);
-		previous_response = rs_filter_get_image(filter->previous, new_request);
-		g_object_unref(new_request);
-	}
-	else
-		previous_response = rs_filter_get_image(filter->previous, request);
+
+	/* Only request the input pixels needed for our ROI */
+	new_request = previous_request(request, input_width, input_height, new_width, new_height, &input_roi);
+	previous_response = rs_filter_get_image(filter->previous, new_request);
+	g_object_unref(new_request);
 
 	input = rs_filter_response_get_image(previous_response);
 
 	if (!RS_IS_IMAGE16(input))
 		return previous_response;
 
-	g_static_rec_mutex_lock(&resampler_mutex);
+	output_roi(request, input_width, input_height, input->w, input->h, new_width, new_height, &input_roi, &roi);
 	input_width = input->w;
 	input_height = input->h;	
 
 	response = rs_filter_response_clone(previous_response);
+	rs_filter_response_set_roi(response, rs_filter_request_get_roi(request));
 	g_object_unref(previous_response);
 	previous_response = NULL;
 
@@ -421,89 +696,17 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	if (input_width < 32 || input_height < 32)
 		use_compatible = TRUE;
 
-	guint threads = rs_get_number_of_processor_cores();
-
-	ResampleInfo* h_resample = g_new(ResampleInfo,  threads);
-	ResampleInfo* v_resample = g_new(ResampleInfo,  threads);
+	if (!use_fast && !use_compatible)
+		output = resample_fused_image(input, &input_roi, &roi, new_width, new_height, rs_filter_request_get_priority(request));
 
-	/* Create intermediate and output images*/
-	afterVertical = rs_image16_new(input_width, resample->new_height, input->channels, input->pixelsize);
+	if (!output)
+		output = resample_two_pass(input, &input_roi, &roi, new_width, new_height, use_compatible, use_fast, rs_filter_request_get_priority(request));
 
-	// Only even count
-	guint output_x_per_thread = ((input_width + threads - 1 ) / threads );
-	while (((output_x_per_thread * input->pixelsize) & 15) != 0)
-		output_x_per_thread++;
-	guint output_x_offset = 0;
-
-	guint i;
-	for (i = 0; i < threads; i++)
-	{
-		/* Set info for Vertical resampler */
-		ResampleInfo *v = &v_resample[i];
-		v->input = input;
-		v->output  = afterVertical;
-		v->old_size = input_height;
-		v->new_size = resample->new_height;
-		v->dest_offset_other = output_x_offset;
-		v->dest_end_other  = MIN(output_x_offset + output_x_per_thread, input_width);
-		v->use_compatible = use_compatible;
-		v->use_fast = use_fast;
-
-		/* Start it up */
-		v->threadid = g_thread_create(start_thread_resampler, v, TRUE, NULL);
-
-		/* Update offset */
-		output_x_offset = v->dest_end_other;
-	}
-
-	/* Wait for vertical threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(v_resample[i].threadid);
-
-	/* input no longer needed */
 	g_object_unref(input);
-	input = NULL;
-
-	/* create output */
-	output = rs_image16_new(resample->new_width,  resample->new_height, afterVertical->channels, afterVertical->pixelsize);
-
-	guint input_y_offset = 0;
-	guint input_y_per_thread = (resample->new_height+threads-1) / threads;
-
-	for (i = 0; i < threads; i++)
-	{
-		/* Set info for Horizontal resampler */
-		ResampleInfo *h = &h_resample[i];
-		h->input = afterVertical;
-		h->output  = output;
-		h->old_size = input_width;
-		h->new_size = resample->new_width;
-		h->dest_offset_other = input_y_offset;
-		h->dest_end_other  = MIN(input_y_offset+input_y_per_thread, resample->new_height);
-		h->use_compatible = use_compatible;
-		h->use_fast = use_fast;
-
-		/* Start it up */
-		h->threadid = g_thread_create(start_thread_resampler, h, TRUE, NULL);
-
-		/* Update offset */
-		input_y_offset = h->dest_end_other;
-
-	}
-
-	/* Wait for horizontal threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(h_resample[i].threadid);
-
-	/* Clean up */
-	g_free(h_resample);
-	g_free(v_resample);
-	g_object_unref(afterVertical);
 
 	rs_filter_response_set_image(response, output);
 	rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "half-size", FALSE);
 	g_object_unref(output);
-	g_static_rec_mutex_unlock(&resampler_mutex);
 	return response;
 }
 
@@ -512,15 +715,19 @@ get_size(RSFilter *filter, const RSFilterRequest *request)
 {
 	RSResample *resample = RS_RESAMPLE(filter);
 	RSFilterResponse *previous_response = rs_filter_get_size(filter->previous, request);
+	gint new_width;
+	gint new_height;
 
-	if ((resample->new_width == -1) || (resample->new_height == -1))
+	get_new_size(resample, &new_width, &new_height);
+
+	if ((new_width == -1) || (new_height == -1))
 		return previous_response;
 
 	RSFilterResponse *response = rs_filter_response_clone(previous_response);
 	g_object_unref(previous_response);
 
-	rs_filter_response_set_width(response, resample->new_width);
-	rs_filter_response_set_height(response, resample->new_height);
+	rs_filter_response_set_width(response, new_width);
+	rs_filter_response_set_height(response, new_height);
 
 	return response;
 }
@@ -555,33 +762,239 @@ lanczos_weight(gfloat value)
 		return 0.0f;
 }
 
-const static gint FPScale = 16384; /* fixed point scaler */
-const static gint FPScaleShift = 14; /* fixed point scaler */
+/* Calculate normalized weights for output pixels start to end-1 when
+   resampling from old_size to new_size */
+static void
+float_weights(ResampleFloatWeights *w, guint old_size, guint new_size, gint start, gint end)
+{
+	gfloat pos_step = ((gfloat) old_size) / ((gfloat)new_size);
+	gfloat filter_step = MIN(1.0 / pos_step, 1.0);
+	gfloat filter_support = (gfloat) lanczos_taps() / filter_step;
+	gint fir_filter_size = MIN((gint) (ceil(filter_support*2)), (gint) old_size);
+	gint i, j;
+
+	w->fir_filter_size = fir_filter_size;
+	w->weights = g_new(gfloat, new_size * fir_filter_size);
+	w->offsets = g_new(gint, new_size);
+
+	for (i = start; i < end; i++)
+	{
+		/* Computed from the index like the 16 bit weights, summing the step drifts */
+		gfloat pos = i * pos_step;
+		gint end_pos = MIN((gint) (pos + filter_support), old_size-1);
+		gint start_pos = MAX(end_pos - fir_filter_size + 1, 0);
+		gfloat ok_pos = MAX(0.0, MIN(old_size-1, pos));
+		gfloat *wg = &w->weights[i*fir_filter_size];
+		gfloat total = 0.0f;
+
+		w->offsets[i] = start_pos;
+
+		for (j = 0; j < fir_filter_size; j++)
+		{
+			wg[j] = lanczos_weight((start_pos+j - ok_pos) * filter_step);
+			total += wg[j];
+		}
+
+		if (total <= 0.0f)
+			total = 1.0f;
+
+		for (j = 0; j < fir_filter_size; j++)
+			wg[j] /= total;
+	}
+}
 
 static void
-ResizeH(ResampleInfo *info)
+float_weights_free(ResampleFloatWeights *w)
 {
-	const RS_IMAGE16 *input = info->input;
-	const RS_IMAGE16 *output = info->output;
-	const guint old_size = info->old_size;
-	const guint new_size = info->new_size;
+	g_free(w->offsets);
+	g_free(w->weights);
+}
+
+/* Resample output row y vertically, out points to the sample at start_x */
+static void
+ResizeV_float_row(const RSImage *input, gint plane, const ResampleFloatWeights *w, gint y, gint start_x, gint end_x, gfloat *out)
+{
+	const gfloat *wg = &w->weights[y*w->fir_filter_size];
+	gint x, i;
+
+	for (x = 0; x < end_x - start_x; x++)
+		out[x] = 0.0f;
+
+	for (i = 0; i < w->fir_filter_size; i++)
+	{
+		const gfloat *in = RS_IMAGE_GET_ROW(input, plane, w->offsets[y] + i) + start_x;
+		const gfloat weight = wg[i];
+		for (x = 0; x < end_x - start_x; x++)
+			out[x] += in[x] * weight;
+	}
+}
+
+/* Resample a row horizontally, in points to input sample in_x and out to output sample start_x */
+static void
+ResizeH_float_row(const gfloat *in, gint in_x, const ResampleFloatWeights *w, gint start_x, gint end_x, gfloat *out)
+{
+	const gfloat *wg = &w->weights[start_x * w->fir_filter_size];
+	gint x, i;
+
+	for (x = start_x; x < end_x; x++)
+	{
+		const gfloat *p = &in[w->offsets[x] - in_x];
+		gfloat acc = 0.0f;
+
+		for (i = 0; i < w->fir_filter_size; i++)
+			acc += p[i] * *wg++;
+		*out++ = acc;
+	}
+}
+
+/* Float version of resample_fused(), one plane row at a time */
+static void
+resample_float_fused(gint start, gint end, gpointer _info)
+{
+	const ResampleFloatInfo *info = _info;
+	gfloat *buffer = NULL;
+	gint y, plane;
+
+	if (info->vertical && info->horizontal)
+		buffer = g_new(gfloat, info->input_end_x - info->input_x);
+
+	for (y = start; y < end; y++)
+		for (plane = 0; plane < info->output->number_of_planes; plane++)
+		{
+			gfloat *out = RS_IMAGE_GET_ROW(info->output, plane, y) + info->output_x;
+			const gfloat *row;
+
+			if (!info->horizontal)
+			{
+				ResizeV_float_row(info->input, plane, &info->v, y, info->output_x, info->output_end_x, out);
+				continue;
+			}
+
+			if (info->vertical)
+			{
+				ResizeV_float_row(info->input, plane, &info->v, y, info->input_x, info->input_end_x, buffer);
+				row = buffer;
+			}
+			else
+				row = RS_IMAGE_GET_ROW(info->input, plane, y) + info->input_x;
+
+			ResizeH_float_row(row, info->input_x, &info->h, info->output_x, info->output_end_x, out);
+		}
+
+	g_free(buffer);
+}
+
+/* Resample planar float, this is the high quality path and doesn't quantize
+   between the passes. Quick requests are left to the 16 bit resampler */
+static RSFilterResponse *
+get_image_float(RSFilter *filter, const RSFilterRequest *request)
+{
+	RSResample *resample = RS_RESAMPLE(filter);
+	RSFilterRequest *new_request;
+	RSFilterResponse *previous_response;
+	RSFilterResponse *response;
+	ResampleFloatInfo info;
+	RSImage *input;
+	RSImage *output;
+	GdkRectangle input_roi;
+	GdkRectangle roi;
+	gint input_width;
+	gint input_height;
+	gint new_width;
+	gint new_height;
+
+	rs_filter_get_size_simple(filter->previous, request, &input_width, &input_height);
+	get_new_size(resample, &new_width, &new_height);
+
+	/* Return the input, if the new size is uninitialized */
+	if ((new_width == -1) || (new_height == -1))
+		return rs_filter_get_image_float(filter->previous, request);
+
+	/* Simply return the input, if we don't scale */
+	if ((input_width == new_width) && (input_height == new_height))
+		return rs_filter_get_image_float(filter->previous, request);
 
+	if (!resample->never_quick && rs_filter_request_get_quick(request))
+		return get_image(filter, request);
+
+	/* Only request the input pixels needed for our ROI */
+	new_request = previous_request(request, input_width, input_height, new_width, new_height, &input_roi);
+	previous_response = rs_filter_get_image_float(filter->previous, new_request);
+	g_object_unref(new_request);
+
+	input = rs_filter_response_get_image_float(previous_response);
+
+	if (!RS_IS_IMAGE(input))
+		return previous_response;
+
+	output_roi(request, input_width, input_height, input->width, input->height, new_width, new_height, &input_roi, &roi);
+
+	response = rs_filter_response_clone(previous_response);
+	rs_filter_response_set_roi(response, rs_filter_request_get_roi(request));
+	g_object_unref(previous_response);
+
+	/* Vertical and horizontal pass are fused, the vertically resampled row
+	   stays in cache for the horizontal pass */
+	info.input = input;
+	info.output = rs_image_new_area(new_width, new_height, input->number_of_planes, &roi);
+	info.vertical = (input->height != new_height);
+	info.horizontal = (input->width != new_width);
+	info.input_x = input_roi.x;
+	info.input_end_x = input_roi.x + input_roi.width;
+	info.output_x = roi.x;
+	info.output_end_x = roi.x + roi.width;
+
+	if (info.vertical)
+		float_weights(&info.v, input->height, new_height, roi.y, roi.y + roi.height);
+	if (info.horizontal)
+		float_weights(&info.h, input->width, new_width, roi.x, roi.x + roi.width);
+
+	rs_parallel_for_full(roi.y, roi.y + roi.height, 0, rs_filter_request_get_priority(request), resample_float_fused, &info);
+
+	if (info.vertical)
+		float_weights_free(&info.v);
+	if (info.horizontal)
+		float_weights_free(&info.h);
+
+	output = info.output;
+	g_object_unref(input);
+
+	rs_filter_response_set_image_float(response, output);
+	rs_filter_param_set_boolean(RS_FILTER_PARAM(response), "half-size", FALSE);
+	g_object_unref(output);
+
+	return response;
+}
+
+const static gint FPScale = 16384; /* fixed point scaler */
+const static gint FPScaleShift = 14; /* fixed point scaler */
+
+#define ALIGNTO16(PTR) ((guintptr)PTR + ((16 - ((guintptr)PTR % 16)) % 16))
+
+/* Calculate FPScale weights for output pixels start to end-1, like the
+   resizers do. Returns FALSE if the filter is wider than the input */
+static gboolean
+resample_weights(ResampleWeights *w, guint old_size, guint new_size, gint start, gint end)
+{
 	gfloat pos_step = ((gfloat) old_size) / ((gfloat)new_size);
 	gfloat filter_step = MIN(1.0 / pos_step, 1.0);
 	gfloat filter_support = (gfloat) lanczos_taps() / filter_step;
 	gint fir_filter_size = (gint) (ceil(filter_support*2));
+	gint i,j,k,c;
 
 	if (old_size <= fir_filter_size)
-		return ResizeH_fast(info);
+		return FALSE;
 
-	gint *weights = g_new(gint, new_size * fir_filter_size);
-	gint *offsets = g_new(gint, new_size);
+	w->fir_filter_size = fir_filter_size;
+	w->pairs = (fir_filter_size + 1) / 2;
+	w->offsets = g_new(gint, new_size);
+	w->weights = g_new(gint, new_size * fir_filter_size);
+	w->_pair_weights_unaligned = g_new(gshort, new_size * w->pairs * 8 + 8);
+	w->pair_weights = (gshort *) ALIGNTO16(w->_pair_weights_unaligned);
 
-	gfloat pos = 0.0f;
-	gint i,j,k;
-
-	for (i=0; i<new_size; ++i)
+	for (i = start; i < end; i++)
 	{
+		gfloat pos = i * pos_step;
 		gint end_pos = (gint) (pos + filter_support);
 
 		if (end_pos > old_size-1)
@@ -592,67 +1005,104 @@ ResizeH(ResampleInfo *info)
 		if (start_pos < 0)
 			start_pos = 0;
 
-		offsets[i] = start_pos * 4;
+		w->offsets[i] = start_pos;
 
-		/* the following code ensures that the coefficients add to exactly FPScale */
+		/* The following code ensures that the coefficients add to exactly FPScale */
 		gfloat total = 0.0;
 
 		/* Ensure that we have a valid position */
 		gfloat ok_pos = MAX(0.0,MIN(old_size-1,pos));
 
-		for (j=0; j<fir_filter_size; ++j)
-		{
-			/* Accumulate all coefficients */
+		for (j = 0; j < fir_filter_size; j++)
 			total += lanczos_weight((start_pos+j - ok_pos) * filter_step);
-		}
 
 		g_assert(total > 0.0f);
 
 		gfloat total2 = 0.0;
+		gint *wg = &w->weights[i*fir_filter_size];
+		gshort *pair = &w->pair_weights[i*w->pairs*8];
 
-		for (k=0; k<fir_filter_size; ++k)
+		for (k = 0; k < fir_filter_size; k++)
 		{
 			gfloat total3 = total2 + lanczos_weight((start_pos+k - ok_pos) * filter_step) / total;
-			weights[i*fir_filter_size+k] = (gint) (total3*FPScale+0.5) - (gint) (total2*FPScale+0.5);
+			wg[k] = (gint) (total3*FPScale+0.5) - (gint) (total2*FPScale+0.5);
 			total2 = total3;
 		}
-		pos += pos_step;
+
+		/* Pairs of taps for pmaddwd, an odd filter gets a zero weight last */
+		for (k = 0; k < w->pairs*2; k++)
+			for (c = 0; c < 4; c++)
+				pair[(k/2)*8 + c*2 + (k&1)] = (k < fir_filter_size) ? wg[k] : 0;
 	}
 
-	g_assert(input->pixelsize == 4);
-	g_assert(input->channels == 3);
+	return TRUE;
+}
 
-	guint y,x;
-	for (y = info->dest_offset_other; y < info->dest_end_other ; y++)
+#undef ALIGNTO16
+
+static void
+resample_weights_free(ResampleWeights *w)
+{
+	g_free(w->offsets);
+	g_free(w->weights);
+	g_free(w->_pair_weights_unaligned);
+}
+
+/* Resample output row y vertically, out points to the pixel at start_x */
+void
+ResizeV_row(const RS_IMAGE16 *input, const ResampleWeights *w, gint y, gint start_x, gint end_x, gushort *out)
+{
+	const gint fir_filter_size = w->fir_filter_size;
+	const gint *wg = &w->weights[y*fir_filter_size];
+	const gushort *in = GET_PIXEL(input, start_x, w->offsets[y]);
+	gint x, i;
+
+	for (x = start_x; x < end_x; x++)
 	{
-		gushort *in_line = GET_PIXEL(input, 0, y);
-		gushort *out = GET_PIXEL(output, 0, y);
-		gint *wg = weights;
+		gint acc1 = 0;
+		gint acc2 = 0;
+		gint acc3 = 0;
 
-		for (x = 0; x < new_size; x++)
+		for (i = 0; i < fir_filter_size; i++)
 		{
-			guint i;
-			gushort *in = &in_line[offsets[x]];
-			gint acc1 = 0;
-			gint acc2 = 0;
-			gint acc3 = 0;
-
-			for (i = 0; i <fir_filter_size; i++)
-			{
-				gint w = *wg++;
-				acc1 += in[i*4]*w;
-				acc2 += in[i*4+1]*w;
-				acc3 += in[i*4+2]*w;
-			}
-			out[x*4] = clampbits((acc1 + (FPScale/2))>>FPScaleShift, 16);
-			out[x*4+1] = clampbits((acc2 + (FPScale/2))>>FPScaleShift, 16);
-			out[x*4+2] = clampbits((acc3 + (FPScale/2))>>FPScaleShift, 16);
+			acc1 += in[i*input->rowstride]*wg[i];
+			acc2 += in[i*input->rowstride+1]*wg[i];
+			acc3 += in[i*input->rowstride+2]*wg[i];
 		}
+		out[0] = clampbits((acc1 + (FPScale/2))>>FPScaleShift, 16);
+		out[1] = clampbits((acc2 + (FPScale/2))>>FPScaleShift, 16);
+		out[2] = clampbits((acc3 + (FPScale/2))>>FPScaleShift, 16);
+		out += 4;
+		in += 4;
 	}
+}
 
-	g_free(weights);
-	g_free(offsets);
+/* Resample a row horizontally, in points to input pixel in_x and out to output pixel start_x */
+void
+ResizeH_row(const gushort *in, gint in_x, const ResampleWeights *w, gint start_x, gint end_x, gushort *out)
+{
+	const gint fir_filter_size = w->fir_filter_size;
+	gint x, i;
+
+	for (x = start_x; x < end_x; x++)
+	{
+		const gushort *p = &in[(w->offsets[x] - in_x) * 4];
+		const gint *wg = &w->weights[x*fir_filter_size];
+		gint acc1 = 0;
+		gint acc2 = 0;
+		gint acc3 = 0;
 
+		for (i = 0; i < fir_filter_size; i++)
+		{
+			acc1 += p[i*4]*wg[i];
+			acc2 += p[i*4+1]*wg[i];
+			acc3 += p[i*4+2]*wg[i];
+		}
+		out[0] = clampbits((acc1 + (FPScale/2))>>FPScaleShift, 16);
+		out[1] = clampbits((acc2 + (FPScale/2))>>FPScaleShift, 16);
+		out[2] = clampbits((acc3 + (FPScale/2))>>FPScaleShift, 16);
+		out += 4;
+	}
 }
 
 void
@@ -722,9 +1172,9 @@ ResizeV(ResampleInfo *info)
 	g_assert(input->channels == 3);
 
 	guint y,x;
-    gint *wg = weights;
+	gint *wg = &weights[info->dest_offset * fir_filter_size];
 
-	for (y = 0; y < new_size ; y++)
+	for (y = info->dest_offset; y < info->dest_end; y++)
 	{
 		gushort *in = GET_PIXEL(input, start_x, offsets[y]);
 		gushort *out = GET_PIXEL(output, 0, y);
@@ -820,11 +1270,11 @@ ResizeH_compatible(ResampleInfo *info)
 	guint y,x,c;
 	for (y = info->dest_offset_other; y < info->dest_end_other ; y++)
 	{
-		gint *wg = weights;
+		gint *wg = &weights[info->dest_offset * fir_filter_size];
 		gushort *in_line = GET_PIXEL(input, 0, y);
 		gushort *out = GET_PIXEL(output, 0, y);
 
-		for (x = 0; x < new_size; x++)
+		for (x = info->dest_offset; x < info->dest_end; x++)
 		{
 			guint i;
 			gushort *in = &in_line[offsets[x]];
@@ -914,9 +1364,9 @@ ResizeV_compatible(ResampleInfo *info)
 	}
 
 	guint y,x,c;
-	gint *wg = weights;
+	gint *wg = &weights[info->dest_offset * fir_filter_size];
 
-	for (y = 0; y < new_size ; y++)
+	for (y = info->dest_offset; y < info->dest_end; y++)
 	{
 		gushort *out = GET_PIXEL(output, 0, y);
 		for (x = start_x; x < end_x; x++)
@@ -955,12 +1405,12 @@ ResizeV_fast(ResampleInfo *info)
 
 	gfloat pos_step = ((gfloat) old_size) / ((gfloat)new_size);
 
-	gint pos = 0;
 	gint delta = (gint)(pos_step * 65536.0);
+	gint pos = delta * info->dest_offset;
 
 	guint y,x,c;
 
-	for (y = 0; y < new_size ; y++)
+	for (y = info->dest_offset; y < info->dest_end; y++)
 	{
 		gushort *in = GET_PIXEL(input, start_x, pos>>16);
 		gushort *out = GET_PIXEL(output, start_x, y);
@@ -1001,10 +1451,10 @@ ResizeH_fast(ResampleInfo *info)
 	{
 		gushort *in_line = GET_PIXEL(input, 0, y);
 		gushort *out = GET_PIXEL(output, 0, y);
-		pos = 0;
-		int out_pos = 0;
+		pos = delta * info->dest_offset;
+		int out_pos = info->dest_offset * pixelsize;
 
-		for (x = 0; x < new_size; x++)
+		for (x = info->dest_offset; x < info->dest_end; x++)
 		{
 			gushort* start_pos = &in_line[(pos>>16)*pixelsize];
 			for (c = 0 ; c < ch; c++)
@@ -58,9 +58,6 @@ enum {
 typedef struct {
 	RS_IMAGE16 *input;			/* Input Image */
 	RS_IMAGE16 *output;			/* Output Image*/
-	gint start_y;
-	gint end_y;
-	GThread *threadid;
 	gboolean use_straight;
 	RSRotate* rotate;
 	gboolean use_fast;		/* Use nearest neighbour resampler */
@@ -77,7 +74,7 @@ static void inline bilinear(RS_IMAGE16 *in, gushort *out, gint x, gint y);
 static void inline nearest(RS_IMAGE16 *in, gushort *out, gint x, gint y);
 static void recalculate(RSRotate *rotate, const RSFilterRequest *request);
 static void recalculate_dims(RSRotate *rotate, gint previous_width, gint previous_height);
-gpointer start_rotate_thread(gpointer _thread_info);
+static void rotate_rows(gint start_y, gint end_y, gpointer _thread_info);
 
 static RSFilterClass *rs_rotate_parent_class = NULL;
 
@@ -200,18 +197,27 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	RS_IMAGE16 *input;
 	RS_IMAGE16 *output = NULL;
 	gboolean use_fast = FALSE;
-	GdkRectangle *old_roi;
+	GdkRectangle *old_roi = NULL;
 	GdkRectangle *roi;
+	RSFilterRequest *new_request;
+	RSWarp *warp = NULL;
 
 	if ((ABS(rotate->angle) < 0.001) && (rotate->orientation==0))
 		return rs_filter_get_image(filter->previous, request);
-	
+
+	new_request = rs_filter_request_clone(request);
+
+	/* We're resampling anyway, let previous geometry corrections be done in
+	 * the same pass. Right angle turns are plain copies, and quick renders
+	 * are not worth it */
+	if (!(rotate->angle < 0.001 && rotate->orientation < 4) && !rs_filter_request_get_quick(request))
+		rs_filter_param_set_boolean(RS_FILTER_PARAM(new_request), RS_WARP_REQUEST_DEFER, TRUE);
+
 	/* FIXME: Handle ROI across rotation */
 	if (rs_filter_request_get_roi(request))
 	{
 		/* Calculate rotated ROI */
 		old_roi = rs_filter_request_get_roi(request);
-		RSFilterRequest *new_request = rs_filter_request_clone(request);
 		recalculate(rotate, request);
 		
 		gdouble minx, miny;
@@ -237,11 +243,10 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		
 		/* Request image */
 		rs_filter_request_set_roi(new_request, roi);
-		previous_response = rs_filter_get_image(filter->previous, new_request);
 		g_free(roi);
-		g_object_unref(new_request);
-	} else 
-		previous_response = rs_filter_get_image(filter->previous, request);
+	}
+	previous_response = rs_filter_get_image(filter->previous, new_request);
+	g_object_unref(new_request);
 
 	input = rs_filter_response_get_image(previous_response);
 
@@ -249,6 +254,7 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		return previous_response;
 
 	response = rs_filter_response_clone(previous_response);
+	warp = rs_filter_param_get_object_with_type(RS_FILTER_PARAM(previous_response), RS_WARP_RESPONSE, RS_TYPE_WARP);
 	g_object_unref(previous_response);
 
 	gboolean straight = FALSE;
@@ -271,36 +277,35 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 		rs_filter_response_set_quick(response);
 	}
 
-	/* Prepare threads */
-	guint i, y_offset, y_per_thread, threaded_h;
-	const guint threads = rs_get_number_of_processor_cores();
-	ThreadInfo *t = g_new(ThreadInfo, threads);
-
-	threaded_h = output->h;
-
-	y_per_thread = (threaded_h + threads-1)/threads;
-	y_offset = 0;
-
-	for (i = 0; i < threads; i++)
+	if (warp)
 	{
-		t[i].use_straight = straight;
-		t[i].input = input;
-		t[i].output = output;
-		t[i].start_y = y_offset;
-		y_offset += y_per_thread;
-		y_offset = MIN(threaded_h, y_offset);
-		t[i].end_y = y_offset;
-		t[i].rotate = rotate;
-		t[i].use_fast = use_fast;
-
-		t[i].threadid = g_thread_create(start_rotate_thread, &t[i], TRUE, NULL);
+		/* Rotation and the deferred correction in one pass. rotate_rows()
+		 * samples half a pixel off, do the same to keep the image in place */
+		RS_MATRIX3 affine = rotate->affine;
+		affine.coeff[2][0] += 0.5;
+		affine.coeff[2][1] += 0.5;
+		rs_filter_param_delete(RS_FILTER_PARAM(response), RS_WARP_RESPONSE);
+		rs_warp_set_affine(warp, &affine);
+		rs_warp_render(warp, input, output, old_roi);
+		g_object_unref(warp);
+		g_object_unref(input);
+
+		rs_filter_response_set_image(response, output);
+		g_object_unref(output);
+
+		return response;
 	}
 
-	/* Wait for threads to finish */
-	for(i = 0; i < threads; i++)
-		g_thread_join(t[i].threadid);
+	/* Render rows in the shared worker pool */
+	ThreadInfo t;
+	t.use_straight = straight;
+	t.input = input;
+	t.output = output;
+	t.rotate = rotate;
+	t.use_fast = use_fast;
+
+	rs_parallel_for_full(0, output->h, 0, rs_filter_request_get_priority(request), rotate_rows, &t);
 
-	g_free(t);
 	g_object_unref(input);
 
 	rs_filter_response_set_image(response, output);
@@ -309,8 +314,8 @@ get_image(RSFilter *filter, const RSFilterRequest *request)
 	return response;
 }
 
-gpointer
-start_rotate_thread(gpointer _thread_info)
+static void
+rotate_rows(gint start_y, gint end_y, gpointer _thread_info)
 {
 	ThreadInfo* t = _thread_info;
 
@@ -319,9 +324,8 @@ start_rotate_thread(gpointer _thread_info)
 	RSRotate *rotate = t->rotate;
 
 	if (t->use_straight) {
-		turn_right_angle(input, output, t->start_y, t->end_y, rotate->orientation);
-		g_thread_exit(NULL);
-		return NULL;
+		turn_right_angle(input, output, start_y, end_y, rotate->orientation);
+		return;
 	}
 
 	gint x, y;
@@ -330,7 +334,7 @@ start_rotate_thread(gpointer _thread_info)
 
 	gint crapx = (gint) (rotate->affine.coeff[0][0]*65536.0);
 	gint crapy = (gint) (rotate->affine.coeff[0][1]*65536.0);
-	for(row=t->start_y;row<t->end_y;row++)
+	for(row=start_y;row<end_y;row++)
 	{
 		gint foox = (gint) ((((gdouble)row) * rotate->affine.coeff[1][0] + rotate->affine.coeff[2][0])*65536.0);
 		gint fooy = (gint) ((((gdouble)row) * rotate->affine.coeff[1][1] + rotate->affine.coeff[2][1])*65536.0);
@@ -345,10 +349,6 @@ start_rotate_thread(gpointer _thread_info)
 				bilinear(input, &output->pixels[destoffset], x>>8, y>>8);
 		}
 	}
-
-	g_thread_exit(NULL);
-
-	return NULL; /* Make the compiler shut up - we'll never return */
 }
 
 
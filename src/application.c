@@ -48,6 +48,7 @@
 #include "filename.h"
 #include "rs-tiff.h"
 #include "rs-batch.h"
+#include "rs-batch-engine.h"
 #include "rs-store.h"
 #include "rs-preview-widget.h"
 #include "rs-histogram.h"
@@ -593,6 +594,76 @@ void segfault_sigaction(int signal, siginfo_t *si, void *arg)
 
 #endif  // defined(RS_USE_INTERNAL_STACKTRACE)
 
+static void
+batch_photo_done(RSBatchEngine *engine, const gchar *input, const gchar *output, gboolean success, gpointer user_data)
+{
+	if (success)
+		g_print("%s -> %s\n", input, output);
+	else
+		g_printerr("Could not export %s\n", input);
+}
+
+/**
+ * Export photos using their saved settings and the batch settings from
+ * configuration without initializing GTK+
+ * @return Exit code
+ */
+static gint
+batch_main(gint argc, gchar **argv, const gchar *directory, gint jobs, gint memory_limit, const gchar *profile)
+{
+	RSBatchEngine *engine;
+	gchar *filetype, *filename, *size_lock;
+	gint i, failed, width = 600, height = 600, scale = 100;
+
+	rs_filetype_init();
+	rs_plugin_manager_load_all_plugins();
+	rs_lens_fix_init();
+
+	filetype = rs_conf_get_string(CONF_BATCH_FILETYPE);
+	if (!filetype || !g_type_is_a(g_type_from_name(filetype), RS_TYPE_OUTPUT))
+	{
+		g_free(filetype);
+		filetype = g_strdup("RSJpegfile");
+	}
+	filename = rs_conf_get_string(CONF_BATCH_FILENAME);
+	if (!filename)
+		filename = g_strdup(DEFAULT_CONF_BATCH_FILENAME);
+
+	engine = rs_batch_engine_new(filetype, directory, filename);
+	g_free(filetype);
+	g_free(filename);
+	if (!engine)
+		return 1;
+
+	rs_conf_get_integer(CONF_BATCH_SIZE_SCALE, &scale);
+	rs_conf_get_integer(CONF_BATCH_SIZE_WIDTH, &width);
+	rs_conf_get_integer(CONF_BATCH_SIZE_HEIGHT, &height);
+	size_lock = rs_conf_get_string(CONF_BATCH_SIZE_LOCK);
+	if (size_lock && g_str_equal(size_lock, "bounding-box"))
+		rs_batch_engine_set_bounding_box(engine, width, height);
+	else if (size_lock && g_str_equal(size_lock, "width"))
+		rs_batch_engine_set_bounding_box(engine, width, -1);
+	else if (size_lock && g_str_equal(size_lock, "height"))
+		rs_batch_engine_set_bounding_box(engine, -1, height);
+	else
+		rs_batch_engine_set_scale(engine, scale/100.0);
+	g_free(size_lock);
+
+	if (jobs > 0)
+		rs_batch_engine_set_jobs(engine, jobs);
+	rs_batch_engine_set_memory_limit(engine, memory_limit);
+	rs_batch_engine_set_profile(engine, profile);
+	rs_batch_engine_set_callback(engine, batch_photo_done, NULL);
+
+	for(i = 1; i < argc; i++)
+		rs_batch_engine_add(engine, argv[i], 0);
+
+	failed = rs_batch_engine_run(engine);
+	rs_batch_engine_free(engine);
+
+	return (failed > 0) ? 1 : 0;
+}
+
 static RS_BLOB* main_blob = NULL;
 
 RS_BLOB* rs_get_blob(void)
@@ -608,12 +679,20 @@ main(int argc, char **argv)
 	gboolean use_system_theme = DEFAULT_CONF_USE_SYSTEM_THEME;
 	gchar *debug = NULL;
     gchar *client_mode_dest = NULL;
+	gchar *batch_dest = NULL;
+	gint batch_jobs = 0;
+	gint batch_memory = 0;
+	gchar *batch_profile = NULL;
 
 	GError *error = NULL;
 	GOptionContext *option_context;
 	const GOptionEntry option_entries[] = {
         { "output", 'o', 0, G_OPTION_ARG_STRING, &client_mode_dest, "Run in client mode", "target filename"},
 		{ "debug", 'd', 0, G_OPTION_ARG_STRING, &debug, "Debug flags to use", "flags" },
+		{ "batch", 'b', 0, G_OPTION_ARG_FILENAME, &batch_dest, "Export photos using saved settings without a GUI", "output directory" },
+		{ "jobs", 'j', 0, G_OPTION_ARG_INT, &batch_jobs, "Number of photos to export concurrently", "N" },
+		{ "memory-limit", 0, 0, G_OPTION_ARG_INT, &batch_memory, "Memory ceiling for concurrent exports", "megabytes" },
+		{ "profile", 0, 0, G_OPTION_ARG_FILENAME, &batch_profile, "Append a JSON performance profile per exported photo", "filename" },
 		{ "do-tests", 't', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &do_test, "Do internal tests", NULL },
 		{ NULL }
 	};
@@ -675,6 +754,9 @@ main(int argc, char **argv)
 	/* Make sure the GType system is initialized */
 	g_type_init();
 
+	if (batch_dest)
+		exit(batch_main(argc, argv, batch_dest, batch_jobs, batch_memory, batch_profile));
+
 	/* Switch to rawstudio theme before any drawing if needed */
 	rs_conf_get_boolean_with_default(CONF_USE_SYSTEM_THEME, &use_system_theme, DEFAULT_CONF_USE_SYSTEM_THEME);
 	if (!use_system_theme)
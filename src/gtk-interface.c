@@ -221,10 +221,24 @@ static gboolean
 open_photo(RS_BLOB *rs, const gchar *filename)
 {
 	RS_PHOTO *photo;
+	RSMetadata *metadata;
 
 	gui_set_busy(TRUE);
 	rs_preview_widget_set_photo(RS_PREVIEW_WIDGET(rs->preview), NULL);
-	photo = rs_photo_load_from_file(filename);
+
+	/* Metadata is loaded once and shared by the preview and the photo */
+	metadata = rs_metadata_new();
+	if (!rs_metadata_load(metadata, filename))
+	{
+		g_object_unref(metadata);
+		metadata = NULL;
+	}
+
+	/* Show the camera's own preview while we decode and demosaic */
+	rs_preview_widget_set_embedded_preview(RS_PREVIEW_WIDGET(rs->preview), metadata, filename);
+	photo = rs_photo_load_from_file_with_metadata(filename, metadata);
+	if (metadata)
+		g_object_unref(metadata);
 
 	if (photo)
 	{
@@ -237,6 +251,7 @@ open_photo(RS_BLOB *rs, const gchar *filename)
 	}
 	else
 	{
+		rs_preview_widget_set_embedded_preview(RS_PREVIEW_WIDGET(rs->preview), NULL, NULL);
 		rs_io_idle_unpause();
 		gui_set_busy(FALSE);
 		rs->post_open_event = NULL;
@@ -1438,6 +1438,16 @@ ACTION(filter_graph)
 	rs_filter_graph(rs->filter_input);
 }
 
+ACTION(filter_profile)
+{
+	gchar *json = rs_filter_get_profile_json(rs->filter_input, NULL);
+
+	if (g_file_set_contents("/tmp/rs-filter-profile.json", json, -1, NULL))
+		gui_status_notify("Filter profile written to /tmp/rs-filter-profile.json");
+	rs_filter_reset_stats(rs->filter_input);
+	g_free(json);
+}
+
 ACTION(add_profile)
 {
 	GtkWidget *dialog = gtk_file_chooser_dialog_new(
@@ -1603,12 +1613,22 @@ get_thumbnails_from_list(GList *files)
   gint i;
   gint num_selected = g_list_length(files);
   gchar *name = NULL;
+  gchar *thumb = NULL;
   GList *thumbnails = NULL;
+  RSMetadata *metadata;
 
   for(i=0; i<num_selected; i++) 
     {
       name = (gchar*) g_list_nth_data(files, i);
-      thumbnails = g_list_append(thumbnails, rs_metadata_dotdir_helper(name, DOTDIR_THUMB));
+      thumb = rs_metadata_dotdir_helper(name, DOTDIR_THUMB);
+
+      /* Thumbnails live in the metadata pack, enfuse needs them as files.
+         Always write them, a file left from an earlier run may be stale */
+      metadata = rs_metadata_new_from_file(name);
+      if (metadata->thumbnail)
+        gdk_pixbuf_save(metadata->thumbnail, thumb, "jpeg", NULL, "quality", "90", NULL);
+      g_object_unref(metadata);
+      thumbnails = g_list_append(thumbnails, thumb);
     }
 
   return thumbnails;
@@ -1975,6 +1995,7 @@ rs_get_core_action_group(RS_BLOB *rs)
 	{ "OnlineDocumentation", GTK_STOCK_HELP, _("_Online Documentation"), NULL, NULL, ACTION_CB(online_documentation) },
 	{ "About", GTK_STOCK_ABOUT, _("_About"), NULL, NULL, ACTION_CB(about) },
 	{ "FilterGraph", NULL, "_Filter Graph", NULL, NULL, ACTION_CB(filter_graph) },
+	{ "FilterProfile", NULL, "Filter _Profile", NULL, NULL, ACTION_CB(filter_profile) },
 
 	/* Not in any menu (yet) */
 	{ "AddProfile", NULL, _("Add Profile ..."), NULL, NULL, ACTION_CB(add_profile) },
@@ -0,0 +1,464 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <rawstudio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <config.h>
+#include "application.h"
+#include "rs-batch-engine.h"
+#include "conf_interface.h"
+#include "filename.h"
+#include "rs-cache.h"
+#include "rs-photo.h"
+
+/* Rough estimate of peak memory usage per pixel while developing a photo */
+#define BATCH_BYTES_PER_PIXEL 32
+
+/* The size of a photo is not known until it is decoded, but decoding is where
+   the first big buffers are allocated. Raw files rarely compress below this
+   many bytes per pixel, so the file size gives an upper bound to start with */
+#define BATCH_FILE_BYTES_PER_PIXEL 1
+
+typedef struct {
+	gchar *filename;
+	gint setting_id;
+} RSBatchJob;
+
+struct _RSBatchEngine {
+	gchar *output_identifier;
+	gchar *directory;
+	gchar *filename;
+	gint width;
+	gint height;
+	gdouble scale;
+	gint jobs;
+	gsize memory_limit;
+	RSBatchEngineFunc callback;
+	gpointer callback_data;
+	gchar *profile;
+	gboolean dcp_lut;
+
+	GMutex *lock;
+	GCond *memory_cond;
+	GQueue *queue;
+	gsize memory_used;
+	gint failed;
+	gboolean abort;
+};
+
+static void
+job_free(RSBatchJob *job)
+{
+	g_free(job->filename);
+	g_free(job);
+}
+
+RSBatchEngine *
+rs_batch_engine_new(const gchar *output_identifier, const gchar *directory, const gchar *filename)
+{
+	RSBatchEngine *engine;
+
+	g_return_val_if_fail(output_identifier != NULL, NULL);
+	g_return_val_if_fail(directory != NULL, NULL);
+	g_return_val_if_fail(filename != NULL, NULL);
+
+	if (!g_type_is_a(g_type_from_name(output_identifier), RS_TYPE_OUTPUT))
+		return NULL;
+
+	engine = g_new0(RSBatchEngine, 1);
+	engine->output_identifier = g_strdup(output_identifier);
+	engine->directory = g_strdup(directory);
+	engine->filename = g_strdup(filename);
+	engine->width = -1;
+	engine->height = -1;
+	engine->scale = -1.0;
+	/* Enough to keep loading, developing and saving busy at the same time */
+	engine->jobs = 3;
+	engine->memory_limit = 0;
+	rs_conf_get_boolean_with_default(CONF_BATCH_DCP_LUT, &engine->dcp_lut, DEFAULT_CONF_BATCH_DCP_LUT);
+	engine->lock = g_mutex_new();
+	engine->memory_cond = g_cond_new();
+	engine->queue = g_queue_new();
+
+	return engine;
+}
+
+void
+rs_batch_engine_free(RSBatchEngine *engine)
+{
+	RSBatchJob *job;
+
+	g_return_if_fail(engine != NULL);
+
+	while ((job = g_queue_pop_head(engine->queue)))
+		job_free(job);
+	g_queue_free(engine->queue);
+	g_cond_free(engine->memory_cond);
+	g_mutex_free(engine->lock);
+	g_free(engine->output_identifier);
+	g_free(engine->directory);
+	g_free(engine->filename);
+	g_free(engine->profile);
+	g_free(engine);
+}
+
+void
+rs_batch_engine_add(RSBatchEngine *engine, const gchar *filename, gint setting_id)
+{
+	RSBatchJob *job;
+
+	g_return_if_fail(engine != NULL);
+	g_return_if_fail(filename != NULL);
+
+	job = g_new(RSBatchJob, 1);
+	job->filename = g_strdup(filename);
+	job->setting_id = CLAMP(setting_id, 0, 2);
+
+	g_mutex_lock(engine->lock);
+	g_queue_push_tail(engine->queue, job);
+	g_mutex_unlock(engine->lock);
+}
+
+void
+rs_batch_engine_set_bounding_box(RSBatchEngine *engine, gint width, gint height)
+{
+	g_return_if_fail(engine != NULL);
+
+	engine->width = width;
+	engine->height = height;
+}
+
+void
+rs_batch_engine_set_scale(RSBatchEngine *engine, gdouble scale)
+{
+	g_return_if_fail(engine != NULL);
+
+	engine->scale = scale;
+}
+
+void
+rs_batch_engine_set_jobs(RSBatchEngine *engine, gint jobs)
+{
+	g_return_if_fail(engine != NULL);
+
+	engine->jobs = MAX(1, jobs);
+}
+
+void
+rs_batch_engine_set_memory_limit(RSBatchEngine *engine, gint megabytes)
+{
+	g_return_if_fail(engine != NULL);
+
+	engine->memory_limit = ((gsize) MAX(0, megabytes)) * 1024 * 1024;
+}
+
+void
+rs_batch_engine_set_callback(RSBatchEngine *engine, RSBatchEngineFunc func, gpointer user_data)
+{
+	g_return_if_fail(engine != NULL);
+
+	engine->callback = func;
+	engine->callback_data = user_data;
+}
+
+void
+rs_batch_engine_set_profile(RSBatchEngine *engine, const gchar *filename)
+{
+	g_return_if_fail(engine != NULL);
+
+	g_free(engine->profile);
+	engine->profile = g_strdup(filename);
+}
+
+void
+rs_batch_engine_abort(RSBatchEngine *engine)
+{
+	g_return_if_fail(engine != NULL);
+
+	g_mutex_lock(engine->lock);
+	engine->abort = TRUE;
+	g_mutex_unlock(engine->lock);
+}
+
+static void
+memory_reserve(RSBatchEngine *engine, gsize bytes)
+{
+	g_mutex_lock(engine->lock);
+	/* Always let at least one photo through */
+	while (engine->memory_limit > 0 && engine->memory_used > 0 && (engine->memory_used + bytes) > engine->memory_limit)
+		g_cond_wait(engine->memory_cond, engine->lock);
+	engine->memory_used += bytes;
+	g_mutex_unlock(engine->lock);
+}
+
+static void
+memory_release(RSBatchEngine *engine, gsize bytes)
+{
+	g_mutex_lock(engine->lock);
+	engine->memory_used -= bytes;
+	g_cond_broadcast(engine->memory_cond);
+	g_mutex_unlock(engine->lock);
+}
+
+/* Replaces a reservation with a better estimate. This never waits, the memory
+   is already in use when we know better */
+static void
+memory_adjust(RSBatchEngine *engine, gsize *reserved, gsize bytes)
+{
+	g_mutex_lock(engine->lock);
+	engine->memory_used = engine->memory_used - *reserved + bytes;
+	if (bytes < *reserved)
+		g_cond_broadcast(engine->memory_cond);
+	g_mutex_unlock(engine->lock);
+	*reserved = bytes;
+}
+
+static gchar *
+build_filename(RSBatchEngine *engine, RSOutput *output, const gchar *input, gint setting_id)
+{
+	GString *filename;
+	gchar *parsed_filename;
+
+	if (NULL == g_strrstr(engine->filename, "%p"))
+	{
+		filename = g_string_new(engine->directory);
+		g_string_append(filename, G_DIR_SEPARATOR_S);
+		g_string_append(filename, engine->filename);
+	}
+	else
+		filename = g_string_new(engine->filename);
+
+	g_string_append(filename, ".");
+	g_string_append(filename, rs_output_get_extension(output));
+	parsed_filename = filename_parse(filename->str, input, setting_id, TRUE);
+	g_string_free(filename, TRUE);
+
+	return parsed_filename;
+}
+
+/* Append the filter profile of a photo as a single line of JSON */
+static void
+write_profile(RSBatchEngine *engine, RSFilter *finput, RS_PHOTO *photo)
+{
+	gchar *label, *json;
+	FILE *file;
+
+	label = g_strdup_printf("%s %s",
+		photo->metadata->make_ascii ? photo->metadata->make_ascii : "",
+		photo->metadata->model_ascii ? photo->metadata->model_ascii : "");
+	json = rs_filter_get_profile_json(finput, g_strstrip(label));
+
+	g_mutex_lock(engine->lock);
+	if ((file = g_fopen(engine->profile, "a")))
+	{
+		fprintf(file, "%s\n", json);
+		fclose(file);
+	}
+	g_mutex_unlock(engine->lock);
+
+	g_free(json);
+	g_free(label);
+}
+
+static gboolean
+process_photo(RSBatchEngine *engine, RSFilter *finput, RSFilter *fend, RSFilter *fcrop, RSBatchJob *job, gchar **output_filename)
+{
+	RS_PHOTO *photo;
+	RSOutput *output;
+	gchar *parsed_dir;
+	gint width = 65535, height = 65535;
+	gsize memory = 0;
+	gboolean exported = FALSE;
+	struct stat st;
+
+	if (g_stat(job->filename, &st) == 0)
+		memory = ((gsize) st.st_size) / BATCH_FILE_BYTES_PER_PIXEL * BATCH_BYTES_PER_PIXEL;
+	memory_reserve(engine, memory);
+
+	photo = rs_photo_load_from_file(job->filename);
+	if (!photo)
+	{
+		memory_release(engine, memory);
+		return FALSE;
+	}
+	memory_adjust(engine, &memory, ((gsize) photo->input->w) * photo->input->h * BATCH_BYTES_PER_PIXEL);
+
+	rs_metadata_load_from_file(photo->metadata, job->filename);
+	rs_cache_load(photo);
+
+	output = rs_output_new(engine->output_identifier);
+	*output_filename = build_filename(engine, output, job->filename, job->setting_id);
+
+	parsed_dir = g_path_get_dirname(*output_filename);
+	if (!g_file_test(parsed_dir, G_FILE_TEST_IS_DIR) && g_mkdir_with_parents(parsed_dir, 00755))
+	{
+		g_warning("Could not create output directory %s", parsed_dir);
+		g_free(parsed_dir);
+		g_object_unref(output);
+		g_object_unref(photo);
+		memory_release(engine, memory);
+		return FALSE;
+	}
+	g_free(parsed_dir);
+
+	rs_filter_reset_stats(finput);
+
+	GList *filters = g_list_append(NULL, fend);
+	rs_photo_apply_to_filters(photo, filters, job->setting_id);
+	g_list_free(filters);
+
+	rs_filter_set_recursive(fend,
+		"image", photo->input_response,
+		"filename", photo->filename,
+		"bounding-box", TRUE,
+		NULL);
+
+	/* Calculate new size */
+	if (engine->scale > 0.0)
+	{
+		rs_filter_get_size_simple(fcrop, RS_FILTER_REQUEST_QUICK, &width, &height);
+		width = (gint) (((gdouble) width) * engine->scale);
+		height = (gint) (((gdouble) height) * engine->scale);
+	}
+	else
+	{
+		if (engine->width > 0)
+			width = engine->width;
+		if (engine->height > 0)
+			height = engine->height;
+	}
+	rs_filter_set_recursive(fend,
+		"width", width,
+		"height", height,
+		NULL);
+
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(output), "filename"))
+		g_object_set(output, "filename", *output_filename, NULL);
+	rs_output_set_from_conf(output, "batch");
+
+	exported = rs_output_execute(output, fend);
+
+	if (engine->profile)
+		write_profile(engine, finput, photo);
+
+	g_object_unref(output);
+	g_object_unref(photo);
+	memory_release(engine, memory);
+
+	return exported;
+}
+
+static gpointer
+worker(gpointer data)
+{
+	RSBatchEngine *engine = data;
+	RSBatchJob *job;
+	gchar *output_filename;
+	gboolean exported;
+
+	/* Every worker needs its own chain, filters keep per-photo state */
+	RSFilter *finput = rs_filter_new("RSInputImage16", NULL);
+	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", finput);
+	RSFilter *ffujirotate = rs_filter_new("RSFujiRotate", fdemosaic);
+	RSFilter *fdemosaic_cache = rs_filter_new("RSCache", ffujirotate);
+	RSFilter *flensfun = rs_filter_new("RSLensfun", fdemosaic_cache);
+	RSFilter *frotate = rs_filter_new("RSRotate", flensfun);
+	RSFilter *fcrop = rs_filter_new("RSCrop", frotate);
+	RSFilter *ftransform_input = rs_filter_new("RSColorspaceTransform", fcrop);
+	RSFilter *fdcp= rs_filter_new("RSDcp", ftransform_input);
+	RSFilter *fcache = rs_filter_new("RSCache", fdcp);
+	RSFilter *fresample= rs_filter_new("RSResample", fcache);
+	RSFilter *fdenoise= rs_filter_new("RSDenoise", fresample);
+	RSFilter *ftransform_display = rs_filter_new("RSColorspaceTransform", fdenoise);
+	RSFilter *fend = ftransform_display;
+
+	/* Demosaic renders the complete image, keep it for the strips of the output */
+	g_object_set(fdemosaic_cache, "ignore-roi", TRUE, NULL);
+
+	/* All photos in a batch tend to share settings, trade a bake for speed */
+	g_object_set(fdcp, "use-lut", engine->dcp_lut, NULL);
+
+	while (1)
+	{
+		g_mutex_lock(engine->lock);
+		job = engine->abort ? NULL : g_queue_pop_head(engine->queue);
+		g_mutex_unlock(engine->lock);
+
+		if (!job)
+			break;
+
+		output_filename = NULL;
+		exported = process_photo(engine, finput, fend, fcrop, job, &output_filename);
+
+		if (!exported)
+			g_atomic_int_inc(&engine->failed);
+
+		if (engine->callback)
+			engine->callback(engine, job->filename, output_filename, exported, engine->callback_data);
+
+		g_free(output_filename);
+		job_free(job);
+	}
+
+	g_object_unref(finput);
+	g_object_unref(fdemosaic);
+	g_object_unref(ffujirotate);
+	g_object_unref(fdemosaic_cache);
+	g_object_unref(flensfun);
+	g_object_unref(frotate);
+	g_object_unref(fcrop);
+	g_object_unref(fcache);
+	g_object_unref(fresample);
+	g_object_unref(fdcp);
+	g_object_unref(fdenoise);
+	g_object_unref(ftransform_input);
+	g_object_unref(ftransform_display);
+
+	return NULL;
+}
+
+gint
+rs_batch_engine_run(RSBatchEngine *engine)
+{
+	GThread **threads;
+	gint i, jobs;
+
+	g_return_val_if_fail(engine != NULL, -1);
+
+	engine->failed = 0;
+	engine->abort = FALSE;
+	g_mkdir_with_parents(engine->directory, 00755);
+
+	jobs = MIN(engine->jobs, g_queue_get_length(engine->queue));
+	threads = g_new(GThread *, jobs);
+
+	for(i = 0; i < jobs; i++)
+		threads[i] = g_thread_create(worker, engine, TRUE, NULL);
+
+	for(i = 0; i < jobs; i++)
+		g_thread_join(threads[i]);
+
+	g_free(threads);
+
+	return engine->failed;
+}
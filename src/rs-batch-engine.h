@@ -0,0 +1,136 @@
+/*
+ * * Copyright (C) 2006-2011 Anders Brander <anders@brander.dk>, 
+ * * Anders Kvist <akv@lnxbx.dk> and Klaus Post <klauspost@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RS_BATCH_ENGINE_H
+#define RS_BATCH_ENGINE_H
+
+#include <glib.h>
+
+typedef struct _RSBatchEngine RSBatchEngine;
+
+/**
+ * Called by the batch engine when a photo has been processed, this will be
+ * called from a worker thread
+ * @param engine The RSBatchEngine
+ * @param input The filename of the source photo
+ * @param output The filename written or NULL if the photo could not be loaded
+ * @param success TRUE if the photo was exported
+ * @param user_data Data passed to rs_batch_engine_set_callback()
+ */
+typedef void (*RSBatchEngineFunc)(RSBatchEngine *engine, const gchar *input, const gchar *output, gboolean success, gpointer user_data);
+
+/**
+ * Create a new batch engine, the engine does not depend on GTK+
+ * @param output_identifier The RSOutput to use, for example "RSJpegfile"
+ * @param directory The output directory
+ * @param filename A filename template as accepted by filename_parse(), without extension
+ * @return A new RSBatchEngine or NULL if output_identifier is not a valid RSOutput
+ */
+extern RSBatchEngine *
+rs_batch_engine_new(const gchar *output_identifier, const gchar *directory, const gchar *filename);
+
+/**
+ * Free a batch engine, this must not be called while rs_batch_engine_run() is running
+ * @param engine A RSBatchEngine
+ */
+extern void
+rs_batch_engine_free(RSBatchEngine *engine);
+
+/**
+ * Add a photo to the engine
+ * @param engine A RSBatchEngine
+ * @param filename The photo to export
+ * @param setting_id Which snapshot to export (0-2)
+ */
+extern void
+rs_batch_engine_add(RSBatchEngine *engine, const gchar *filename, gint setting_id);
+
+/**
+ * Scale exported photos to fit a bounding box
+ * @param engine A RSBatchEngine
+ * @param width Maximum width or -1 for no limit
+ * @param height Maximum height or -1 for no limit
+ */
+extern void
+rs_batch_engine_set_bounding_box(RSBatchEngine *engine, gint width, gint height);
+
+/**
+ * Scale exported photos by a factor, this overrides any bounding box
+ * @param engine A RSBatchEngine
+ * @param scale Scale factor, 1.0 to export at full size
+ */
+extern void
+rs_batch_engine_set_scale(RSBatchEngine *engine, gdouble scale);
+
+/**
+ * Set how many photos can be in flight at the same time. Each photo is
+ * loaded, developed and saved by its own thread while the filters share the
+ * worker pool, so loading and saving of one photo will overlap developing of
+ * another
+ * @param engine A RSBatchEngine
+ * @param jobs Number of photos to process concurrently
+ */
+extern void
+rs_batch_engine_set_jobs(RSBatchEngine *engine, gint jobs);
+
+/**
+ * Limit the estimated memory used by photos in flight. A photo will wait
+ * before developing until enough memory is available, one photo will
+ * always be allowed to run
+ * @param engine A RSBatchEngine
+ * @param megabytes Memory ceiling in megabytes or 0 for no limit
+ */
+extern void
+rs_batch_engine_set_memory_limit(RSBatchEngine *engine, gint megabytes);
+
+/**
+ * Set a function to be called for every processed photo
+ * @param engine A RSBatchEngine
+ * @param func A RSBatchEngineFunc or NULL
+ * @param user_data Data to pass to func
+ */
+extern void
+rs_batch_engine_set_callback(RSBatchEngine *engine, RSBatchEngineFunc func, gpointer user_data);
+
+/**
+ * Append a JSON profile of the filter chain for every exported photo to a
+ * file, one line per photo labelled with the camera make and model
+ * @param engine A RSBatchEngine
+ * @param filename The file to append to or NULL to disable
+ */
+extern void
+rs_batch_engine_set_profile(RSBatchEngine *engine, const gchar *filename);
+
+/**
+ * Process all added photos, this will block until done or aborted
+ * @param engine A RSBatchEngine
+ * @return The number of photos that failed to export
+ */
+extern gint
+rs_batch_engine_run(RSBatchEngine *engine);
+
+/**
+ * Stop processing, photos already in flight will be finished. This is safe
+ * to call from any thread and from the callback
+ * @param engine A RSBatchEngine
+ */
+extern void
+rs_batch_engine_abort(RSBatchEngine *engine);
+
+#endif /* RS_BATCH_ENGINE_H */
@@ -400,7 +400,8 @@ rs_batch_process(RS_QUEUE *queue)
 	RSFilter *finput = rs_filter_new("RSInputImage16", NULL);
 	RSFilter *fdemosaic = rs_filter_new("RSDemosaic", finput);
 	RSFilter *ffujirotate = rs_filter_new("RSFujiRotate", fdemosaic);
-	RSFilter *flensfun = rs_filter_new("RSLensfun", ffujirotate);
+	RSFilter *fdemosaic_cache = rs_filter_new("RSCache", ffujirotate);
+	RSFilter *flensfun = rs_filter_new("RSLensfun", fdemosaic_cache);
 	RSFilter *frotate = rs_filter_new("RSRotate", flensfun);
 	RSFilter *fcrop = rs_filter_new("RSCrop", frotate);
 	RSFilter *ftransform_input = rs_filter_new("RSColorspaceTransform", fcrop);
@@ -412,6 +413,14 @@ rs_batch_process(RS_QUEUE *queue)
 	RSFilter *fend = ftransform_display;
 	RSFilterResponse *filter_response;
 	RSColorSpace *display_color_space;
+	gboolean dcp_lut = DEFAULT_CONF_BATCH_DCP_LUT;
+
+	/* Demosaic renders the complete image, keep it for the strips of the output */
+	g_object_set(fdemosaic_cache, "ignore-roi", TRUE, NULL);
+
+	/* All photos in a batch tend to share settings, trade a bake for speed */
+	rs_conf_get_boolean_with_default(CONF_BATCH_DCP_LUT, &dcp_lut, DEFAULT_CONF_BATCH_DCP_LUT);
+	g_object_set(fdcp, "use-lut", dcp_lut, NULL);
 
 	gdk_threads_enter();
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -524,6 +533,7 @@ rs_batch_process(RS_QUEUE *queue)
 			/* Render preview image */
 			RSFilterRequest *request = rs_filter_request_new();
 			rs_filter_request_set_quick(RS_FILTER_REQUEST(request), FALSE);
+			rs_filter_request_set_priority(request, RS_PARALLEL_PRIORITY_LOW);
 			/* FIXME: Should be set to output colorspace, not forced to sRGB */
 
 			rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", display_color_space);	
@@ -620,6 +630,7 @@ rs_batch_process(RS_QUEUE *queue)
 	g_object_unref(finput);
 	g_object_unref(fdemosaic);
 	g_object_unref(ffujirotate);
+	g_object_unref(fdemosaic_cache);
 	g_object_unref(flensfun);
 	g_object_unref(frotate);
 	g_object_unref(fcrop);
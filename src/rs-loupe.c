@@ -244,6 +244,7 @@ redraw(RSLoupe *loupe)
 
 	/* Create request ROI */
 	RSFilterRequest *request = rs_filter_request_new();
+	rs_filter_request_set_priority(request, RS_PARALLEL_PRIORITY_HIGH);
 	GdkRectangle roi;
 	roi.x = CLAMP(loupe->center_x - window_width/2, 0, width-window_width-1);
 	roi.y = CLAMP(loupe->center_y - window_height/2, 0, height-window_height-1);
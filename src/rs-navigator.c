@@ -333,6 +333,7 @@ redraw(RSNavigator *navigator)
 	{
 		RSFilterRequest *request = rs_filter_request_new();
 		rs_filter_request_set_quick(RS_FILTER_REQUEST(request), TRUE);
+		rs_filter_request_set_priority(request, RS_PARALLEL_PRIORITY_HIGH);
 		rs_filter_param_set_object(RS_FILTER_PARAM(request), "colorspace", navigator->display_color_space);
 		
 		gdk_threads_leave();
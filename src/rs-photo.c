@@ -763,6 +763,18 @@ rs_photo_set_wb_from_camera(RS_PHOTO *photo, const gint snapshot)
  */
 RS_PHOTO *
 rs_photo_load_from_file(const gchar *filename)
+{
+	return rs_photo_load_from_file_with_metadata(filename, NULL);
+}
+
+/**
+ * Loads a photo in to a RS_PHOTO using metadata already loaded by the caller
+ * @param filename The filename to load
+ * @param metadata Metadata loaded from filename or NULL to load it here
+ * @return A RS_PHOTO on success, NULL on error
+ */
+RS_PHOTO *
+rs_photo_load_from_file_with_metadata(const gchar *filename, RSMetadata *metadata)
 {
 	RS_PHOTO *photo = NULL;
 	RSFilterResponse *response;
@@ -787,7 +799,12 @@ rs_photo_load_from_file(const gchar *filename)
 	if (photo)
 	{
 		/* Load metadata */
-		if (rs_metadata_load(photo->metadata, filename))
+		if (metadata)
+		{
+			g_object_unref(photo->metadata);
+			photo->metadata = g_object_ref(metadata);
+		}
+		if (metadata || rs_metadata_load(photo->metadata, filename))
 		{
 			/* Rotate photo inplace */
 			switch (photo->metadata->orientation)
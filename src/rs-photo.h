@@ -329,6 +329,15 @@ extern void rs_photo_lens_updated(RS_PHOTO *photo);
 extern RS_PHOTO *
 rs_photo_load_from_file(const gchar *filename);
 
+/**
+ * Loads a photo in to a RS_PHOTO using metadata already loaded by the caller
+ * @param filename The filename to load
+ * @param metadata Metadata loaded from filename or NULL to load it here
+ * @return A RS_PHOTO on success, NULL on error
+ */
+extern RS_PHOTO *
+rs_photo_load_from_file_with_metadata(const gchar *filename, RSMetadata *metadata);
+
 /**
  * Loads a photo in to a RS_PHOTO including metadata
  * @param photo A RS_PHOTO
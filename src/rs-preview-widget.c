@@ -186,6 +186,7 @@ struct _RSPreviewWidget
 	GdkRectangle *last_roi[MAX_VIEWS];
 	RS_PHOTO *photo;
 	RS_PHOTO *photo_blank_stored;
+	GdkPixbuf *embedded; /* Shown while photo is being loaded */
 	void *transform;
 	gint snapshot[MAX_VIEWS];
 	gint dirty[MAX_VIEWS]; /* Dirty flag, used for multiple things */
@@ -249,6 +250,8 @@ static guint signals[LAST_SIGNAL] = { 0 };
 static void get_max_size(RSPreviewWidget *preview, gint *width, gint *height);
 static gboolean get_placement(RSPreviewWidget *preview, const guint view, GdkRectangle *placement);
 static void redraw(RSPreviewWidget *preview, GdkRectangle *dirty_area);
+static void redraw_embedded(RSPreviewWidget *preview, GdkRectangle *dirty_area);
+static void drop_embedded(RSPreviewWidget *preview);
 static void realize(GtkWidget *widget, gpointer data);
 static gboolean scroll (GtkWidget *widget, GdkEventScroll *event, gpointer user_data);
 static gboolean expose(GtkWidget *widget, GdkEventExpose *event, gpointer user_data);
@@ -432,6 +435,7 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 		g_object_set(preview->filter_cache3[i], "latency", 1, NULL);
 
 		preview->request[i] = rs_filter_request_new();
+		rs_filter_request_set_priority(preview->request[i], RS_PARALLEL_PRIORITY_HIGH);
 		rs_filter_param_set_object(RS_FILTER_PARAM(preview->request[i]), "colorspace", preview->display_color_space);
 #if MAX_VIEWS > 3
 #error Fix line below
@@ -456,6 +460,7 @@ rs_preview_widget_init(RSPreviewWidget *preview)
 	preview->loupe = rs_loupe_new();
 	g_object_set(preview->loupe_filter_cache, "ignore-roi", TRUE, NULL);
 	preview->photo = NULL;
+	preview->embedded = NULL;
 	preview->loupe_view = -1;
 
 	preview->navigator_filter_scale = rs_filter_new("RSResample", NULL);
@@ -782,6 +787,7 @@ rs_preview_widget_set_photo(RSPreviewWidget *preview, RS_PHOTO *photo)
 
 	if (preview->photo)
 	{
+		/* The embedded preview stays up until the first render of the photo is done */
 		rs_preview_widget_set_photo_settings(preview);
 		rs_preview_widget_update_display_colorspace(preview, TRUE);
 		photo->thumbnail_filter = preview->navigator_filter_end;
@@ -791,6 +797,58 @@ rs_preview_widget_set_photo(RSPreviewWidget *preview, RS_PHOTO *photo)
 	}
 }
 
+/**
+ * Shows the largest JPEG embedded in a photo until the photo is rendered
+ * @param preview A RSPreviewWidget
+ * @param metadata Metadata loaded from filename or NULL to drop the preview
+ * @param filename The photo to show the preview of
+ */
+void
+rs_preview_widget_set_embedded_preview(RSPreviewWidget *preview, RSMetadata *metadata, const gchar *filename)
+{
+	GtkWidget *canvas = GTK_WIDGET(preview->canvas);
+	GdkPixbuf *pixbuf;
+	GdkRectangle rect;
+	gint width, height;
+	gint w, h;
+
+	g_return_if_fail(RS_IS_PREVIEW_WIDGET(preview));
+
+	if (preview->embedded)
+	{
+		g_object_unref(preview->embedded);
+		preview->embedded = NULL;
+		if (!metadata && !preview->photo && GTK_WIDGET_REALIZED(canvas))
+			gdk_window_invalidate_rect(canvas->window, NULL, FALSE);
+	}
+
+	if (!metadata || !filename || !GTK_WIDGET_REALIZED(canvas))
+		return;
+
+	width = canvas->allocation.width - PADDING*2;
+	height = canvas->allocation.height - PADDING*2;
+	if (width < 1 || height < 1)
+		return;
+
+	/* Let libjpeg scale to the view size while decoding, that's most of the work */
+	pixbuf = rs_metadata_get_embedded_preview(metadata, filename, width, height);
+	if (!pixbuf)
+		return;
+
+	w = gdk_pixbuf_get_width(pixbuf);
+	h = gdk_pixbuf_get_height(pixbuf);
+	rs_constrain_to_bounding_box(width, height, &w, &h);
+	preview->embedded = gdk_pixbuf_scale_simple(pixbuf, MAX(w, 1), MAX(h, 1), GDK_INTERP_BILINEAR);
+	g_object_unref(pixbuf);
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.width = canvas->allocation.width;
+	rect.height = canvas->allocation.height;
+	redraw_embedded(preview, &rect);
+	GUI_CATCHUP_DISPLAY(preview->display);
+}
+
 /**
  * Sets settings of active photo of a RSPreviewWidget
  * @param preview A RSPreviewWidget
@@ -2626,6 +2684,7 @@ rs_preview_do_render(RSPreviewWidget *preview, GdkRectangle *dirty_area)
 	cairo_t *cr = NULL;
 	const static gdouble dashes[] = { 4.0, 4.0, };
 	gint width, height;
+	gboolean rendered = FALSE;
 
 #define CAIRO_LINE(cr, x1, y1, x2, y2) do { \
 	cairo_move_to((cr), (x1), (y1)); \
@@ -2692,6 +2751,7 @@ rs_preview_do_render(RSPreviewWidget *preview, GdkRectangle *dirty_area)
 						GDK_RGB_DITHER_NONE, 0, 0);
 
 				g_object_unref(buffer);
+				rendered = TRUE;
 			}
 
 			if(preview->views > 1 && rs_filter_request_get_quick(new_request) && !preview->keep_quick_enabled)
@@ -2706,6 +2766,8 @@ rs_preview_do_render(RSPreviewWidget *preview, GdkRectangle *dirty_area)
 				g_object_unref(gc);
 				g_object_unref(new_request);
 				g_object_unref(response);
+				if (rendered)
+					drop_embedded(preview);
 				if (!(preview->photo && preview->photo->signal && *preview->photo->signal == MAIN_SIGNAL_CANCEL_LOAD))
 				{
 					rs_filter_request_set_quick(preview->request[i], FALSE);
@@ -2990,13 +3052,63 @@ rs_preview_do_render(RSPreviewWidget *preview, GdkRectangle *dirty_area)
 	if (cr)
 		cairo_destroy(cr);
 	gdk_window_end_paint(window);
+
+	if (rendered)
+		drop_embedded(preview);
+}
+
+static void
+redraw_embedded(RSPreviewWidget *preview, GdkRectangle *dirty_area)
+{
+	GtkWidget *widget = GTK_WIDGET(preview->canvas);
+	GdkWindow *window = widget->window;
+	GdkDrawable *drawable = GDK_DRAWABLE(window);
+	GdkGC *gc = gdk_gc_new(drawable);
+	GdkRectangle placement;
+	GdkRectangle area;
+
+	placement.width = gdk_pixbuf_get_width(preview->embedded);
+	placement.height = gdk_pixbuf_get_height(preview->embedded);
+	placement.x = (widget->allocation.width - placement.width)/2;
+	placement.y = (widget->allocation.height - placement.height)/2;
+
+	gdk_window_begin_paint_rect(window, dirty_area);
+	gdk_gc_set_foreground(gc, &preview->bgcolor);
+	gdk_draw_rectangle(drawable, gc, TRUE, dirty_area->x, dirty_area->y, dirty_area->width, dirty_area->height);
+	if (gdk_rectangle_intersect(dirty_area, &placement, &area))
+		gdk_draw_pixbuf(drawable, gc,
+			preview->embedded,
+			area.x-placement.x,
+			area.y-placement.y,
+			area.x, area.y,
+			area.width, area.height,
+			GDK_RGB_DITHER_NONE, 0, 0);
+	gdk_window_end_paint(window);
+	g_object_unref(gc);
+}
+
+/* The photo has been rendered, the embedded preview is no longer needed.
+   Only the dirty area was rendered, so the rest of the canvas is invalidated */
+static void
+drop_embedded(RSPreviewWidget *preview)
+{
+	if (!preview->embedded)
+		return;
+
+	g_object_unref(preview->embedded);
+	preview->embedded = NULL;
+	gdk_window_invalidate_rect(GTK_WIDGET(preview->canvas)->window, NULL, FALSE);
 }
 
 static void
 redraw(RSPreviewWidget *preview, GdkRectangle *dirty_area)
 {
 	if (!preview->photo)
+	{
+		if (preview->embedded)
+			redraw_embedded(preview, dirty_area);
 		return;
+	}
 
 	if (preview->skip_redraws)
 		return;
@@ -3021,6 +3133,13 @@ redraw(RSPreviewWidget *preview, GdkRectangle *dirty_area)
 		preview->last_required_direct_redraw = direct_redraw;
 	}
 
+	/* Keep the embedded preview up and let the render thread do the slow first render */
+	if (preview->embedded)
+	{
+		redraw_embedded(preview, dirty_area);
+		direct_redraw = FALSE;
+	}
+
 	/* Should this thread handle rendering itself */
 	if (direct_redraw)
 	{
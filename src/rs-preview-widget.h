@@ -61,6 +61,14 @@ extern void rs_preview_widget_set_zoom_to_fit(RSPreviewWidget *preview, gboolean
  */
 extern void rs_preview_widget_set_photo(RSPreviewWidget *preview, RS_PHOTO *photo);
 
+/**
+ * Shows the largest JPEG embedded in a photo until a photo is set
+ * @param preview A RSPreviewWidget
+ * @param metadata Metadata loaded from filename or NULL to drop the preview
+ * @param filename The photo to show the preview of
+ */
+extern void rs_preview_widget_set_embedded_preview(RSPreviewWidget *preview, RSMetadata *metadata, const gchar *filename);
+
 /**
  * Sets settings of active photo of a RSPreviewWidget
  * @param preview A RSPreviewWidget